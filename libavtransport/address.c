@@ -313,6 +313,42 @@ static int parse_settings(void *log_ctx, AVTAddress *addr,
                 addr->opts.tx_buf = res;
             else if (!strcmp(key, "rx_buf"))
                 addr->opts.rx_buf = res;
+        } else if (!strcmp(key, "shards") || !strcmp(key, "shard")) {
+            uint64_t res = strtoul(val, &end, 10);
+            if (end == val) {
+                avt_log(log_ctx, AVT_LOG_ERROR, "Invalid option %s value: %s\n", key, val);
+                return AVT_ERROR(EINVAL);
+            } else if (res > UINT16_MAX) {
+                avt_log(log_ctx, AVT_LOG_ERROR, "Option %s value too high: %s\n", key, val);
+                return AVT_ERROR(ERANGE);
+            }
+
+            if (!strcmp(key, "shards"))
+                addr->opts.shards = res;
+            else if (!strcmp(key, "shard"))
+                addr->opts.shard = res;
+        } else if (!strcmp(key, "pmtud")) {
+            uint64_t res = strtoul(val, &end, 10);
+            if (end == val) {
+                avt_log(log_ctx, AVT_LOG_ERROR, "Invalid option %s value: %s\n", key, val);
+                return AVT_ERROR(EINVAL);
+            } else if (res > UINT16_MAX) {
+                avt_log(log_ctx, AVT_LOG_ERROR, "Option %s value too high: %s\n", key, val);
+                return AVT_ERROR(ERANGE);
+            }
+
+            addr->opts.pmtud = res;
+        } else if (!strcmp(key, "cscov")) {
+            if (!strcmp(val, "udp")) {
+                addr->opts.cscov = AVT_ADDRESS_CSCOV_UDP;
+            } else if (!strcmp(val, "header")) {
+                addr->opts.cscov = AVT_ADDRESS_CSCOV_HEADER;
+            } else if (!strcmp(val, "full")) {
+                addr->opts.cscov = AVT_ADDRESS_CSCOV_FULL;
+            } else {
+                avt_log(log_ctx, AVT_LOG_ERROR, "Invalid option %s value: %s\n", key, val);
+                return AVT_ERROR(EINVAL);
+            }
         } else if (!strcmp(key, "certfile") || !strcmp(key, "keyfile")) {
             char *dupd = strdup(val);
             if (!dupd)
@@ -328,6 +364,12 @@ static int parse_settings(void *log_ctx, AVTAddress *addr,
         }
     } while ((option = strtok_r(NULL, "&", &tmp)));
 
+    if (addr->opts.shard && (addr->opts.shard >= addr->opts.shards)) {
+        avt_log(log_ctx, AVT_LOG_ERROR, "Shard %i out of range (%i shards)\n",
+                addr->opts.shard, addr->opts.shards);
+        return AVT_ERROR(EINVAL);
+    }
+
     /* Write parsed settings to the logging buffer */
     if (addr->opts.start_time)
         snprintf(&opts_buf[strlen(opts_buf)], opts_buf_size - strlen(opts_buf),
@@ -338,6 +380,16 @@ static int parse_settings(void *log_ctx, AVTAddress *addr,
     if (addr->opts.tx_buf)
         snprintf(&opts_buf[strlen(opts_buf)], opts_buf_size - strlen(opts_buf),
                  "      tx_buf: %i\n", addr->opts.tx_buf);
+    if (addr->opts.shards)
+        snprintf(&opts_buf[strlen(opts_buf)], opts_buf_size - strlen(opts_buf),
+                 "      shard: %i/%i\n", addr->opts.shard, addr->opts.shards);
+    if (addr->opts.pmtud)
+        snprintf(&opts_buf[strlen(opts_buf)], opts_buf_size - strlen(opts_buf),
+                 "      pmtud: %i\n", addr->opts.pmtud);
+    if (addr->opts.cscov)
+        snprintf(&opts_buf[strlen(opts_buf)], opts_buf_size - strlen(opts_buf),
+                 "      cscov: %s\n",
+                 addr->opts.cscov == AVT_ADDRESS_CSCOV_HEADER ? "header" : "full");
     if (addr->opts.nb_default_sid) {
         snprintf(&opts_buf[strlen(opts_buf)], opts_buf_size - strlen(opts_buf),
                  "      default streams: ");
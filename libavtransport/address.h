@@ -47,6 +47,13 @@ enum AVTAddressConnection {
     AVT_ADDRESS_CALLBACK,
 };
 
+/* UDP-Lite checksum coverage */
+enum AVTAddressChecksumCoverage {
+    AVT_ADDRESS_CSCOV_UDP = 0, /* UDP header only */
+    AVT_ADDRESS_CSCOV_HEADER,  /* UDP header, and the AVTransport header */
+    AVT_ADDRESS_CSCOV_FULL,    /* Entire datagram */
+};
+
 typedef struct AVTCallbacksPacket {
     void *opaque;
     int (*out)(void *opaque, union AVTPacketData pkt, AVTBuffer *buf);
@@ -92,6 +99,17 @@ typedef struct AVTAddress {
         int rx_buf;
         int tx_buf;
 
+        /* Number of listening sockets sharing the port, and the index
+         * of this one. Zero if not sharded. */
+        int shards;
+        int shard;
+
+        /* Largest path MTU to probe for, zero if probing is disabled */
+        int pmtud;
+
+        /* UDP-Lite checksum coverage */
+        enum AVTAddressChecksumCoverage cscov;
+
         /* Default stream IDs */
         uint16_t *default_sid;
         int nb_default_sid;
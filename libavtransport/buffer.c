@@ -135,10 +135,11 @@ AVTBuffer *avt_buffer_ref(AVTBuffer *buf, ptrdiff_t offset, size_t len)
 
 int avt_buffer_offset(AVTBuffer *buf, ptrdiff_t offset)
 {
-    if (buf->base_data + offset > buf->end_data)
+    if (offset < 0 || (size_t)offset > buf->len)
         return AVT_ERROR(EINVAL);
 
     buf->data += offset;
+    buf->len -= offset;
 
     return 0;
 }
@@ -70,6 +70,7 @@ static inline int avt_buffer_quick_create(AVTBuffer *buf, uint8_t *data,
     buf->data = data;
     buf->len = len;
     buf->opaque = opaque;
+    buf->flags = flags;
     if (!free_cb)
         buf->free = avt_buffer_default_free;
     else
@@ -100,7 +101,7 @@ static inline void avt_buffer_quick_unref(AVTBuffer *buf)
         return;
 
     if (atomic_fetch_sub_explicit(buf->refcnt, 1, memory_order_acq_rel) <= 1) {
-        buf->free(buf->opaque, buf->data, buf->end_data - buf->base_data);
+        buf->free(buf->opaque, buf->base_data, buf->end_data - buf->base_data);
         free(buf->refcnt);
     }
 
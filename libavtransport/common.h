@@ -41,6 +41,8 @@ typedef struct AVTStreamPriv {
 
 struct AVTContext {
     AVTContextOptions opts;
+
+    struct AVTReceiver *in;
 };
 
 #endif /* AVTRANSPORT_COMMON */
@@ -28,10 +28,13 @@
 #include <avtransport/version.h>
 
 #include "connection_internal.h"
+#include "input_internal.h"
 #include "protocol_common.h"
 #include "io_common.h"
 #include "utils_internal.h"
 #include "scheduler.h"
+#include "mirror.h"
+#include "mem.h"
 
 struct AVTConnection {
     AVTAddress addr;
@@ -45,30 +48,54 @@ struct AVTConnection {
     const AVTProtocol *p;
     AVTProtocolCtx *p_ctx;
 
-    /* File mirror */
-    const AVTProtocol *mirror;
-    AVTProtocolCtx *mirror_ctx;
+    /* Mirror */
+    AVTMirror *mirror;
 
     /* Input buffer */
     AVTPacketFifo in_fifo;
+    AVTReceiver *in;
+
+    /* Connections all input is forwarded to */
+    AVTConnection **relay;
+    int nb_relay;
+    bool relay_regen_fec;
+    struct {
+        uint64_t packets;
+        uint64_t dropped_packets;
+    } relay_stats;
 
     /* Output FIFO, pre-scheduler */
     AVTPacketFifo out_fifo_pre;
     AVTPacketFifo out_fifo_post;
     AVTScheduler  out_scheduler;
+
+    /* Rate at which output was accepted */
+    struct {
+        uint64_t packets;
+        int64_t start; /* Start of the current measurement period */
+        int64_t bits;  /* Bits sent during the current period */
+        int64_t rate;  /* Smoothed rate, in bits per second */
+    } tx;
 };
 
+/* Period over which the output rate is measured, in nanoseconds */
+#define CONN_TX_RATE_PERIOD (100*1000*1000)
+
 int avt_connection_destroy(AVTConnection **_conn)
 {
     AVTConnection *conn = *_conn;
-    if (conn)
+    if (!conn)
         return 0;
 
+    avt_mirror_close(&conn->mirror);
+    free(conn->relay);
+
     int err = conn->p->close(&conn->p_ctx);
 
     avt_pkt_fifo_free(&conn->out_fifo_post);
     avt_scheduler_free(&conn->out_scheduler);
     avt_pkt_fifo_free(&conn->out_fifo_pre);
+    avt_pkt_fifo_free(&conn->in_fifo);
     avt_addr_free(&conn->addr);
 
     if (conn->p_ctx)
@@ -126,12 +153,15 @@ int avt_connection_init(AVTContext *ctx, AVTConnection **_conn,
     /* Protocol init */
     AVTProtocolOpts opts = {
         .ldpc_iterations = info->input_opts.ldpc_iterations,
+        .index_cache = info->input_opts.index_cache,
     };
     ret = avt_protocol_init(ctx, &conn->p, &conn->p_ctx, &conn->addr,
                             conn->io, conn->io_ctx, &opts);
     if (ret < 0)
         goto fail;
 
+    conn->relay_regen_fec = info->input_opts.relay_regen_fec;
+
     /* Get max packet size */
     size_t max_pkt_size;
     ret = conn->p->get_max_pkt_len(conn->p_ctx, &max_pkt_size);
@@ -169,27 +199,275 @@ int avt_connection_send(AVTConnection *conn, AVTPktd *p)
     return 0;
 }
 
-int avt_connection_process(AVTConnection *conn, int64_t timeout)
+void avt_connection_get_pkt_params(AVTConnection *conn,
+                                   size_t *max_pkt_size, int64_t *bandwidth)
+{
+    *max_pkt_size = conn->out_scheduler.max_pkt_size;
+    *bandwidth = conn->out_scheduler.bandwidth;
+}
+
+int64_t avt_connection_get_rtt(AVTConnection *conn)
+{
+    return conn->p->get_rtt ? conn->p->get_rtt(conn->p_ctx) : 0;
+}
+
+int avt_connection_send_seq(AVTConnection *conn, const AVTPacketFifo *seq)
+{
+    return avt_scheduler_push_seq(&conn->out_scheduler, seq);
+}
+
+int avt_connection_share_seq(AVTConnection *conn, AVTScheduler *src)
+{
+    return avt_scheduler_share_seq(&conn->out_scheduler, src);
+}
+
+int avt_connection_register_receiver(AVTConnection *conn, AVTReceiver *r)
+{
+    if (r && !conn->p->receive)
+        return AVT_ERROR(ENOTSUP);
+
+    /* Segments can be received directly into the packets being merged */
+    if (conn->p->set_placement) {
+        int err = conn->p->set_placement(conn->p_ctx,
+                                         r ? avt_receive_place : NULL, r);
+        if (err < 0)
+            return err;
+    }
+
+    conn->in = r;
+
+    return 0;
+}
+
+int avt_connection_relay_add(AVTConnection *conn, AVTConnection *dst)
+{
+    if (!conn->p->receive || !dst->p->send_seq)
+        return AVT_ERROR(ENOTSUP);
+
+    for (auto i = 0; i < conn->nb_relay; i++)
+        if (conn->relay[i] == dst)
+            return AVT_ERROR(EEXIST);
+
+    AVTConnection **tmp = avt_reallocarray(conn->relay, conn->nb_relay + 1,
+                                           sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+
+    conn->relay = tmp;
+    conn->relay[conn->nb_relay++] = dst;
+
+    return 0;
+}
+
+int avt_connection_relay_remove(AVTConnection *conn, AVTConnection *dst)
+{
+    for (auto i = 0; i < conn->nb_relay; i++) {
+        if (conn->relay[i] == dst) {
+            memmove(&conn->relay[i], &conn->relay[i + 1],
+                    (conn->nb_relay - i - 1)*sizeof(*conn->relay));
+            conn->nb_relay--;
+            return 0;
+        }
+    }
+
+    return AVT_ERROR(ENOENT);
+}
+
+/* Mirror sent packets. Those the mirror had to drop are kept in memory
+ * instead, as they can't be read back from it to be resent. */
+static int mirror_sent(AVTConnection *conn, AVTPacketFifo *seq)
+{
+    int ret = avt_mirror_push(conn->mirror, seq->data, seq->nb, true);
+    if (ret < 0 || !avt_mirror_can_fetch(conn->mirror))
+        return AVT_MIN(ret, 0);
+
+    for (auto i = ret; i < seq->nb; i++) {
+        int err = avt_pkt_fifo_push(&conn->out_fifo_pre, &seq->data[i]);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/* Send already encoded packets, bypassing the scheduler */
+static int relay_seq(AVTConnection *conn, AVTPacketFifo *seq, int64_t timeout)
 {
     int err;
 
-    AVTPacketFifo *seq;
-    err = avt_scheduler_pop(&conn->out_scheduler, &seq);
+    if (!avt_mirror_can_fetch(conn->mirror)) {
+        err = avt_pkt_fifo_copy(&conn->out_fifo_pre, seq);
+        if (err < 0)
+            return err;
+    }
+
+    err = conn->p->send_seq(conn->p_ctx, seq, timeout);
     if (err < 0)
         return err;
 
-    /* Ref segmented output packets for retransmission purposes */
-    err = avt_pkt_fifo_copy(&conn->out_fifo_pre, seq);
+    if (conn->mirror)
+        return mirror_sent(conn, seq);
+
+    return 0;
+}
+
+/* Follow the maximum packet size of the protocol, re-cutting whatever
+ * was not yet sent. Returns 1 if it changed. */
+static int sync_max_pkt_size(AVTConnection *conn)
+{
+    size_t max_pkt_size;
+    int err = conn->p->get_max_pkt_len(conn->p_ctx, &max_pkt_size);
     if (err < 0)
         return err;
+    else if (AVT_MIN(max_pkt_size, UINT32_MAX) == conn->out_scheduler.max_pkt_size)
+        return 0;
+
+    err = avt_scheduler_set_max_pkt_size(&conn->out_scheduler, max_pkt_size);
+    return err < 0 ? err : 1;
+}
+
+/* A packet was too large for the path. If the MTU changed, retry
+ * on the next call. */
+static int update_max_pkt_size(AVTConnection *conn)
+{
+    int err = sync_max_pkt_size(conn);
+    return !err ? AVT_ERROR(EMSGSIZE) : AVT_MIN(err, 0);
+}
+
+static void update_tx_rate(AVTConnection *conn, const AVTPacketFifo *seq)
+{
+    const int64_t now = avt_get_time_ns();
+
+    for (auto i = 0; i < seq->nb; i++)
+        conn->tx.bits += (seq->data[i].hdr_len + seq->data[i].pl.len)*8;
+    conn->tx.packets += seq->nb;
+
+    if (!conn->tx.start) {
+        conn->tx.start = now;
+        return;
+    } else if ((now - conn->tx.start) < CONN_TX_RATE_PERIOD) {
+        return;
+    }
+
+    int64_t rate = avt_rescale(conn->tx.bits, 1000000000, now - conn->tx.start);
+    conn->tx.rate = conn->tx.rate ? (3*conn->tx.rate + rate) / 4 : rate;
+    conn->tx.start = now;
+    conn->tx.bits = 0;
+}
+
+int avt_connection_process(AVTConnection *conn, int64_t timeout)
+{
+    int err;
+    int nb_in = 0;
+
+    /* Receive whatever is available, and process it as a single batch.
+     * Path MTU probes are acknowledged over the same connection. */
+    if (conn->in || conn->nb_relay || conn->addr.opts.pmtud) {
+        nb_in = conn->p->receive(conn->p_ctx, &conn->in_fifo, timeout);
+        if (nb_in < 0 && nb_in != AVT_ERROR(EAGAIN))
+            return nb_in;
+
+        if (conn->mirror && conn->in_fifo.nb) {
+            err = avt_mirror_push(conn->mirror, conn->in_fifo.data,
+                                  conn->in_fifo.nb, false);
+            if (err < 0)
+                return err;
+        }
+
+        /* Headers were already corrected on reception */
+        if (conn->relay_regen_fec && conn->nb_relay) {
+            for (auto i = 0; i < conn->in_fifo.nb; i++)
+                avt_packet_ldpc_encode_header(conn->in_fifo.data[i].hdr,
+                                              conn->in_fifo.data[i].hdr_len);
+        }
+
+        /* A destination failing must not hold up the others, or reception */
+        for (auto i = 0; i < conn->nb_relay && conn->in_fifo.nb; i++) {
+            err = relay_seq(conn->relay[i], &conn->in_fifo, timeout);
+            if (err < 0) {
+                avt_log(conn, AVT_LOG_WARN, "Unable to relay %u packets to "
+                        "destination %i: %i\n", conn->in_fifo.nb, i, err);
+                conn->relay_stats.dropped_packets += conn->in_fifo.nb;
+            } else {
+                conn->relay_stats.packets += conn->in_fifo.nb;
+            }
+        }
+
+        /* Even with nothing received, timeouts may need handling */
+        if (conn->in && (conn->in_fifo.nb ||
+                         avt_receive_deadline(conn->in) <= avt_get_time_ns())) {
+            err = avt_receive_process(conn->in, conn, &conn->in_fifo);
+            if (err < 0)
+                return err;
+        } else {
+            avt_pkt_fifo_clear(&conn->in_fifo);
+        }
+    }
+
+    if (conn->addr.opts.pmtud) {
+        err = sync_max_pkt_size(conn);
+        if (err < 0)
+            return err;
+    }
+
+    AVTPacketFifo *seq;
+    err = avt_scheduler_pop(&conn->out_scheduler, &seq);
+    if (err == AVT_ERROR(EAGAIN) && nb_in > 0)
+        return 0;
+    else if (err < 0)
+        return err;
+
+    /* Ref segmented output packets for retransmission purposes, unless
+     * they can be read back from a file mirror */
+    if (!avt_mirror_can_fetch(conn->mirror)) {
+        err = avt_pkt_fifo_copy(&conn->out_fifo_pre, seq);
+        if (err < 0)
+            return err;
+    }
 
     err = conn->p->send_seq(conn->p_ctx, seq, timeout);
-    if (err < 0)
+    if (err < 0) {
         avt_scheduler_done(&conn->out_scheduler, seq);
+        if (err == AVT_ERROR(EMSGSIZE))
+            return update_max_pkt_size(conn);
+        return err;
+    }
+
+    update_tx_rate(conn, seq);
+
+    if (conn->mirror)
+        return mirror_sent(conn, seq);
 
     return err;
 }
 
+int avt_connection_get_poll(AVTConnection *conn, AVTConnectionPoll *poll)
+{
+    const AVTPacketFifo *staging = conn->out_scheduler.staging;
+
+    *poll = (AVTConnectionPoll) {
+        .fd = conn->io->get_fd ? conn->io->get_fd(conn->io_ctx) : -1,
+        .read = conn->in || conn->nb_relay || conn->addr.opts.pmtud,
+        .write = staging && staging->nb,
+        .timeout = INT64_MAX,
+    };
+
+    int64_t deadline = INT64_MAX;
+    if (conn->in)
+        deadline = avt_receive_deadline(conn->in);
+    if (poll->read && conn->p->get_deadline)
+        deadline = AVT_MIN(deadline, conn->p->get_deadline(conn->p_ctx));
+    if (deadline != INT64_MAX)
+        poll->timeout = AVT_MAX(deadline - avt_get_time_ns(), 0);
+
+    /* Without a file descriptor, there is nothing to wait on, and the
+     * I/O never blocks */
+    if (poll->fd < 0 && (poll->read || poll->write))
+        poll->timeout = 0;
+
+    return 0;
+}
+
 int avt_connection_flush(AVTConnection *conn, int64_t timeout)
 {
     int err;
@@ -201,20 +479,138 @@ int avt_connection_flush(AVTConnection *conn, int64_t timeout)
 
     if (seq) {
         err = conn->p->send_seq(conn->p_ctx, seq, timeout);
-        if (err < 0)
+        if (err == AVT_ERROR(EMSGSIZE)) {
+            avt_scheduler_done(&conn->out_scheduler, seq);
+            err = update_max_pkt_size(conn);
+            if (err < 0)
+                return err;
+            return avt_connection_flush(conn, timeout);
+        } else if (err < 0) {
             avt_scheduler_done(&conn->out_scheduler, seq);
+            return err;
+        }
+
+        update_tx_rate(conn, seq);
+    }
+
+    err = conn->p->flush(conn->p_ctx, timeout);
+
+    /* Everything was sent, even if it could not be mirrored */
+    if (seq && conn->mirror) {
+        int ret = mirror_sent(conn, seq);
+        if (ret < 0) {
+            avt_log(conn, AVT_LOG_ERROR, "Unable to mirror sent packets: %i\n", ret);
+            if (err >= 0)
+                err = ret;
+        }
     }
 
-    return conn->p->flush(conn->p_ctx, timeout);
+    /* Sent packets can only be resent from the mirror once written */
+    if (conn->mirror) {
+        int ret = avt_mirror_drain(conn->mirror, timeout);
+        if (ret < 0 && err >= 0)
+            err = ret;
+    }
+
+    return err;
+}
+
+int avt_connection_resend(AVTConnection *conn, uint32_t seq, int64_t timeout)
+{
+    int err;
+    AVTPktd p = { };
+
+    /* Packets the mirror dropped are kept in memory */
+    err = AVT_ERROR(ENOENT);
+    if (avt_mirror_can_fetch(conn->mirror))
+        err = avt_mirror_fetch(conn->mirror, seq, &p);
+
+    if (err == AVT_ERROR(ENOENT)) {
+        AVTPktd *found = NULL;
+        for (auto i = 0; i < conn->out_fifo_pre.nb; i++) {
+            if (conn->out_fifo_pre.data[i].pkt.seq == seq) {
+                found = &conn->out_fifo_pre.data[i];
+                break;
+            }
+        }
+        if (!found)
+            return AVT_ERROR(ENOENT);
+
+        p = *found;
+        p.pl = (AVTBuffer){ };
+        avt_buffer_quick_ref(&p.pl, &found->pl, 0, found->pl.len);
+    } else if (err < 0) {
+        return err;
+    }
+
+    err = conn->p->send_packet(conn->p_ctx, &p, timeout);
+    avt_buffer_quick_unref(&p.pl);
+
+    return err;
+}
+
+int avt_connection_seek(AVTContext *ctx, AVTConnection *conn,
+                        int64_t pts, AVTRational tb,
+                        int64_t offset, bool offset_is_absolute)
+{
+    if (!conn->p->seek)
+        return AVT_ERROR(ENOTSUP);
+
+    int err;
+
+    /* Indices are in nanoseconds */
+    if (pts != INT64_MIN) {
+        pts = avt_rescale_rational(pts, tb, (AVTRational){ 1, 1000000000 });
+        err = conn->p->seek(conn->p_ctx, -1, UINT32_MAX, pts, false);
+    } else if (!offset_is_absolute) {
+        /* The read position is only known to the I/O */
+        return AVT_ERROR(ENOTSUP);
+    } else {
+        err = conn->p->seek(conn->p_ctx, offset, UINT32_MAX, INT64_MIN, false);
+    }
+
+    /* Packets after the new position may already have been received */
+    if (err >= 0 && conn->in)
+        avt_receive_reset(conn->in);
+
+    return err;
 }
 
 int avt_connection_mirror_open(AVTContext *ctx, AVTConnection *conn,
                                AVTConnectionInfo *info)
 {
-    return  0;
+    if (conn->mirror)
+        return AVT_ERROR(EEXIST);
+
+    return avt_mirror_init(ctx, &conn->mirror, info);
 }
 
 int avt_connection_mirror_close(AVTContext *ctx, AVTConnection *conn)
 {
-    return  0;
+    return avt_mirror_close(&conn->mirror);
+}
+
+int avt_connection_get_status(AVTConnection *conn, AVTConnectionStatus *s)
+{
+    int err;
+    size_t mtu;
+
+    memset(s, 0, sizeof(*s));
+
+    err = conn->p->get_max_pkt_len(conn->p_ctx, &mtu);
+    if (err < 0)
+        return err;
+    s->mtu = AVT_MIN(mtu, UINT32_MAX);
+
+    s->tx.packets = conn->tx.packets;
+    s->tx.bitrate = conn->tx.rate;
+    s->tx.rtt = avt_connection_get_rtt(conn);
+
+    s->relay.packets = conn->relay_stats.packets;
+    s->relay.dropped_packets = conn->relay_stats.dropped_packets;
+
+    if (conn->mirror)
+        avt_mirror_status(conn->mirror, s);
+
+    return 0;
 }
@@ -30,9 +30,37 @@
 #include <avtransport/connection.h>
 #include <avtransport/send.h>
 #include "packet_common.h"
+#include "utils_internal.h"
+#include "scheduler.h"
+
+typedef struct AVTReceiver AVTReceiver;
 
 int avt_connection_register_sender(AVTConnection *conn, AVTSender *s);
 
+/* Packets received on the connection get passed to r. NULL unregisters. */
+int avt_connection_register_receiver(AVTConnection *conn, AVTReceiver *r);
+
 int avt_connection_send(AVTConnection *conn, AVTPktd *p);
 
+/* Packetization parameters of the connection's output. Connections which
+ * share them output identical packets. */
+void avt_connection_get_pkt_params(AVTConnection *conn,
+                                   size_t *max_pkt_size, int64_t *bandwidth);
+
+/* Smoothed round-trip time to the receiver in nanoseconds, 0 if unknown */
+int64_t avt_connection_get_rtt(AVTConnection *conn);
+
+/* Queue packets which were already segmented and encoded, using the
+ * connection's packetization parameters. Payloads are ref'd. */
+int avt_connection_send_seq(AVTConnection *conn, const AVTPacketFifo *seq);
+
+/* Allocate sequence numbers for the connection's own packets from the
+ * same counter as the scheduler whose output it is sent. */
+int avt_connection_share_seq(AVTConnection *conn, AVTScheduler *src);
+
+/* Send a previously sent packet again. Packets are read back from the
+ * mirror, if it's a file, otherwise from memory.
+ * Returns AVT_ERROR(ENOENT) if the packet is no longer available. */
+int avt_connection_resend(AVTConnection *conn, uint32_t seq, int64_t timeout);
+
 #endif /* AVTRANSPORT_CONNECTION_INTERNAL_H */
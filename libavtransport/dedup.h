@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AVTRANSPORT_DEDUP_H
+#define AVTRANSPORT_DEDUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "utils_internal.h"
+
+/* Number of sequence numbers remembered, must be a power of two */
+#define AVT_DEDUP_WINDOW 4096
+
+/* Sliding bitmap of the sequence numbers most recently received,
+ * so that the same packet received over several connections is only
+ * processed once. */
+typedef struct AVTDedup {
+    uint64_t seen[AVT_DEDUP_WINDOW / 64];
+    uint32_t head; /* Newest sequence number received */
+    bool init;
+} AVTDedup;
+
+/* Returns true if seq was already received. Sequence numbers too old
+ * for the window are not known to be duplicates. */
+static inline bool avt_dedup_check(const AVTDedup *d, uint32_t seq)
+{
+    uint32_t age = d->head - seq;
+    if (!d->init || (int32_t)age < 0 || age >= AVT_DEDUP_WINDOW)
+        return false;
+
+    uint32_t idx = seq & (AVT_DEDUP_WINDOW - 1);
+    return d->seen[idx >> 6] & (UINT64_C(1) << (idx & 63));
+}
+
+/* Mark seq as received. Returns true if it already was. */
+static inline bool avt_dedup_mark(AVTDedup *d, uint32_t seq)
+{
+    int32_t ahead = seq - d->head;
+
+    if (!d->init) {
+        memset(d->seen, 0, sizeof(d->seen));
+        d->head = seq;
+        d->init = true;
+    } else if (ahead >= AVT_DEDUP_WINDOW) {
+        memset(d->seen, 0, sizeof(d->seen));
+        d->head = seq;
+    } else if (ahead > 0) {
+        /* Forget everything the window slides past, a word at a time */
+        uint32_t s = d->head + 1;
+        uint32_t left = ahead;
+        while (left) {
+            uint32_t idx = s & (AVT_DEDUP_WINDOW - 1);
+            uint32_t len = AVT_MIN(64 - (idx & 63), left);
+            uint64_t mask = len == 64 ? UINT64_MAX :
+                                        ((UINT64_C(1) << len) - 1) << (idx & 63);
+            d->seen[idx >> 6] &= ~mask;
+            s += len;
+            left -= len;
+        }
+        d->head = seq;
+    } else if ((uint32_t)(d->head - seq) >= AVT_DEDUP_WINDOW) {
+        return false;
+    }
+
+    uint32_t idx = seq & (AVT_DEDUP_WINDOW - 1);
+    uint64_t bit = UINT64_C(1) << (idx & 63);
+    bool seen = d->seen[idx >> 6] & bit;
+    d->seen[idx >> 6] |= bit;
+
+    return seen;
+}
+
+#endif /* AVTRANSPORT_DEDUP_H */
@@ -77,6 +77,25 @@ enum AVTConnectionType {
      *       (overriding those signalled by the sender)
      *     - rx_buf: receive buffer size
      *     - tx_buf: send buffer size
+     *     - shards=<N>&shard=<i>: listen on socket i of N sharing the port.
+     *       Senders are steered to a shard by their source address, so
+     *       each shard, being a separate connection with its own receive
+     *       state, may be processed on its own thread.
+     *       Shards of a port must all be opened by the same process, and
+     *       may be opened and closed in any order. Senders of a shard
+     *       which is closed are spread over the others.
+     *       With UDP-Lite, or if the steering program cannot be loaded
+     *       (e.g. lacking CAP_BPF), sockets are picked by the order they
+     *       were bound in instead, so shard i only gets its share if shards
+     *       are opened in order from 0 to N-1, and none is closed while
+     *       the others are in use.
+     *     - pmtud=<MTU>: probe the path for MTUs up to the given size, starting
+     *       from 1280, and raise the packet size once the receiver confirms
+     *       a probe got through.
+     *     - cscov=<udp|header|full>: UDP-Lite checksum coverage. "udp" (the
+     *       default) covers only the UDP header, "header" also covers the
+     *       AVTransport header, and "full" covers the entire datagram.
+     *       Damaged payloads are delivered and repaired via FEC unless "full".
      *     - cert: certificate file path for QUIC
      *     - key: key file path for QUIC
      *
@@ -214,8 +233,17 @@ typedef struct AVTConnectionInfo {
          * and decrease potential errors, negative values disables decoding. */
         int ldpc_iterations;
 
+        /* When relaying, recompute the FEC of every header, rather than
+         * forwarding it as received. */
+        bool relay_regen_fec;
+
+        /* Files without index packets are scanned to be seeked in.
+         * If set, the index built is kept next to the file,
+         * in <path>.idx, and reused while the file is unchanged. */
+        bool index_cache;
+
         /* Padding to allow for future options. Must always be set to 0. */
-        uint8_t padding[1024 - 0*1 - 0*2 - 1*4 - 1*8];
+        uint8_t padding[1024 - 2*1 - 0*2 - 1*4 - 1*8];
     } input_opts;
 
     struct {
@@ -288,6 +316,33 @@ AVT_API int avt_connection_init(AVTContext *ctx, AVTConnection **conn,
  */
 AVT_API int avt_connection_process(AVTConnection *conn, int64_t timeout);
 
+typedef struct AVTConnectionPoll {
+    /* File descriptor to wait on, -1 if the connection has none,
+     * in which case only the timeout applies. Connections without one
+     * (e.g. files) never block, and always have a timeout of 0 when
+     * there is anything to read or write. */
+    int fd;
+
+    /* Conditions on the file descriptor to wait for */
+    bool read;
+    bool write;
+
+    /* Time in nanoseconds after which avt_connection_process() must be
+     * called, even if the file descriptor has no events, e.g. for
+     * retransmission requests, path MTU probes, or input which was
+     * already buffered. INT64_MAX if there is no such deadline. */
+    int64_t timeout;
+} AVTConnectionPoll;
+
+/**
+ * Get what to wait on before calling avt_connection_process(), to drive
+ * connections from an event loop without busy-waiting.
+ * Must be called again after every avt_connection_process() call, as
+ * the conditions may change.
+ */
+AVT_API int avt_connection_get_poll(AVTConnection *conn,
+                                    AVTConnectionPoll *poll);
+
 /**
  * Creates an AVTransport stream mirror.
  *
@@ -305,6 +360,19 @@ AVT_API int avt_connection_mirror_open(AVTContext *ctx, AVTConnection *conn,
                                        AVTConnectionInfo *info);
 AVT_API int avt_connection_mirror_close(AVTContext *ctx, AVTConnection *conn);
 
+/**
+ * Forward every packet received on conn to dst, as-is.
+ *
+ * Packets are neither merged nor rescheduled, only their headers are
+ * parsed, and their payloads are passed through by reference. Relayed
+ * packets are kept in the retransmit cache of dst.
+ * May be called multiple times, to relay to multiple connections.
+ *
+ * NOTE: dst must be removed before it is destroyed.
+ */
+AVT_API int avt_connection_relay_add(AVTConnection *conn, AVTConnection *dst);
+AVT_API int avt_connection_relay_remove(AVTConnection *conn, AVTConnection *dst);
+
 enum AVTConnectionStatusFlags {
     AVT_CONN_STATE_MTU,
     AVT_CONN_STATE_ERR,
@@ -371,12 +439,49 @@ typedef struct AVTConnectionStatus {
 
         /* Total duration of all packets buffered (timebase: 1 nanosecond) */
         int64_t buffer_duration;
+
+        /* Smoothed round-trip time to the receiver (timebase: 1 nanosecond),
+         * 0 if not measured. Only measured with path MTU discovery, from
+         * the acknowledgements of its probes. */
+        int64_t rtt;
     } tx;
 
+    /* Mirror statistics */
+    struct {
+        /* The total number of packets written to the mirror */
+        uint64_t packets;
+
+        /* The total number of packets not mirrored due to the mirror
+         * not keeping up */
+        uint64_t dropped_packets;
+
+        /* Number of packets waiting to be written to the mirror */
+        uint64_t queued_packets;
+
+        /* Average time the last written packets each spent between being
+         * queued up, and being written (timebase: 1 nanosecond) */
+        int64_t lag;
+    } mirror;
+
+    /* Relay statistics, counted once for every destination */
+    struct {
+        /* The total number of received packets relayed */
+        uint64_t packets;
+
+        /* The total number of received packets which could not be relayed */
+        uint64_t dropped_packets;
+    } relay;
+
     /* Padding to allow for future options. Must always be set to 0. */
-    uint8_t padding[4096 - 0*1 - 0*2 - 3*4 - 10*8];
+    uint8_t padding[4096 - 0*1 - 0*2 - 3*4 - 17*8];
 } AVTConnectionStatus;
 
+/**
+ * Get the current status of a connection.
+ */
+AVT_API int avt_connection_get_status(AVTConnection *conn,
+                                      AVTConnectionStatus *s);
+
 /**
  * Subscribe to receive status notifications.
  * Special error codes like AVTERROR_EOS will be returned from status_cb on
@@ -393,6 +498,8 @@ AVT_API int avt_connection_status_cb(AVTConnection *conn, void *opaque,
  * If pts is INT64_MIN, then offset, a byte value, will be used.
  * If offset_is_absolute, the offset will be treated as an absolute position,
  * otherwise, a relative seek will be performed.
+ * Anything received before is forgotten, so packets after the new position
+ * are output again, even if they already were.
  * May return an error if no starting PTS was found, or a seek was impossible. */
 AVT_API int avt_connection_seek(AVTContext *ctx, AVTConnection *st,
                                 int64_t pts, AVTRational tb,
@@ -400,6 +507,8 @@ AVT_API int avt_connection_seek(AVTContext *ctx, AVTConnection *st,
 
 /**
  * Immediately flush all buffered data for a connection.
+ * If a mirror is open, also waits for up to timeout for it to write out
+ * all sent packets, returning AVT_ERROR(EAGAIN) if it could not.
  * Should be called before avt_connection_destroy().
  */
 AVT_API int avt_connection_flush(AVTConnection *conn, int64_t timeout);
@@ -42,8 +42,15 @@ typedef struct AVTReceiveOptions {
      */
     bool accept_incomplete;
 
+    /* Set when all connections carry the same packets, such as from
+     * a redundant sender. Packets are then output as soon as they are
+     * received over any connection, rather than waiting on all of them,
+     * and copies received over other connections are dropped.
+     * Otherwise, no packets are checked for being copies. */
+    bool redundant;
+
     /* Padding to allow for future options. Must always be set to 0. */
-    uint8_t padding[4096 - 1*1 - 0*2 - 0*4 - 0*8];
+    uint8_t padding[4096 - 2*1 - 0*2 - 0*4 - 0*8];
 } AVTReceiveOptions;
 
 /* List of callbacks. All are optional. */
@@ -67,8 +67,16 @@ typedef struct AVTSenderOptions {
     /* Set to true to enable sending hash packets for all packets with a payload. */
     bool hash;
 
+    /* Set to true to send identical packets, with identical sequence numbers,
+     * over all connections, for redundancy over independent paths.
+     * All connections are then packetized together, at the smallest
+     * packet size among them, and must not interleave (their bandwidth
+     * must be INT64_MAX). Receivers should open all paths, and set
+     * the redundant receive option. */
+    bool redundant;
+
     /* Padding to allow for future options. Must always be set to 0. */
-    uint8_t padding[4096 - 1*8 - 0*16 - 3*32 - 0*64];
+    uint8_t padding[4096 - 2*8 - 0*16 - 3*32 - 0*64];
 } AVTSenderOptions;
 
 /* Open a send context and immediately send/write a stream session packet.
@@ -78,6 +86,30 @@ typedef struct AVTSenderOptions {
 AVT_API int avt_send_open(AVTContext *ctx, AVTSender **s,
                           AVTConnection *conn, AVTSenderOptions *opts);
 
+/* Open a send context, or reuse an existing one, and add a connection
+ * as a path of its bond.
+ *
+ * Bonded connections, such as several modems and an ethernet link to the
+ * same receiver, act as one multipath output. Rather than each receiving
+ * every packet, segments are striped across all paths of the bond, in
+ * proportion to each path's capacity. Each segment goes out over the path
+ * it would arrive over first, given the path's capacity, what is already
+ * queued on it, and its delay. The receiver must open all paths to merge
+ * them back together.
+ *
+ * The delay of a path is half its round-trip time, which is measured if
+ * the connection does path MTU discovery (pmtud=), and taken to be 0
+ * otherwise.
+ *
+ * capacity is the bandwidth of the path, in bits per second, and must be
+ * given. It is not measured: the rate at which a path accepts output is
+ * only the rate the bond feeds it at, and receivers acknowledge nothing
+ * but path MTU probes, so nothing says what the path could take.
+ * The connection must not interleave (its bandwidth must be INT64_MAX). */
+AVT_API int avt_send_bond(AVTContext *ctx, AVTSender **s,
+                          AVTConnection *conn, int64_t capacity,
+                          AVTSenderOptions *opts);
+
 /* Set the epoch to use, as nanoseconds after 00:00:00 UTC on 1 January 1970.
  * Should be called once, at the start of streaming.
  * If zero, or not called, the current time will be used. */
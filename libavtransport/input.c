@@ -0,0 +1,504 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "input_internal.h"
+#include "input_packet.h"
+#include "utils_packet.h"
+#include "mem.h"
+
+#include "config.h"
+
+static void free_input_context(AVTReceiver **_r)
+{
+    AVTReceiver *r = *_r;
+
+    avt_merger_table_free(&r->mergers);
+
+    avt_reorder_free(r->ctx, &r->reorder);
+    avt_pkt_fifo_free(&r->out);
+
+    for (auto i = 0; i < UINT16_MAX; i++)
+        avt_recv_stream_free(&r->streams[i]);
+
+#ifdef CONFIG_HAVE_LIBZSTD
+    ZSTD_freeDCtx(r->zstd_ctx);
+#endif
+
+    XXH3_freeState(r->xxh_state);
+
+    free(r->conn);
+    free(r->path);
+    free(r);
+
+    *_r = NULL;
+}
+
+static inline int alloc_input_context(AVTContext *ctx, AVTReceiver **_r,
+                                      AVTReceiveCallbacks *cb, void *cb_opaque,
+                                      AVTReceiveOptions *opts)
+{
+    int err;
+    AVTReceiver *r = calloc(1, sizeof(*r));
+    if (!r)
+        return AVT_ERROR(ENOMEM);
+
+    r->ctx = ctx;
+    r->path_deadline = INT64_MAX;
+    r->cb = *cb;
+    r->cb_opaque = cb_opaque;
+    if (opts)
+        r->opts = *opts;
+
+    err = avt_reorder_init(ctx, &r->reorder, AVT_RECEIVER_REORDER_SIZE);
+    if (err < 0) {
+        free_input_context(&r);
+        return err;
+    }
+
+    err = avt_merger_table_init(&r->mergers, AVT_RECEIVER_MERGERS,
+                                AVT_RECEIVER_MERGE_TIMEOUT);
+    if (err < 0) {
+        free_input_context(&r);
+        return err;
+    }
+
+    /* Init xxHash state */
+    r->xxh_state = XXH3_createState();
+    if (!r->xxh_state) {
+        free_input_context(&r);
+        return AVT_ERROR(ENOMEM);
+    }
+
+#ifdef CONFIG_HAVE_LIBZSTD
+    /* Init Zstd context */
+    r->zstd_ctx = ZSTD_createDCtx();
+    if (!r->zstd_ctx) {
+        free_input_context(&r);
+        return AVT_ERROR(ENOMEM);
+    }
+#endif
+
+    *_r = r;
+
+    return 0;
+}
+
+int avt_receive_open(AVTContext *ctx, AVTConnection *conn,
+                     AVTReceiveCallbacks *cb, void *cb_opaque,
+                     AVTReceiveOptions *opts)
+{
+    int err;
+    AVTReceiver *r = ctx->in;
+
+    /* Allocate state, if not already existing */
+    if (!r) {
+        err = alloc_input_context(ctx, &r, cb, cb_opaque, opts);
+        if (err < 0)
+            return err;
+        ctx->in = r;
+    }
+
+    /* Register connection for input */
+    if (r->nb_conn_alloc < (r->nb_conn + 1)) {
+        AVTConnection **tmp = avt_reallocarray(r->conn,
+                                               r->nb_conn_alloc + 1,
+                                               sizeof(*tmp));
+        if (!tmp)
+            return AVT_ERROR(ENOMEM);
+
+        r->conn = tmp;
+
+        AVTReceiverPath *tmp_path = avt_reallocarray(r->path,
+                                                     r->nb_conn_alloc + 1,
+                                                     sizeof(*tmp_path));
+        if (!tmp_path)
+            return AVT_ERROR(ENOMEM);
+
+        r->path = tmp_path;
+        r->nb_conn_alloc++;
+    }
+
+    err = avt_connection_register_receiver(conn, r);
+    if (err < 0)
+        return err;
+
+    /* Waited on for a while, even if nothing arrives */
+    r->path[r->nb_conn] = (AVTReceiverPath) {
+        .last_rx = avt_get_time_ns(),
+    };
+    r->conn[r->nb_conn++] = conn;
+
+    return 0;
+}
+
+int avt_receive_set_options(AVTContext *ctx, AVTReceiveOptions *opts)
+{
+    if (!ctx->in)
+        return AVT_ERROR(EINVAL);
+
+    ctx->in->opts = *opts;
+
+    return 0;
+}
+
+int avt_receive_close(AVTContext *ctx)
+{
+    AVTReceiver *r = ctx->in;
+    if (!r)
+        return 0;
+
+    for (auto i = 0; i < r->nb_conn; i++)
+        avt_connection_register_receiver(r->conn[i], NULL);
+
+    free_input_context(&ctx->in);
+
+    return 0;
+}
+
+/* Give up on a packet being merged, output whatever we can of it,
+ * and return its merger to the table. */
+static int merger_evict(AVTReceiver *r, AVTMerger *m, bool output)
+{
+    int ret;
+    AVTPktd p = { };
+
+    if (!output || !r->opts.accept_incomplete) {
+        avt_merger_table_release(&r->mergers, m);
+        return 0;
+    }
+
+    ret = avt_pkt_merge_force(r, m, &p);
+    avt_merger_table_release(&r->mergers, m);
+    if (ret < 0)
+        return 0;
+
+    const size_t len = avt_buffer_get_data_len(&p.pl);
+    avt_packet_change_size(&p, 0, len, len);
+
+    ret = avt_reorder_push(r->ctx, &r->reorder, &p);
+    avt_buffer_quick_unref(&p.pl);
+
+    return ret;
+}
+
+/* Get the merger for a target, or a new one if the target is not in any.
+ * If all are in use, the least recently updated one is evicted. */
+static int get_merger(AVTReceiver *r, uint32_t target, AVTMerger **out)
+{
+    int ret;
+    const int64_t now = avt_get_time_ns();
+
+    ret = avt_merger_table_get(&r->mergers, target, now, out);
+    if (ret != AVT_ERROR(ENOSPC))
+        return ret;
+
+    AVTMerger *oldest = avt_merger_table_oldest(&r->mergers);
+    avt_log(r, AVT_LOG_DEBUG, "Out of mergers, giving up on packet %u\n",
+            oldest->target);
+
+    ret = merger_evict(r, oldest, true);
+    if (ret < 0)
+        return ret;
+
+    return avt_merger_table_get(&r->mergers, target, now, out);
+}
+
+/* Update a merger's state in the table after a segment was added to it */
+static void merger_update(AVTReceiver *r, AVTMerger *m)
+{
+    if (m->active)
+        avt_merger_table_touch(&r->mergers, m, avt_get_time_ns());
+    else
+        avt_merger_table_release(&r->mergers, m);
+}
+
+/* Returns true if a packet with this sequence number is too late */
+static inline bool is_late(AVTReceiver *r, uint32_t seq)
+{
+    return r->have_last_seq && !avt_seq_before(r->last_seq, seq);
+}
+
+static int merge_pkt(AVTReceiver *r, AVTPktd *p)
+{
+    int ret;
+    bool is_parity;
+    uint32_t seg_off, seg_size, tot_size;
+    int srs = avt_packet_series(p, &is_parity, &seg_off, &seg_size, &tot_size);
+
+    uint32_t target = p->pkt.seq;
+    if (srs < 0)
+        target = is_parity ? p->pkt.generic_parity.target_seq :
+                             p->pkt.generic_segment.target_seq;
+
+    if (is_late(r, target)) {
+        avt_log(r, AVT_LOG_TRACE, "Late packet %" PRIu64 " dropped\n",
+                p->pkt.seq);
+        return 0;
+    }
+
+    /* Complete already */
+    if (!srs)
+        return avt_reorder_push(r->ctx, &r->reorder, p);
+
+    AVTMerger *m;
+    ret = get_merger(r, target, &m);
+    if (ret < 0)
+        return ret;
+
+    ret = avt_pkt_merge_seg(r, m, p);
+    merger_update(r, m);
+    if (ret == AVT_ERROR(EAGAIN)) {
+        return 0;
+    } else if (ret == AVT_ERROR(ENOMEM)) {
+        return ret;
+    } else if (ret < 0) {
+        avt_log(r, AVT_LOG_DEBUG, "Unable to merge packet %" PRIu64 ": %i\n",
+                p->pkt.seq, ret);
+        return 0;
+    }
+
+    avt_packet_change_size(p, 0, ret, ret);
+
+    return avt_reorder_push(r->ctx, &r->reorder, p);
+}
+
+int avt_receive_place(void *opaque, AVTPktd *p)
+{
+    int ret;
+    AVTReceiver *r = opaque;
+
+    if (p->pkt.desc != AVT_PKT_STREAM_DATA_SEGMENT)
+        return AVT_ERROR(ENOTSUP);
+
+    const uint32_t target = p->pkt.generic_segment.target_seq;
+    if (is_late(r, target))
+        return AVT_ERROR(ENOENT);
+    else if (r->opts.redundant && avt_dedup_check(&r->dedup, p->pkt.seq))
+        return AVT_ERROR(EEXIST);
+
+    AVTMerger *m;
+    ret = get_merger(r, target, &m);
+    if (ret < 0)
+        return ret;
+
+    ret = avt_pkt_merge_place(r, m, p);
+    merger_update(r, m);
+
+    return ret;
+}
+
+/* Release all packets no active merger is still waiting on */
+static int release_pkts(AVTReceiver *r, int64_t now)
+{
+    int ret;
+    AVTMerger *oldest = NULL;
+
+    for (AVTMerger *m = r->mergers.lru_first; m; m = m->lru_next)
+        if (!oldest || avt_seq_before(m->target, oldest->target))
+            oldest = m;
+
+    bool limited = !!oldest;
+    uint32_t limit = oldest ? oldest->target : 0;
+
+    /* Packets may arrive out of order across several connections, while
+     * each keeps its own order. Only output packets all connections,
+     * bar silent ones, have gone past. */
+    r->path_deadline = INT64_MAX;
+    for (auto i = 0; r->nb_conn > 1 && !r->opts.redundant && i < r->nb_conn; i++) {
+        AVTReceiverPath *path = &r->path[i];
+        int64_t expiry = path->last_rx + AVT_RECEIVER_PATH_TIMEOUT + 1;
+        if (expiry <= now)
+            continue;
+
+        r->path_deadline = AVT_MIN(expiry, r->path_deadline);
+        if (!path->have_seq)
+            return 0;
+
+        if (!limited || avt_seq_before(path->max_seq + 1, limit)) {
+            limit = path->max_seq + 1;
+            limited = true;
+        }
+    }
+
+    /* Reordering only waits on packets being merged. Packets not part
+     * of any series which arrive after newer ones are considered late. */
+    if (limited)
+        ret = avt_reorder_pop(r->ctx, &r->reorder, limit, &r->out);
+    else
+        ret = avt_reorder_flush(r->ctx, &r->reorder, &r->out);
+    if (ret <= 0)
+        return ret;
+
+    r->last_seq = r->out.data[r->out.nb - 1].pkt.seq;
+    r->have_last_seq = true;
+
+    /* If the reorder buffer overflowed, mergers may have been overtaken */
+    for (AVTMerger *m = r->mergers.lru_first, *next; m; m = next) {
+        next = m->lru_next;
+        if (is_late(r, m->target))
+            merger_evict(r, m, false);
+    }
+
+    return ret;
+}
+
+void avt_receive_reset(AVTReceiver *r)
+{
+    while (r->mergers.lru_first)
+        avt_merger_table_release(&r->mergers, r->mergers.lru_first);
+
+    avt_reorder_clear(&r->reorder);
+    avt_pkt_fifo_clear(&r->out);
+
+    r->dedup.init = false;
+    r->have_last_seq = false;
+
+    for (auto i = 0; i < r->nb_conn; i++)
+        r->path[i].have_seq = false;
+}
+
+int64_t avt_receive_deadline(AVTReceiver *r)
+{
+    int64_t deadline = avt_merger_table_deadline(&r->mergers);
+
+    /* Held back packets get released once a connection is given up on */
+    if (r->reorder.pkts.nb)
+        deadline = AVT_MIN(r->path_deadline, deadline);
+
+    return deadline;
+}
+
+int avt_receive_process(AVTReceiver *r, AVTConnection *conn,
+                        AVTPacketFifo *in)
+{
+    int err = 0;
+    const int64_t now = avt_get_time_ns();
+
+    AVTReceiverPath *path = NULL;
+    for (auto i = 0; i < r->nb_conn; i++) {
+        if (r->conn[i] == conn) {
+            path = &r->path[i];
+            break;
+        }
+    }
+
+    if (path && in->nb)
+        path->last_rx = now;
+
+    /* Stage 1: keep hashes, merge segments, and queue up complete packets */
+    for (auto i = 0; i < in->nb; i++) {
+        AVTPktd *p = &in->data[i];
+
+        if (path && (!path->have_seq || avt_seq_before(path->max_seq, p->pkt.seq))) {
+            path->max_seq = p->pkt.seq;
+            path->have_seq = true;
+        }
+
+        /* Only the first copy of each packet is kept */
+        if (r->opts.redundant && avt_dedup_mark(&r->dedup, p->pkt.seq)) {
+            avt_buffer_quick_unref(&p->pl);
+            continue;
+        }
+
+        switch (p->pkt.desc) {
+        case AVT_PKT_SESSION_START: [[fallthrough]];
+        case AVT_PKT_FEC_GROUPING:  [[fallthrough]];
+        case AVT_PKT_STREAM_INDEX:
+            break;
+        case AVT_PKT_HASH_DATA:
+            avt_recv_pkt_hash_data(r, p);
+            break;
+        default:
+            if (!err)
+                err = merge_pkt(r, p);
+            break;
+        }
+
+        avt_buffer_quick_unref(&p->pl);
+    }
+    in->nb = 0;
+    if (err < 0)
+        return err;
+
+    /* Give up on packets which have not been added to in a while */
+    AVTMerger *m;
+    while ((m = avt_merger_table_expired(&r->mergers, now))) {
+        avt_log(r, AVT_LOG_DEBUG, "Packet %u timed out\n", m->target);
+        err = merger_evict(r, m, true);
+        if (err < 0)
+            return err;
+    }
+
+    /* Stage 2: release packets in order */
+    err = release_pkts(r, now);
+    if (err <= 0)
+        return err;
+
+    /* Stage 3: verify and decompress payloads */
+    uint32_t nb_out = 0;
+    for (auto i = 0; i < r->out.nb; i++) {
+        AVTPktd *p = &r->out.data[i];
+
+        err = avt_recv_pkt_verify(r, p);
+        if (err < 0 && !r->opts.accept_incomplete) {
+            avt_buffer_quick_unref(&p->pl);
+            continue;
+        }
+
+        err = avt_recv_pkt_decompress(r, p);
+        if (err < 0) {
+            avt_buffer_quick_unref(&p->pl);
+            if (err == AVT_ERROR(ENOMEM))
+                goto end;
+            continue;
+        }
+
+        if (nb_out != i) {
+            r->out.data[nb_out] = *p;
+            p->pl = (AVTBuffer){ };
+        }
+        nb_out++;
+    }
+
+    /* Stage 4: output */
+    err = 0;
+    for (auto i = 0; i < nb_out; i++) {
+        int ret = avt_recv_pkt_output(r, &r->out.data[i]);
+        if (ret < 0 && !err)
+            err = ret;
+    }
+
+end:
+    for (auto i = 0; i < r->out.nb; i++)
+        avt_buffer_quick_unref(&r->out.data[i].pl);
+    r->out.nb = 0;
+
+    return err < 0 ? err : nb_out;
+}
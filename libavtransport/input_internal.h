@@ -0,0 +1,139 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AVTRANSPORT_INPUT_INTERNAL_H
+#define AVTRANSPORT_INPUT_INTERNAL_H
+
+#include <avtransport/receive.h>
+
+#include "common.h"
+#include "connection_internal.h"
+#include "merger.h"
+#include "reorder.h"
+#include "dedup.h"
+
+#include "config.h"
+
+#ifdef CONFIG_HAVE_LIBXXH
+#include <xxhash.h>
+#else
+#define XXH_INLINE_ALL
+#include "extern/xxhash.h"
+#endif
+
+#ifdef CONFIG_HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* Number of packets which can be reassembled at the same time */
+#define AVT_RECEIVER_MERGERS 64
+
+/* Time after which a packet not being added to is given up on, in nanoseconds */
+#define AVT_RECEIVER_MERGE_TIMEOUT (2*INT64_C(1000000000))
+
+/* When receiving over several connections, time after which a connection
+ * which went silent is no longer waited on for reordering, in nanoseconds */
+#define AVT_RECEIVER_PATH_TIMEOUT (200*INT64_C(1000000))
+
+/* Number of payload hashes kept around until their target is output */
+#define AVT_RECEIVER_HASHES 64
+
+/* Default limit of the amount of data held back for reordering */
+#define AVT_RECEIVER_REORDER_SIZE (32*1024*1024)
+
+typedef struct AVTReceiverHash {
+    bool valid;
+    uint32_t target;
+    uint8_t hash[16];
+} AVTReceiverHash;
+
+typedef struct AVTReceiverPath {
+    /* Highest sequence number received over the connection */
+    uint32_t max_seq;
+    bool have_seq;
+
+    /* Time anything was last received over the connection */
+    int64_t last_rx;
+} AVTReceiverPath;
+
+typedef struct AVTReceiver {
+    AVTContext *ctx;
+    AVTReceiveOptions opts;
+    AVTReceiveCallbacks cb;
+    void *cb_opaque;
+
+    AVTConnection **conn;
+    AVTReceiverPath *path; /* State of each connection */
+    uint32_t nb_conn;
+    uint32_t nb_conn_alloc;
+
+    /* Time at which the first connection waited on goes silent */
+    int64_t path_deadline;
+
+    AVTStream streams[UINT16_MAX];
+
+    /* Sequence numbers received, to drop copies from other connections */
+    AVTDedup dedup;
+
+    /* Segment reassembly */
+    AVTMergerTable mergers;
+
+    /* Complete packets, waiting on any older ones still being merged */
+    AVTReorderBuffer reorder;
+
+    /* Packets released for output, in order */
+    AVTPacketFifo out;
+
+    /* Sequence number of the last packet output */
+    uint64_t last_seq;
+    bool have_last_seq;
+
+    AVTReceiverHash hashes[AVT_RECEIVER_HASHES];
+
+    XXH3_state_t *xxh_state;
+#ifdef CONFIG_HAVE_LIBZSTD
+    ZSTD_DCtx *zstd_ctx;
+#endif
+} AVTReceiver;
+
+/* Process a batch of packets received over conn. Payloads of all packets
+ * are consumed. Returns the number of packets output, or a negative error. */
+int avt_receive_process(AVTReceiver *r, AVTConnection *conn,
+                        AVTPacketFifo *in);
+
+/* Forget all packets being received, and what was received so far, so
+ * that packets received again, e.g. after seeking, are output again. */
+void avt_receive_reset(AVTReceiver *r);
+
+/* Time by which avt_receive_process() must be called again, even with no
+ * new packets, for timeouts to be handled. INT64_MAX if there's none. */
+int64_t avt_receive_deadline(AVTReceiver *r);
+
+/* Placement callback, for protocols to receive segments directly into
+ * the packet being reassembled */
+int avt_receive_place(void *opaque, AVTPktd *p);
+
+#endif /* AVTRANSPORT_INPUT_INTERNAL_H */
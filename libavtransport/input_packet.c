@@ -0,0 +1,440 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "input_packet.h"
+
+#include "config.h"
+#include "packet_common.h"
+#include "utils_packet.h"
+
+#ifdef CONFIG_HAVE_LIBBROTLIDEC
+#include <brotli/decode.h>
+#endif
+
+void avt_recv_pkt_hash_data(AVTReceiver *r, AVTPktd *p)
+{
+    const uint32_t target = p->pkt.hash_data.hash_target;
+    AVTReceiverHash *h = &r->hashes[target % AVT_RECEIVER_HASHES];
+
+    h->valid = true;
+    h->target = target;
+    memcpy(h->hash, p->pkt.hash_data.hash_data, sizeof(h->hash));
+}
+
+int avt_recv_pkt_verify(AVTReceiver *r, AVTPktd *p)
+{
+    const uint32_t seq = p->pkt.seq & UINT32_MAX;
+    AVTReceiverHash *h = &r->hashes[seq % AVT_RECEIVER_HASHES];
+    if (!h->valid || h->target != seq)
+        return 0;
+
+    h->valid = false;
+
+    size_t len;
+    uint8_t *data = avt_buffer_get_data(&p->pl, &len);
+
+    XXH128_canonical_t hash;
+    XXH128_canonicalFromHash(&hash, XXH3_128bits(data, len));
+    if (memcmp(hash.digest, h->hash, sizeof(h->hash))) {
+        avt_log(r, AVT_LOG_ERROR, "Hash mismatch for packet %" PRIu64 "\n",
+                p->pkt.seq);
+        return AVT_ERROR(EILSEQ);
+    }
+
+    return 0;
+}
+
+#ifdef CONFIG_HAVE_LIBZSTD
+static int payload_decompress_zstd(AVTReceiver *r, AVTBuffer *dst,
+                                   const uint8_t *src, size_t src_len)
+{
+    int err;
+
+    /* The sender always pledges the size, but do not rely on it */
+    unsigned long long size = ZSTD_getFrameContentSize(src, src_len);
+    if (size == ZSTD_CONTENTSIZE_ERROR)
+        return AVT_ERROR(EINVAL);
+    else if (size == ZSTD_CONTENTSIZE_UNKNOWN)
+        size = AVT_MAX(src_len << 2, ZSTD_DStreamOutSize());
+
+    /* TODO: use a buffer pool */
+    uint8_t *data = avt_buffer_quick_alloc(dst, size);
+    if (!data)
+        return AVT_ERROR(ENOMEM);
+
+    ZSTD_DCtx_reset(r->zstd_ctx, ZSTD_reset_session_only);
+
+    ZSTD_inBuffer in = { .src = src, .size = src_len };
+    ZSTD_outBuffer out = { .dst = data, .size = size };
+
+    while (1) {
+        size_t ret = ZSTD_decompressStream(r->zstd_ctx, &out, &in);
+        if (ZSTD_isError(ret)) {
+            avt_log(r, AVT_LOG_ERROR, "Error while decompressing with Zstd: %s\n",
+                    ZSTD_getErrorName(ret));
+            err = AVT_ERROR(EINVAL);
+            goto fail;
+        } else if (!ret) {
+            break;
+        } else if (out.pos < out.size) {
+            /* Out of input, but the frame is not done */
+            err = AVT_ERROR(EINVAL);
+            goto fail;
+        }
+
+        err = avt_buffer_resize(dst, out.size << 1);
+        if (err < 0)
+            goto fail;
+
+        out.dst = avt_buffer_get_data(dst, &out.size);
+    }
+
+    avt_buffer_resize(dst, out.pos);
+
+    return 0;
+
+fail:
+    avt_buffer_quick_unref(dst);
+    return err;
+}
+#endif
+
+#ifdef CONFIG_HAVE_LIBBROTLIDEC
+static int payload_decompress_brotli(AVTReceiver *r, AVTBuffer *dst,
+                                     const uint8_t *src, size_t src_len)
+{
+    int err = 0;
+    size_t size = src_len << 2;
+
+    /* TODO: use a buffer pool */
+    uint8_t *data = avt_buffer_quick_alloc(dst, size);
+    if (!data)
+        return AVT_ERROR(ENOMEM);
+
+    BrotliDecoderState *bs = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+    if (!bs) {
+        avt_buffer_quick_unref(dst);
+        return AVT_ERROR(ENOMEM);
+    }
+
+    size_t avail_in = src_len;
+    const uint8_t *next_in = src;
+    size_t avail_out = size;
+    uint8_t *next_out = data;
+
+    BrotliDecoderResult res;
+    while ((res = BrotliDecoderDecompressStream(bs, &avail_in, &next_in,
+                                                &avail_out, &next_out,
+                                                NULL)) ==
+           BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+        const size_t pos = size - avail_out;
+
+        err = avt_buffer_resize(dst, size << 1);
+        if (err < 0)
+            break;
+
+        data = avt_buffer_get_data(dst, &size);
+        next_out = data + pos;
+        avail_out = size - pos;
+    }
+
+    BrotliDecoderDestroyInstance(bs);
+
+    if (!err && res != BROTLI_DECODER_RESULT_SUCCESS) {
+        avt_log(r, AVT_LOG_ERROR, "Error while decompressing with Brotli!\n");
+        err = AVT_ERROR(EINVAL);
+    }
+
+    if (err < 0) {
+        avt_buffer_quick_unref(dst);
+        return err;
+    }
+
+    avt_buffer_resize(dst, size - avail_out);
+
+    return 0;
+}
+#endif
+
+int avt_recv_pkt_decompress(AVTReceiver *r, AVTPktd *p)
+{
+    int err;
+    enum AVTDataCompression method = avt_packet_get_compression(p);
+    if (method == AVT_DATA_COMPRESSION_NONE)
+        return 0;
+
+    size_t src_len;
+    const uint8_t *src = avt_buffer_get_data(&p->pl, &src_len);
+
+    AVTBuffer dst = { };
+    switch (method) {
+#ifdef CONFIG_HAVE_LIBZSTD
+    case AVT_DATA_COMPRESSION_ZSTD:
+        err = payload_decompress_zstd(r, &dst, src, src_len);
+        break;
+#endif
+#ifdef CONFIG_HAVE_LIBBROTLIDEC
+    case AVT_DATA_COMPRESSION_BROTLI:
+        err = payload_decompress_brotli(r, &dst, src, src_len);
+        break;
+#endif
+    default:
+        avt_log(r, AVT_LOG_ERROR, "Unsupported compression method: %i\n", method);
+        return AVT_ERROR(ENOTSUP);
+    };
+
+    if (err < 0)
+        return err;
+
+    avt_buffer_quick_unref(&p->pl);
+    p->pl = dst;
+
+    const size_t len = avt_buffer_get_data_len(&p->pl);
+    avt_packet_set_compression(p, AVT_DATA_COMPRESSION_NONE);
+    avt_packet_change_size(p, 0, len, len);
+
+    return 0;
+}
+
+/* Move the payload of a packet to a standalone buffer, given to users */
+static int payload_to_buffer(AVTPktd *p, AVTBuffer **buf)
+{
+    *buf = NULL;
+    if (!avt_buffer_get_refcount(&p->pl))
+        return 0;
+
+    AVTBuffer *tmp = malloc(sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+
+    *tmp = p->pl;
+    p->pl = (AVTBuffer){ };
+    *buf = tmp;
+
+    return 0;
+}
+
+static inline AVTStream *get_stream(AVTReceiver *r, uint16_t id)
+{
+    if (id == UINT16_MAX)
+        return NULL;
+
+    AVTStream *st = &r->streams[id];
+    if (!st->priv || !st->priv->active) {
+        avt_log(r, AVT_LOG_DEBUG, "Packet for unregistered stream 0x%X\n", id);
+        return NULL;
+    }
+
+    return st;
+}
+
+static int recv_stream_registration(AVTReceiver *r, AVTPktd *p)
+{
+    AVTStreamRegistration *reg = &p->pkt.stream_registration;
+    if (reg->stream_id == UINT16_MAX)
+        return 0;
+
+    AVTStream *st = &r->streams[reg->stream_id];
+    if (!st->priv) {
+        st->priv = calloc(1, sizeof(*st->priv));
+        if (!st->priv)
+            return AVT_ERROR(ENOMEM);
+    }
+
+    st->id = reg->stream_id;
+    st->codec_id = reg->codec_id;
+    st->timebase = reg->timebase;
+    st->flags = reg->stream_flags;
+    st->bitrate = reg->bandwidth;
+    st->related_to = reg->related_stream_id != UINT16_MAX ?
+                     &r->streams[reg->related_stream_id] : NULL;
+    st->derived_from = reg->derived_stream_id != UINT16_MAX ?
+                       &r->streams[reg->derived_stream_id] : NULL;
+    st->priv->codec_id = reg->codec_id;
+
+    if (st->priv->active) {
+        if (r->cb.stream_update_cb)
+            r->cb.stream_update_cb(r->cb_opaque, st);
+        return 0;
+    }
+
+    st->priv->active = true;
+    if (r->cb.stream_register_cb)
+        return r->cb.stream_register_cb(r->cb_opaque, st);
+
+    return 0;
+}
+
+static inline void stream_updated(AVTReceiver *r, AVTStream *st)
+{
+    if (r->cb.stream_update_cb)
+        r->cb.stream_update_cb(r->cb_opaque, st);
+}
+
+int avt_recv_pkt_output(AVTReceiver *r, AVTPktd *p)
+{
+    int err = 0;
+    AVTStream *st;
+    AVTBuffer *buf;
+
+    switch (p->pkt.desc) {
+    case AVT_PKT_TIME_SYNC:
+        if (r->cb.time_sync_cb)
+            r->cb.time_sync_cb(r->cb_opaque, p->pkt.time_sync.epoch);
+        break;
+    case AVT_PKT_STREAM_REGISTRATION:
+        err = recv_stream_registration(r, p);
+        break;
+    case AVT_PKT_VIDEO_INFO:
+        if (!(st = get_stream(r, p->pkt.stream_id)))
+            break;
+        st->video_info = p->pkt.video_info;
+        stream_updated(r, st);
+        break;
+    case AVT_PKT_VIDEO_ORIENTATION:
+        if (!(st = get_stream(r, p->pkt.stream_id)))
+            break;
+        st->video_orientation = p->pkt.video_orientation;
+        stream_updated(r, st);
+        break;
+    case AVT_PKT_STREAM_DURATION:
+        if (!(st = get_stream(r, p->pkt.stream_id)))
+            break;
+        st->duration = p->pkt.stream_duration.total_duration;
+        if (r->cb.duration_cb && st->timebase.den)
+            r->cb.duration_cb(r->cb_opaque,
+                              avt_rescale_rational(st->duration, st->timebase,
+                                                   (AVTRational){ 1, 1000000000 }));
+        break;
+    case AVT_PKT_STREAM_END:
+        if (!(st = get_stream(r, p->pkt.stream_id)))
+            break;
+        st->priv->active = false;
+        if (r->cb.stream_close_cb)
+            r->cb.stream_close_cb(r->cb_opaque, st);
+        break;
+    case AVT_PKT_STREAM_DATA:
+        if (!(st = get_stream(r, p->pkt.stream_id)) || !r->cb.stream_pkt_cb)
+            break;
+
+        err = payload_to_buffer(p, &buf);
+        if (err < 0)
+            break;
+
+        err = r->cb.stream_pkt_cb(r->cb_opaque, st, (AVTPacket) {
+            .data = buf,
+            .total_size = avt_buffer_get_data_len(buf),
+            .type = p->pkt.stream_data.frame_type,
+            .pts = p->pkt.stream_data.pts,
+            .dts = p->pkt.stream_data.pts,
+            .duration = p->pkt.stream_data.duration,
+        });
+
+        avt_buffer_unref(&buf);
+        break;
+    case AVT_PKT_USER_DATA:
+        if (!r->cb.user_pkt_cb)
+            break;
+
+        err = payload_to_buffer(p, &buf);
+        if (err < 0)
+            break;
+
+        err = r->cb.user_pkt_cb(r->cb_opaque, buf, p->pkt.desc,
+                                p->pkt.user_data.user_field,
+                                p->pkt.seq & UINT32_MAX);
+
+        avt_buffer_unref(&buf);
+        break;
+    case AVT_PKT_FONT_DATA:
+        if (!r->cb.font_register_cb)
+            break;
+
+        err = payload_to_buffer(p, &buf);
+        if (err < 0)
+            break;
+
+        st = p->pkt.stream_id != UINT16_MAX ? get_stream(r, p->pkt.stream_id) : NULL;
+        r->cb.font_register_cb(r->cb_opaque, st, buf,
+                               (const char *)p->pkt.font_data.font_name);
+
+        avt_buffer_unref(&buf);
+        break;
+    case AVT_PKT_LUT_ICC:
+        if (!(st = get_stream(r, p->pkt.stream_id)))
+            break;
+
+        err = payload_to_buffer(p, &buf);
+        if (err < 0)
+            break;
+
+        if (p->pkt.lut_icc.lut_type == AVT_CLUT_TYPE_ICC_PROFILE) {
+            avt_buffer_unref(&st->icc_data);
+            st->icc_info = p->pkt.lut_icc;
+            st->icc_data = buf;
+            st->nb_icc = 1;
+        } else {
+            avt_buffer_unref(&st->lut_data);
+            st->lut_info = p->pkt.lut_icc;
+            st->lut_data = buf;
+            st->nb_lut = 1;
+        }
+
+        stream_updated(r, st);
+        break;
+    case AVT_PKT_STREAM_CONFIG:
+        if (!(st = get_stream(r, p->pkt.stream_id)))
+            break;
+
+        err = payload_to_buffer(p, &buf);
+        if (err < 0)
+            break;
+
+        avt_buffer_unref(&st->init_data);
+        st->init_data = buf;
+
+        stream_updated(r, st);
+        break;
+    default:
+        /* TODO: metadata parsing */
+        break;
+    }
+
+    return err;
+}
+
+void avt_recv_stream_free(AVTStream *st)
+{
+    avt_buffer_unref(&st->icc_data);
+    avt_buffer_unref(&st->lut_data);
+    avt_buffer_unref(&st->init_data);
+    free(st->priv);
+    st->priv = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AVTRANSPORT_INPUT_PACKET_H
+#define AVTRANSPORT_INPUT_PACKET_H
+
+#include "input_internal.h"
+
+/* Hash data, kept until its target is output */
+void avt_recv_pkt_hash_data(AVTReceiver *r, AVTPktd *p);
+
+/* Check the payload against its hash, if one was received.
+ * Returns AVT_ERROR(EILSEQ) on a mismatch. */
+int avt_recv_pkt_verify(AVTReceiver *r, AVTPktd *p);
+
+/* Decompress the payload in place, if compressed */
+int avt_recv_pkt_decompress(AVTReceiver *r, AVTPktd *p);
+
+/* Update state and run the callbacks for a complete packet.
+ * Returns the first error returned by a callback. */
+int avt_recv_pkt_output(AVTReceiver *r, AVTPktd *p);
+
+/* Free all data held by a stream */
+void avt_recv_stream_free(AVTStream *st);
+
+#endif /* AVTRANSPORT_INPUT_PACKET_H */
@@ -93,6 +93,20 @@ typedef struct AVTIO {
      * Returns positive offset after writing on success, otherwise negative error. */
     avt_pos (*write_pkt)(AVTIOCtx *io, AVTPktd *p, int64_t timeout);
 
+    /* Write a path MTU probe. Unlike with write_pkt, it must be sent
+     * even if larger than the path MTU the system knows of.
+     * Returns positive offset after writing on success, otherwise negative error.
+     * May be NULL if unsupported, in which case write_pkt is used. */
+    avt_pos (*write_probe)(AVTIOCtx *io, AVTPktd *p, int64_t timeout);
+
+    /* Write a single packet back to the source of a datagram read,
+     * leaving the output's destination as-is. idx is the index of the
+     * datagram in the last batch read by read_dgrams, or 0 for the last
+     * datagram read by any other means.
+     * Returns 0 on success, otherwise negative error.
+     * May be NULL if unsupported. */
+    int (*reply_pkt)(AVTIOCtx *io, AVTPktd *p, int idx, int64_t timeout);
+
     /* Rewrite a packet at a specific location.
      * The old packet's size must exactly match the new packet. */
     avt_pos (*rewrite)(AVTIOCtx *io, AVTPktd *p, avt_pos off, int64_t timeout);
@@ -108,9 +122,33 @@ typedef struct AVTIO {
     avt_pos (*read_input)(AVTIOCtx *io, AVTBuffer *buf, size_t len,
                           int64_t timeout, enum AVTIOReadFlags flags);
 
+    /* Replace buf with a reference to up to len bytes of input, without
+     * copying. The data must not be modified.
+     *
+     * Returns positive current offset after reading on success,
+     * otherwise negative error.
+     * May be NULL if unsupported. */
+    avt_pos (*read_ref)(AVTIOCtx *io, AVTBuffer *buf, size_t len,
+                        int64_t timeout);
+
+    /* Read up to nb datagrams at once, with datagram i going into dgram[i],
+     * which must have space for size bytes. The size of each datagram is
+     * written to len[i], which is 0 if the datagram did not fit.
+     * Only waits for the first datagram.
+     *
+     * Returns the number of datagrams read on success,
+     * otherwise negative error.
+     * May be NULL if unsupported. */
+    int (*read_dgrams)(AVTIOCtx *io, uint8_t **dgram, size_t *len, int nb,
+                       size_t size, int64_t timeout);
+
     /* Set the read position */
     avt_pos (*seek)(AVTIOCtx *io, avt_pos off);
 
+    /* Get a file descriptor which can be polled for I/O readiness.
+     * May be NULL if unsupported. */
+    int (*get_fd)(AVTIOCtx *io);
+
     /* Flush data written */
     int (*flush)(AVTIOCtx *io, int64_t timeout);
 
@@ -26,7 +26,8 @@
 
 #include "config.h"
 
-#if defined(CONFIG_HAVE_MREMAP) || defined(CONFIG_HAVE_FALLOCATE)
+#if defined(CONFIG_HAVE_MREMAP) || defined(CONFIG_HAVE_FALLOCATE) || \
+    defined(CONFIG_HAVE_SYNC_FILE_RANGE)
 #define _GNU_SOURCE
 #endif
 
@@ -37,18 +38,22 @@
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <limits.h>
-
-#ifdef CONFIG_HAVE_MREMAP
 #include <sys/mman.h>
-#endif
 
 #include "io_common.h"
 #include "io_utils.h"
 #include "utils_internal.h"
+#include "mem.h"
 
 /* A reasonable default */
 #define MIN_ALLOC 1024*1024
 
+/* Mappings double in size when growing, but by no more than this at once */
+#define MAX_GROW (256*1024*1024)
+
+/* Written data is handed off to the kernel for writeback in chunks this big */
+#define WRITEBACK_CHUNK (8*1024*1024)
+
 struct AVTIOCtx {
     int fd;
     AVTBuffer map;
@@ -56,6 +61,21 @@ struct AVTIOCtx {
     avt_pos rpos;
     avt_pos wpos;
 
+    /* End of valid data in the file, excluding any preallocated space */
+    avt_pos data_end;
+
+    /* Everything before this has been submitted for writeback */
+    avt_pos wb_pos;
+
+    /* Range handed out as references. It must not be rewritten while
+     * any references are still around, as they're read-only. */
+    avt_pos ref_start;
+    avt_pos ref_end;
+
+    /* Previous mappings, still referenced after being replaced */
+    AVTBuffer *old_map;
+    int nb_old_map;
+
     bool file_grew;
 };
 
@@ -69,8 +89,11 @@ static COLD int mmap_close(AVTIOCtx **_io)
 {
     AVTIOCtx *io = *_io;
     avt_buffer_quick_unref(&io->map);
+    for (auto i = 0; i < io->nb_old_map; i++)
+        avt_buffer_quick_unref(&io->old_map[i]);
+    free(io->old_map);
     if (io->file_grew)
-        ftruncate(io->fd, io->wpos);
+        ftruncate(io->fd, io->data_end);
     close(io->fd);
     free(io);
     *_io = NULL;
@@ -105,11 +128,27 @@ static int fd_fallocate(AVTIOCtx *io, size_t len)
     return 0;
 }
 
+/* Hint that the mapping is accessed sequentially, and may use huge pages.
+ * Both are only hints, so failures are not fatal. */
+static void mmap_advise(uint8_t *data, size_t len)
+{
+#ifdef MADV_SEQUENTIAL
+    madvise(data, len, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+    madvise(data, len, MADV_HUGEPAGE);
+#endif
+}
+
 static COLD int mmap_init_common(AVTContext *ctx, AVTIOCtx *io)
 {
     int ret;
 
-    size_t len = lseek(io->fd, SEEK_END, 0);
+    off_t file_len = lseek(io->fd, 0, SEEK_END);
+    if (file_len < 0)
+        return avt_handle_errno(io, "Error in lseek(): %i %s\n");
+
+    size_t len = file_len;
     if (!len) {
         len = MIN_ALLOC;
         ret = fd_fallocate(io, len);
@@ -118,6 +157,8 @@ static COLD int mmap_init_common(AVTContext *ctx, AVTIOCtx *io)
         io->file_grew = 1;
     }
 
+    io->data_end = file_len;
+
     int fd_dup = dup(io->fd);
     if (fd_dup < 0)
         return avt_handle_errno(io, "Error in dup(): %i %s\n");
@@ -128,12 +169,14 @@ static COLD int mmap_init_common(AVTContext *ctx, AVTIOCtx *io)
                       MAP_NONBLOCK,
                       fd_dup, 0);
 
-    if (!data) {
+    if (data == MAP_FAILED) {
         ret = avt_handle_errno(io, "Error in mmap(): %i %s\n");
         close(fd_dup);
         return ret;
     }
 
+    mmap_advise(data, len);
+
     ret = avt_buffer_quick_create(&io->map, data, len,
                                   (void *)((intptr_t)fd_dup),
                                   mmap_buffer_free,
@@ -206,6 +249,8 @@ static int mmap_grow(AVTIOCtx *io, size_t amount)
     uint8_t *old_map = avt_buffer_get_data(&io->map, &old_map_size);
     void *new_map = MAP_FAILED;
 
+    /* Grow geometrically, so long recordings need few remaps */
+    amount = AVT_MAX(amount, AVT_MIN(old_map_size, MAX_GROW));
     amount = AVT_MAX(amount, MIN_ALLOC);
     size_t new_map_size = old_map_size + amount;
 
@@ -229,6 +274,7 @@ static int mmap_grow(AVTIOCtx *io, size_t amount)
     if (new_map != MAP_FAILED) {
         /* Update the existing buffer */
         avt_buffer_update(&io->map, new_map, new_map_size);
+        mmap_advise(new_map, new_map_size);
         return 0;
     } else if (new_map == MAP_FAILED && errno != ENOMEM) {
         ret = avt_handle_errno(io, "Error in mremap(): %i %s\n");
@@ -247,9 +293,9 @@ static int mmap_grow(AVTIOCtx *io, size_t amount)
         return ret;
     }
 
+    /* Not populated, as the mapping may be many gigabytes in size */
     void *data = mmap(NULL, new_map_size, PROT_READ | PROT_WRITE,
-                      MAP_SHARED |
-                      MAP_POPULATE,
+                      MAP_SHARED,
                       fd_dup, 0);
     if (data == MAP_FAILED) {
         ret = avt_handle_errno(io, "Error in mmap(): %i %s\n");
@@ -257,6 +303,8 @@ static int mmap_grow(AVTIOCtx *io, size_t amount)
         return ret;
     }
 
+    mmap_advise(data, new_map_size);
+
     AVTBuffer new_buf;
     ret = avt_buffer_quick_create(&new_buf, data, new_map_size,
                                   (void *)((intptr_t)fd_dup),
@@ -268,12 +316,63 @@ static int mmap_grow(AVTIOCtx *io, size_t amount)
         return ret;
     }
 
-    avt_buffer_quick_unref(&io->map);
+    /* References to the old mapping still see any rewrites */
+    if (avt_buffer_get_refcount(&io->map) > 1) {
+        AVTBuffer *tmp = avt_reallocarray(io->old_map, io->nb_old_map + 1,
+                                          sizeof(*tmp));
+        if (!tmp) {
+            avt_buffer_quick_unref(&new_buf);
+            return AVT_ERROR(ENOMEM);
+        }
+        io->old_map = tmp;
+        io->old_map[io->nb_old_map++] = io->map;
+    } else {
+        avt_buffer_quick_unref(&io->map);
+    }
+
     io->map = new_buf;
 
     return 0;
 }
 
+/* Check if any references handed out are still around */
+static bool mmap_refs_outstanding(AVTIOCtx *io)
+{
+    for (auto i = 0; i < io->nb_old_map; i++) {
+        if (avt_buffer_get_refcount(&io->old_map[i]) > 1)
+            continue;
+        avt_buffer_quick_unref(&io->old_map[i]);
+        io->old_map[i--] = io->old_map[--io->nb_old_map];
+    }
+
+    return io->nb_old_map || (avt_buffer_get_refcount(&io->map) > 1);
+}
+
+/* Start writeback of all complete chunks written so far, without waiting
+ * for it to finish. The kernel writes the pages back on its own, in the
+ * background. This keeps the amount of dirty pages low, so the final
+ * flush and page reclaim don't stall on long recordings.
+ * Only a hint: the data has been written by the time this is called,
+ * so failures are logged, and left to be caught by the next flush. */
+static void mmap_writeback(AVTIOCtx *io)
+{
+    avt_pos end = io->wpos & ~((avt_pos)WRITEBACK_CHUNK - 1);
+    if (end <= io->wb_pos)
+        return;
+
+#ifdef CONFIG_HAVE_SYNC_FILE_RANGE
+    if (sync_file_range(io->fd, io->wb_pos, end - io->wb_pos,
+                        SYNC_FILE_RANGE_WRITE))
+        avt_handle_errno(io, "Error in sync_file_range(): %i %s\n");
+#else
+    uint8_t *map_data = avt_buffer_get_data(&io->map, NULL);
+    if (msync(&map_data[io->wb_pos], end - io->wb_pos, MS_ASYNC))
+        avt_handle_errno(io, "Error in msync(): %i %s\n");
+#endif
+
+    io->wb_pos = end;
+}
+
 static int mmap_max_pkt_len(AVTIOCtx *io, size_t *mtu)
 {
     *mtu = SIZE_MAX;
@@ -282,7 +381,7 @@ static int mmap_max_pkt_len(AVTIOCtx *io, size_t *mtu)
 
 static inline avt_pos mmap_seek(AVTIOCtx *io, avt_pos pos)
 {
-    if (pos > avt_buffer_get_data_len(&io->map))
+    if (pos > io->data_end)
         return AVT_ERROR(ERANGE);
     return (io->rpos = pos);
 }
@@ -303,10 +402,15 @@ static avt_pos mmap_write_pkt(AVTIOCtx *io, AVTPktd *p, int64_t timeout)
 
     map_data = avt_buffer_get_data(&io->map, &map_size);
     memcpy(&map_data[io->wpos], p->hdr, p->hdr_len);
-    memcpy(&map_data[io->wpos + p->hdr_len], pl_data, pl_len);
+    if (pl_len)
+        memcpy(&map_data[io->wpos + p->hdr_len], pl_data, pl_len);
 
     avt_pos offset = io->wpos + p->hdr_len + pl_len;
     AVT_SWAP(io->wpos, offset);
+    io->data_end = AVT_MAX(io->data_end, io->wpos);
+
+    mmap_writeback(io);
+
     return offset;
 }
 
@@ -337,6 +441,10 @@ static avt_pos mmap_write_vec(AVTIOCtx *io, AVTPktd *iov, uint32_t nb_iov,
     }
 
     AVT_SWAP(io->wpos, offset);
+    io->data_end = AVT_MAX(io->data_end, io->wpos);
+
+    mmap_writeback(io);
+
     return offset;
 }
 
@@ -352,33 +460,61 @@ static avt_pos mmap_rewrite(AVTIOCtx *io, AVTPktd *p, avt_pos off,
     if ((off + p->hdr_len + pl_len) > map_size)
         return AVT_ERROR(ERANGE);
 
+    /* Data handed out as references may not change under them */
+    if (((off + p->hdr_len + pl_len) > io->ref_start) && (off < io->ref_end) &&
+        mmap_refs_outstanding(io)) {
+        avt_log(io, AVT_LOG_ERROR, "Unable to rewrite data still referenced\n");
+        return AVT_ERROR(EBUSY);
+    }
+
     memcpy(&map_data[off], p->hdr, p->hdr_len);
-    memcpy(&map_data[off + p->hdr_len], pl_data, pl_len);
+    if (pl_len)
+        memcpy(&map_data[off + p->hdr_len], pl_data, pl_len);
 
     return off;
 }
 
-static inline int64_t mmap_read(AVTIOCtx *io, AVTBuffer *dst,
-                                size_t len, int64_t timeout,
-                                enum AVTIOReadFlags flags)
+static avt_pos mmap_read_ref(AVTIOCtx *io, AVTBuffer *dst, size_t len,
+                             int64_t timeout)
 {
-    size_t map_size;
-    uint8_t *map_data = avt_buffer_get_data(&io->map, &map_size);
+    len = AVT_MIN(io->data_end - io->rpos, len);
 
-    /* TODO: cap map_size at wpos? */
-    len = AVT_MIN(map_size - io->rpos, len);
-
-    if (flags & AVT_IO_READ_MUTABLE) {
-        dst = avt_buffer_get_data(dst, NULL);
-        memcpy(dst, &map_data[io->rpos], len);
+    if (!mmap_refs_outstanding(io)) {
+        io->ref_start = io->rpos;
+        io->ref_end = io->rpos + len;
     } else {
-        avt_buffer_quick_unref(dst);
-        avt_buffer_quick_ref(dst, &io->map, io->rpos, len);
+        io->ref_start = AVT_MIN(io->ref_start, io->rpos);
+        io->ref_end = AVT_MAX(io->ref_end, io->rpos + len);
     }
 
-    len = io->rpos + len;
-    AVT_SWAP(io->rpos, len);
-    return len;
+    /* The mapping is read-only, so references may be handed out freely.
+     * If it gets moved or recreated while growing, references keep the
+     * old mapping alive. */
+    avt_buffer_quick_ref(dst, &io->map, io->rpos, len);
+
+    avt_pos ret = io->rpos + len;
+    AVT_SWAP(io->rpos, ret);
+    return ret;
+}
+
+static avt_pos mmap_read(AVTIOCtx *io, AVTBuffer *dst, size_t len,
+                         int64_t timeout, enum AVTIOReadFlags flags)
+{
+    if (!(flags & AVT_IO_READ_MUTABLE))
+        return mmap_read_ref(io, dst, len, timeout);
+
+    uint8_t *map_data = avt_buffer_get_data(&io->map, NULL);
+    uint8_t *dst_data = avt_buffer_get_data(dst, NULL);
+
+    len = AVT_MIN(io->data_end - io->rpos, len);
+    memcpy(dst_data, &map_data[io->rpos], len);
+
+    [[maybe_unused]] int tmp = avt_buffer_resize(dst, len);
+    avt_assert2(tmp >= 0);
+
+    avt_pos ret = io->rpos + len;
+    AVT_SWAP(io->rpos, ret);
+    return ret;
 }
 
 static int mmap_flush(AVTIOCtx *io, int64_t timeout)
@@ -399,6 +535,7 @@ const AVTIO avt_io_mmap = {
     .init = mmap_init,
     .get_max_pkt_len = mmap_max_pkt_len,
     .read_input = mmap_read,
+    .read_ref = mmap_read_ref,
     .write_vec = mmap_write_vec,
     .write_pkt = mmap_write_pkt,
     .rewrite = mmap_rewrite,
@@ -413,6 +550,7 @@ const AVTIO avt_io_mmap_path = {
     .init = mmap_init_path,
     .get_max_pkt_len = mmap_max_pkt_len,
     .read_input = mmap_read,
+    .read_ref = mmap_read_ref,
     .write_vec = mmap_write_vec,
     .write_pkt = mmap_write_pkt,
     .rewrite = mmap_rewrite,
@@ -29,6 +29,7 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <arpa/inet.h>
 #include <netinet/udp.h>
@@ -55,11 +56,22 @@
 #include <linux/net_tstamp.h>
 #endif
 
+#if __has_include(<linux/filter.h>)
+#include <linux/filter.h>
+#endif
+
+#if defined(SO_ATTACH_REUSEPORT_EBPF) && __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#define SHARD_EBPF
+#endif
+
 #include <ifaddrs.h>
 
 #include "io_socket_common.h"
 #include "io_utils.h"
 #include "attributes.h"
+#include "mem.h"
 
 int avt_socket_get_opt(void *log_ctx, int socket,
                        int lvl, int opt, void *data, int len,
@@ -74,6 +86,35 @@ int avt_socket_get_opt(void *log_ctx, int socket,
     return 0;
 }
 
+int avt_socket_set_cscov(void *log_ctx, AVTSocketCommon *sc, size_t hdr_len)
+{
+    int ret;
+    const int cscov = 8 + AVT_MIN(hdr_len, AVT_MAX_HEADER_LEN);
+    if (!sc->cscov_hdr || cscov == sc->cscov)
+        return 0;
+
+    SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_UDPLITE, UDPLITE_SEND_CSCOV, cscov);
+    sc->cscov = cscov;
+
+    return 0;
+}
+
+int avt_socket_set_pmtu_probe(void *log_ctx, AVTSocketCommon *sc, bool probe)
+{
+    [[maybe_unused]] int ret;
+
+#ifdef IPV6_PMTUDISC_PROBE
+    SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+                   probe ? (int)IPV6_PMTUDISC_PROBE : (int)IPV6_PMTUDISC_DO);
+#endif
+#ifdef IP_PMTUDISC_PROBE
+    SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_IP, IP_MTU_DISCOVER,
+                   probe ? (int)IP_PMTUDISC_PROBE : (int)IP_PMTUDISC_DO);
+#endif
+
+    return 0;
+}
+
 int avt_socket_get_mtu(void *log_ctx, AVTSocketCommon *sc, size_t *mtu)
 {
     size_t ret = 1280;
@@ -83,15 +124,15 @@ int avt_socket_get_mtu(void *log_ctx, AVTSocketCommon *sc, size_t *mtu)
 
 #ifdef IPV6_RECVPATHMTU
     struct ip6_mtuinfo mtu6;
+    socklen_t mtu6_len = sizeof(mtu6);
 
     memcpy(&mtu6.ip6m_addr, sc->remote_addr, sc->addr_size);
-    ret = avt_socket_get_opt(log_ctx, sc->socket, IPPROTO_IPV6, IPV6_PATHMTU,
-                             &mtu6, sizeof(mtu6),
-                             "Unable to get MTU: %i %s\n");
-    if (ret < 0)
-        return ret;
-    else
+
+    /* Listening sockets are not connected, and have no path MTU */
+    if (!getsockopt(sc->socket, IPPROTO_IPV6, IPV6_PATHMTU, &mtu6, &mtu6_len))
         ret = mtu6.ip6m_mtu;
+    else if (errno != ENOTCONN)
+        return avt_handle_errno(log_ctx, "Unable to get MTU: %i %s\n");
 #endif
     *mtu = ret;
 
@@ -144,6 +185,289 @@ static int setup_unix_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *add
     return 0;
 }
 
+/* All shards of a port opened by this process */
+struct AVTShardGroup {
+    struct sockaddr_in6 addr;
+    int proto;
+    int shards;
+    int refs;
+
+    /* Sockets, indexed by shard, and the program picking one */
+    int map_fd;
+    int prog_fd;
+
+    AVTShardGroup *next;
+};
+
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static AVTShardGroup *shard_groups;
+
+/* Must be called with shard_lock held */
+static void shard_group_unref(AVTShardGroup *g)
+{
+    if (--g->refs)
+        return;
+
+    AVTShardGroup **prev = &shard_groups;
+    while (*prev != g)
+        prev = &(*prev)->next;
+    *prev = g->next;
+
+    close(g->prog_fd);
+    close(g->map_fd);
+    free(g);
+}
+
+#ifdef SHARD_EBPF
+#define SHARD_INSN(c, d, s, o, i)                                              \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s),          \
+                         .off = (o), .imm = (i) })
+
+static int shard_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Same steering as attach_shard_filter(), except sockets are picked from
+ * a map indexed by shard, rather than by the order they were bound in.
+ * Packets for a shard which is not open are spread over the rest. */
+static int shard_load_prog(int map_fd, int shards)
+{
+    char license[] = "BSD";
+    struct bpf_insn code[] = {
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+
+        /* IP version */
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -24),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 1),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET),
+        SHARD_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative),
+        SHARD_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 41, 0),         /* pass */
+        SHARD_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_7, BPF_REG_10, -24, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_7, 0, 0, 4),
+        SHARD_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, 10, 4),         /* ipv6 */
+
+        /* IPv4 source address */
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 12),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -24),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 4),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET),
+        SHARD_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative),
+        SHARD_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 30, 0),         /* pass */
+        SHARD_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_10, -24, 0),
+        SHARD_INSN(BPF_JMP | BPF_JA, 0, 0, 15, 0),                          /* hash */
+
+        /* IPv6 source address, folded */
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 8),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -24),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 16),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET),
+        SHARD_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative),
+        SHARD_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 20, 0),         /* pass */
+        SHARD_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_10, -24, 0),
+        SHARD_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_9, BPF_REG_10, -20, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_XOR | BPF_X, BPF_REG_8, BPF_REG_9, 0, 0),
+        SHARD_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_9, BPF_REG_10, -16, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_XOR | BPF_X, BPF_REG_8, BPF_REG_9, 0, 0),
+        SHARD_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_9, BPF_REG_10, -12, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_XOR | BPF_X, BPF_REG_8, BPF_REG_9, 0, 0),
+
+        /* Shard index (hash) */
+        SHARD_INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_8, 0, 0, 32),
+        SHARD_INSN(BPF_ALU | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_8, 0, 0),
+        SHARD_INSN(BPF_ALU | BPF_RSH | BPF_K, BPF_REG_9, 0, 0, 16),
+        SHARD_INSN(BPF_ALU | BPF_XOR | BPF_X, BPF_REG_8, BPF_REG_9, 0, 0),
+        SHARD_INSN(BPF_ALU | BPF_MOD | BPF_K, BPF_REG_8, 0, 0, shards),
+        SHARD_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_8, -4, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        SHARD_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        SHARD_INSN(0, 0, 0, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        SHARD_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -4),
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        SHARD_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+
+        /* pass */
+        SHARD_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        SHARD_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    union bpf_attr attr = {
+        .prog_type = BPF_PROG_TYPE_SK_REUSEPORT,
+        .insns = (uintptr_t)code,
+        .insn_cnt = AVT_ARRAY_ELEMS(code),
+        .license = (uintptr_t)license,
+    };
+
+    return shard_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* Join the group of shards of the port, and place the socket at its index */
+static int shard_group_join(AVTSocketCommon *sc, AVTAddress *addr, int proto)
+{
+    int ret;
+    AVTShardGroup *g;
+
+    pthread_mutex_lock(&shard_lock);
+
+    for (g = shard_groups; g; g = g->next) {
+        if (g->proto == proto && g->shards == addr->opts.shards &&
+            !memcmp(&g->addr, &sc->ip.local_addr, sizeof(g->addr)))
+            break;
+    }
+
+    if (!g) {
+        g = calloc(1, sizeof(*g));
+        if (!g) {
+            ret = AVT_ERROR(ENOMEM);
+            goto end;
+        }
+
+        union bpf_attr map_attr = {
+            .map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY,
+            .key_size = sizeof(uint32_t),
+            .value_size = sizeof(uint64_t),
+            .max_entries = addr->opts.shards,
+        };
+        g->map_fd = shard_bpf(BPF_MAP_CREATE, &map_attr);
+        g->prog_fd = g->map_fd < 0 ? -1 :
+                     shard_load_prog(g->map_fd, addr->opts.shards);
+        if (g->prog_fd < 0) {
+            ret = AVT_ERROR(errno);
+            if (g->map_fd >= 0)
+                close(g->map_fd);
+            free(g);
+            goto end;
+        }
+
+        g->addr = sc->ip.local_addr;
+        g->proto = proto;
+        g->shards = addr->opts.shards;
+        g->next = shard_groups;
+        shard_groups = g;
+    }
+    g->refs++;
+
+    uint32_t key = addr->opts.shard;
+    uint64_t val = sc->socket;
+    union bpf_attr elem_attr = {
+        .map_fd = g->map_fd,
+        .key = (uintptr_t)&key,
+        .value = (uintptr_t)&val,
+        .flags = BPF_ANY,
+    };
+    if (shard_bpf(BPF_MAP_UPDATE_ELEM, &elem_attr) < 0 ||
+        setsockopt(sc->socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+                   &g->prog_fd, sizeof(g->prog_fd)) < 0) {
+        ret = AVT_ERROR(errno);
+        shard_group_unref(g);
+        goto end;
+    }
+
+    sc->shard = g;
+    ret = 0;
+
+end:
+    pthread_mutex_unlock(&shard_lock);
+    return ret;
+}
+#endif
+
+static void shard_group_leave(AVTSocketCommon *sc)
+{
+    if (!sc->shard)
+        return;
+
+    pthread_mutex_lock(&shard_lock);
+    shard_group_unref(sc->shard);
+    sc->shard = NULL;
+    pthread_mutex_unlock(&shard_lock);
+}
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/* Steer packets to a socket of the reuseport group by their source address.
+ * The program runs with the packet data starting after the UDP header,
+ * so the IP header is accessed relative to SKF_NET_OFF. */
+static int attach_shard_filter(void *log_ctx, AVTSocketCommon *sc, int shards)
+{
+    struct sock_filter code[] = {
+        /* IP version */
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, SKF_NET_OFF),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 2),
+
+        /* IPv4 source address */
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_JMP | BPF_JA, 10),
+
+        /* IPv6 source address, folded */
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+
+        /* Socket index */
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    struct sock_fprog prog = {
+        .len = AVT_ARRAY_ELEMS(code),
+        .filter = code,
+    };
+
+    if (setsockopt(sc->socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) < 0)
+        return avt_handle_errno(log_ctx, "setsockopt(SOL_SOCKET, "
+                                "SO_ATTACH_REUSEPORT_CBPF) failed: %i %s\n");
+
+    return 0;
+}
+#endif
+
+/* Must be called once the socket is bound */
+static int setup_shard(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
+                       int proto)
+{
+    [[maybe_unused]] int ret;
+
+#ifdef SHARD_EBPF
+    /* The kernel only maps UDP and TCP sockets */
+    ret = proto == IPPROTO_UDP ? shard_group_join(sc, addr, proto) :
+                                 AVT_ERROR(ENOTSUP);
+    if (ret >= 0)
+        return ret;
+
+    avt_log(log_ctx, AVT_LOG_WARN, "Unable to steer to shards by index (%i), "
+            "steering by the order they are opened in instead\n", ret);
+#endif
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    /* The steering program applies to the whole group, and indexes
+     * sockets in the order they were bound */
+    if (!addr->opts.shard)
+        return attach_shard_filter(log_ctx, sc, addr->opts.shards);
+#endif
+
+    return 0;
+}
+
 static int setup_ip_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
                            int proto)
 {
@@ -162,6 +486,16 @@ static int setup_ip_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
 #endif
     }
 
+    /* Share the port between multiple listening sockets */
+    if (addr->listen && addr->opts.shards > 1) {
+#ifdef SO_REUSEPORT
+        SET_SOCKET_OPT(log_ctx, sc->socket, SOL_SOCKET, SO_REUSEPORT, (int)1);
+#else
+        avt_log(log_ctx, AVT_LOG_ERROR, "Unable to shard socket, not supported!\n");
+        return AVT_ERROR(EOPNOTSUPP);
+#endif
+    }
+
     /* Set receive/send buffer */
     if (addr->opts.rx_buf)
         SET_SOCKET_OPT(log_ctx, sc->socket, SOL_SOCKET, SO_RCVBUF, (int)addr->opts.rx_buf);
@@ -192,13 +526,23 @@ static int setup_ip_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
     SET_SOCKET_OPT(log_ctx, sc->socket, proto, UDP_GRO, (int)0);
 #endif
 
-    /* Adjust UDP-Lite checksum coverage */
-    if (proto == IPPROTO_UDPLITE) {
-        /* Minimum valid transmit value */
-        SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_UDPLITE, UDPLITE_SEND_CSCOV, (int)8);
+    /* Adjust UDP-Lite checksum coverage. Unless requested otherwise,
+     * damaged payloads are let through, to be repaired via FEC. */
+    if (proto == IPPROTO_UDPLITE && addr->opts.cscov != AVT_ADDRESS_CSCOV_FULL) {
+        /* Minimum valid value is just the UDP header */
+        int cscov = 8;
+        if (addr->opts.cscov == AVT_ADDRESS_CSCOV_HEADER)
+            cscov += AVT_MIN_HEADER_LEN;
+
+        SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_UDPLITE, UDPLITE_SEND_CSCOV, cscov);
 
-        /* Setup receive coverage too */
-        SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_UDPLITE, UDPLITE_RECV_CSCOV, (int)8);
+        /* Setup receive coverage too. Headers are at least this long,
+         * so every sender covers at least this much. */
+        SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_UDPLITE, UDPLITE_RECV_CSCOV, cscov);
+
+        /* Headers vary in length, and are covered as they get sent */
+        sc->cscov_hdr = addr->opts.cscov == AVT_ADDRESS_CSCOV_HEADER;
+        sc->cscov = cscov;
     }
 
     /* Disable IPv6 only */
@@ -207,6 +551,14 @@ static int setup_ip_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
     /* Disable fragmentation */
     SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_IPV6, IPV6_DONTFRAG, (int)1);
 
+    /* Only path MTU probes are sent regardless of the kernel's own estimate,
+     * so that regular packets exceeding it fail with EMSGSIZE */
+    if (addr->opts.pmtud) {
+        ret = avt_socket_set_pmtu_probe(log_ctx, sc, false);
+        if (ret < 0)
+            return ret;
+    }
+
 #ifdef IPV6_RECVPATHMTU
     /* Enable MTU monitoring */
     SET_SOCKET_OPT(log_ctx, sc->socket, IPPROTO_IPV6, IPV6_RECVPATHMTU, (int)1);
@@ -235,7 +587,7 @@ static int setup_ip_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
 
     /* Setup binding */
     sc->ip.local_addr.sin6_family = AF_INET6;
-    sc->ip.local_addr.sin6_port = addr->port;
+    sc->ip.local_addr.sin6_port = htons(addr->port);
     if (addr->listen) {
         memcpy(sc->ip.local_addr.sin6_addr.s6_addr, addr->ip, 16);
         sc->ip.local_addr.sin6_scope_id = addr->scope;
@@ -243,7 +595,7 @@ static int setup_ip_socket(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr,
 
     /* Setup connecting */
     sc->ip.remote_addr.sin6_family = AF_INET6;
-    sc->ip.remote_addr.sin6_port = addr->port;
+    sc->ip.remote_addr.sin6_port = htons(addr->port);
     if (!addr->listen) {
         memcpy(sc->ip.remote_addr.sin6_addr.s6_addr, addr->ip, 16);
         sc->ip.remote_addr.sin6_scope_id = addr->scope;
@@ -295,7 +647,7 @@ COLD int avt_socket_open(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr)
 
         /* Setup binding */
         sc->ip.local_addr.sin6_family = AF_INET6;
-        sc->ip.local_addr.sin6_port = addr->port;
+        sc->ip.local_addr.sin6_port = htons(addr->port);
         if (addr->listen) {
             memcpy(sc->ip.local_addr.sin6_addr.s6_addr, addr->ip, 16);
             sc->ip.local_addr.sin6_scope_id = addr->scope;
@@ -303,7 +655,7 @@ COLD int avt_socket_open(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr)
 
         /* Setup connecting */
         sc->ip.remote_addr.sin6_family = AF_INET6;
-        sc->ip.remote_addr.sin6_port = addr->port;
+        sc->ip.remote_addr.sin6_port = htons(addr->port);
         if (!addr->listen) {
             memcpy(sc->ip.remote_addr.sin6_addr.s6_addr, addr->ip, 16);
             sc->ip.remote_addr.sin6_scope_id = addr->scope;
@@ -339,6 +691,12 @@ COLD int avt_socket_open(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr)
             goto fail;
         }
 
+        if (type == SOCK_DGRAM && addr->opts.shards > 1) {
+            ret = setup_shard(log_ctx, sc, addr, proto);
+            if (ret < 0)
+                goto fail;
+        }
+
         /* For UNIX sockets, listen */
         if (type == SOCK_STREAM && (listen(sc->socket, 0) < 0)) {
             ret = avt_handle_errno(log_ctx, "Unable to listen to socket: %i %s\n");
@@ -356,6 +714,7 @@ COLD int avt_socket_open(void *log_ctx, AVTSocketCommon *sc, AVTAddress *addr)
     return 0;
 
 fail:
+    shard_group_leave(sc);
     close(sc->socket);
     sc->socket = -1;
     return ret;
@@ -365,6 +724,8 @@ COLD int avt_socket_close(void *log_ctx, AVTSocketCommon *sc)
 {
     int ret = 0;
 
+    shard_group_leave(sc);
+
     if (sc->socket >= 0) {
         ret = close(sc->socket);
         if (ret < 0)
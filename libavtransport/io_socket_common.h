@@ -34,9 +34,19 @@
 #include <avtransport/avtransport.h>
 #include "address.h"
 
+typedef struct AVTShardGroup AVTShardGroup;
+
 typedef struct AVTSocketCommon {
     int socket;
 
+    /* Steering state shared with the other shards of the port, if any */
+    AVTShardGroup *shard;
+
+    /* UDP-Lite checksum coverage, including the UDP header. If cscov_hdr
+     * is set, it follows the length of the headers being sent. */
+    int cscov;
+    bool cscov_hdr;
+
     struct sockaddr *local_addr;
     struct sockaddr *remote_addr;
     socklen_t addr_size;
@@ -84,6 +94,15 @@ int avt_socket_get_opt(void *log_ctx, int socket,
                        int lvl, int opt, void *data, int len,
                        const char *errmsg);
 
+/* Cover hdr_len bytes of AVTransport header with the UDP-Lite checksum,
+ * if coverage was set to follow the header. */
+int avt_socket_set_cscov(void *log_ctx, AVTSocketCommon *sc, size_t hdr_len);
+
+/* Switch the socket between sending path MTU probes, which ignore the
+ * system's path MTU estimate, and regular packets, which never get
+ * fragmented. */
+int avt_socket_set_pmtu_probe(void *log_ctx, AVTSocketCommon *sc, bool probe);
+
 /* Get MTU */
 int avt_socket_get_mtu(void *log_ctx, AVTSocketCommon *sc, size_t *mtu);
 
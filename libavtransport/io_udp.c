@@ -25,13 +25,14 @@
  */
 
 #define _GNU_SOURCE // ipv6_mtuinfo
-#define _XOPEN_SOURCE 700 // pwrite, IOV_MAX
+#define _XOPEN_SOURCE 700 // pwrite
 
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <stdckdint.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include <sys/uio.h>
 #include <sys/socket.h>
@@ -44,20 +45,59 @@
 #include "io_socket_common.h"
 #include "attributes.h"
 #include "utils_internal.h"
+#include "mem.h"
+#include "config.h"
 
 #if __has_include(<linux/errqueue.h>)
 #include <linux/errqueue.h>
 #endif
 
-#ifndef IOV_MAX
-#warning "IOV_MAX not defined!"
-#define IOV_MAX 0
+/* Maximum number of datagrams handed to the kernel at once */
+#define UDP_MAX_MSGS 1024
+
+/* Maximum number of datagrams received at once */
+#define UDP_MAX_RECV_MSGS 64
+
+#if defined(CONFIG_HAVE_SENDMMSG) || defined(CONFIG_HAVE_RECVMMSG)
+typedef struct mmsghdr UDPMessage;
+#else
+typedef struct UDPMessage {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} UDPMessage;
 #endif
 
+typedef struct UDPDestination {
+    struct sockaddr_in6 addr;
+
+    /* Last error sending to the destination, and the number of
+     * packets which could not be sent to it */
+    int err;
+    uint64_t nb_err;
+} UDPDestination;
+
 struct AVTIOCtx {
     AVTSocketCommon sc;
+
+    /* Header and payload of each packet being sent */
     struct iovec *iov;
 
+    /* Secondary destinations, every packet is also sent to each of them */
+    UDPDestination *dst;
+    int nb_dst;
+
+    /* One message per packet and destination */
+    UDPMessage *msg;
+    int nb_msg;
+
+    /* Batched reception */
+    UDPMessage rx_msg[UDP_MAX_RECV_MSGS];
+    struct iovec rx_iov[UDP_MAX_RECV_MSGS];
+
+    /* Source of each datagram in the last batch read, for replies.
+     * Entries with no address have their family left unset. */
+    struct sockaddr_in6 src[UDP_MAX_RECV_MSGS];
+
     avt_pos wpos;
     avt_pos rpos;
 };
@@ -66,6 +106,8 @@ static COLD int udp_close(AVTIOCtx **_io)
 {
     AVTIOCtx *io = *_io;
     int ret = avt_socket_close(io, &io->sc);
+    free(io->msg);
+    free(io->dst);
     free(io->iov);
     free(io);
     *_io = NULL;
@@ -79,14 +121,19 @@ static COLD int udp_init(AVTContext *ctx, AVTIOCtx **_io, AVTAddress *addr)
     if (!io)
         return AVT_ERROR(ENOMEM);
 
-    io->iov = calloc(IOV_MAX + 1, sizeof(*io->iov));
-    if (!io->iov) {
+    io->iov = calloc(2*UDP_MAX_MSGS, sizeof(*io->iov));
+    io->msg = calloc(UDP_MAX_MSGS, sizeof(*io->msg));
+    if (!io->iov || !io->msg) {
+        free(io->msg);
+        free(io->iov);
         free(io);
         return AVT_ERROR(ENOMEM);
     }
+    io->nb_msg = UDP_MAX_MSGS;
 
     ret = avt_socket_open(io, &io->sc, addr);
     if (ret < 0) {
+        free(io->msg);
         free(io->iov);
         free(io);
         return ret;
@@ -102,10 +149,231 @@ static int udp_max_pkt_len(AVTIOCtx *io, size_t *mtu)
     return avt_socket_get_mtu(io, &io->sc, mtu);
 }
 
+static int udp_find_dst(AVTIOCtx *io, const struct sockaddr_in6 *dst)
+{
+    for (int i = 0; i < io->nb_dst; i++)
+        if (!memcmp(&io->dst[i].addr, dst, sizeof(*dst)))
+            return i;
+    return -1;
+}
+
+static inline struct sockaddr_in6 udp_addr_to_dst(const AVTAddress *addr)
+{
+    struct sockaddr_in6 dst = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(addr->port),
+        .sin6_scope_id = addr->scope,
+    };
+    memcpy(dst.sin6_addr.s6_addr, addr->ip, 16);
+    return dst;
+}
+
+static int udp_add_dst(AVTIOCtx *io, AVTAddress *addr)
+{
+    const struct sockaddr_in6 dst = udp_addr_to_dst(addr);
+
+    if (!memcmp(io->sc.remote_addr, &dst, sizeof(dst)) ||
+        udp_find_dst(io, &dst) >= 0)
+        return AVT_ERROR(EEXIST);
+
+    UDPDestination *tmp = avt_reallocarray(io->dst, io->nb_dst + 1,
+                                           sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+    io->dst = tmp;
+
+    /* Every packet must fit in a batch, along with all of its copies */
+    if ((io->nb_dst + 2) > io->nb_msg) {
+        UDPMessage *msg = avt_reallocarray(io->msg, io->nb_dst + 2,
+                                           sizeof(*msg));
+        if (!msg)
+            return AVT_ERROR(ENOMEM);
+        io->msg = msg;
+        io->nb_msg = io->nb_dst + 2;
+    }
+
+    io->dst[io->nb_dst++] = (UDPDestination) { .addr = dst };
+
+    return 0;
+}
+
+static int udp_del_dst(AVTIOCtx *io, AVTAddress *addr)
+{
+    const struct sockaddr_in6 dst = udp_addr_to_dst(addr);
+
+    int idx = udp_find_dst(io, &dst);
+    if (idx < 0)
+        return AVT_ERROR(ENOENT);
+
+    memmove(&io->dst[idx], &io->dst[idx + 1],
+            (io->nb_dst - idx - 1)*sizeof(*io->dst));
+    io->nb_dst--;
+
+    return 0;
+}
+
+static int udp_send_msgs(AVTIOCtx *io, UDPMessage *msg, int nb_msg, int flags)
+{
+#ifdef CONFIG_HAVE_SENDMMSG
+    return sendmmsg(io->sc.socket, msg, nb_msg, flags);
+#else
+    ssize_t ret = sendmsg(io->sc.socket, &msg->msg_hdr, flags);
+    if (ret < 0)
+        return ret;
+    msg->msg_len = ret;
+    return 1;
+#endif
+}
+
+/* Waits for up to timeout (in nanoseconds) for the socket to take more data */
+static int udp_wait_writable(AVTIOCtx *io, int64_t timeout)
+{
+    struct pollfd pfd = { .fd = io->sc.socket, .events = POLLOUT };
+    int ms = timeout == INT64_MAX ? -1 :
+             AVT_MIN((timeout + 999999) / 1000000, INT_MAX);
+
+    int ret;
+    do {
+        ret = poll(&pfd, 1, ms);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return avt_handle_errno(io, "Unable to poll socket: %i %s");
+
+    return ret ? 0 : AVT_ERROR(EAGAIN);
+}
+
+static void udp_dst_error(AVTIOCtx *io, UDPDestination *dst, int err)
+{
+    char addr[INET6_ADDRSTRLEN] = "";
+
+    /* Only log when the reason changes, not for every packet */
+    if (dst->err != err) {
+        inet_ntop(AF_INET6, &dst->addr.sin6_addr, addr, sizeof(addr));
+        avt_log(io, AVT_LOG_WARN, "Unable to send to destination [%s]:%i: "
+                "%i %s\n", addr, ntohs(dst->addr.sin6_port), err,
+                strerror(err));
+    }
+
+    dst->err = err;
+    dst->nb_err++;
+}
+
+/* Sends every packet to the primary and all secondary destinations.
+ * A secondary destination failing does not stop the others from
+ * receiving the packet, only an error on the primary one is returned. */
+static avt_pos udp_write_vec(AVTIOCtx *io, AVTPktd *pkt, uint32_t nb_pkt,
+                             int64_t timeout)
+{
+    int ret;
+    avt_pos off = 0;
+    bool sent = false;
+    const int flags = !timeout ? MSG_DONTWAIT : 0;
+    const int nb_addr = 1 + io->nb_dst;
+    const int batch = AVT_MIN(io->nb_msg / nb_addr, UDP_MAX_MSGS);
+
+    while (nb_pkt) {
+        const int nb = AVT_MIN(nb_pkt, batch);
+        int nb_msg = 0;
+
+        /* Coverage is per socket, so the longest header sets it, and
+         * shorter ones have a few bytes of payload covered too */
+        size_t hdr_len = 0;
+        for (int i = 0; i < nb; i++)
+            hdr_len = AVT_MAX(hdr_len, pkt[i].hdr_len);
+
+        ret = avt_socket_set_cscov(io, &io->sc, hdr_len);
+        if (ret < 0)
+            return ret;
+
+        /* Each packet is only referenced, once for all destinations */
+        for (int i = 0; i < nb; i++) {
+            struct iovec *iov = &io->iov[2*i];
+            iov[0].iov_base = pkt[i].hdr;
+            iov[0].iov_len  = pkt[i].hdr_len;
+            iov[1].iov_base = avt_buffer_get_data(&pkt[i].pl, &iov[1].iov_len);
+
+            for (int j = 0; j < nb_addr; j++) {
+                io->msg[nb_msg++] = (UDPMessage) { .msg_hdr = {
+                    .msg_name = !j ? io->sc.remote_addr :
+                                     (struct sockaddr *)&io->dst[j - 1].addr,
+                    .msg_namelen = !j ? io->sc.addr_size :
+                                        sizeof(io->dst[j - 1].addr),
+                    .msg_iov = iov,
+                    .msg_iovlen = 1 + !!iov[1].iov_len,
+                } };
+            }
+        }
+
+        for (int i = 0; i < nb_msg;) {
+            ret = udp_send_msgs(io, &io->msg[i], nb_msg - i, flags);
+            if (ret >= 0) {
+                sent |= ret > 0;
+                i += ret;
+                continue;
+            }
+
+            const int err = errno;
+            if (err == EINTR) {
+                continue;
+            } else if (err == EAGAIN || err == EWOULDBLOCK) {
+                /* Nothing went out yet, the caller can simply retry */
+                if (!sent)
+                    return AVT_ERROR(EAGAIN);
+
+                /* Returning an error now would have the caller resend
+                 * what was already sent. Wait for the socket to drain
+                 * instead, and drop the rest if it does not in time. */
+                if (!udp_wait_writable(io, timeout))
+                    continue;
+
+                avt_log(io, AVT_LOG_WARN, "Socket full, dropped %i of %i "
+                        "messages\n", nb_msg - i, nb_msg);
+                for (; i < nb_msg; i++)
+                    io->msg[i].msg_len = 0;
+                break;
+            }
+
+            /* The message which failed is the first one not sent */
+            const int j = i % nb_addr;
+            if (!j) {
+                errno = err;
+                return avt_handle_errno(io, "Unable to send message: %i %s");
+            }
+
+            udp_dst_error(io, &io->dst[j - 1], err);
+            io->msg[i++].msg_len = 0;
+            sent = true;
+        }
+
+        /* Only count what was sent to the primary destination */
+        for (int i = 0; i < nb_msg; i += nb_addr) {
+            off += io->msg[i].msg_len;
+            for (int j = 1; j < nb_addr; j++)
+                if (io->msg[i + j].msg_len)
+                    io->dst[j - 1].err = 0;
+        }
+
+        pkt += nb;
+        nb_pkt -= nb;
+    }
+
+    off = io->wpos + off;
+    AVT_SWAP(io->wpos, off);
+    return off;
+}
+
 static avt_pos udp_write_pkt(AVTIOCtx *io, AVTPktd *p, int64_t timeout)
 {
     int64_t ret;
 
+    if (io->nb_dst)
+        return udp_write_vec(io, p, 1, timeout);
+
+    ret = avt_socket_set_cscov(io, &io->sc, p->hdr_len);
+    if (ret < 0)
+        return ret;
+
     size_t pl_len;
     uint8_t *pl_data = avt_buffer_get_data(&p->pl, &pl_len);
 
@@ -132,45 +400,53 @@ static avt_pos udp_write_pkt(AVTIOCtx *io, AVTPktd *p, int64_t timeout)
     return ret;
 }
 
-static avt_pos udp_write_vec(AVTIOCtx *io, AVTPktd *pkt, uint32_t nb_pkt,
-                             int64_t timeout)
+static avt_pos udp_write_probe(AVTIOCtx *io, AVTPktd *p, int64_t timeout)
 {
-    int64_t ret;
-    avt_pos off = 0;
-    int nb_iov = 0;
+    int err = avt_socket_set_pmtu_probe(io, &io->sc, true);
+    if (err < 0)
+        return err;
 
-    while (nb_pkt) {
-        nb_iov = 0;
-        do {
-            io->iov[nb_iov + 0].iov_base = pkt->hdr;
-            io->iov[nb_iov + 0].iov_len  = pkt->hdr_len;
-            io->iov[nb_iov + 1].iov_base = avt_buffer_get_data(&pkt->pl,
-                                                               &io->iov[nb_iov + 1].iov_len);
-            nb_iov += 1 + !!io->iov[nb_iov + 1].iov_base;
-
-            pkt++;
-            nb_pkt--;
-        } while (nb_pkt && ((nb_iov + 2) > IOV_MAX));
-
-        struct msghdr pm = {
-            .msg_name = io->sc.remote_addr,
-            .msg_namelen = io->sc.addr_size,
-            .msg_iov = io->iov,
-            .msg_iovlen = nb_iov,
-            .msg_control = NULL,
-            .msg_flags = 0,
-        };
+    avt_pos ret = udp_write_pkt(io, p, timeout);
 
-        ret = sendmsg(io->sc.socket, &pm, !timeout ? MSG_DONTWAIT : 0);
-        if (ret < 0)
-            return avt_handle_errno(io, "Unable to send message: %i %s");
+    /* Regular packets must not go past the system's estimate */
+    err = avt_socket_set_pmtu_probe(io, &io->sc, false);
+    if (ret >= 0 && err < 0)
+        return err;
 
-        off += ret;
-    }
+    return ret;
+}
 
-    off = io->wpos + off;
-    AVT_SWAP(io->wpos, off);
-    return off;
+static int udp_reply_pkt(AVTIOCtx *io, AVTPktd *p, int idx, int64_t timeout)
+{
+    if (idx < 0 || idx >= UDP_MAX_RECV_MSGS ||
+        io->src[idx].sin6_family != AF_INET6)
+        return AVT_ERROR(EDESTADDRREQ);
+
+    int err = avt_socket_set_cscov(io, &io->sc, p->hdr_len);
+    if (err < 0)
+        return err;
+
+    size_t pl_len;
+    uint8_t *pl_data = avt_buffer_get_data(&p->pl, &pl_len);
+
+    struct iovec vdata[2] = {
+        { .iov_base = p->hdr, .iov_len = p->hdr_len },
+        { .iov_base = pl_data, .iov_len = pl_len },
+    };
+
+    struct msghdr pm = {
+        .msg_name = &io->src[idx],
+        .msg_namelen = sizeof(io->src[idx]),
+        .msg_iov = vdata,
+        .msg_iovlen = 1 + !!pl_len,
+        .msg_control = NULL,
+        .msg_flags = 0,
+    };
+
+    if (sendmsg(io->sc.socket, &pm, !timeout ? MSG_DONTWAIT : 0) < 0)
+        return avt_handle_errno(io, "Unable to send reply: %i %s");
+
+    return 0;
 }
 
 static avt_pos udp_read_input(AVTIOCtx *io, AVTBuffer *buf, size_t len,
@@ -217,9 +493,11 @@ static avt_pos udp_read_input(AVTIOCtx *io, AVTBuffer *buf, size_t len,
     msg.msg_controllen = sizeof(cmsgbuf.buf);
 #endif
 
-    ret = recvmsg(io->sc.socket, &msg, 0x0);
+    ret = recvmsg(io->sc.socket, &msg, !timeout ? MSG_DONTWAIT : 0);
     if (ret < 0) {
-        return avt_handle_errno(io, "Unable to receive message: %s");
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return AVT_ERROR(EAGAIN);
+        return avt_handle_errno(io, "Unable to receive message: %i %s\n");
     } else if (ret == 0) { /* Ancillary message only */
         struct cmsghdr *cmsg;
 
@@ -239,7 +517,10 @@ static avt_pos udp_read_input(AVTIOCtx *io, AVTBuffer *buf, size_t len,
 #endif
         }
 
-        return 0;
+        err = avt_buffer_resize(buf, 0);
+        avt_assert2(err >= 0);
+
+        return io->rpos;
     } else if (ret > 0) { /* Ancillary message with the data */
         struct cmsghdr *cmsg;
         for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
@@ -252,6 +533,10 @@ static avt_pos udp_read_input(AVTIOCtx *io, AVTBuffer *buf, size_t len,
         }
     }
 
+    io->src[0] = remote_addr;
+    if (msg.msg_namelen != sizeof(remote_addr))
+        io->src[0].sin6_family = AF_UNSPEC;
+
     if (msg.msg_flags & MSG_TRUNC) {
         avt_log(io, AVT_LOG_ERROR, "Packet truncated! MTU changed?\n");
         // TODO: signal to the protocol layer to update the MTU
@@ -266,16 +551,86 @@ static avt_pos udp_read_input(AVTIOCtx *io, AVTBuffer *buf, size_t len,
     return ret;
 }
 
+static int udp_recv_msgs(AVTIOCtx *io, UDPMessage *msg, int nb_msg, int flags)
+{
+#ifdef CONFIG_HAVE_RECVMMSG
+    return recvmmsg(io->sc.socket, msg, nb_msg, flags | MSG_WAITFORONE, NULL);
+#else
+    int i;
+    for (i = 0; i < nb_msg; i++) {
+        ssize_t ret = recvmsg(io->sc.socket, &msg[i].msg_hdr, flags);
+        if (ret < 0)
+            return i ? i : ret;
+        msg[i].msg_len = ret;
+        flags |= MSG_DONTWAIT;
+    }
+    return i;
+#endif
+}
+
+static int udp_read_dgrams(AVTIOCtx *io, uint8_t **dgram, size_t *len, int nb,
+                           size_t size, int64_t timeout)
+{
+    nb = AVT_MIN(nb, UDP_MAX_RECV_MSGS);
+
+    for (int i = 0; i < nb; i++) {
+        io->rx_iov[i] = (struct iovec) {
+            .iov_base = dgram[i],
+            .iov_len = size,
+        };
+        io->rx_msg[i] = (UDPMessage) { .msg_hdr = {
+            .msg_name = &io->src[i],
+            .msg_namelen = sizeof(io->src[i]),
+            .msg_iov = &io->rx_iov[i],
+            .msg_iovlen = 1,
+        } };
+    }
+
+    int ret = udp_recv_msgs(io, io->rx_msg, nb, !timeout ? MSG_DONTWAIT : 0);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return AVT_ERROR(EAGAIN);
+        return avt_handle_errno(io, "Unable to receive messages: %i %s\n");
+    }
+
+    for (int i = 0; i < ret; i++) {
+        const struct msghdr *msg = &io->rx_msg[i].msg_hdr;
+        if (msg->msg_namelen != sizeof(io->src[i]))
+            io->src[i].sin6_family = AF_UNSPEC;
+
+        len[i] = io->rx_msg[i].msg_len;
+        if (msg->msg_flags & MSG_TRUNC) {
+            avt_log(io, AVT_LOG_DEBUG, "Datagram larger than expected, dropped\n");
+            len[i] = 0;
+        }
+
+        io->rpos += len[i];
+    }
+
+    return ret;
+}
+
+static int udp_get_fd(AVTIOCtx *io)
+{
+    return io->sc.socket;
+}
+
 const AVTIO avt_io_udp = {
     .name = "udp",
     .type = AVT_IO_UDP,
     .init = udp_init,
     .get_max_pkt_len = udp_max_pkt_len,
+    .add_dst = udp_add_dst,
+    .del_dst = udp_del_dst,
     .read_input = udp_read_input,
+    .read_dgrams = udp_read_dgrams,
     .write_vec = udp_write_vec,
     .write_pkt = udp_write_pkt,
+    .write_probe = udp_write_probe,
+    .reply_pkt = udp_reply_pkt,
     .rewrite = NULL,
     .seek = NULL,
+    .get_fd = udp_get_fd,
     .flush = NULL,
     .close = udp_close,
 };
@@ -285,11 +640,17 @@ const AVTIO avt_io_udp_lite = {
     .type = AVT_IO_UDP_LITE,
     .init = udp_init,
     .get_max_pkt_len = udp_max_pkt_len,
+    .add_dst = udp_add_dst,
+    .del_dst = udp_del_dst,
     .read_input = udp_read_input,
+    .read_dgrams = udp_read_dgrams,
     .write_vec = udp_write_vec,
     .write_pkt = udp_write_pkt,
+    .write_probe = udp_write_probe,
+    .reply_pkt = udp_reply_pkt,
     .rewrite = NULL,
     .seek = NULL,
+    .get_fd = udp_get_fd,
     .flush = NULL,
     .close = udp_close,
 };
@@ -237,6 +237,12 @@ static avt_pos unix_write_vec_native(AVTIOCtx *io, AVTPktd *pkt, uint32_t nb_pkt
 
 #include "io_template.c"
 
+/* Until a client is accepted, only the listening socket can be polled */
+static int unix_get_fd(AVTIOCtx *io)
+{
+    return io->fd >= 0 ? io->fd : io->sc.socket;
+}
+
 const AVTIO avt_io_unix = {
     .name = "unix",
     .type = AVT_IO_UNIX,
@@ -251,6 +257,7 @@ const AVTIO avt_io_unix = {
     .write_pkt = unix_write_pkt,
     .rewrite = NULL,
     .seek = NULL,
+    .get_fd = unix_get_fd,
     .flush = NULL,
     .close = unix_close,
 };
@@ -24,6 +24,8 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdbit.h>
+
 #include "ldpc_encode.h"
 #include "ldpc_tables.h"
 #include "bytestream.h"
@@ -37,3 +39,24 @@ void avt_ldpc_encode_2784_2016(uint8_t *src)
 {
     ldpc_encode(src, ldpc_h_matrix_2784_2016, 2016, 768);
 }
+
+void avt_ldpc_update_288_224(uint8_t *src, const uint8_t *diff,
+                             int off, int len)
+{
+    const uint64_t *H = ldpc_h_matrix_288_224;
+    uint8_t *dst = src + (224 / 8);
+    uint64_t parity = AVT_RB64(dst);
+
+    /* The code is linear, so every data bit which flipped simply flips
+     * the parity bits of its column in the matrix */
+    for (int j = 0; j < len; j++) {
+        unsigned int bits = diff[j];
+        while (bits) {
+            const int k = 7 - stdc_trailing_zeros(bits);
+            parity ^= H[(off + j)*8 + k];
+            bits &= bits - 1;
+        }
+    }
+
+    AVT_WB64(dst, parity);
+}
@@ -36,4 +36,10 @@ void avt_ldpc_encode_288_224(uint8_t *dst);
 
 void avt_ldpc_encode_2784_2016(uint8_t *dst);
 
+/* Updates the LDPC code of a sequence after some of its data changed,
+ * without recomputing it over all of the data. diff must contain
+ * the XOR of the old and new data, for len bytes starting at off. */
+void avt_ldpc_update_288_224(uint8_t *dst, const uint8_t *diff,
+                             int off, int len);
+
 #endif /* AVTRANSPORT_LDPC_ENCODE */
@@ -36,95 +36,167 @@
 #include "utils_packet.h"
 #include "mem.h"
 
-static inline int fill_ranges(AVTMerger *m, bool is_parity,
-                              uint32_t seg_off, uint32_t seg_size)
+static inline uint32_t gcd_u32(uint32_t a, uint32_t b)
 {
-    AVTMergerRange *ranges;
-    uint32_t nb_ranges;
-    uint32_t *nb_ranges_dst;
-    uint32_t ranges_allocated;
+    while (b) {
+        uint32_t tmp = a % b;
+        a = b;
+        b = tmp;
+    }
+    return a;
+}
 
-    if (!is_parity) {
-        ranges = m->ranges;
-        nb_ranges = m->nb_ranges;
-        nb_ranges_dst = &m->nb_ranges;
-        ranges_allocated = m->ranges_allocated;
-    } else {
-        ranges = m->parity_ranges;
-        nb_ranges = m->nb_parity_ranges;
-        nb_ranges_dst = &m->nb_parity_ranges;
-        ranges_allocated = m->parity_ranges_allocated;
+/* Find the first bit in [start, end) which is set (or unset if !val).
+ * Returns end if none was found. */
+static inline uint64_t bits_find(const uint64_t *map, uint64_t start,
+                                 uint64_t end, bool val)
+{
+    if (start >= end)
+        return end;
+
+    const uint64_t inv = val ? 0x0 : UINT64_MAX;
+    const uint64_t last = (end - 1) >> 6;
+    uint64_t idx = start >> 6;
+    uint64_t w = (map[idx] ^ inv) & (UINT64_MAX << (start & 63));
+
+    while (!w) {
+        if (++idx > last)
+            return end;
+        w = map[idx] ^ inv;
     }
 
-    int dst_idx = 0;
-    int consolidate_idx = -1;
+    return AVT_MIN((idx << 6) + stdc_trailing_zeros(w), end);
+}
 
-    /* Attempt to work the range into the existing ranges */
-    for (auto i = 0; i < nb_ranges; i++) {
-        AVTMergerRange *r = &ranges[i];
-        /* Overlaps dealt with in validate_packet */
-        if ((seg_off + seg_size) == r->offset) {
-            /* Potential new segment's end reaches another segment exactly */
+/* Set all bits in [start, end) */
+static inline void bits_set(uint64_t *map, uint64_t start, uint64_t end)
+{
+    while (start < end) {
+        const uint32_t off = start & 63;
+        const uint32_t nb = AVT_MIN(64 - off, end - start);
+        map[start >> 6] |= (nb == 64 ? UINT64_MAX : ((1ULL << nb) - 1)) << off;
+        start += nb;
+    }
+}
 
-            /* Prepend to existing range */
-            r->offset = seg_off;
-            r->size += seg_size;
+static void ranges_reset(AVTMergerRanges *r)
+{
+    if (r->nb_words)
+        memset(r->map, 0, r->nb_words*sizeof(*r->map));
+    r->nb_words = 0;
+    r->granule = 0;
+}
 
-            /* If the previous range is not completed with this one, exit */
-            if (!i || ((ranges[i - 1].offset + ranges[i - 1].size) < r->offset))
-                return 0;
+static void ranges_free(AVTMergerRanges *r)
+{
+    free(r->map);
+    memset(r, 0, sizeof(*r));
+}
 
-            consolidate_idx = i - 1;
-            break;
-        } else if ((r->offset + r->size) == seg_off) {
-            /* Potential new segment's start reaches another segment's start exactly */
+/* Make room for nb_bits. Words past nb_words are always zero. */
+static int ranges_grow(AVTMergerRanges *r, uint64_t nb_bits)
+{
+    const uint64_t nb_words = (nb_bits + 63) >> 6;
+    if (nb_words > UINT32_MAX)
+        return AVT_ERROR(EINVAL);
 
-            /* Extend exisint range */
-            r->size += seg_size;
+    if (nb_words > r->nb_words_alloc) {
+        const uint32_t nb_alloc = AVT_MAX(nb_words, (uint64_t)r->nb_words_alloc << 1);
+        uint64_t *map = avt_reallocarray(r->map, nb_alloc, sizeof(*map));
+        if (!map)
+            return AVT_ERROR(ENOMEM);
 
-            if ((i == (nb_ranges - 1)) || ((r->offset + r->size) < ranges[i + 1].offset))
-                return 0;
+        memset(&map[r->nb_words_alloc], 0,
+               (nb_alloc - r->nb_words_alloc)*sizeof(*map));
+        r->map = map;
+        r->nb_words_alloc = nb_alloc;
+    }
 
-            consolidate_idx = i;
-            break;
-        } else if (seg_off > (r->offset + r->size)) {
-            /* New segment. Pick its index here for ordering. */
-            dst_idx = i;
-        }
+    r->nb_words = AVT_MAX(r->nb_words, nb_words);
+
+    return 0;
+}
+
+/* Switch to a smaller granule. Only happens if segments aren't evenly
+ * sized, so there's no need to be clever here. */
+static int ranges_regranulate(AVTMergerRanges *r, uint32_t granule)
+{
+    const uint64_t f = r->granule / granule;
+    const uint64_t nb_bits = (uint64_t)r->nb_words << 6;
+    const uint64_t nb_words = ((nb_bits*f) + 63) >> 6;
+    if (nb_words > UINT32_MAX)
+        return AVT_ERROR(EINVAL);
+
+    uint64_t *map = NULL;
+    if (nb_words) {
+        map = calloc(nb_words, sizeof(*map));
+        if (!map)
+            return AVT_ERROR(ENOMEM);
     }
 
-    /* Add a range */
-    if (consolidate_idx < 0) {
-        if ((nb_ranges + 1) > ranges_allocated) {
-            AVTMergerRange *tmp = avt_reallocarray(ranges,
-                                                   (nb_ranges + 1) << 1,
-                                                   sizeof(*tmp));
-            if (!tmp)
-                return AVT_ERROR(ENOMEM);
+    uint64_t start = bits_find(r->map, 0, nb_bits, true);
+    while (start < nb_bits) {
+        uint64_t end = bits_find(r->map, start, nb_bits, false);
+        bits_set(map, start*f, end*f);
+        start = bits_find(r->map, end, nb_bits, true);
+    }
 
-            ranges = tmp;
-            ranges_allocated = (m->nb_ranges + 1) << 1;
-            if (!is_parity) {
-                m->ranges = ranges;
-                m->ranges_allocated = ranges_allocated;
-            } else {
-                m->parity_ranges = ranges;
-                m->parity_ranges_allocated = ranges_allocated;
-            }
-        }
+    free(r->map);
+    r->map = map;
+    r->nb_words = r->nb_words_alloc = nb_words;
+    r->granule = granule;
 
-        memmove(&ranges[dst_idx + 1], &ranges[dst_idx],
-                (nb_ranges - dst_idx - 1)*sizeof(AVTMerger));
-        nb_ranges++;
-        *nb_ranges_dst = nb_ranges;
-        return 0;
+    return 0;
+}
+
+/* Check if a range is free. Returns AVT_ERROR(EAGAIN) if it's a duplicate,
+ * and AVT_ERROR(EINVAL) if it overlaps with other ranges, or is empty. */
+static int ranges_check(AVTMergerRanges *r, uint32_t seg_off, uint32_t seg_size,
+                        bool ends_pkt)
+{
+    int ret;
+
+    /* Segments always carry some payload */
+    if (!seg_size)
+        return AVT_ERROR(EINVAL);
+
+    /* The last segment needn't be aligned, it simply takes up the last bit */
+    uint32_t granule = gcd_u32(r->granule, seg_off);
+    if (!ends_pkt || !granule)
+        granule = gcd_u32(granule, seg_size);
+    if (!granule)
+        return AVT_ERROR(EINVAL);
+
+    if (r->granule && (granule != r->granule)) {
+        ret = ranges_regranulate(r, granule);
+        if (ret < 0)
+            return ret;
     }
+    r->granule = granule;
 
-    ranges[consolidate_idx].size = ranges[consolidate_idx + 1].size;
-    memmove(&ranges[consolidate_idx + 1], &ranges[consolidate_idx + 2],
-            nb_ranges - consolidate_idx - 2);
-    nb_ranges--;
-    *nb_ranges_dst = nb_ranges;
+    const uint64_t start = seg_off / granule;
+    const uint64_t end = ((uint64_t)seg_off + seg_size + granule - 1) / granule;
+    const uint64_t lim = AVT_MIN(end, (uint64_t)r->nb_words << 6);
+
+    if (bits_find(r->map, start, lim, true) == lim)
+        return 0;
+    else if ((lim == end) && (bits_find(r->map, start, end, false) == end))
+        return AVT_ERROR(EAGAIN);
+
+    return AVT_ERROR(EINVAL);
+}
+
+/* Mark a range checked with ranges_check() as received */
+static int ranges_mark(AVTMergerRanges *r, uint32_t seg_off, uint32_t seg_size)
+{
+    const uint64_t start = seg_off / r->granule;
+    const uint64_t end = ((uint64_t)seg_off + seg_size + r->granule - 1) / r->granule;
+
+    int ret = ranges_grow(r, end);
+    if (ret < 0)
+        return ret;
+
+    bits_set(r->map, start, end);
 
     return 0;
 }
@@ -144,17 +216,14 @@ static inline int fill_phantom_header(void *log_ctx, AVTMerger *m,
     if (!(m->hdr_mask == 0x7F))
         return 0;
 
-    uint16_t tgt_desc = AVT_RB16(&m->p.hdr[0]);
-    if ((tgt_desc == (AVT_PKT_TIME_SYNC & 0xFF00)) ||
-        (tgt_desc == (AVT_PKT_STREAM_DATA & 0xFF00)))
-        tgt_desc &= 0xFF00;
+    enum AVTPktDescriptors tgt_desc = avt_packet_read_desc(m->p.hdr);
 
     AVTBytestream bs = avt_bs_init(m->p.hdr, sizeof(m->p.hdr));
 
     // TODO more sanity checking
 
     switch (tgt_desc) {
-    case AVT_PKT_STREAM_DATA & ~(AVT_PKT_FLAG_LSB_BITMASK):
+    case AVT_PKT_STREAM_DATA:
         avt_decode_stream_data(&bs, &m->p.pkt.stream_data);
         break;
     case AVT_PKT_LUT_ICC:
@@ -203,9 +272,9 @@ static int validate_packet(void *log_ctx, AVTMerger *m, AVTPktd *p, int srs,
         return AVT_ERROR(EINVAL);
     }
 
-    /* Check for phantom header mismatch */;
+    /* Check for phantom header mismatch */
     const uint32_t hdr_part = p->pkt.seq % 7;
-    if (m->hdr_mask & (1 << (6 - hdr_part))) {
+    if (srs < 0 && !is_parity && (m->hdr_mask & (1 << (6 - hdr_part)))) {
         const uint8_t *hdr_part_data = &m->p.hdr[4*hdr_part];
         for (auto i = 0; i < 4; i++)
             if (hdr_part_data[i] != p->pkt.generic_segment.header_7[i])
@@ -213,33 +282,9 @@ static int validate_packet(void *log_ctx, AVTMerger *m, AVTPktd *p, int srs,
     }
 
     /* Check for overlaps */
-    AVTMergerRange *ranges;
-    uint32_t nb_ranges;
-    if (!is_parity) {
-        ranges = m->ranges;
-        nb_ranges = m->nb_ranges;
-    } else {
-        ranges = m->parity_ranges;
-        nb_ranges = m->nb_parity_ranges;
-    }
-
-    for (auto i = 0; i < nb_ranges; i++) {
-        AVTMergerRange *r = &ranges[i];
-        /* Check for overlaps first */
-        if (r->offset == seg_off && r->size == seg_size) {
-            return AVT_ERROR(EAGAIN);
-        } else if ((r->offset + r->size) < seg_off &&
-            r->offset >= seg_off) {
-            /* Segment's start overlaps with another segment */
-            return AVT_ERROR(EINVAL);
-        } else if ((seg_off + seg_size) > r->offset &&
-            (seg_off + seg_size) <= (r->offset + r->size)) {
-            /* Segment's end overlaps with another segment */
-            return AVT_ERROR(EINVAL);
-        }
-    }
-
-    return 0;
+    const bool ends_pkt = tot_size && ((seg_off + seg_size) == tot_size);
+    return ranges_check(is_parity ? &m->parity_ranges : &m->ranges,
+                        seg_off, seg_size, ends_pkt);
 }
 
 int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
@@ -279,6 +324,9 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
             avt_pkt_merge_done(m);
             return 0;
         }
+#else
+        return 0;
+#endif
     }
 
     size_t src_size;
@@ -303,8 +351,17 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
             return AVT_ERROR(EBUSY);
     } else {
         m->hdr_mask = 0x0;
-        m->nb_ranges = 0;
-        m->nb_parity_ranges = 0;
+        ranges_reset(&m->ranges);
+        ranges_reset(&m->parity_ranges);
+
+        /* Only sets up the granule, but rejects invalid ranges before
+         * anything gets referenced */
+        const bool ends_pkt = tot_size && ((seg_off + seg_size) == tot_size);
+        AVTMergerRanges *r = !is_parity ? &m->ranges : &m->parity_ranges;
+        ret = ranges_check(r, seg_off, seg_size, ends_pkt);
+        if (ret < 0)
+            return ret;
+
         m->pkt_len_track = 0;
         m->target_tot_len = tot_size;
         m->nb_tgt_packets = !!tot_size;
@@ -331,30 +388,6 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
             m->target = p->pkt.generic_parity.target_seq;
         }
 
-        /* Ensure there's enough memory for some amount of ranges */
-        AVTMergerRange *tmp;
-        if (m->ranges_allocated < 128) {
-            tmp = avt_reallocarray(m->ranges,
-                                   (m->nb_ranges + 1) << 1,
-                                   sizeof(*tmp));
-            if (!tmp)
-                return AVT_ERROR(ENOMEM);
-
-            m->ranges = tmp;
-            m->ranges_allocated = (m->nb_ranges + 1) << 1;
-        }
-
-        if (m->parity_ranges_allocated < 128) {
-            tmp = avt_reallocarray(m->parity_ranges,
-                                   (m->nb_parity_ranges + 1) << 1,
-                                   sizeof(*tmp));
-            if (!tmp)
-                return AVT_ERROR(ENOMEM);
-
-            m->parity_ranges = tmp;
-            m->parity_ranges_allocated = (m->nb_parity_ranges + 1) << 1;
-        }
-
         /* Setup buffer */
         AVTBuffer *target;
         if (!is_parity)
@@ -363,10 +396,17 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
             target = &m->parity;
 
         /* Have enough memory for either data or parity */
-        if (seg_off || avt_buffer_read_only(&p->pl)) {
-            /* In case we have a read-only buffer, copy the data */
+        /* The header of a segmented packet doesn't carry the total size,
+         * so only allocate for what we have. It gets resized once known. */
+        const uint32_t alloc_size = tot_size ? tot_size : seg_off + seg_size;
+        if (seg_off + seg_size > alloc_size)
+            return AVT_ERROR(EINVAL);
+
+        if (seg_off || avt_buffer_read_only(&p->pl) ||
+            (avt_buffer_get_refcount(&p->pl) > 1)) {
+            /* In case we have a read-only or shared buffer, copy the data */
             AVTBuffer tmp_buf;
-            uint8_t *dst = avt_buffer_quick_alloc(&tmp_buf, tot_size);
+            uint8_t *dst = avt_buffer_quick_alloc(&tmp_buf, alloc_size);
             if (!dst)
                 return AVT_ERROR(ENOMEM);
 
@@ -375,7 +415,7 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
             *target = tmp_buf;
         } else {
             /* Resize the buffer if possible */
-            ret = avt_buffer_resize(&p->pl, tot_size);
+            ret = avt_buffer_resize(&p->pl, alloc_size);
             if (ret < 0)
                 return ret;
 
@@ -384,13 +424,14 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
         }
 
         /* Mark what we have available */
-        if (!is_parity) {
-            m->ranges[m->nb_ranges++] = (AVTMergerRange) { seg_off, seg_size };
+        ret = ranges_mark(r, seg_off, seg_size);
+        if (ret < 0)
+            return ret;
+
+        if (!is_parity)
             m->pkt_len_track = seg_size;
-        } else {
-            m->parity_ranges[m->nb_parity_ranges++] = (AVTMergerRange) { seg_off, seg_size };
+        else
             m->pkt_parity_len_track = seg_size;
-        }
 
         m->active = true;
 
@@ -404,7 +445,7 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
         return ret;
 
     /* Packet header state */
-    if (!m->p_avail && (srs < -1)) {
+    if (!m->p_avail && (srs < 0)) {
         ret = fill_phantom_header(log_ctx, m, p, is_parity);
         if (ret < 0)
             return ret;
@@ -428,14 +469,16 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
     }
 
     /* Track ranges */
-    ret = fill_ranges(m, is_parity, seg_off, seg_size);
+    ret = ranges_mark(is_parity ? &m->parity_ranges : &m->ranges,
+                      seg_off, seg_size);
     if (ret < 0)
         return ret;
 
-    /* Copy new data */
+    /* Copy new data, unless it was received in place */
     if (!is_parity) {
         uint8_t *dst = avt_buffer_get_data(&m->p.pl, NULL);
-        memcpy(dst + seg_off, src, seg_size);
+        if (src != (dst + seg_off))
+            memcpy(dst + seg_off, src, seg_size);
         m->pkt_len_track += seg_size;
     } else {
         uint8_t *dst = avt_buffer_get_data(&m->parity, NULL);
@@ -468,6 +511,106 @@ int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p)
     return AVT_ERROR(EAGAIN);
 }
 
+int avt_pkt_merge_place(void *log_ctx, AVTMerger *m, AVTPktd *p)
+{
+    int ret;
+
+    bool is_parity;
+    uint32_t seg_off, seg_size, tot_size;
+    int srs = avt_packet_series(p, &is_parity, &seg_off, &seg_size, &tot_size);
+
+    /* Only data segments are guaranteed to signal the total size */
+    if (srs >= 0 || is_parity || !tot_size)
+        return AVT_ERROR(ENOTSUP);
+    else if (!seg_size || ((uint64_t)seg_off + seg_size) > tot_size)
+        return AVT_ERROR(EINVAL);
+
+    const uint32_t target = p->pkt.generic_segment.target_seq;
+
+    if (m->active) {
+        if (target != m->target)
+            return AVT_ERROR(EBUSY);
+        else if (!avt_buffer_get_refcount(&m->p.pl))
+            return AVT_ERROR(ENOTSUP);
+        else if (m->target_tot_len && (tot_size != m->target_tot_len))
+            return AVT_ERROR(EINVAL);
+
+        /* Data already received must never get overwritten */
+        ret = validate_packet(log_ctx, m, p, srs,
+                              seg_off, seg_size, tot_size, false);
+        if (ret < 0)
+            return ret == AVT_ERROR(EAGAIN) ? AVT_ERROR(EEXIST) : ret;
+
+        /* Started with the header packet, allocate for everything */
+        if (!m->target_tot_len) {
+            ret = avt_buffer_resize(&m->p.pl, tot_size);
+            if (ret < 0)
+                return ret;
+
+            m->target_tot_len = tot_size;
+        }
+    } else {
+        /* Start a new packet, with no ranges yet */
+        if (!avt_buffer_quick_alloc(&m->p.pl, tot_size))
+            return AVT_ERROR(ENOMEM);
+
+        m->hdr_mask = 0x0;
+        ranges_reset(&m->ranges);
+        ranges_reset(&m->parity_ranges);
+        m->pkt_len_track = 0;
+        m->target_tot_len = tot_size;
+        m->nb_tgt_packets = 1;
+        m->p_avail = false;
+        m->last = p->pkt.seq;
+        m->target = target;
+        m->active = true;
+    }
+
+    avt_buffer_quick_ref(&p->pl, &m->p.pl, seg_off, seg_size);
+
+    return 0;
+}
+
+int avt_pkt_merge_missing(AVTMerger *m, AVTMergerRange *missing, int nb_max)
+{
+    if (!m->active || !m->target_tot_len)
+        return AVT_ERROR(EAGAIN);
+
+    const AVTMergerRanges *r = &m->ranges;
+    const uint64_t tot = m->target_tot_len;
+    if (!r->granule) {
+        if (nb_max < 1)
+            return 0;
+        missing[0] = (AVTMergerRange){ 0, tot };
+        return 1;
+    }
+
+    /* Anything past the end of the bitmap is missing */
+    const uint64_t granule = r->granule;
+    const uint64_t nb_bits = (tot + granule - 1) / granule;
+    const uint64_t nb_map = AVT_MIN(nb_bits, (uint64_t)r->nb_words << 6);
+
+    int nb = 0;
+    uint64_t start = bits_find(r->map, 0, nb_map, false);
+    while ((start < nb_bits) && (nb < nb_max)) {
+        uint64_t end = bits_find(r->map, start, nb_map, true);
+        if (end == nb_map)
+            end = nb_bits;
+
+        missing[nb++] = (AVTMergerRange) {
+            .offset = start*granule,
+            .size = AVT_MIN(end*granule, tot) - start*granule,
+        };
+
+        if (end >= nb_map)
+            break;
+
+        start = bits_find(r->map, end, nb_map, false);
+    }
+
+    return nb;
+}
+
 int avt_pkt_merge_force(void *log_ctx, AVTMerger *m, AVTPktd *p)
 {
     /* If inactive, we don't have anything */
@@ -481,6 +624,7 @@ int avt_pkt_merge_force(void *log_ctx, AVTMerger *m, AVTPktd *p)
 
     *p = m->p;
     m->p = (AVTPktd){ };
+    m->active = false;
 
     return m->pkt_len_track;
 }
@@ -494,8 +638,176 @@ void avt_pkt_merge_done(AVTMerger *m)
 void avt_pkt_merge_free(AVTMerger *m)
 {
     avt_pkt_merge_done(m);
-    free(m->ranges);
-    free(m->parity_ranges);
+    ranges_free(&m->ranges);
+    ranges_free(&m->parity_ranges);
     avt_buffer_quick_unref(&m->parity);
     memset(m, 0, sizeof(*m));
 }
+
+static inline uint32_t table_hash(AVTMergerTable *t, uint32_t target)
+{
+    /* Fibonacci hashing, as targets are mostly sequential */
+    return (target*UINT32_C(0x9E3779B1)) >> (32 - stdc_trailing_zeros(t->nb_slots));
+}
+
+int avt_merger_table_init(AVTMergerTable *t, uint32_t max_used,
+                          int64_t timeout)
+{
+    memset(t, 0, sizeof(*t));
+
+    /* Keep the table at most half full */
+    t->nb_slots = stdc_bit_ceil(AVT_MAX(max_used, 1) << 1);
+    t->slots = calloc(t->nb_slots, sizeof(*t->slots));
+    if (!t->slots)
+        return AVT_ERROR(ENOMEM);
+
+    t->pool = calloc(max_used, sizeof(*t->pool));
+    if (!t->pool) {
+        free(t->slots);
+        return AVT_ERROR(ENOMEM);
+    }
+
+    t->max_used = max_used;
+    t->timeout = timeout;
+
+    return 0;
+}
+
+static void lru_unlink(AVTMergerTable *t, AVTMerger *m)
+{
+    if (m->lru_prev)
+        m->lru_prev->lru_next = m->lru_next;
+    else
+        t->lru_first = m->lru_next;
+
+    if (m->lru_next)
+        m->lru_next->lru_prev = m->lru_prev;
+    else
+        t->lru_last = m->lru_prev;
+
+    m->lru_prev = m->lru_next = NULL;
+}
+
+static void lru_append(AVTMergerTable *t, AVTMerger *m)
+{
+    m->lru_prev = t->lru_last;
+    m->lru_next = NULL;
+    if (t->lru_last)
+        t->lru_last->lru_next = m;
+    else
+        t->lru_first = m;
+    t->lru_last = m;
+}
+
+int avt_merger_table_get(AVTMergerTable *t, uint32_t target, int64_t now,
+                         AVTMerger **out)
+{
+    const uint32_t mask = t->nb_slots - 1;
+    uint32_t idx = table_hash(t, target);
+
+    for (; t->slots[idx]; idx = (idx + 1) & mask) {
+        if (t->slots[idx]->target == target) {
+            *out = t->slots[idx];
+            return 0;
+        }
+    }
+
+    if (t->nb_used == t->max_used)
+        return AVT_ERROR(ENOSPC);
+
+    AVTMerger *m;
+    if (t->nb_pool) {
+        m = t->pool[--t->nb_pool];
+    } else {
+        m = calloc(1, sizeof(*m));
+        if (!m)
+            return AVT_ERROR(ENOMEM);
+    }
+
+    m->target = target;
+    m->last_update = now;
+    t->slots[idx] = m;
+    lru_append(t, m);
+    t->nb_used++;
+
+    *out = m;
+
+    return 0;
+}
+
+void avt_merger_table_touch(AVTMergerTable *t, AVTMerger *m, int64_t now)
+{
+    m->last_update = now;
+    if (t->lru_last != m) {
+        lru_unlink(t, m);
+        lru_append(t, m);
+    }
+}
+
+AVTMerger *avt_merger_table_oldest(AVTMergerTable *t)
+{
+    return t->lru_first;
+}
+
+AVTMerger *avt_merger_table_expired(AVTMergerTable *t, int64_t now)
+{
+    AVTMerger *m = t->lru_first;
+    if (m && ((now - m->last_update) > t->timeout))
+        return m;
+    return NULL;
+}
+
+int64_t avt_merger_table_deadline(AVTMergerTable *t)
+{
+    AVTMerger *m = t->lru_first;
+    if (!m)
+        return INT64_MAX;
+    return m->last_update + t->timeout + 1;
+}
+
+void avt_merger_table_release(AVTMergerTable *t, AVTMerger *m)
+{
+    const uint32_t mask = t->nb_slots - 1;
+    uint32_t idx = table_hash(t, m->target);
+    while (t->slots[idx] != m)
+        idx = (idx + 1) & mask;
+
+    /* Shift back any entries which would become unreachable */
+    uint32_t next = idx;
+    for (;;) {
+        t->slots[idx] = NULL;
+        for (;;) {
+            next = (next + 1) & mask;
+            if (!t->slots[next])
+                goto done;
+
+            /* Can the entry at next stay where it is? */
+            uint32_t home = table_hash(t, t->slots[next]->target);
+            if (((next - home) & mask) >= ((next - idx) & mask))
+                break;
+        }
+        t->slots[idx] = t->slots[next];
+        idx = next;
+    }
+
+done:
+    lru_unlink(t, m);
+    avt_pkt_merge_done(m);
+    t->pool[t->nb_pool++] = m;
+    t->nb_used--;
+}
+
+void avt_merger_table_free(AVTMergerTable *t)
+{
+    while (t->lru_first)
+        avt_merger_table_release(t, t->lru_first);
+
+    for (auto i = 0; i < t->nb_pool; i++) {
+        avt_pkt_merge_free(t->pool[i]);
+        free(t->pool[i]);
+    }
+
+    free(t->pool);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
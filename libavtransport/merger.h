@@ -34,6 +34,16 @@ typedef struct AVTMergerRange {
     uint32_t size;
 } AVTMergerRange;
 
+/* Received data, tracked as a bitmap. Each bit covers a granule of bytes,
+ * the largest size which all segments received so far are aligned to.
+ * Segments of equal size, besides the last one, thus take a bit each. */
+typedef struct AVTMergerRanges {
+    uint64_t *map;
+    uint32_t nb_words; /* Words which may have bits set */
+    uint32_t nb_words_alloc;
+    uint32_t granule; /* Bytes per bit, 0 if nothing was received */
+} AVTMergerRanges;
+
 /* One merger per seq ID */
 typedef struct AVTMerger {
     bool active; /* If there's an active packet that needs more segments */
@@ -50,20 +60,41 @@ typedef struct AVTMerger {
     uint32_t pkt_len_track;
     uint32_t target_tot_len;
     /* Packet data ranges */
-    AVTMergerRange *ranges;
-    uint32_t nb_ranges;
-    uint32_t ranges_allocated;
+    AVTMergerRanges ranges;
 
     /* Parity data for the packet */
     AVTBuffer parity; // Preserved between resets
     uint32_t pkt_parity_len_track;
     uint32_t parity_tot_len;
     /* Parity date ranges */
-    AVTMergerRange *parity_ranges;
-    uint32_t nb_parity_ranges;
-    uint32_t parity_ranges_allocated;
+    AVTMergerRanges parity_ranges;
+
+    /* Merger table state */
+    int64_t last_update;
+    struct AVTMerger *lru_prev;
+    struct AVTMerger *lru_next;
 } AVTMerger;
 
+/* Manager for mergers of packets being reassembled concurrently */
+typedef struct AVTMergerTable {
+    /* Hash table of mergers in use, keyed by target */
+    AVTMerger **slots;
+    uint32_t nb_slots;
+
+    /* Mergers in use, least recently updated first */
+    AVTMerger *lru_first;
+    AVTMerger *lru_last;
+    uint32_t nb_used;
+    uint32_t max_used;
+
+    /* Unused mergers, which keep their allocations for reuse */
+    AVTMerger **pool;
+    uint32_t nb_pool;
+
+    /* Time after which a merger which was not updated expires */
+    int64_t timeout;
+} AVTMergerTable;
+
 /* Basic merger function. Input and output is 'p'.
  * Returns the payload size once an output is possible.
  * Returns AVT_ERROR(EAGAIN) if more segments are needed.
@@ -72,6 +103,21 @@ typedef struct AVTMerger {
  * Returns an error code in all other circumstances. */
 int avt_pkt_merge_seg(void *log_ctx, AVTMerger *m, AVTPktd *p);
 
+/* Direct placement. For a segment which only has its header received,
+ * set p->pl to the part of the packet being merged its payload belongs to,
+ * so that it can be received in place, and needn't be copied by
+ * avt_pkt_merge_seg().
+ * Returns AVT_ERROR(ENOTSUP) if the segment's destination cannot be known,
+ * AVT_ERROR(EBUSY) if it belongs to a different target, AVT_ERROR(EEXIST)
+ * if it was already received, and AVT_ERROR(EINVAL) if it overlaps with
+ * anything received. */
+int avt_pkt_merge_place(void *log_ctx, AVTMerger *m, AVTPktd *p);
+
+/* Write up to nb_max ranges of the packet being merged which are still
+ * missing. Returns the number of ranges written, or AVT_ERROR(EAGAIN)
+ * if the total size of the packet is not yet known. */
+int avt_pkt_merge_missing(AVTMerger *m, AVTMergerRange *missing, int nb_max);
+
 /* Force whatever output is possible out. p will be overwritten. */
 int avt_pkt_merge_force(void *log_ctx, AVTMerger *m, AVTPktd *p);
 
@@ -83,4 +129,30 @@ void avt_pkt_merge_done(AVTMerger *m);
  * Frees up the parity data buffer as well. */
 void avt_pkt_merge_free(AVTMerger *m);
 
+int avt_merger_table_init(AVTMergerTable *t, uint32_t max_used,
+                          int64_t timeout);
+
+/* Get the merger for a target, or a new one if there's none.
+ * Returns AVT_ERROR(ENOSPC) if all mergers are in use. */
+int avt_merger_table_get(AVTMergerTable *t, uint32_t target, int64_t now,
+                         AVTMerger **m);
+
+/* Mark a merger as updated */
+void avt_merger_table_touch(AVTMergerTable *t, AVTMerger *m, int64_t now);
+
+/* Get the least recently updated merger, NULL if none are in use */
+AVTMerger *avt_merger_table_oldest(AVTMergerTable *t);
+
+/* Get the least recently updated merger if it has expired, otherwise NULL */
+AVTMerger *avt_merger_table_expired(AVTMergerTable *t, int64_t now);
+
+/* Time at which the least recently updated merger expires,
+ * INT64_MAX if none are in use */
+int64_t avt_merger_table_deadline(AVTMergerTable *t);
+
+/* Reset a merger, and return it to the pool */
+void avt_merger_table_release(AVTMergerTable *t, AVTMerger *m);
+
+void avt_merger_table_free(AVTMergerTable *t);
+
 #endif /* AVTRANSPORT_MERGER_H */
@@ -0,0 +1,479 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mirror.h"
+#include "io_utils.h"
+#include "mem.h"
+
+/* How long the writer thread sleeps for when idle, at most */
+#define MIRROR_IDLE_WAIT 10000000
+
+static void mirror_set_err(AVTMirror *m, int err)
+{
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&m->err, &expected, err))
+        avt_log(m->ctx, AVT_LOG_ERROR, "Error writing mirror: %i\n", err);
+}
+
+/* Wait until packets are queued up, or the mirror is closed.
+ * Returns false if there's nothing left to write. */
+static bool mirror_wait(AVTMirror *m, unsigned int tail)
+{
+    pthread_mutex_lock(&m->lock);
+
+    /* Pairs with the check in avt_mirror_push() */
+    atomic_store(&m->idle, true);
+    while (atomic_load(&m->head) == tail && !atomic_load(&m->quit)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += MIRROR_IDLE_WAIT;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+    }
+    atomic_store(&m->idle, false);
+
+    pthread_mutex_unlock(&m->lock);
+
+    return atomic_load(&m->head) != tail;
+}
+
+/* Extend a sequence number to 64 bits, relative to the last one indexed */
+static inline uint64_t mirror_ext_seq(AVTMirror *m, uint32_t seq)
+{
+    return m->index_last + (int32_t)(seq - (uint32_t)m->index_last);
+}
+
+static int mirror_index_write(AVTMirror *m, AVTMirrorIndexEntry *e,
+                              unsigned int nb, uint64_t ext_seq)
+{
+    const size_t len = nb*sizeof(*e);
+    const off_t off = (ext_seq - m->index_base)*sizeof(*e);
+    if (pwrite(fileno(m->index), e, len, off) != len)
+        return avt_handle_errno(m->ctx, "Error writing mirror index: %i %s\n");
+    return 0;
+}
+
+/* Record where sent packets were written to. Offsets are tracked here,
+ * as the file is written sequentially. Consecutive packets are
+ * written to the index at once. */
+static int mirror_index(AVTMirror *m, AVTPktd *p, bool *sent, unsigned int nb)
+{
+    int err = 0;
+    AVTMirrorIndexEntry run[AVT_MIRROR_BATCH];
+    unsigned int nb_run = 0;
+    uint64_t run_start = 0;
+
+    pthread_mutex_lock(&m->index_lock);
+    for (auto i = 0; i < nb; i++) {
+        const size_t size = p[i].hdr_len + p[i].pl.len;
+        if (sent[i]) {
+            if (!m->index_base) {
+                m->index_last = (UINT64_C(1) << 32) + p[i].pkt.seq;
+                m->index_base = m->index_last;
+            }
+
+            /* Packets from before the first one cannot be looked up */
+            uint64_t ext_seq = mirror_ext_seq(m, p[i].pkt.seq);
+            if (ext_seq < m->index_base)
+                goto next;
+
+            if (nb_run && ext_seq != (run_start + nb_run)) {
+                err = mirror_index_write(m, run, nb_run, run_start);
+                if (err < 0)
+                    break;
+                nb_run = 0;
+            }
+            if (!nb_run)
+                run_start = ext_seq;
+
+            run[nb_run++] = (AVTMirrorIndexEntry) {
+                .offset = m->wpos,
+                .size = size,
+                .seq = p[i].pkt.seq,
+            };
+            m->index_last = AVT_MAX(m->index_last, ext_seq);
+        }
+next:
+        m->wpos += size;
+    }
+    if (!err && nb_run)
+        err = mirror_index_write(m, run, nb_run, run_start);
+    pthread_mutex_unlock(&m->index_lock);
+
+    return err;
+}
+
+static void *mirror_thread(void *arg)
+{
+    AVTMirror *m = arg;
+
+    for (;;) {
+        unsigned int tail = atomic_load_explicit(&m->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&m->head, memory_order_acquire);
+        if (head == tail) {
+            if (!mirror_wait(m, tail))
+                break;
+            continue;
+        }
+
+        /* Write as many packets as possible at once, without wrapping */
+        const unsigned int start = tail & (AVT_MIRROR_QUEUE - 1);
+        unsigned int nb = AVT_MIN(head - tail, AVT_MIRROR_QUEUE - start);
+        nb = AVT_MIN(nb, AVT_MIRROR_BATCH);
+
+        AVTPacketFifo seq = {
+            .data = &m->queue[start],
+            .nb = nb,
+            .alloc = nb,
+        };
+
+        /* Keep writing on errors, as the queue must still be drained */
+        int err = m->p->send_seq(m->p_ctx, &seq, INT64_MAX);
+        if (err < 0)
+            mirror_set_err(m, err);
+
+        /* After an error, offsets are unknown, so stop indexing */
+        if (m->index && !atomic_load_explicit(&m->err, memory_order_relaxed)) {
+            err = mirror_index(m, seq.data, &m->queue_sent[start], nb);
+            if (err < 0)
+                mirror_set_err(m, err);
+        }
+
+        /* Each packet waited for a different amount of time */
+        const int64_t now = avt_get_time_ns();
+        int64_t lag = 0;
+        for (auto i = 0; i < nb; i++)
+            lag += now - m->queue_time[start + i];
+        atomic_store_explicit(&m->lag, lag / nb, memory_order_relaxed);
+        atomic_fetch_add_explicit(&m->packets, nb, memory_order_relaxed);
+
+        for (auto i = 0; i < nb; i++)
+            avt_buffer_quick_unref(&m->queue[start + i].pl);
+
+        /* Pairs with avt_mirror_drain() */
+        atomic_store(&m->tail, tail + nb);
+        if (atomic_load(&m->draining)) {
+            pthread_mutex_lock(&m->lock);
+            pthread_cond_broadcast(&m->drained);
+            pthread_mutex_unlock(&m->lock);
+        }
+    }
+
+    int err = m->p->flush(m->p_ctx, INT64_MAX);
+    if (err < 0)
+        mirror_set_err(m, err);
+
+    return NULL;
+}
+
+static void mirror_free(AVTMirror *m)
+{
+    if (m->p_ctx)
+        m->p->close(&m->p_ctx);
+    if (m->io_ctx)
+        m->io->close(&m->io_ctx);
+
+    if (m->index) {
+        pthread_mutex_destroy(&m->index_lock);
+        fclose(m->index);
+        close(m->read_fd);
+    }
+
+    avt_addr_free(&m->addr);
+    free(m->queue_sent);
+    free(m->queue_time);
+    free(m->queue);
+    free(m);
+}
+
+COLD int avt_mirror_init(AVTContext *ctx, AVTMirror **_m,
+                         AVTConnectionInfo *info)
+{
+    int err;
+    AVTMirror *m = calloc(1, sizeof(*m));
+    if (!m)
+        return AVT_ERROR(ENOMEM);
+
+    m->ctx = ctx;
+
+    m->queue = calloc(AVT_MIRROR_QUEUE, sizeof(*m->queue));
+    m->queue_time = calloc(AVT_MIRROR_QUEUE, sizeof(*m->queue_time));
+    m->queue_sent = calloc(AVT_MIRROR_QUEUE, sizeof(*m->queue_sent));
+    if (!m->queue || !m->queue_time || !m->queue_sent) {
+        err = AVT_ERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = avt_addr_from_info(ctx, &m->addr, info);
+    if (err < 0)
+        goto fail;
+
+    err = avt_io_init(ctx, &m->io, &m->io_ctx, &m->addr);
+    if (err < 0)
+        goto fail;
+
+    /* Sent packets are looked up using their offsets, which index
+     * packets would shift */
+    AVTProtocolOpts opts = {
+        .no_index = true,
+    };
+    err = avt_protocol_init(ctx, &m->p, &m->p_ctx, &m->addr,
+                            m->io, m->io_ctx, &opts);
+    if (err < 0)
+        goto fail;
+
+    /* Files can serve as a retransmit cache */
+    if (m->addr.type == AVT_ADDRESS_FILE) {
+        m->read_fd = open(m->addr.path, O_RDONLY | O_CLOEXEC);
+        if (m->read_fd < 0) {
+            err = avt_handle_errno(ctx, "Error opening mirror for reading: %i %s\n");
+            goto fail;
+        }
+
+        err = pthread_mutex_init(&m->index_lock, NULL);
+        if (err) {
+            close(m->read_fd);
+            err = AVT_ERROR(err);
+            goto fail;
+        }
+
+        /* Created last, as its presence means all of the above is valid */
+        m->index = tmpfile();
+        if (!m->index) {
+            err = avt_handle_errno(ctx, "Error creating mirror index: %i %s\n");
+            pthread_mutex_destroy(&m->index_lock);
+            close(m->read_fd);
+            goto fail;
+        }
+    }
+
+    err = pthread_mutex_init(&m->lock, NULL);
+    if (err) {
+        err = AVT_ERROR(err);
+        goto fail;
+    }
+
+    err = pthread_cond_init(&m->cond, NULL);
+    if (err) {
+        pthread_mutex_destroy(&m->lock);
+        err = AVT_ERROR(err);
+        goto fail;
+    }
+
+    err = pthread_cond_init(&m->drained, NULL);
+    if (err) {
+        pthread_cond_destroy(&m->cond);
+        pthread_mutex_destroy(&m->lock);
+        err = AVT_ERROR(err);
+        goto fail;
+    }
+
+    err = pthread_create(&m->thread, NULL, mirror_thread, m);
+    if (err) {
+        pthread_cond_destroy(&m->drained);
+        pthread_cond_destroy(&m->cond);
+        pthread_mutex_destroy(&m->lock);
+        err = AVT_ERROR(err);
+        goto fail;
+    }
+
+    *_m = m;
+
+    return 0;
+
+fail:
+    mirror_free(m);
+    return err;
+}
+
+int avt_mirror_push(AVTMirror *m, AVTPktd *p, uint32_t nb_p, bool sent)
+{
+    unsigned int head = atomic_load_explicit(&m->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&m->tail, memory_order_acquire);
+    const int64_t now = avt_get_time_ns();
+
+    uint32_t i;
+    for (i = 0; i < nb_p; i++) {
+        if ((head - tail) == AVT_MIRROR_QUEUE)
+            break;
+
+        const unsigned int idx = head & (AVT_MIRROR_QUEUE - 1);
+        AVTPktd *dst = &m->queue[idx];
+        *dst = p[i];
+        dst->pl = (AVTBuffer){ };
+        avt_buffer_quick_ref(&dst->pl, &p[i].pl, 0, p[i].pl.len);
+        m->queue_time[idx] = now;
+        m->queue_sent[idx] = sent;
+        head++;
+    }
+
+    if (i < nb_p) {
+        avt_log(m->ctx, AVT_LOG_WARN, "Mirror queue full, dropping %u packets\n",
+                nb_p - i);
+        atomic_fetch_add_explicit(&m->dropped, nb_p - i, memory_order_relaxed);
+    }
+
+    /* Pairs with mirror_wait() */
+    atomic_store(&m->head, head);
+    if (atomic_load(&m->idle)) {
+        pthread_mutex_lock(&m->lock);
+        pthread_cond_signal(&m->cond);
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    int err = atomic_load_explicit(&m->err, memory_order_relaxed);
+    return err < 0 ? err : i;
+}
+
+int avt_mirror_drain(AVTMirror *m, int64_t timeout)
+{
+    struct timespec ts;
+    if (timeout && timeout != INT64_MAX) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout / 1000000000;
+        ts.tv_nsec += timeout % 1000000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    int err = 0;
+    pthread_mutex_lock(&m->lock);
+
+    /* Pairs with the writer thread */
+    atomic_store(&m->draining, true);
+    while (atomic_load(&m->tail) != atomic_load_explicit(&m->head, memory_order_relaxed)) {
+        if (!timeout) {
+            err = AVT_ERROR(EAGAIN);
+            break;
+        } else if (timeout == INT64_MAX) {
+            pthread_cond_wait(&m->drained, &m->lock);
+        } else if (pthread_cond_timedwait(&m->drained, &m->lock, &ts) == ETIMEDOUT) {
+            err = AVT_ERROR(EAGAIN);
+            break;
+        }
+    }
+    atomic_store(&m->draining, false);
+
+    pthread_mutex_unlock(&m->lock);
+
+    return err;
+}
+
+int avt_mirror_fetch(AVTMirror *m, uint32_t seq, AVTPktd *p)
+{
+    AVTMirrorIndexEntry e = { };
+
+    pthread_mutex_lock(&m->index_lock);
+    uint64_t ext_seq = mirror_ext_seq(m, seq);
+    ssize_t ret = 0;
+    if (m->index_base && ext_seq >= m->index_base)
+        ret = pread(fileno(m->index), &e, sizeof(e),
+                    (ext_seq - m->index_base)*sizeof(e));
+    pthread_mutex_unlock(&m->index_lock);
+
+    /* Packets never indexed read back as holes */
+    if (ret < 0)
+        return avt_handle_errno(m->ctx, "Error reading mirror index: %i %s\n");
+    else if (ret != sizeof(e) || e.seq != seq || !e.size)
+        return AVT_ERROR(ENOENT);
+
+    AVTBuffer buf = { };
+    uint8_t *data = avt_buffer_quick_alloc(&buf, e.size);
+    if (!data)
+        return AVT_ERROR(ENOMEM);
+
+    ret = pread(m->read_fd, data, e.size, e.offset);
+    if (ret < 0) {
+        avt_buffer_quick_unref(&buf);
+        return avt_handle_errno(m->ctx, "Error reading mirror: %i %s\n");
+    } else if (ret != e.size) {
+        avt_buffer_quick_unref(&buf);
+        return AVT_ERROR(ENOENT);
+    }
+
+    const size_t hdr_len = AVT_MIN(e.size, AVT_MAX_HEADER_LEN);
+    memcpy(p->hdr, data, hdr_len);
+
+    int64_t pl_len = avt_packet_decode_header(m->ctx, p);
+    if (pl_len < 0 || (p->hdr_len + pl_len) != e.size) {
+        avt_buffer_quick_unref(&buf);
+        return pl_len < 0 ? pl_len : AVT_ERROR(EINVAL);
+    }
+
+    p->pl = (AVTBuffer){ };
+    if (pl_len)
+        avt_buffer_quick_ref(&p->pl, &buf, p->hdr_len, pl_len);
+    avt_buffer_quick_unref(&buf);
+
+    return 0;
+}
+
+void avt_mirror_status(AVTMirror *m, AVTConnectionStatus *s)
+{
+    const unsigned int head = atomic_load_explicit(&m->head, memory_order_relaxed);
+    const unsigned int tail = atomic_load_explicit(&m->tail, memory_order_relaxed);
+
+    s->mirror.packets = atomic_load_explicit(&m->packets, memory_order_relaxed);
+    s->mirror.dropped_packets = atomic_load_explicit(&m->dropped,
+                                                     memory_order_relaxed);
+    s->mirror.queued_packets = head - tail;
+    s->mirror.lag = atomic_load_explicit(&m->lag, memory_order_relaxed);
+}
+
+COLD int avt_mirror_close(AVTMirror **_m)
+{
+    AVTMirror *m = *_m;
+    if (!m)
+        return 0;
+
+    pthread_mutex_lock(&m->lock);
+    atomic_store(&m->quit, true);
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+
+    pthread_join(m->thread, NULL);
+    pthread_cond_destroy(&m->drained);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+
+    int err = atomic_load(&m->err);
+
+    mirror_free(m);
+    *_m = NULL;
+
+    return err;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AVTRANSPORT_MIRROR_H
+#define AVTRANSPORT_MIRROR_H
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "address.h"
+#include "io_common.h"
+#include "protocol_common.h"
+#include "utils_internal.h"
+
+/* Number of packets which can be queued up for the mirror. Must be a power of 2. */
+#define AVT_MIRROR_QUEUE 4096
+
+/* Maximum number of packets written at once */
+#define AVT_MIRROR_BATCH 256
+
+/* Location of a sent packet in a file mirror */
+typedef struct AVTMirrorIndexEntry {
+    avt_pos offset;
+    uint32_t size;
+    uint32_t seq;
+} AVTMirrorIndexEntry;
+
+/* Mirror context.
+ * Packets are queued by the connection through a single-producer,
+ * single-consumer lock-free ring, and written by a separate thread,
+ * so mirroring never blocks on the mirror's I/O. */
+typedef struct AVTMirror {
+    AVTContext *ctx;
+    AVTAddress addr;
+
+    const AVTIO *io;
+    AVTIOCtx *io_ctx;
+
+    const AVTProtocol *p;
+    AVTProtocolCtx *p_ctx;
+
+    /* Queued packets, the time they were queued at, and whether they
+     * were sent or received */
+    AVTPktd *queue;
+    int64_t *queue_time;
+    bool *queue_sent;
+
+    /* Written by the connection */
+    alignas(64) atomic_uint head;
+    /* Written by the writer thread */
+    alignas(64) atomic_uint tail;
+
+    /* The writer thread only sleeps when the queue is empty */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_bool idle;
+    atomic_bool quit;
+
+    /* Signalled by the writer thread once the queue is empty,
+     * while anyone is waiting for it to be */
+    pthread_cond_t drained;
+    atomic_bool draining;
+
+    /* First error the writer thread ran into */
+    atomic_int err;
+
+    /* File mirrors only: index of sent packets, by sequence number,
+     * and a descriptor to read them back with.
+     * The index is kept in a temporary file, so it covers every packet
+     * in the mirror, no matter how long it runs for. Sequence numbers
+     * are extended to 64 bits, and entries are stored at
+     * (extended sequence number - index_base). */
+    FILE *index;
+    pthread_mutex_t index_lock;
+    uint64_t index_base;
+    uint64_t index_last;
+    avt_pos wpos;
+    int read_fd;
+
+    /* Statistics */
+    atomic_uint_fast64_t packets;
+    atomic_uint_fast64_t dropped;
+    atomic_int_fast64_t lag;
+} AVTMirror;
+
+/* Open the mirror's output, and start its writer thread */
+int avt_mirror_init(AVTContext *ctx, AVTMirror **m, AVTConnectionInfo *info);
+
+/* Queue up packets to be mirrored. Payloads are referenced.
+ * Never blocks. If the queue is full, packets are dropped.
+ * Returns the number of packets queued, which are always the first ones,
+ * or a negative error. */
+int avt_mirror_push(AVTMirror *m, AVTPktd *p, uint32_t nb_p, bool sent);
+
+/* Returns true if sent packets can be read back from the mirror */
+static inline bool avt_mirror_can_fetch(AVTMirror *m)
+{
+    return m && m->index;
+}
+
+/* Wait until all queued packets have been written, for up to timeout
+ * nanoseconds. Returns AVT_ERROR(EAGAIN) if they were not. */
+int avt_mirror_drain(AVTMirror *m, int64_t timeout);
+
+/* Read back a sent packet from a file mirror.
+ * Returns AVT_ERROR(ENOENT) if the packet is not, or not yet, in the file. */
+int avt_mirror_fetch(AVTMirror *m, uint32_t seq, AVTPktd *p);
+
+/* Statistics */
+void avt_mirror_status(AVTMirror *m, AVTConnectionStatus *s);
+
+/* Write out all queued packets, flush, and close everything */
+int avt_mirror_close(AVTMirror **m);
+
+#endif /* AVTRANSPORT_MIRROR_H */
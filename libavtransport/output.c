@@ -38,6 +38,8 @@
 int avt_send_close(AVTSender **_s)
 {
     AVTSender *s = *_s;
+    if (!s)
+        return 0;
 
 #ifdef CONFIG_HAVE_LIBZSTD
     ZSTD_freeCCtx(s->zstd_ctx);
@@ -45,6 +47,22 @@ int avt_send_close(AVTSender **_s)
 
     XXH3_freeState(s->xxh_state);
 
+    for (auto i = 0; i < s->nb_groups; i++) {
+        AVTSenderGroup *g = &s->groups[i];
+        avt_scheduler_free(g->sched);
+        free(g->sched);
+        free(g->conn);
+    }
+    free(s->groups);
+
+    if (s->bond.sched) {
+        avt_scheduler_free(s->bond.sched);
+        free(s->bond.sched);
+    }
+    for (auto i = 0; i < s->bond.nb_path; i++)
+        avt_pkt_fifo_free(&s->bond.path[i].out);
+    free(s->bond.path);
+
     free(s);
 
     *_s = NULL;
@@ -69,15 +87,6 @@ static inline int alloc_output_context(AVTSender **_s, AVTSenderOptions *opts)
                             AVT_SENDER_COMPRESS_VIDEO;
     }
 
-    /* Allocate one here just so we don't have to tear this down later in
-     * case malloc fails */
-    s->conn = calloc(1, sizeof(*s->conn));
-    if (!s->conn) {
-        avt_send_close(&s);
-        return AVT_ERROR(ENOMEM);
-    }
-    s->nb_conn_alloc = 1;
-
     /* Init xxHash state */
     s->xxh_state = XXH3_createState();
     if (!s->xxh_state) {
@@ -99,14 +108,82 @@ static inline int alloc_output_context(AVTSender **_s, AVTSenderOptions *opts)
     return 0;
 }
 
+static int add_to_group(AVTSender *s, AVTConnection *conn,
+                        size_t max_pkt_size, int64_t bandwidth)
+{
+    int err;
+    AVTSenderGroup *g = NULL;
+
+    for (auto i = 0; i < s->nb_groups; i++) {
+        if (s->groups[i].max_pkt_size == max_pkt_size &&
+            s->groups[i].bandwidth == bandwidth) {
+            g = &s->groups[i];
+            break;
+        }
+    }
+
+    /* Redundant connections must all output identical packets */
+    if (!g && s->opts.redundant && s->nb_groups) {
+        g = &s->groups[0];
+        if (bandwidth != g->bandwidth)
+            return AVT_ERROR(EINVAL);
+        if (max_pkt_size < g->max_pkt_size) {
+            err = avt_scheduler_set_max_pkt_size(g->sched, max_pkt_size);
+            if (err < 0)
+                return err;
+            g->max_pkt_size = max_pkt_size;
+        }
+    }
+
+    if (!g) {
+        AVTSenderGroup *tmp = avt_reallocarray(s->groups, s->nb_groups + 1,
+                                               sizeof(*tmp));
+        if (!tmp)
+            return AVT_ERROR(ENOMEM);
+        s->groups = tmp;
+
+        g = &s->groups[s->nb_groups];
+        *g = (AVTSenderGroup){
+            .max_pkt_size = max_pkt_size,
+            .bandwidth = bandwidth,
+        };
+
+        g->sched = calloc(1, sizeof(*g->sched));
+        if (!g->sched)
+            return AVT_ERROR(ENOMEM);
+
+        err = avt_scheduler_init(g->sched, max_pkt_size, bandwidth);
+        if (err < 0) {
+            free(g->sched);
+            return err;
+        }
+
+        s->nb_groups++;
+    }
+
+    AVTConnection **tmp = avt_reallocarray(g->conn, g->nb_conn + 1,
+                                           sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+    g->conn = tmp;
+
+    /* Members also send packets of their own, which must not reuse
+     * any of the group's sequence numbers */
+    err = avt_connection_share_seq(conn, g->sched);
+    if (err < 0)
+        return err;
+
+    g->conn[g->nb_conn++] = conn;
+
+    return 0;
+}
+
 int avt_send_open(AVTContext *ctx, AVTSender **_s,
                   AVTConnection *conn, AVTSenderOptions *opts)
 {
     int err;
     AVTSender *s = NULL;
 
-    // TODO: query connection status here
-
     /* Allocate state, if not already existing */
     if (!(*_s)) {
         err = alloc_output_context(&s, opts);
@@ -117,19 +194,76 @@ int avt_send_open(AVTContext *ctx, AVTSender **_s,
         s = *_s;
     }
 
-    /* Register connection for output */
-    if (s->nb_conn_alloc < (s->nb_conn + 1)) {
-        AVTConnection **tmp = avt_reallocarray(s->conn,
-                                               s->nb_conn_alloc + 1,
-                                               sizeof(*tmp));
-        if (!tmp)
+    /* Connections with the same packetization parameters, including the
+     * bandwidth they interleave for, are packetized together */
+    size_t max_pkt_size;
+    int64_t bandwidth;
+    avt_connection_get_pkt_params(conn, &max_pkt_size, &bandwidth);
+
+    return add_to_group(s, conn, max_pkt_size, bandwidth);
+}
+
+int avt_send_bond(AVTContext *ctx, AVTSender **_s,
+                  AVTConnection *conn, int64_t capacity,
+                  AVTSenderOptions *opts)
+{
+    int err;
+    AVTSender *s = NULL;
+    AVTSenderBond *b;
+
+    size_t max_pkt_size;
+    int64_t bandwidth;
+    avt_connection_get_pkt_params(conn, &max_pkt_size, &bandwidth);
+    if (bandwidth != INT64_MAX || capacity <= 0)
+        return AVT_ERROR(EINVAL);
+
+    if (!(*_s)) {
+        err = alloc_output_context(&s, opts);
+        if (err < 0)
+            return err;
+        *_s = s;
+    } else {
+        s = *_s;
+    }
+    b = &s->bond;
+
+    for (auto i = 0; i < b->nb_path; i++)
+        if (b->path[i].conn == conn)
+            return AVT_ERROR(EEXIST);
+
+    AVTSenderBondPath *tmp = avt_reallocarray(b->path, b->nb_path + 1,
+                                              sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+    b->path = tmp;
+
+    if (!b->sched) {
+        b->sched = calloc(1, sizeof(*b->sched));
+        if (!b->sched)
             return AVT_ERROR(ENOMEM);
 
-        s->conn = tmp;
-        s->nb_conn_alloc++;
+        err = avt_scheduler_init(b->sched, max_pkt_size, INT64_MAX);
+        if (err < 0) {
+            free(b->sched);
+            b->sched = NULL;
+            return err;
+        }
+
+    } else if (max_pkt_size < b->sched->max_pkt_size) {
+        /* Segments must fit on every path */
+        err = avt_scheduler_set_max_pkt_size(b->sched, max_pkt_size);
+        if (err < 0)
+            return err;
     }
 
-    s->conn[s->nb_conn++] = conn;
+    err = avt_connection_share_seq(conn, b->sched);
+    if (err < 0)
+        return err;
+
+    b->path[b->nb_path++] = (AVTSenderBondPath) {
+        .conn = conn,
+        .capacity = capacity,
+    };
 
     return 0;
 }
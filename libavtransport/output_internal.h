@@ -31,6 +31,7 @@
 
 #include "common.h"
 #include "connection_internal.h"
+#include "scheduler.h"
 
 #include "config.h"
 
@@ -45,13 +46,50 @@
 #include <zstd.h>
 #endif
 
+/* Connections with identical packetization parameters. Packets are
+ * segmented and encoded once, and the result is handed to every member. */
+typedef struct AVTSenderGroup {
+    size_t max_pkt_size;
+    int64_t bandwidth;
+    AVTScheduler *sched;
+
+    AVTConnection **conn;
+    uint32_t nb_conn;
+} AVTSenderGroup;
+
+typedef struct AVTSenderBondPath {
+    AVTConnection *conn;
+    int64_t capacity; /* Bits per second */
+
+    /* Time at which everything striped onto the path would be sent */
+    int64_t finish;
+
+    /* One-way delay, half of the path's measured round-trip time */
+    int64_t delay;
+
+    /* Packets striped onto the path from the current sequence */
+    AVTPacketFifo out;
+} AVTSenderBondPath;
+
+/* Connections acting as paths of a single multipath output. Packets are
+ * segmented and encoded once, and each segment goes out over one path. */
+typedef struct AVTSenderBond {
+    AVTScheduler *sched;
+
+    AVTSenderBondPath *path;
+    uint32_t nb_path;
+} AVTSenderBond;
+
 typedef struct AVTSender {
     AVTContext *ctx;
     AVTSenderOptions opts;
 
-    AVTConnection **conn;
-    uint32_t nb_conn;
-    uint32_t nb_conn_alloc;
+    /* All connections, other than bonded ones */
+    AVTSenderGroup *groups;
+    uint32_t nb_groups;
+
+    /* Bonded connections */
+    AVTSenderBond bond;
 
     AVTStream streams[UINT16_MAX];
     uint16_t active_stream_idx[UINT16_MAX];
@@ -31,6 +31,7 @@
 #include "config.h"
 #include "packet_common.h"
 #include "utils_packet.h"
+#include "packet_encode.h"
 
 #ifdef CONFIG_HAVE_LIBBROTLIENC
 #include <brotli/encode.h>
@@ -125,6 +126,54 @@ static inline enum AVTDataCompression compress_method(AVTPktd *p,
     return AVT_DATA_COMPRESSION_NONE;
 }
 
+#ifdef CONFIG_HAVE_LIBZSTD
+/* Input is fed to ZSTD in chunks of this size, so that the output of
+ * each chunk gets hashed while it's still in cache. */
+#define PAYLOAD_CHUNK_SIZE (128*1024)
+
+/* Single-pass compression + hashing. The source is fed to ZSTD a chunk
+ * at a time, and whatever compressed output was produced is hashed
+ * immediately, while still hot. */
+static int payload_compress_zstd(AVTSender *s, int lvl,
+                                 uint8_t *dst, size_t dst_size,
+                                 const uint8_t *src, size_t src_len,
+                                 size_t *dst_len)
+{
+    size_t ret;
+    ZSTD_outBuffer out = { .dst = dst, .size = dst_size, .pos = 0 };
+    ZSTD_inBuffer in = { .src = src, .size = 0, .pos = 0 };
+
+    ZSTD_CCtx_reset(s->zstd_ctx, ZSTD_reset_session_only);
+    ZSTD_CCtx_setParameter(s->zstd_ctx, ZSTD_c_compressionLevel, lvl);
+    /* Keep the content size in the frame header, like ZSTD_compressCCtx */
+    ZSTD_CCtx_setPledgedSrcSize(s->zstd_ctx, src_len);
+
+    do {
+        size_t hashed = out.pos;
+        in.size = AVT_MIN(in.size + PAYLOAD_CHUNK_SIZE, src_len);
+        ZSTD_EndDirective op = in.size == src_len ? ZSTD_e_end :
+                                                    ZSTD_e_continue;
+
+        ret = ZSTD_compressStream2(s->zstd_ctx, &out, &in, op);
+        if (ZSTD_isError(ret)) {
+            avt_log(s, AVT_LOG_ERROR, "Error while compressing with ZSTD: %s\n",
+                    ZSTD_getErrorName(ret));
+            return AVT_ERROR(EINVAL);
+        }
+
+        if (s->opts.hash)
+            XXH3_128bits_update(s->xxh_state, dst + hashed, out.pos - hashed);
+
+        /* The output is bounded by ZSTD_compressBound, so ZSTD_e_end
+         * always finishes the frame in one call */
+    } while (in.size < src_len || ret);
+
+    *dst_len = out.pos;
+
+    return 0;
+}
+#endif
+
 static int payload_process(AVTSender *s, AVTStream *st,
                            AVTPktd *p, AVTBuffer *pl)
 {
@@ -169,6 +218,8 @@ static int payload_process(AVTSender *s, AVTStream *st,
     switch (method) {
     case AVT_DATA_COMPRESSION_NONE:
         avt_buffer_quick_ref(&p->pl, pl, 0, AVT_BUFFER_REF_ALL);
+        if (s->opts.hash)
+            XXH3_128bits_update(s->xxh_state, src, src_len);
         break;
 #ifdef CONFIG_HAVE_LIBZSTD
     case AVT_DATA_COMPRESSION_ZSTD:
@@ -179,10 +230,9 @@ static int payload_process(AVTSender *s, AVTStream *st,
         if (!dst)
             return AVT_ERROR(ENOMEM);
 
-        dst_len = ZSTD_compressCCtx(s->zstd_ctx, dst, dst_size, src, src_len, lvl);
-        if (!dst_len) {
-            avt_log(s, AVT_LOG_ERROR, "Error while compressing with ZSTD!\n");
-            err = AVT_ERROR(EINVAL);
+        err = payload_compress_zstd(s, lvl, dst, dst_size,
+                                    src, src_len, &dst_len);
+        if (err < 0) {
             free(dst);
             break;
         }
@@ -220,6 +270,10 @@ static int payload_process(AVTSender *s, AVTStream *st,
             break;
         }
 
+        /* Text payloads are small, so the output is still in cache */
+        if (s->opts.hash)
+            XXH3_128bits_update(s->xxh_state, dst, dst_size);
+
         zbuf = avt_buffer_create(dst, dst_size, NULL, avt_buffer_default_free);
         if (!zbuf) {
             free(dst);
@@ -238,13 +292,14 @@ static int payload_process(AVTSender *s, AVTStream *st,
         return AVT_ERROR(EINVAL);
     };
 
+    if (err < 0)
+        return err;
+
     /* Set compression method */
     avt_packet_set_compression(p, method);
 
-    /* Generate has for the payload if enabled */
+    /* The hash state was updated while processing, only finalize it here */
     if (s->opts.hash) {
-        src = avt_buffer_get_data(&p->pl, &src_len);
-        XXH3_128bits_update(s->xxh_state, src, src_len);
         XXH128_hash_t hash = XXH3_128bits_digest(s->xxh_state);
         XXH128_canonicalFromHash((XXH128_canonical_t *)&p->pl_hash, hash);
         p->pl_has_hash = true;
@@ -253,12 +308,143 @@ static int payload_process(AVTSender *s, AVTStream *st,
     return err;
 }
 
+static inline size_t conn_max_pkt_size(AVTConnection *conn)
+{
+    size_t max_pkt_size;
+    int64_t bandwidth;
+    avt_connection_get_pkt_params(conn, &max_pkt_size, &bandwidth);
+    return max_pkt_size;
+}
+
+/* Segments must fit on every connection they go out on, whose maximum
+ * packet size may change, e.g. through path MTU discovery */
+static inline int sync_max_pkt_size(AVTScheduler *sched, size_t max_pkt_size)
+{
+    if (max_pkt_size == sched->max_pkt_size)
+        return 0;
+    return avt_scheduler_set_max_pkt_size(sched, max_pkt_size);
+}
+
+static inline int send_group(AVTSenderGroup *g, AVTPktd *p)
+{
+    int ret = 0;
+    AVTPacketFifo *seq;
+
+    size_t max_pkt_size = SIZE_MAX;
+    for (auto i = 0; i < g->nb_conn; i++)
+        max_pkt_size = AVT_MIN(conn_max_pkt_size(g->conn[i]), max_pkt_size);
+
+    int err = sync_max_pkt_size(g->sched, max_pkt_size);
+    if (err < 0)
+        return err;
+    g->max_pkt_size = max_pkt_size;
+
+    err = avt_scheduler_push(g->sched, p);
+    if (err < 0)
+        return err;
+
+    /* Interleaving may hold packets back until later ones arrive */
+    err = avt_scheduler_pop(g->sched, &seq);
+    if (err == AVT_ERROR(EAGAIN))
+        return 0;
+    else if (err < 0)
+        return err;
+
+    /* Members only take references to the already encoded packets */
+    for (auto i = 0; i < g->nb_conn; i++) {
+        err = avt_connection_send_seq(g->conn[i], seq);
+        if (err < 0)
+            ret = err;
+    }
+
+    err = avt_scheduler_recycle(g->sched, seq);
+    if (err < 0)
+        ret = err;
+
+    return ret;
+}
+
+static inline int send_bond(AVTSenderBond *b, AVTPktd *p)
+{
+    int ret = 0;
+    AVTPacketFifo *seq;
+    const int64_t now = avt_get_time_ns();
+
+    size_t max_pkt_size = SIZE_MAX;
+    for (auto i = 0; i < b->nb_path; i++)
+        max_pkt_size = AVT_MIN(conn_max_pkt_size(b->path[i].conn), max_pkt_size);
+
+    int err = sync_max_pkt_size(b->sched, max_pkt_size);
+    if (err < 0)
+        return err;
+
+    err = avt_scheduler_push(b->sched, p);
+    if (err < 0)
+        return err;
+
+    err = avt_scheduler_pop(b->sched, &seq);
+    if (err < 0)
+        return err;
+
+    /* Paths whose round-trip time is unknown are taken to have no delay */
+    for (auto i = 0; i < b->nb_path; i++)
+        b->path[i].delay = avt_connection_get_rtt(b->path[i].conn)/2;
+
+    /* Each segment goes to the path over which it would arrive first */
+    for (auto i = 0; i < seq->nb; i++) {
+        AVTPktd *sp = &seq->data[i];
+        int64_t bits = (sp->hdr_len + sp->pl.len)*8;
+
+        int best = 0;
+        int64_t best_arrival = INT64_MAX;
+        int64_t best_finish = INT64_MAX;
+        for (auto j = 0; j < b->nb_path; j++) {
+            int64_t finish = AVT_MAX(b->path[j].finish, now) +
+                             avt_rescale(bits, 1000000000, b->path[j].capacity);
+            if ((finish + b->path[j].delay) < best_arrival) {
+                best_arrival = finish + b->path[j].delay;
+                best_finish = finish;
+                best = j;
+            }
+        }
+
+        b->path[best].finish = best_finish;
+        err = avt_pkt_fifo_push(&b->path[best].out, sp);
+        if (err < 0) {
+            ret = err;
+            break;
+        }
+    }
+
+    for (auto i = 0; i < b->nb_path; i++) {
+        AVTSenderBondPath *bp = &b->path[i];
+        if (bp->out.nb) {
+            err = avt_connection_send_seq(bp->conn, &bp->out);
+            if (err < 0)
+                ret = err;
+        }
+        avt_pkt_fifo_clear(&bp->out);
+    }
+
+    err = avt_scheduler_recycle(b->sched, seq);
+    if (err < 0)
+        ret = err;
+
+    return ret;
+}
+
 static inline int send_pkt(AVTSender *s, AVTPktd *p)
 {
     int ret = 0;
 
-    for (int i = 0; i < s->nb_conn; i++) {
-        int err = avt_connection_send(s->conn[i], p);
+    if (s->bond.nb_path) {
+        int err = send_bond(&s->bond, p);
+        if (err < 0)
+            ret = err;
+    }
+
+    for (int i = 0; i < s->nb_groups; i++) {
+        int err = send_group(&s->groups[i], p);
         if (err < 0)
             ret = err;
     }
@@ -24,9 +24,14 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
 #include <avtransport/avtransport.h>
 #include "packet_decode.h"
 #include "protocol_common.h"
+#include "ldpc_decode.h"
+#include "ldpc_encode.h"
+#include "utils_packet.h"
 #include "mem.h"
 
 extern const AVTProtocol avt_protocol_datagram;
@@ -68,28 +73,229 @@ int avt_protocol_init(AVTContext *ctx, const AVTProtocol **_p,
     return err;
 }
 
+void avt_packet_ldpc_decode_header(uint8_t *hdr, int hdr_size, int iterations)
+{
+    if (iterations < 0)
+        return;
+
+    avt_ldpc_decode_288_224(hdr, iterations);
+
+    switch (hdr_size) {
+    case AVT_MIN_HEADER_LEN*2:
+        avt_ldpc_decode_288_224(hdr + AVT_MIN_HEADER_LEN, iterations);
+        break;
+    case AVT_MAX_HEADER_LEN:
+        avt_ldpc_decode_2784_2016(hdr + AVT_MIN_HEADER_LEN, iterations);
+        break;
+    default:
+        break;
+    }
+}
+
+void avt_packet_ldpc_encode_header(uint8_t *hdr, int hdr_size)
+{
+    avt_ldpc_encode_288_224(hdr);
+
+    switch (hdr_size) {
+    case AVT_MIN_HEADER_LEN*2:
+        avt_ldpc_encode_288_224(hdr + AVT_MIN_HEADER_LEN);
+        break;
+    case AVT_MAX_HEADER_LEN:
+        avt_ldpc_encode_2784_2016(hdr + AVT_MIN_HEADER_LEN);
+        break;
+    default:
+        break;
+    }
+}
+
+int64_t avt_packet_decode_header(void *log_ctx, AVTPktd *p)
+{
+    const enum AVTPktDescriptors desc = avt_packet_read_desc(p->hdr);
+    AVTBytestream bs = avt_bs_init(p->hdr, sizeof(p->hdr));
+
+    const AVTPktDesc *d = avt_pkt_desc_get(desc);
+    if (!d) {
+        avt_log(log_ctx, AVT_LOG_ERROR, "Unknown descriptor 0x%x received\n", desc);
+        return AVT_ERROR(ENOTSUP);
+    }
+
+    d->decode(&bs, &p->pkt);
+    p->hdr_len = d->hdr_size;
+
+    return d->payload_len(&p->pkt);
+}
+
+int avt_index_list_config(AVTIndexContext *ic, uint64_t nb_index_max)
+{
+    if (ic->nb_index_total)
+        return AVT_ERROR(EINVAL);
+
+    ic->nb_index_max = nb_index_max;
+
+    return 0;
+}
+
+int avt_index_list_add(AVTIndexContext *ic, const AVTIndexEntry *e, avt_pos pos)
+{
+    auto dst = ic->nb_index;
+    if (ic->nb_index_max && ic->nb_index >= ic->nb_index_max) {
+        dst = ic->nb_index_total % ic->nb_index_max;
+    } else if ((ic->nb_index + 1) > ic->nb_alloc_index) {
+        const int new_alloc = (ic->nb_alloc_index << 1) + 1;
+        AVTIndexEntry *tmp = avt_reallocarray(ic->index, new_alloc,
+                                              sizeof(*tmp));
+        if (!tmp)
+            return AVT_ERROR(ENOMEM);
+        ic->index = tmp;
+
+        avt_pos *tmp_pos = avt_reallocarray(ic->index_pos, new_alloc,
+                                            sizeof(*tmp_pos));
+        if (!tmp_pos)
+            return AVT_ERROR(ENOMEM);
+        ic->index_pos = tmp_pos;
+
+        ic->nb_alloc_index = new_alloc;
+    }
+
+    if (dst == ic->nb_index)
+        ic->nb_index++;
+
+    ic->index[dst] = *e;
+    ic->index_pos[dst] = pos;
+    ic->nb_index_total++;
+
+    return 0;
+}
+
+/* Entries are kept in a ring once the limit is reached */
+static inline int index_phys(AVTIndexContext *ic, int idx)
+{
+    if (ic->nb_index_total <= ic->nb_index)
+        return idx;
+    return (ic->nb_index_total + idx) % ic->nb_index;
+}
+
+/* Index of the first entry with a pts after the given one */
+static int index_upper_bound(AVTIndexContext *ic, int64_t pts)
+{
+    /* Entries are in file order, so their timestamps only ever increase */
+    int lo = 0, hi = ic->nb_index;
+    while (lo < hi) {
+        const int mid = lo + ((hi - lo) >> 1);
+        if (ic->index[index_phys(ic, mid)].pts <= pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static inline void index_move(AVTIndexContext *ic, int dst, int src)
+{
+    ic->index[index_phys(ic, dst)] = ic->index[index_phys(ic, src)];
+    ic->index_pos[index_phys(ic, dst)] = ic->index_pos[index_phys(ic, src)];
+}
+
+/* Insert an entry which may be older than the newest one */
+static int index_list_insert(AVTIndexContext *ic, const AVTIndexEntry *e,
+                             avt_pos pos)
+{
+    int err;
+    int dst = index_upper_bound(ic, e->pts);
+
+    if (!ic->nb_index_max || ic->nb_index < ic->nb_index_max) {
+        /* Append, then move into place */
+        err = avt_index_list_add(ic, e, pos);
+        if (err < 0)
+            return err;
+        for (int i = ic->nb_index - 1; i > dst; i--)
+            index_move(ic, i, i - 1);
+    } else {
+        /* The ring is full, so the oldest entry makes way */
+        if (!dst)
+            return 0;
+        for (int i = 0; i < (dst - 1); i++)
+            index_move(ic, i, i + 1);
+        dst--;
+    }
+
+    ic->index[index_phys(ic, dst)] = *e;
+    ic->index_pos[index_phys(ic, dst)] = pos;
+
+    return 0;
+}
+
 int avt_index_list_parse(AVTIndexContext *ic, AVTBytestream *bs,
-                         AVTStreamIndex *pkt)
+                         AVTStreamIndex *pkt, avt_pos pos)
 {
+    int err;
+
+    /* Note down the packet, unless already parsed */
+    int lo = 0, hi = ic->nb_parsed;
+    while (lo < hi) {
+        const int mid = lo + ((hi - lo) >> 1);
+        if (ic->parsed[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < ic->nb_parsed && ic->parsed[lo] == pos)
+        return 0;
+
+    if (ic->nb_parsed == ic->nb_alloc_parsed) {
+        const int new_alloc = (ic->nb_alloc_parsed << 1) + 1;
+        avt_pos *tmp = avt_reallocarray(ic->parsed, new_alloc, sizeof(*tmp));
+        if (!tmp)
+            return AVT_ERROR(ENOMEM);
+        ic->parsed = tmp;
+        ic->nb_alloc_parsed = new_alloc;
+    }
+    memmove(&ic->parsed[lo + 1], &ic->parsed[lo],
+            (ic->nb_parsed - lo)*sizeof(*ic->parsed));
+    ic->parsed[lo] = pos;
+    ic->nb_parsed++;
+
+    /* Packets after all others only ever add newer entries */
+    const bool newest = lo == (ic->nb_parsed - 1);
+
     for (auto i = 0; i < pkt->nb_indices; i++) {
-        auto dst = ic->nb_index;
-        if (ic->nb_index >= ic->nb_index_max) {
-            dst = ic->nb_index_total % ic->nb_index_max;
-        } else if ((ic->nb_index + 1) > ic->nb_alloc_index) {
-            AVTIndexEntry *tmp = avt_reallocarray(ic->index,
-                                                  ic->nb_alloc_index + 1,
-                                                  sizeof(*tmp));
-            if (!tmp)
-                return AVT_ERROR(ENOMEM);
-
-            ic->index = tmp;
-            ic->nb_index++;
-            ic->nb_alloc_index++;
-        }
+        AVTIndexEntry e;
+        avt_decode_index_entry(bs, &e);
 
-        avt_decode_index_entry(bs, &ic->index[dst]);
-        ic->nb_index_total++;
+        const avt_pos e_pos = e.pkt_offset ? pos + e.pkt_offset : -1;
+        if (newest)
+            err = avt_index_list_add(ic, &e, e_pos);
+        else
+            err = index_list_insert(ic, &e, e_pos);
+        if (err < 0)
+            return err;
     }
 
     return 0;
 }
+
+int avt_index_list_find(AVTIndexContext *ic, int64_t pts,
+                        AVTIndexEntry *e, avt_pos *pos)
+{
+    const int lo = index_upper_bound(ic, pts);
+
+    /* Skip over entries without an offset */
+    for (int i = lo - 1; i >= 0; i--) {
+        const int idx = index_phys(ic, i);
+        if (ic->index_pos[idx] >= 0) {
+            *e = ic->index[idx];
+            *pos = ic->index_pos[idx];
+            return 0;
+        }
+    }
+
+    return AVT_ERROR(ENOENT);
+}
+
+void avt_index_list_free(AVTIndexContext *ic)
+{
+    free(ic->index);
+    free(ic->index_pos);
+    free(ic->parsed);
+    memset(ic, 0, sizeof(*ic));
+}
@@ -33,8 +33,20 @@
 
 typedef struct AVTProtocolOpts {
     int ldpc_iterations;
+
+    /* Do not write index packets, for outputs whose layout is
+     * tracked by the caller */
+    bool no_index;
+
+    /* Keep indices built by scanning unindexed files in <path>.idx */
+    bool index_cache;
 } AVTProtocolOpts;
 
+/* Given a packet with a decoded header, set p->pl to the location its
+ * payload should be received to. Returns a negative error if the payload
+ * has no known destination, and must be received into a new buffer. */
+typedef int (*AVTPlacementCb)(void *opaque, AVTPktd *p);
+
 /* High level interface */
 typedef struct AVTProtocolCtx AVTProtocolCtx;
 typedef struct AVTProtocol {
@@ -66,9 +78,22 @@ typedef struct AVTProtocol {
                          union AVTPacketData pkt, AVTBuffer *pl,
                          void **series, int64_t pos);
 
-    /* Receive a packet. Returns offset after reading. */
+    /* Receive packets into the FIFO. Returns the number of packets
+     * appended, or a negative error. */
     int (*receive)(AVTProtocolCtx *s, AVTPacketFifo *fifo, int64_t timeout);
 
+    /* Returns the time in nanoseconds at which receive() must be called,
+     * regardless of I/O readiness. 0 if data is already buffered,
+     * INT64_MAX if there is no such deadline. NULL if never needed. */
+    int64_t (*get_deadline)(AVTProtocolCtx *s);
+
+    /* Returns the smoothed round-trip time to the receiver in nanoseconds,
+     * 0 if not measured yet. NULL if never measured. */
+    int64_t (*get_rtt)(AVTProtocolCtx *s);
+
+    /* Set a callback to receive payloads in place. NULL if unsupported. */
+    int (*set_placement)(AVTProtocolCtx *s, AVTPlacementCb cb, void *opaque);
+
     /* Seek to a place in the stream */
     int (*seek)(AVTProtocolCtx *p, int64_t off, uint32_t seq,
                 int64_t ts, bool ts_is_dts);
@@ -87,14 +112,47 @@ COLD int avt_protocol_init(AVTContext *ctx, const AVTProtocol **_p,
 
 typedef struct AVTIndexContext {
     AVTIndexEntry *index;
+    avt_pos *index_pos; /* Absolute position of each entry's packet */
     int nb_index;
     int nb_alloc_index;
     uint64_t nb_index_total;
-    uint64_t nb_index_max;
+    uint64_t nb_index_max; /* Zero means unlimited */
+
+    /* Positions of all index packets parsed, in ascending order */
+    avt_pos *parsed;
+    int nb_parsed;
+    int nb_alloc_parsed;
 } AVTIndexContext;
 
+/* Run error correction over an encoded header of hdr_size bytes */
+void avt_packet_ldpc_decode_header(uint8_t *hdr, int hdr_size, int iterations);
+
+/* Recompute the FEC of a header of hdr_size bytes */
+void avt_packet_ldpc_encode_header(uint8_t *hdr, int hdr_size);
+
+/* Decode the header in p->hdr into p->pkt, and set p->hdr_len.
+ * Returns the length of the payload following the header, or a negative
+ * error for unknown packets. */
+int64_t avt_packet_decode_header(void *log_ctx, AVTPktd *p);
+
 int avt_index_list_config(AVTIndexContext *ic, uint64_t nb_index_max);
+
+/* Append a single entry, for a packet located at pos (-1 if unknown) */
+int avt_index_list_add(AVTIndexContext *ic, const AVTIndexEntry *e, avt_pos pos);
+
+/* Parse the entries of an index packet located at pos.
+ * Index packets which were already parsed are skipped, so indices
+ * may be loaded up front, and encountered again while reading.
+ * Index packets may be parsed in any order. Entries from packets before
+ * the last one parsed are inserted in timestamp order. */
 int avt_index_list_parse(AVTIndexContext *ic, AVTBytestream *bs,
-                         AVTStreamIndex *pkt);
+                         AVTStreamIndex *pkt, avt_pos pos);
+
+/* Find the last entry with a pts at or before the given one.
+ * Returns AVT_ERROR(ENOENT) if there's none. */
+int avt_index_list_find(AVTIndexContext *ic, int64_t pts,
+                        AVTIndexEntry *e, avt_pos *pos);
+
+void avt_index_list_free(AVTIndexContext *ic);
 
 #endif /* AVTRANSPORT_PROTOCOL_COMMON */
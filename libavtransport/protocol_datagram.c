@@ -27,20 +27,84 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <inttypes.h>
 
 #include <avtransport/avtransport.h>
 #include "protocol_common.h"
 #include "io_common.h"
+#include "utils_packet.h"
+
+/* Maximum number of datagrams read in a single call */
+#define DATAGRAM_RECV_BATCH 64
+
+/* Largest possible datagram */
+#define DATAGRAM_MAX_SIZE UINT16_MAX
+
+/* The path MTU includes the IPv6 and UDP headers */
+#define DATAGRAM_IP_HDR_SIZE (40 + 8)
+
+/* Descriptor bit of packets sent back from a receiver */
+#define DATAGRAM_REVERSE_BIT 0x8000
+
+/* Path MTU discovery. Probes are session start packets padded up to the
+ * size being probed, which receivers echo back as reverse signalling.
+ * The search starts from the minimum IPv6 MTU. Once done, the found MTU
+ * is periodically confirmed, and if it stops being, the search restarts
+ * from the base, as the path has turned into a black hole for it. */
+#define DATAGRAM_PMTUD_BASE    1280
+#define DATAGRAM_PMTUD_STEP    16
+#define DATAGRAM_PMTUD_PROBES  3
+#define DATAGRAM_PMTUD_TIMEOUT (1000LL * 1000 * 1000)
+#define DATAGRAM_PMTUD_CONFIRM (5LL * 1000 * 1000 * 1000)
+#define DATAGRAM_PMTUD_RAISE   (600LL * 1000 * 1000 * 1000)
 
 struct AVTProtocolCtx {
     const AVTIO *io;
     AVTIOCtx *io_ctx;
     AVTProtocolOpts opts;
+
+    /* Datagrams get received here first, if the I/O cannot split them */
+    AVTBuffer rx_buf;
+
+    /* Pool of datagram-sized slots, for I/Os which can receive batches.
+     * Slots are reused, unless their datagram's payload was handed out,
+     * in which case the slot is given up to it, and replaced. */
+    uint8_t *rx_slot[DATAGRAM_RECV_BATCH];
+    size_t rx_len[DATAGRAM_RECV_BATCH];
+
+    /* Payload placement */
+    AVTPlacementCb place_cb;
+    void *place_opaque;
+
+    /* Path MTU discovery, all sizes include the IP header */
+    struct {
+        size_t max;       /* Largest MTU searched for, 0 if disabled */
+        size_t cur;       /* Largest confirmed MTU */
+        size_t hi;        /* Upper bound of the current search */
+        size_t probe;     /* MTU of the outstanding probe, 0 if none */
+        bool confirm;     /* Outstanding probe confirms cur */
+        int nb_lost;
+        uint64_t seq;     /* Sequence number of the outstanding probe */
+        int64_t deadline; /* When to send the next probe */
+        int64_t raise;    /* When to search above cur again, 0 if searching */
+        int64_t sent;     /* When the outstanding probe was sent */
+        int64_t rtt;      /* Smoothed round-trip time of acknowledged probes */
+
+        /* Probe template, taken from the session start packet */
+        AVTPktd pkt;
+        bool have_pkt;
+        AVTBuffer pad;
+    } pmtud;
 };
 
 static COLD int datagram_proto_close(AVTProtocolCtx **p)
 {
     AVTProtocolCtx *priv = *p;
+    avt_buffer_quick_unref(&priv->pmtud.pad);
+    avt_buffer_quick_unref(&priv->rx_buf);
+    for (auto i = 0; i < DATAGRAM_RECV_BATCH; i++)
+        free(priv->rx_slot[i]);
     free(priv);
     *p = NULL;
     return 0;
@@ -49,7 +113,7 @@ static COLD int datagram_proto_close(AVTProtocolCtx **p)
 static COLD int datagram_proto_init(AVTContext *ctx, AVTProtocolCtx **_p, AVTAddress *addr,
                                     const AVTIO *io, AVTIOCtx *io_ctx, AVTProtocolOpts *opts)
 {
-    AVTProtocolCtx *p = malloc(sizeof(*p));
+    AVTProtocolCtx *p = calloc(1, sizeof(*p));
     if (!p)
         return AVT_ERROR(ENOMEM);
 
@@ -57,6 +121,20 @@ static COLD int datagram_proto_init(AVTContext *ctx, AVTProtocolCtx **_p, AVTAdd
     p->io_ctx = io_ctx;
     p->opts = *opts;
 
+    if (addr->opts.pmtud) {
+        p->pmtud.max = AVT_MAX(addr->opts.pmtud, DATAGRAM_PMTUD_BASE);
+        p->pmtud.cur = DATAGRAM_PMTUD_BASE;
+        p->pmtud.hi = p->pmtud.max;
+
+        size_t pad_len = p->pmtud.max - DATAGRAM_IP_HDR_SIZE;
+        uint8_t *pad = avt_buffer_quick_alloc(&p->pmtud.pad, pad_len);
+        if (!pad) {
+            free(p);
+            return AVT_ERROR(ENOMEM);
+        }
+        memset(pad, 0, pad_len);
+    }
+
     *_p = p;
 
     return 0;
@@ -76,50 +154,455 @@ static int datagram_proto_rm_dst(AVTProtocolCtx *p, AVTAddress *addr)
     return p->io->del_dst(p->io_ctx, addr);
 }
 
+/* Restart the search from the base, as cur no longer gets through */
+static void datagram_pmtud_reset(AVTProtocolCtx *p, const char *reason)
+{
+    if (p->pmtud.cur > DATAGRAM_PMTUD_BASE)
+        avt_log(p, AVT_LOG_WARN, "Path MTU of %zu %s, falling back to %i\n",
+                p->pmtud.cur, reason, DATAGRAM_PMTUD_BASE);
+
+    p->pmtud.cur = DATAGRAM_PMTUD_BASE;
+    p->pmtud.hi = p->pmtud.max;
+    p->pmtud.raise = 0;
+    p->pmtud.probe = 0;
+    p->pmtud.confirm = false;
+    p->pmtud.nb_lost = 0;
+    p->pmtud.deadline = 0;
+}
+
+/* Send a probe for the next MTU to test, if it's time */
+static int datagram_pmtud_probe(AVTProtocolCtx *p)
+{
+    const int64_t now = avt_get_time_ns();
+    if (!p->pmtud.have_pkt || now < p->pmtud.deadline)
+        return 0;
+
+    size_t size = p->pmtud.probe;
+    if (size && ++p->pmtud.nb_lost >= DATAGRAM_PMTUD_PROBES) {
+        if (p->pmtud.confirm) {
+            datagram_pmtud_reset(p, "no longer confirmed");
+        } else {
+            avt_log(p, AVT_LOG_DEBUG, "Path MTU probe of %zu lost\n", size);
+            p->pmtud.hi = size - 1;
+        }
+        size = 0;
+    }
+
+    if (!size) {
+        p->pmtud.nb_lost = 0;
+        p->pmtud.probe = 0;
+        p->pmtud.confirm = false;
+
+        /* Search done, try raising again later */
+        if ((p->pmtud.hi - p->pmtud.cur) < DATAGRAM_PMTUD_STEP) {
+            if (!p->pmtud.raise) {
+                p->pmtud.raise = now + DATAGRAM_PMTUD_RAISE;
+            } else if (now >= p->pmtud.raise) {
+                p->pmtud.hi = p->pmtud.max;
+                p->pmtud.raise = 0;
+            }
+        }
+
+        /* Nothing left to search, keep confirming what was found */
+        if ((p->pmtud.hi - p->pmtud.cur) < DATAGRAM_PMTUD_STEP) {
+            size = p->pmtud.cur;
+            p->pmtud.confirm = true;
+        } else {
+            size = p->pmtud.cur + (p->pmtud.hi - p->pmtud.cur + 1)/2;
+        }
+    }
+
+    AVTPktd *probe = &p->pmtud.pkt;
+    probe->pkt.seq = ++p->pmtud.seq;
+    avt_packet_encode_header(probe);
+    avt_buffer_quick_ref(&probe->pl, &p->pmtud.pad, 0,
+                         size - DATAGRAM_IP_HDR_SIZE - probe->hdr_len);
+
+    p->pmtud.probe = size;
+    p->pmtud.sent = now;
+    p->pmtud.deadline = now + DATAGRAM_PMTUD_TIMEOUT;
+
+    int64_t ret = p->io->write_probe ? p->io->write_probe(p->io_ctx, probe, 0) :
+                                       p->io->write_pkt(p->io_ctx, probe, 0);
+    avt_buffer_quick_unref(&probe->pl);
+    if (ret == AVT_ERROR(EMSGSIZE)) {
+        /* Larger than the interface's MTU */
+        if (p->pmtud.confirm) {
+            datagram_pmtud_reset(p, "exceeds the interface's");
+        } else {
+            p->pmtud.nb_lost = DATAGRAM_PMTUD_PROBES;
+            p->pmtud.deadline = now;
+        }
+    } else if (ret < 0 && ret != AVT_ERROR(EAGAIN)) {
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Probes are built from the first session start packet sent */
+static int datagram_pmtud_send(AVTProtocolCtx *p, AVTPktd *pkt, int nb_pkt)
+{
+    if (!p->pmtud.max)
+        return 0;
+
+    for (auto i = 0; i < nb_pkt && !p->pmtud.have_pkt; i++) {
+        if (pkt[i].pkt.desc != AVT_PKT_SESSION_START)
+            continue;
+
+        p->pmtud.pkt.pkt = pkt[i].pkt;
+        p->pmtud.pkt.pkt.session_start.session_flags |= AVT_SESSION_REVERSE_SIGNAL_READY;
+        p->pmtud.have_pkt = true;
+    }
+
+    return datagram_pmtud_probe(p);
+}
+
+/* Regular packets are never sent past the system's path MTU estimate.
+ * If that fell below what was confirmed, so must the packet size. */
+static int datagram_pmtud_send_err(AVTProtocolCtx *p, int64_t err)
+{
+    if (err == AVT_ERROR(EMSGSIZE) && p->pmtud.max)
+        datagram_pmtud_reset(p, "exceeds the system's estimate");
+    return err;
+}
+
 static int datagram_proto_send_packet(AVTProtocolCtx *p, AVTPktd *pkt,
                                       int64_t timeout)
 {
-    int64_t ret = p->io->write_pkt(p->io_ctx, pkt, timeout);
+    int64_t ret = datagram_pmtud_send(p, pkt, 1);
     if (ret < 0)
         return ret;
+
+    ret = p->io->write_pkt(p->io_ctx, pkt, timeout);
+    if (ret < 0)
+        return datagram_pmtud_send_err(p, ret);
     return 0;
 }
 
 static int datagram_proto_send_seq(AVTProtocolCtx *p, AVTPacketFifo *seq,
                                    int64_t timeout)
 {
-    int64_t ret = p->io->write_vec(p->io_ctx, seq->data, seq->nb, timeout);
+    int64_t ret = datagram_pmtud_send(p, seq->data, seq->nb);
     if (ret < 0)
         return ret;
+
+    ret = p->io->write_vec(p->io_ctx, seq->data, seq->nb, timeout);
+    if (ret < 0)
+        return datagram_pmtud_send_err(p, ret);
     return 0;
 }
 
+/* Handle path MTU probes, and their acknowledgements.
+ * idx is the index of the datagram in its batch, for replies.
+ * Returns 1 if the datagram, of len bytes, was consumed. */
+static int datagram_pmtud_recv(AVTProtocolCtx *s, AVTPktd *p,
+                               size_t len, int idx, bool reverse)
+{
+    if (p->pkt.desc != AVT_PKT_SESSION_START ||
+        !(p->pkt.session_start.session_flags & AVT_SESSION_REVERSE_SIGNAL_READY))
+        return 0;
+
+    if (reverse) {
+        if (s->pmtud.probe && p->pkt.seq == s->pmtud.seq) {
+            const int64_t now = avt_get_time_ns();
+            avt_log(s, s->pmtud.confirm ? AVT_LOG_DEBUG : AVT_LOG_VERBOSE,
+                    "Path MTU of %zu confirmed\n", s->pmtud.probe);
+            s->pmtud.cur = s->pmtud.probe;
+            s->pmtud.probe = 0;
+            s->pmtud.nb_lost = 0;
+
+            /* Every probe has its own sequence number, so resent ones
+             * are never mistaken for the original */
+            const int64_t rtt = now - s->pmtud.sent;
+            s->pmtud.rtt = !s->pmtud.rtt ? rtt : s->pmtud.rtt + (rtt - s->pmtud.rtt)/8;
+
+            /* The search goes on right away, confirmations are spaced out */
+            s->pmtud.deadline = s->pmtud.confirm ? now + DATAGRAM_PMTUD_CONFIRM : 0;
+            s->pmtud.confirm = false;
+        }
+        return 1;
+    }
+
+    /* Only padded session start packets are probes */
+    if (len <= p->hdr_len)
+        return 0;
+
+    /* Echo the header back */
+    AVTPktd ack = { .hdr_len = p->hdr_len };
+    memcpy(ack.hdr, p->hdr, p->hdr_len);
+    ack.hdr[0] |= DATAGRAM_REVERSE_BIT >> 8;
+
+    /* Listening sockets have no destination of their own */
+    int64_t ret = s->io->reply_pkt ? s->io->reply_pkt(s->io_ctx, &ack, idx, 0) :
+                                     s->io->write_pkt(s->io_ctx, &ack, 0);
+    if (ret < 0)
+        avt_log(s, AVT_LOG_DEBUG, "Unable to acknowledge probe: %" PRIi64 "\n", ret);
+
+    return 1;
+}
+
+/* Decode the header of a datagram of len bytes into p.
+ * Packets sent back from a receiver are decoded with their reverse
+ * signalling bit cleared, and flagged in reverse.
+ * Returns the payload size signalled. */
+static int64_t datagram_decode_hdr(AVTProtocolCtx *s, AVTPktd *p,
+                                   const uint8_t *data, size_t len,
+                                   bool *reverse)
+{
+    uint8_t desc[2];
+
+    if (len < AVT_MIN_HEADER_LEN)
+        return AVT_ERROR(EBADMSG);
+
+    *reverse = AVT_RB16(data) & DATAGRAM_REVERSE_BIT;
+    AVT_WB16(desc, AVT_RB16(data) & ~DATAGRAM_REVERSE_BIT);
+
+    const int hdr_size = avt_packet_hdr_size(avt_packet_read_desc(desc));
+    if (!hdr_size || len < hdr_size)
+        return AVT_ERROR(EBADMSG);
+
+    memcpy(p->hdr, data, hdr_size);
+    memcpy(p->hdr, desc, sizeof(desc));
+    avt_packet_ldpc_decode_header(p->hdr, hdr_size, s->opts.ldpc_iterations);
+
+    int64_t pl_len = avt_packet_decode_header(s, p);
+    if (pl_len < 0)
+        return AVT_ERROR(EBADMSG);
+
+    return pl_len;
+}
+
+/* Receive one datagram into p, and decode its header */
+static int datagram_receive_pkt(AVTProtocolCtx *s, AVTPktd *p, int64_t timeout)
+{
+    int64_t err;
+    AVTBuffer *rb = &s->rx_buf;
+
+    avt_buffer_resize(rb, DATAGRAM_MAX_SIZE);
+    err = s->io->read_input(s->io_ctx, rb, DATAGRAM_MAX_SIZE,
+                            timeout, AVT_IO_READ_MUTABLE);
+    if (err < 0)
+        return err;
+
+    size_t len;
+    uint8_t *data = avt_buffer_get_data(rb, &len);
+    if (!len)
+        return AVT_ERROR(EAGAIN);
+
+    bool reverse;
+    int64_t pl_len = datagram_decode_hdr(s, p, data, len, &reverse);
+    if (pl_len < 0)
+        return pl_len;
+    else if (datagram_pmtud_recv(s, p, len, 0, reverse))
+        return 1;
+    else if (reverse)
+        return AVT_ERROR(EBADMSG);
+
+    if (pl_len > (len - p->hdr_len)) {
+        avt_log(s, AVT_LOG_DEBUG, "Truncated packet received: %" PRIi64
+                                  " bytes signalled, %zu received\n",
+                pl_len, len - p->hdr_len);
+        return AVT_ERROR(EBADMSG);
+    }
+
+    if (!pl_len)
+        return 0;
+
+    // TODO: pool buffer
+    uint8_t *pl = avt_buffer_quick_alloc(&p->pl, pl_len);
+    if (!pl)
+        return AVT_ERROR(ENOMEM);
+
+    memcpy(pl, data + p->hdr_len, pl_len);
+
+    return 0;
+}
+
+/* Take datagram idx of the last batch received into p.
+ * Segments which can be placed are copied straight to their destination,
+ * while still in cache. Otherwise, the payload is not copied, but takes
+ * over the datagram's slot. */
+static int datagram_take_pkt(AVTProtocolCtx *s, AVTPktd *p, int idx)
+{
+    uint8_t *data = s->rx_slot[idx];
+    size_t len = s->rx_len[idx];
+
+    bool reverse;
+    int64_t pl_len = datagram_decode_hdr(s, p, data, len, &reverse);
+    if (pl_len < 0)
+        return pl_len;
+    else if (datagram_pmtud_recv(s, p, len, idx, reverse))
+        return 1;
+    else if (reverse)
+        return AVT_ERROR(EBADMSG);
+
+    if (pl_len > (len - p->hdr_len)) {
+        avt_log(s, AVT_LOG_DEBUG, "Truncated packet received: %" PRIi64
+                                  " bytes signalled, %zu received\n",
+                pl_len, len - p->hdr_len);
+        return AVT_ERROR(EBADMSG);
+    }
+
+    if (!pl_len)
+        return 0;
+
+    if (s->place_cb && s->place_cb(s->place_opaque, p) >= 0) {
+        memcpy(avt_buffer_get_data(&p->pl, NULL), data + p->hdr_len, pl_len);
+        return 0;
+    }
+
+    /* Shrinking is done in place, and gives back the unused space */
+    uint8_t *tmp = realloc(data, len);
+    if (tmp)
+        s->rx_slot[idx] = data = tmp;
+
+    AVTBuffer slot;
+    int err = avt_buffer_quick_create(&slot, data, len, NULL,
+                                      avt_buffer_default_free, 0);
+    if (err < 0)
+        return err;
+    s->rx_slot[idx] = NULL;
+
+    avt_buffer_quick_ref(&p->pl, &slot, p->hdr_len, pl_len);
+    avt_buffer_quick_unref(&slot);
+
+    return 0;
+}
+
+/* Receive a batch of datagrams in one go */
+static int datagram_receive_batch(AVTProtocolCtx *s, AVTPacketFifo *fifo,
+                                  int64_t timeout)
+{
+    int err;
+    int nb_pkts = 0;
+
+    for (auto i = 0; i < DATAGRAM_RECV_BATCH; i++) {
+        if (!s->rx_slot[i] && !(s->rx_slot[i] = malloc(DATAGRAM_MAX_SIZE)))
+            return AVT_ERROR(ENOMEM);
+    }
+
+    int nb = s->io->read_dgrams(s->io_ctx, s->rx_slot, s->rx_len,
+                                DATAGRAM_RECV_BATCH, DATAGRAM_MAX_SIZE, timeout);
+    if (nb < 0)
+        return nb;
+
+    for (auto i = 0; i < nb; i++) {
+        AVTPktd *p = avt_pkt_fifo_push_new(fifo, NULL, 0, 0);
+        if (!p)
+            return nb_pkts ? nb_pkts : AVT_ERROR(ENOMEM);
+
+        p->hdr_off = 0;
+        p->pl_has_hash = false;
+
+        err = datagram_take_pkt(s, p, i);
+        if (err) {
+            avt_buffer_quick_unref(&p->pl);
+            fifo->nb--;
+
+            /* Control, corrupt or foreign packets are simply skipped */
+            if (err > 0 || err == AVT_ERROR(EBADMSG))
+                continue;
+            return nb_pkts ? nb_pkts : err;
+        }
+
+        nb_pkts++;
+    }
+
+    return nb_pkts;
+}
+
 static int datagram_proto_receive(AVTProtocolCtx *s, AVTPacketFifo *fifo,
                                   int64_t timeout)
 {
+    int err;
+    int nb_pkts = 0;
+
+    /* Probes are also due when nothing is being sent */
+    err = datagram_pmtud_probe(s);
+    if (err < 0)
+        return err;
+
+    if (s->io->read_dgrams)
+        return datagram_receive_batch(s, fifo, timeout);
+
+    if (!avt_buffer_get_refcount(&s->rx_buf) &&
+        !avt_buffer_quick_alloc(&s->rx_buf, DATAGRAM_MAX_SIZE))
+        return AVT_ERROR(ENOMEM);
+
+    /* Only wait for the first packet, then drain whatever is queued */
+    for (auto i = 0; i < DATAGRAM_RECV_BATCH; i++) {
+        AVTPktd *p = avt_pkt_fifo_push_new(fifo, NULL, 0, 0);
+        if (!p)
+            return AVT_ERROR(ENOMEM);
+
+        p->hdr_off = 0;
+        p->pl_has_hash = false;
 
+        err = datagram_receive_pkt(s, p, nb_pkts ? 0 : timeout);
+        if (err) {
+            avt_buffer_quick_unref(&p->pl);
+            fifo->nb--;
+
+            /* Control, corrupt or foreign packets are simply skipped */
+            if (err > 0 || err == AVT_ERROR(EBADMSG))
+                continue;
+            else if (nb_pkts)
+                break;
+            return err;
+        }
+
+        nb_pkts++;
+    }
+
+    return nb_pkts;
+}
+
+static int64_t datagram_proto_get_deadline(AVTProtocolCtx *s)
+{
+    if (!s->pmtud.max || !s->pmtud.have_pkt)
+        return INT64_MAX;
+    return s->pmtud.deadline;
+}
+
+static int64_t datagram_proto_get_rtt(AVTProtocolCtx *s)
+{
+    return s->pmtud.rtt;
+}
+
+static int datagram_proto_set_placement(AVTProtocolCtx *s,
+                                        AVTPlacementCb cb, void *opaque)
+{
+    s->place_cb = cb;
+    s->place_opaque = opaque;
     return 0;
 }
 
 static int datagram_proto_max_pkt_len(AVTProtocolCtx *p, size_t *mtu)
 {
     size_t tmp;
-    const size_t udp_hdr_size = 8;
+
+    /* Only what was confirmed by a probe is safe */
+    if (p->pmtud.max) {
+        *mtu = p->pmtud.cur - DATAGRAM_IP_HDR_SIZE;
+        return 0;
+    }
 
     int ret = p->io->get_max_pkt_len(p->io_ctx, &tmp);
-    if (ret < 0 || (tmp < (AVT_MIN_HEADER_LEN - udp_hdr_size)))
+    if (ret < 0 || (tmp < (AVT_MIN_HEADER_LEN + DATAGRAM_IP_HDR_SIZE)))
         return ret;
 
-    *mtu = tmp - udp_hdr_size;
+    *mtu = tmp - DATAGRAM_IP_HDR_SIZE;
 
     return 0;
 }
 
 static int datagram_proto_flush(AVTProtocolCtx *p, int64_t timeout)
 {
+    /* Datagrams are sent as soon as they're written */
     if (p->io->flush)
         return p->io->flush(p->io_ctx, timeout);
-    return AVT_ERROR(ENOTSUP);
+    return 0;
 }
 
 const AVTProtocol avt_protocol_datagram = {
@@ -133,6 +616,9 @@ const AVTProtocol avt_protocol_datagram = {
     .send_seq = datagram_proto_send_seq,
     .update_packet = NULL,
     .receive = datagram_proto_receive,
+    .get_deadline = datagram_proto_get_deadline,
+    .get_rtt = datagram_proto_get_rtt,
+    .set_placement = datagram_proto_set_placement,
     .seek = NULL,
     .flush = datagram_proto_flush,
     .close = datagram_proto_close,
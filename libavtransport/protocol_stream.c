@@ -27,25 +27,108 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <inttypes.h>
 
 #include <avtransport/avtransport.h>
+#include "packet_encode.h"
 #include "packet_decode.h"
 #include "protocol_common.h"
 #include "io_common.h"
 #include "bytestream.h"
 #include "ldpc_decode.h"
+#include "utils_packet.h"
+#include "mem.h"
+#include "stream_scan.h"
+
+/* Maximum number of packets read in a single call */
+#define STREAM_RECV_BATCH 64
+
+/* Index packets are written once they have this many entries, */
+#define STREAM_INDEX_ENTRIES 256
+/* or once their oldest entry is this many bytes behind */
+#define STREAM_INDEX_INTERVAL (16*1024*1024)
+
+/* Maximum amount of data read while searching for the first index packet */
+#define STREAM_INDEX_SEARCH (4*STREAM_INDEX_INTERVAL)
+
+/* Appended to the path of files to get their index cache */
+#define STREAM_INDEX_CACHE_EXT ".idx"
+
+/* Amount of data read at once while searching for a valid header */
+#define STREAM_RESYNC_CHUNK (64*1024)
+
+/* Size of the input buffer, for I/Os which do not reference their data */
+#define STREAM_READ_AHEAD (4*1024*1024)
+
+typedef struct StreamTimebase {
+    uint16_t stream_id;
+    AVTRational tb;
+} StreamTimebase;
 
 struct AVTProtocolCtx {
+    AVTContext *ctx;
     const AVTIO *io;
     AVTIOCtx *io_ctx;
     AVTProtocolOpts opts;
 
     AVTIndexContext ic;
+    bool index_loaded;
+    avt_pos index_next; /* Position of the next index packet, if known */
+    avt_pos index_cur;  /* Position of the last index packet read */
+    char *index_cache; /* Sidecar file for indices built by scanning, if enabled */
+
+    /* Index generation, for outputs which can be rewritten */
+    bool gen_index;
+    AVTIndexEntry *widx;
+    avt_pos *widx_pos;
+    int nb_widx;
+    int widx_alloc;
+    avt_pos wpos;
+    uint64_t last_seq;
+
+    /* Last index packet written, to back-patch with the next one */
+    AVTPktd last_idx;
+    avt_pos last_idx_pos;
+    bool have_last_idx;
+
+    /* End of the last footer written, which points to the last index packet */
+    avt_pos footer_end;
+
+    /* Timebases of registered streams, as index timestamps are in nanoseconds */
+    StreamTimebase *tbs;
+    int nb_tbs;
+
+    /* Input buffer. Headers are parsed in place, and payloads are
+     * handed out as references, unless the I/O can do that itself. */
+    AVTBuffer ra;
+    size_t ra_size;
+    size_t ra_start; /* Start of unconsumed data */
+    size_t ra_end;   /* End of buffered data */
+    avt_pos ra_pos;  /* Position of the first unconsumed byte */
+    bool read_ahead;
+    bool ra_pending; /* A receive batch ended with data still buffered */
+
+    uint8_t raw_hdr[AVT_MAX_HEADER_LEN]; /* Before error correction */
+
+    /* Resynchronization statistics */
+    uint64_t nb_resyncs;
+    uint64_t resync_bytes;
+
+    /* Payload placement */
+    AVTPlacementCb place_cb;
+    void *place_opaque;
 };
 
 static COLD int stream_proto_close(AVTProtocolCtx **_p)
 {
     AVTProtocolCtx *p = *_p;
+    avt_index_list_free(&p->ic);
+    avt_buffer_quick_unref(&p->ra);
+    free(p->index_cache);
+    free(p->widx);
+    free(p->widx_pos);
+    free(p->tbs);
     free(p);
     *_p = NULL;
     return 0;
@@ -54,14 +137,36 @@ static COLD int stream_proto_close(AVTProtocolCtx **_p)
 static COLD int stream_init(AVTContext *ctx, AVTProtocolCtx **_p, AVTAddress *addr,
                             const AVTIO *io, AVTIOCtx *io_ctx, AVTProtocolOpts *opts)
 {
-    AVTProtocolCtx *p = malloc(sizeof(*p));
+    AVTProtocolCtx *p = calloc(1, sizeof(*p));
     if (!p)
         return AVT_ERROR(ENOMEM);
 
+    p->ctx = ctx;
     p->io = io;
     p->io_ctx = io_ctx;
     p->opts = *opts;
 
+    if (opts->index_cache && addr->path) {
+        const size_t len = strlen((char *)addr->path);
+        p->index_cache = malloc(len + sizeof(STREAM_INDEX_CACHE_EXT));
+        if (!p->index_cache) {
+            free(p);
+            return AVT_ERROR(ENOMEM);
+        }
+        memcpy(p->index_cache, addr->path, len);
+        memcpy(&p->index_cache[len], STREAM_INDEX_CACHE_EXT,
+               sizeof(STREAM_INDEX_CACHE_EXT));
+    }
+
+    /* Indices are only useful, and can only be back-patched, in files */
+    p->gen_index = io->rewrite && io->seek && !opts->no_index;
+
+    /* Buffer input which the I/O can't reference, rather than issuing
+     * a read for every header and payload */
+    p->read_ahead = !io->read_ref;
+    p->ra_size = p->read_ahead ? STREAM_READ_AHEAD :
+                                 STREAM_RESYNC_CHUNK + AVT_MAX_HEADER_LEN;
+
     *_p = p;
 
     return 0;
@@ -81,191 +186,550 @@ static int stream_rm_dst(AVTProtocolCtx *p, AVTAddress *addr)
     return p->io->del_dst(p->io_ctx, addr);
 }
 
+static const AVTRational ns_tb = { 1, 1000000000 };
+
+static int stream_add_timebase(AVTProtocolCtx *s, AVTStreamRegistration *reg)
+{
+    for (auto i = 0; i < s->nb_tbs; i++) {
+        if (s->tbs[i].stream_id == reg->stream_id) {
+            s->tbs[i].tb = reg->timebase;
+            return 0;
+        }
+    }
+
+    StreamTimebase *tmp = avt_reallocarray(s->tbs, s->nb_tbs + 1, sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+
+    s->tbs = tmp;
+    s->tbs[s->nb_tbs++] = (StreamTimebase) {
+        .stream_id = reg->stream_id,
+        .tb = reg->timebase,
+    };
+
+    return 0;
+}
+
+static int stream_add_entry(AVTProtocolCtx *s, AVTIndexEntry e, avt_pos pos)
+{
+    if (s->nb_widx == s->widx_alloc) {
+        const int alloc = s->widx_alloc ? 2*s->widx_alloc : STREAM_INDEX_ENTRIES;
+
+        AVTIndexEntry *widx = avt_reallocarray(s->widx, alloc, sizeof(*widx));
+        if (!widx)
+            return AVT_ERROR(ENOMEM);
+        s->widx = widx;
+
+        avt_pos *widx_pos = avt_reallocarray(s->widx_pos, alloc, sizeof(*widx_pos));
+        if (!widx_pos)
+            return AVT_ERROR(ENOMEM);
+        s->widx_pos = widx_pos;
+
+        s->widx_alloc = alloc;
+    }
+
+    s->widx[s->nb_widx] = e;
+    s->widx_pos[s->nb_widx++] = pos;
+
+    return 0;
+}
+
+/* Write an index packet with all pending entries, and point the
+ * previous index packet to it. */
+static int stream_write_index(AVTProtocolCtx *s, int64_t timeout)
+{
+    avt_pos pos;
+    int64_t ret;
+    AVTPktd p = { };
+
+    /* The entry offsets are relative to the index packet, which gets
+     * written at the current end of the output. */
+    pos = s->wpos;
+
+    uint8_t *data = avt_buffer_quick_alloc(&p.pl, s->nb_widx*AVT_PKT_INDEX_ENTRY_SIZE);
+    if (!data)
+        return AVT_ERROR(ENOMEM);
+
+    AVTBytestream bs = avt_bs_init(data, s->nb_widx*AVT_PKT_INDEX_ENTRY_SIZE);
+    for (auto i = 0; i < s->nb_widx; i++) {
+        AVTIndexEntry e = s->widx[i];
+        const avt_pos off = s->widx_pos[i] - pos;
+
+        /* Writes are split up so that this only happens for packets
+         * larger than the offset's range, which cannot be seeked to */
+        e.pkt_offset = off;
+        if (off < INT32_MIN) {
+            avt_log(s->ctx, AVT_LOG_WARN, "Keyframe at %" PRIi64 " too far "
+                    "from its index packet, not indexing\n", s->widx_pos[i]);
+            e.pkt_offset = 0;
+        }
+        avt_encode_index_entry(&bs, e);
+    }
+
+    const avt_pos prev = pos - s->last_idx_pos;
+    p.pkt = AVT_STREAM_INDEX_HDR(
+        .global_seq = s->last_seq,
+        .stream_id = UINT16_MAX,
+        .prev_idx = (s->have_last_idx && prev <= UINT32_MAX) ? prev : 0,
+        .next_idx = 0,
+        .nb_indices = s->nb_widx,
+    );
+    avt_packet_encode_header(&p);
+
+    ret = s->io->write_pkt(s->io_ctx, &p, timeout);
+    avt_buffer_quick_unref(&p.pl);
+    if (ret < 0)
+        return ret;
+
+    /* Where the packet actually went, which the offsets must agree with */
+    if (ret != pos) {
+        avt_log(s->ctx, AVT_LOG_ERROR, "Index packet written at %" PRIi64
+                ", expected %" PRIi64 "\n", ret, pos);
+        return AVT_ERROR(EIO);
+    }
+
+    s->wpos = pos + p.hdr_len + s->nb_widx*AVT_PKT_INDEX_ENTRY_SIZE;
+    s->nb_widx = 0;
+
+    /* Back-patch the previous index packet's header */
+    if (s->have_last_idx && prev <= UINT32_MAX) {
+        s->last_idx.pkt.stream_index.next_idx = prev;
+        avt_packet_encode_header(&s->last_idx);
+        ret = s->io->rewrite(s->io_ctx, &s->last_idx, s->last_idx_pos, timeout);
+        if (ret < 0)
+            return ret;
+    }
+
+    s->last_idx = p;
+    s->last_idx_pos = pos;
+    s->have_last_idx = true;
+
+    return 0;
+}
+
+/* Note down keyframes in packets written at pos. The output only gets
+ * an index packet once the whole batch is written, as it can't go in
+ * between packets which are already out. */
+static int stream_index_pkts(AVTProtocolCtx *s, AVTPktd *pkts, uint32_t nb,
+                             avt_pos pos, int64_t timeout)
+{
+    int err;
+
+    for (auto i = 0; i < nb; i++) {
+        AVTPktd *p = &pkts[i];
+
+        if (p->pkt.desc == AVT_PKT_STREAM_REGISTRATION) {
+            err = stream_add_timebase(s, &p->pkt.stream_registration);
+            if (err < 0)
+                return err;
+        } else if (p->pkt.desc == AVT_PKT_STREAM_DATA &&
+                   p->pkt.stream_data.frame_type == AVT_FRAME_TYPE_KEY) {
+            for (auto j = 0; j < s->nb_tbs; j++) {
+                if (s->tbs[j].stream_id != p->pkt.stream_id)
+                    continue;
+
+                err = stream_add_entry(s, (AVTIndexEntry) {
+                    .index_entry_descriptor = AVT_PKT_STREAM_DATA,
+                    .pts = avt_rescale_rational(p->pkt.stream_data.pts,
+                                                s->tbs[j].tb, ns_tb),
+                    .target_seq = p->pkt.seq,
+                }, pos);
+                if (err < 0)
+                    return err;
+                break;
+            }
+        }
+
+        s->last_seq = p->pkt.seq;
+        pos += p->hdr_len + avt_buffer_get_data_len(&p->pl);
+    }
+
+    s->wpos = pos;
+
+    if (s->nb_widx >= STREAM_INDEX_ENTRIES ||
+        (s->nb_widx && (pos - s->widx_pos[0]) >= STREAM_INDEX_INTERVAL))
+        return stream_write_index(s, timeout);
+
+    return 0;
+}
+
 static int stream_proto_send_packet(AVTProtocolCtx *p, AVTPktd *pkt,
                                     int64_t timeout)
 {
-    int ret = p->io->write_pkt(p->io_ctx, pkt, timeout);
+    avt_pos ret = p->io->write_pkt(p->io_ctx, pkt, timeout);
     if (ret < 0)
         return ret;
+
+    if (p->gen_index)
+        return stream_index_pkts(p, pkt, 1, ret, timeout);
+
     return 0;
 }
 
 static int stream_send_seq(AVTProtocolCtx *p,
                            AVTPacketFifo *seq, int64_t timeout)
 {
-    int ret = p->io->write_vec(p->io_ctx, seq->data, seq->nb, timeout);
-    if (ret < 0)
-        return ret;
+    int err;
+    avt_pos ret;
+
+    if (!p->gen_index) {
+        ret = p->io->write_vec(p->io_ctx, seq->data, seq->nb, timeout);
+        return ret < 0 ? ret : 0;
+    }
+
+    /* Large sequences are written in parts, with index packets in between,
+     * so that entry offsets stay well within range */
+    uint32_t start = 0;
+    while (start < seq->nb) {
+        uint32_t nb = 0;
+        size_t len = 0;
+        while ((start + nb) < seq->nb && (!nb || len < STREAM_INDEX_INTERVAL)) {
+            AVTPktd *pkt = &seq->data[start + nb++];
+            len += pkt->hdr_len + avt_buffer_get_data_len(&pkt->pl);
+        }
+
+        ret = p->io->write_vec(p->io_ctx, &seq->data[start], nb, timeout);
+        if (ret < 0)
+            return ret;
+
+        err = stream_index_pkts(p, &seq->data[start], nb, ret, timeout);
+        if (err < 0)
+            return err;
+
+        start += nb;
+    }
+
     return 0;
 }
 
-static int stream_receive(AVTProtocolCtx *s, AVTPacketFifo *fifo,
-                          int64_t timeout)
+/* Make sure at least need bytes are buffered, reading up to want bytes at
+ * once if the buffer isn't used for read-ahead.
+ * Returns the number of bytes buffered, or a negative error. */
+static int64_t stream_fill(AVTProtocolCtx *s, size_t need, size_t want,
+                           int64_t timeout)
 {
-    int64_t err = 0;
-    AVTPktd *p = avt_pkt_fifo_push_new(fifo, NULL, 0, AVT_BUFFER_REF_ALL);
-    if (!p)
+    avt_pos ret;
+    AVTBuffer tmp = { };
+    size_t avail = s->ra_end - s->ra_start;
+
+    if (avail >= need)
+        return avail;
+
+    if (!s->ra.refcnt && !avt_buffer_quick_alloc(&s->ra, s->ra_size))
         return AVT_ERROR(ENOMEM);
 
-    AVTBuffer buf = {
-        .base_data = p->hdr,
-        .data = p->hdr,
-        .end_data = &p->hdr[sizeof(p->hdr)],
-        .len = sizeof(p->hdr),
-    };
+    /* Move what's left to the start. Payloads handed out may still
+     * reference the buffer, in which case a new one is needed. */
+    if ((s->ra_start + AVT_MAX(need, want)) > s->ra_size) {
+        uint8_t *data = avt_buffer_get_data(&s->ra, NULL);
+        if (avt_buffer_get_refcount(&s->ra) > 1) {
+            AVTBuffer ra = { };
+            uint8_t *new_data = avt_buffer_quick_alloc(&ra, s->ra_size);
+            if (!new_data)
+                return AVT_ERROR(ENOMEM);
+            memcpy(new_data, &data[s->ra_start], avail);
+            avt_buffer_quick_unref(&s->ra);
+            s->ra = ra;
+        } else {
+            memmove(data, &data[s->ra_start], avail);
+        }
+        s->ra_start = 0;
+        s->ra_end = avail;
+    }
+
+    while (avail < need) {
+        const size_t len = s->read_ahead ? s->ra_size - s->ra_end :
+                                           AVT_MAX(need, want) - avail;
+
+        avt_buffer_quick_ref(&tmp, &s->ra, s->ra_end, len);
+        ret = s->io->read_input(s->io_ctx, &tmp, len, timeout,
+                                AVT_IO_READ_MUTABLE);
+        const size_t got = avt_buffer_get_data_len(&tmp);
+        avt_buffer_quick_unref(&tmp);
+        if (ret < 0)
+            return ret;
+        else if (!got)
+            return AVT_ERROR(EAGAIN);
+
+        if (!avail)
+            s->ra_pos = ret;
+
+        s->ra_end += got;
+        avail += got;
+    }
+
+    return avail;
+}
+
+static inline uint8_t *stream_data(AVTProtocolCtx *s)
+{
+    return (uint8_t *)avt_buffer_get_data(&s->ra, NULL) + s->ra_start;
+}
+
+static void stream_consume(AVTProtocolCtx *s, size_t len)
+{
+    s->ra_start += len;
+    s->ra_pos += len;
+
+    /* Start over if nothing may still reference the buffered data */
+    if (s->ra_start == s->ra_end && avt_buffer_get_refcount(&s->ra) == 1)
+        s->ra_start = s->ra_end = 0;
+}
+
+static avt_pos stream_seek(AVTProtocolCtx *s, avt_pos pos)
+{
+    if (avt_buffer_get_refcount(&s->ra) > 1)
+        avt_buffer_quick_unref(&s->ra);
+    s->ra_start = s->ra_end = 0;
+
+    return s->io->seek(s->io_ctx, pos);
+}
+
+/* Search for the next valid header, after one which was invalid.
+ * On success, the new header is at the start of the buffered data. */
+static int stream_resync(AVTProtocolCtx *s, int64_t timeout)
+{
+    int64_t err;
+    const avt_pos pos = s->ra_pos;
+
+    s->nb_resyncs++;
+
+    /* The first byte did not start a valid header */
+    stream_consume(s, 1);
+
+    while (1) {
+        const size_t avail = s->ra_end - s->ra_start;
+        const size_t off = avt_scan_find_header(stream_data(s), avail);
+        if (off < avail) {
+            stream_consume(s, off);
+            avt_log(s->ctx, AVT_LOG_WARN, "Resynchronized at %" PRIi64 ", "
+                    "skipped %" PRIi64 " bytes\n", s->ra_pos, s->ra_pos - pos);
+            break;
+        }
+
+        /* Keep anything which may be the start of a header */
+        stream_consume(s, avail - AVT_MIN(avail, AVT_MAX_HEADER_LEN - 1));
+
+        err = stream_fill(s, s->ra_end - s->ra_start + 1,
+                          STREAM_RESYNC_CHUNK, timeout);
+        if (err < 0) {
+            s->resync_bytes += s->ra_pos - pos;
+            return err;
+        }
+    }
+
+    s->resync_bytes += s->ra_pos - pos;
+
+    return 0;
+}
+
+/* Read a payload of len bytes into p->pl, after its header was consumed */
+static int stream_read_payload(AVTProtocolCtx *s, AVTPktd *p, size_t len,
+                               bool placed, int64_t timeout)
+{
+    avt_pos ret;
+    AVTBuffer tmp = { };
+    const size_t avail = s->ra_end - s->ra_start;
+
+    /* Buffered data is referenced, unless the payload has a destination */
+    if (avail >= len) {
+        if (placed) {
+            memcpy(avt_buffer_get_data(&p->pl, NULL), stream_data(s), len);
+            avt_buffer_resize(&p->pl, len);
+        } else {
+            avt_buffer_quick_ref(&p->pl, &s->ra, s->ra_start, len);
+        }
+        stream_consume(s, len);
+        return 0;
+    }
+
+    /* Otherwise, read directly. If there's not enough data, we'll try to
+     * do what we can with what we get down the road. */
+    if (!placed && !avail && s->io->read_ref) {
+        ret = s->io->read_ref(s->io_ctx, &p->pl, len, timeout);
+        return ret < 0 ? ret : 0;
+    }
+
+    // TODO: pool buffer
+    if (!placed && !avt_buffer_quick_alloc(&p->pl, len))
+        return AVT_ERROR(ENOMEM);
+
+    if (avail) {
+        memcpy(avt_buffer_get_data(&p->pl, NULL), stream_data(s), avail);
+        stream_consume(s, avail);
+    }
+
+    avt_buffer_quick_ref(&tmp, &p->pl, avail, len - avail);
+    ret = s->io->read_input(s->io_ctx, &tmp, len - avail, timeout,
+                            AVT_IO_READ_MUTABLE);
+    const size_t got = avt_buffer_get_data_len(&tmp);
+    avt_buffer_quick_unref(&tmp);
+    if (ret < 0)
+        return ret;
+
+    avt_buffer_resize(&p->pl, avail + got);
+
+    return 0;
+}
 
+/* Receive a single packet into p.
+ * Returns 1 if the packet was consumed internally. */
+static int stream_receive_pkt(AVTProtocolCtx *s, AVTPktd *p, int64_t timeout)
+{
+    int64_t err;
+    uint8_t *hdr;
+    int hdr_size;
+
+resync:
     /* Get the minimum header size */
-    err = s->io->read_input(s->io_ctx, &buf, AVT_MIN_HEADER_LEN,
-                            timeout, AVT_IO_READ_MUTABLE);
+    err = stream_fill(s, AVT_MIN_HEADER_LEN, AVT_MIN_HEADER_LEN, timeout);
     if (err < 0)
         return err;
 
-    /* Check LDPC codes */
-    avt_ldpc_decode_288_224(buf.data, s->opts.ldpc_iterations);
-
-    uint16_t desc = AVT_RB16(&buf.data[0]);
+    const avt_pos hdr_pos = s->ra_pos;
+    hdr = stream_data(s);
 
-    /* For identification purposes, zero out any bitmask bits */
-    if ((desc == (AVT_PKT_TIME_SYNC & 0xFF00)) ||
-        (desc == (AVT_PKT_STREAM_DATA & 0xFF00)))
-        desc &= 0xFF00;
+    /* Error correction is done in place, so keep the original */
+    memcpy(s->raw_hdr, hdr, AVT_MIN_HEADER_LEN);
+    avt_ldpc_decode_288_224(hdr, s->opts.ldpc_iterations);
 
     /* Get the rest of the header */
-    const int left_size = avt_pkt_hdr_size(desc) - AVT_MIN_HEADER_LEN;
-    if (left_size > 0) {
-        buf.data += AVT_MIN_HEADER_LEN;
-        buf.len -= AVT_MIN_HEADER_LEN;
-
-        err = s->io->read_input(s->io_ctx, &buf, left_size,
-                                timeout, AVT_IO_READ_MUTABLE);
+    hdr_size = avt_packet_hdr_size(avt_packet_read_desc(hdr));
+    if (!hdr_size) {
+        memcpy(hdr, s->raw_hdr, AVT_MIN_HEADER_LEN);
+        err = stream_resync(s, timeout);
         if (err < 0)
             return err;
+        goto resync;
+    }
+
+    if (hdr_size > AVT_MIN_HEADER_LEN) {
+        err = stream_fill(s, hdr_size, hdr_size, timeout);
+        if (err < 0) {
+            memcpy(stream_data(s), s->raw_hdr, AVT_MIN_HEADER_LEN);
+            return err;
+        }
+        hdr = stream_data(s);
+
+        memcpy(&s->raw_hdr[AVT_MIN_HEADER_LEN], &hdr[AVT_MIN_HEADER_LEN],
+               hdr_size - AVT_MIN_HEADER_LEN);
 
         /* Check LDPC codes */
-        switch (left_size) {
-        case 36: avt_ldpc_decode_288_224(buf.data, s->opts.ldpc_iterations);
+        switch (hdr_size - AVT_MIN_HEADER_LEN) {
+        case AVT_MIN_HEADER_LEN:
+            avt_ldpc_decode_288_224(&hdr[AVT_MIN_HEADER_LEN], s->opts.ldpc_iterations);
             break;
-        case 384: avt_ldpc_decode_2784_2016(buf.data, s->opts.ldpc_iterations);
+        case AVT_MAX_HEADER_LEN - AVT_MIN_HEADER_LEN:
+            avt_ldpc_decode_2784_2016(&hdr[AVT_MIN_HEADER_LEN], s->opts.ldpc_iterations);
             break;
         default:
             break;
         }
+    }
 
-        buf.data += AVT_MIN_HEADER_LEN;
-        buf.len -= AVT_MIN_HEADER_LEN;
+    /* Damaged beyond what error correction could repair */
+    if (avt_scan_check_header(hdr, hdr_size) != hdr_size) {
+        memcpy(hdr, s->raw_hdr, hdr_size);
+        err = stream_resync(s, timeout);
+        if (err < 0)
+            return err;
+        goto resync;
     }
 
-    p->hdr_len = buf.data - buf.base_data;
+    memcpy(p->hdr, hdr, hdr_size);
 
-    size_t pl_bytes = 0;
-    AVTBytestream bs = avt_bs_init(p->hdr, sizeof(p->hdr));
+    int64_t pl_bytes = avt_packet_decode_header(s, p);
+    if (pl_bytes < 0)
+        return pl_bytes;
 
-    switch (desc) {
-    case AVT_PKT_SESSION_START:
-        avt_decode_session_start(&bs, &p->pkt.session_start);
-        return 0;
-    case AVT_PKT_TIME_SYNC & ~(AVT_PKT_FLAG_LSB_BITMASK):
-        avt_decode_time_sync(&bs, &p->pkt.time_sync);
-        return 0;
-    case AVT_PKT_VIDEO_INFO:
-        avt_decode_video_info(&bs, &p->pkt.video_info);
-        return 0;
-    case AVT_PKT_VIDEO_ORIENTATION:
-        avt_decode_video_orientation(&bs, &p->pkt.video_orientation);
-        return 0;
-    case AVT_PKT_STREAM_REGISTRATION:
-        avt_decode_stream_registration(&bs, &p->pkt.stream_registration);
-        return 0;
-    case AVT_PKT_STEREO_VIDEO:
-        avt_decode_stereo_video(&bs, &p->pkt.stereo_video);
-        return 0;
-    case AVT_PKT_STREAM_END:
-        avt_decode_stream_end(&bs, &p->pkt.stream_end);
-        return 0;
-    case AVT_PKT_STREAM_INDEX:
-        avt_decode_stream_index(&bs, &p->pkt.stream_index);
-        pl_bytes = p->pkt.stream_index.nb_indices * AVT_PKT_INDEX_ENTRY_SIZE;
+    /* Wait until the entire packet has been buffered, if it fits */
+    if (s->read_ahead && (hdr_size + pl_bytes) <= s->ra_size) {
+        err = stream_fill(s, hdr_size + pl_bytes, 0, timeout);
+        if (err < 0) {
+            memcpy(stream_data(s), s->raw_hdr, hdr_size);
+            return err;
+        }
+    }
 
-        // TODO: store buffer in state
-        AVTBuffer *tmp = avt_buffer_alloc(pl_bytes);
-        if (!tmp)
-            return AVT_ERROR(ENOMEM);
+    stream_consume(s, hdr_size);
 
-        /* Read index entries */
-        err = s->io->read_input(s->io_ctx, tmp, pl_bytes,
-                                timeout, 0x0);
+    if (pl_bytes) {
+        /* Read the payload directly into its destination if possible */
+        bool placed = s->place_cb && s->place_cb(s->place_opaque, p) >= 0;
+        err = stream_read_payload(s, p, pl_bytes, placed, timeout);
         if (err < 0)
             return err;
+    }
 
+    /* Indices are kept, and bypass reordering */
+    if (p->pkt.desc == AVT_PKT_STREAM_INDEX) {
         size_t index_size;
-        uint8_t *index_data = avt_buffer_get_data(tmp, &index_size);
-
-        bs = avt_bs_init(index_data, index_size);
+        uint8_t *index_data = avt_buffer_get_data(&p->pl, &index_size);
+        AVTBytestream bs = avt_bs_init(index_data, index_size);
 
-        /* Parse */
-        err = avt_index_list_parse(&s->ic, &bs, &p->pkt.stream_index);
-        avt_buffer_unref(&tmp);
+        err = avt_index_list_parse(&s->ic, &bs, &p->pkt.stream_index, hdr_pos);
+        avt_buffer_quick_unref(&p->pl);
         if (err < 0)
             return err;
 
-        /* Bypass reordering */
-        return AVT_ERROR(EAGAIN);
-    case AVT_PKT_STREAM_DATA & ~(AVT_PKT_FLAG_LSB_BITMASK):
-        avt_decode_stream_data(&bs, &p->pkt.stream_data);
-        pl_bytes = p->pkt.stream_data.data_length;
-        break;
-    case AVT_PKT_FEC_GROUPING:
-        avt_decode_fec_grouping(&bs, &p->pkt.fec_grouping);
-        break;
-    case AVT_PKT_FEC_GROUP_DATA:
-        avt_decode_fec_group_data(&bs, &p->pkt.fec_group_data);
-        pl_bytes = p->pkt.fec_group_data.fec_data_length;
-        break;
-    case AVT_PKT_LUT_ICC:
-        avt_decode_lut_icc(&bs, &p->pkt.lut_icc);
-    case AVT_PKT_FONT_DATA:
-        avt_decode_font_data(&bs, &p->pkt.font_data);
-    case AVT_PKT_USER_DATA:
-        avt_decode_user_data(&bs, &p->pkt.user_data);
-    case AVT_PKT_STREAM_CONFIG: [[fallthrough]];
-    case AVT_PKT_METADATA:
-        avt_decode_generic_data(&bs, &p->pkt.generic_data);
-        pl_bytes = p->pkt.generic_data.payload_length;
-        break;
-    case AVT_PKT_LUT_ICC_SEGMENT:       [[fallthrough]];
-    case AVT_PKT_FONT_DATA_SEGMENT:     [[fallthrough]];
-    case AVT_PKT_METADATA_SEGMENT:      [[fallthrough]];
-    case AVT_PKT_USER_DATA_SEGMENT:     [[fallthrough]];
-    case AVT_PKT_STREAM_DATA_SEGMENT:   [[fallthrough]];
-    case AVT_PKT_STREAM_CONFIG_SEGMENT:
-        avt_decode_generic_segment(&bs, &p->pkt.generic_segment);
-        pl_bytes = p->pkt.generic_segment.seg_length;
-        break;
-    case AVT_PKT_LUT_ICC_PARITY:       [[fallthrough]];
-    case AVT_PKT_FONT_DATA_PARITY:     [[fallthrough]];
-    case AVT_PKT_METADATA_PARITY:      [[fallthrough]];
-    case AVT_PKT_USER_DATA_PARITY:     [[fallthrough]];
-    case AVT_PKT_STREAM_DATA_PARITY:   [[fallthrough]];
-    case AVT_PKT_STREAM_CONFIG_PARITY:
-        avt_decode_generic_parity(&bs, &p->pkt.generic_parity);
-        pl_bytes = p->pkt.generic_parity.parity_data_length;
-        break;
-    default:
-        avt_log(p, AVT_LOG_ERROR, "Unknown descriptor 0x%x received\n", desc);
-        return AVT_ERROR(ENOTSUP);
-    };
+        s->index_cur = hdr_pos;
+        s->index_next = p->pkt.stream_index.next_idx ?
+                        hdr_pos + p->pkt.stream_index.next_idx : -1;
 
-    // TODO: pool buffer
-    if (!avt_buffer_quick_alloc(&p->pl, pl_bytes))
-        return AVT_ERROR(ENOMEM);
+        return 1;
+    }
 
-    err = s->io->read_input(s->io_ctx, &p->pl, pl_bytes, timeout, 0x0);
-    if (err < 0)
-        return err;
+    return 0;
+}
+
+static int stream_receive(AVTProtocolCtx *s, AVTPacketFifo *fifo,
+                          int64_t timeout)
+{
+    int err;
+    int nb_pkts = 0;
+
+    s->ra_pending = false;
 
-    /* If there's not enough data, we'll try to do what we can with what
-     * we get down the road */
+    for (auto i = 0; i < STREAM_RECV_BATCH; i++) {
+        AVTPktd *p = avt_pkt_fifo_push_new(fifo, NULL, 0, 0);
+        if (!p)
+            return AVT_ERROR(ENOMEM);
+
+        p->hdr_off = 0;
+        p->pl_has_hash = false;
+
+        err = stream_receive_pkt(s, p, timeout);
+        if (err) {
+            avt_buffer_quick_unref(&p->pl);
+            fifo->nb--;
+
+            /* Index packets are consumed, try the next one */
+            if (err > 0)
+                continue;
+            else if (nb_pkts)
+                return nb_pkts;
+            return err;
+        }
+
+        nb_pkts++;
+    }
+
+    /* The batch filled up, the I/O may not signal what's left */
+    s->ra_pending = s->ra_end > s->ra_start;
+
+    return nb_pkts;
+}
 
+static int64_t stream_get_deadline(AVTProtocolCtx *s)
+{
+    return s->ra_pending ? 0 : INT64_MAX;
+}
+
+static int stream_set_placement(AVTProtocolCtx *s,
+                                AVTPlacementCb cb, void *opaque)
+{
+    s->place_cb = cb;
+    s->place_opaque = opaque;
     return 0;
 }
 
@@ -274,22 +738,274 @@ static int stream_proto_max_pkt_len(AVTProtocolCtx *p, size_t *mtu)
     return p->io->get_max_pkt_len(p->io_ctx, mtu);
 }
 
-static int stream_proto_seek(AVTProtocolCtx *p,
+/* Read the index packet at pos. Returns AVT_ERROR(EBADMSG) if there's
+ * no intact one there. */
+static int stream_read_index_at(AVTProtocolCtx *s, avt_pos pos,
+                                AVTStreamIndex *idx)
+{
+    AVTPktd p = { };
+
+    avt_pos ret = stream_seek(s, pos);
+    if (ret < 0)
+        return ret;
+
+    int err = stream_receive_pkt(s, &p, 0);
+    avt_buffer_quick_unref(&p.pl);
+    if (err < 0 && err != AVT_ERROR(EAGAIN))
+        return err;
+    else if (err != 1 || s->index_cur != pos)
+        return AVT_ERROR(EBADMSG);
+
+    *idx = p.pkt.stream_index;
+
+    return 0;
+}
+
+/* Read all index packets backwards, starting from the footer at the end */
+static int stream_read_index_footer(AVTProtocolCtx *s)
+{
+    int err;
+    AVTBuffer map = { };
+    AVTStreamIndex idx;
+
+    /* The end of the stream is only known when it can be mapped */
+    if (!s->io->read_ref)
+        return AVT_ERROR(ENOENT);
+
+    avt_pos pos = stream_seek(s, 0);
+    if (pos < 0)
+        return pos;
+
+    pos = s->io->read_ref(s->io_ctx, &map, SIZE_MAX, 0);
+    const size_t len = avt_buffer_get_data_len(&map);
+    avt_buffer_quick_unref(&map);
+    if (pos < 0)
+        return pos;
+
+    const int hdr_size = avt_packet_hdr_size(AVT_PKT_STREAM_INDEX);
+    if (len < hdr_size)
+        return AVT_ERROR(ENOENT);
+
+    pos = len - hdr_size;
+    err = stream_read_index_at(s, pos, &idx);
+    if (err == AVT_ERROR(EBADMSG) || (!err && idx.nb_indices))
+        return AVT_ERROR(ENOENT);
+
+    /* The first index packet does not point anywhere */
+    while (!err && idx.prev_idx) {
+        if (idx.prev_idx > pos)
+            return AVT_ERROR(EBADMSG);
+        pos -= idx.prev_idx;
+        err = stream_read_index_at(s, pos, &idx);
+    }
+
+    return err;
+}
+
+/* Read all index packets, either from the end, or starting with the
+ * first index packet in the stream, and all others it links to */
+static int stream_read_index_chain(AVTProtocolCtx *s)
+{
+    int err;
+    avt_pos pos;
+    AVTPktd p = { };
+
+    /* Payloads of skipped packets must not be placed anywhere */
+    AVTPlacementCb place_cb = s->place_cb;
+    s->place_cb = NULL;
+
+    /* Indices read from a broken chain are kept */
+    err = stream_read_index_footer(s);
+    if (!err || err == AVT_ERROR(ENOMEM))
+        goto end;
+
+    pos = stream_seek(s, 0);
+    if (pos < 0) {
+        err = pos;
+        goto end;
+    }
+
+    s->index_next = -1;
+    for (;;) {
+        err = stream_receive_pkt(s, &p, 0);
+        const size_t pl_len = avt_buffer_get_data_len(&p.pl);
+        avt_buffer_quick_unref(&p.pl);
+        if (err == AVT_ERROR(EAGAIN))
+            err = AVT_ERROR(ENOENT);
+        if (err)
+            break;
+
+        pos += p.hdr_len + pl_len;
+        if (pos >= STREAM_INDEX_SEARCH) {
+            err = AVT_ERROR(ENOENT);
+            break;
+        }
+    }
+    if (err < 0)
+        goto end;
+
+    /* Follow the chain */
+    while (s->index_next > 0) {
+        pos = stream_seek(s, s->index_next);
+        if (pos < 0) {
+            err = pos;
+            goto end;
+        }
+
+        err = stream_receive_pkt(s, &p, 0);
+        avt_buffer_quick_unref(&p.pl);
+        if (!err)
+            err = AVT_ERROR(EBADMSG);
+        if (err < 0)
+            goto end;
+    }
+
+    err = 0;
+
+end:
+    s->place_cb = place_cb;
+    return err;
+}
+
+/* Index a stream without usable index packets by scanning all of it */
+static int stream_build_index(AVTProtocolCtx *s)
+{
+    int err;
+    avt_pos ret;
+    AVTBuffer map = { };
+
+    /* Only done when the whole stream can be accessed at once */
+    if (!s->io->read_ref)
+        return AVT_ERROR(ENOENT);
+
+    ret = stream_seek(s, 0);
+    if (ret < 0)
+        return ret;
+
+    ret = s->io->read_ref(s->io_ctx, &map, SIZE_MAX, 0);
+    if (ret < 0)
+        return ret;
+
+    size_t len;
+    const uint8_t *data = avt_buffer_get_data(&map, &len);
+
+    if (s->index_cache &&
+        avt_scan_cache_read(&s->ic, s->index_cache, data, len) >= 0) {
+        avt_buffer_quick_unref(&map);
+        return 0;
+    }
+
+    err = avt_scan_build_index(s->ctx, &s->ic, data, len, 0);
+    if (!err && s->index_cache &&
+        avt_scan_cache_write(&s->ic, s->index_cache, data, len) < 0)
+        avt_log(s->ctx, AVT_LOG_WARN, "Unable to write index cache %s\n",
+                s->index_cache);
+
+    avt_buffer_quick_unref(&map);
+
+    return err;
+}
+
+static int stream_load_index(AVTProtocolCtx *s)
+{
+    int err = stream_read_index_chain(s);
+
+    /* Missing, or broken */
+    if (err == AVT_ERROR(ENOENT) || err == AVT_ERROR(EBADMSG)) {
+        avt_index_list_free(&s->ic);
+        err = stream_build_index(s);
+    }
+    if (err < 0)
+        return err;
+
+    if (!s->ic.nb_index)
+        return AVT_ERROR(ENOENT);
+
+    s->index_loaded = true;
+
+    return 0;
+}
+
+static int stream_proto_seek(AVTProtocolCtx *s,
                              int64_t off, uint32_t seq,
                              int64_t ts, bool ts_is_dts)
 {
-    if (!p->io->seek)
+    int err;
+    avt_pos pos;
+
+    if (!s->io->seek)
         return AVT_ERROR(ENOTSUP);
 
-    /* TODO: verify there's a packet there, use the indices in ts/seq mode */
-    p->io->seek(p->io_ctx, off);
-    /* Patch out the index if we succeed with the returned value */
+    if (ts != INT64_MIN) {
+        AVTIndexEntry e;
 
-    return AVT_ERROR(ENOTSUP);
+        /* Indices only contain presentation timestamps */
+        if (ts_is_dts)
+            return AVT_ERROR(ENOTSUP);
+
+        if (!s->index_loaded) {
+            err = stream_load_index(s);
+            if (err < 0)
+                return err;
+        }
+
+        err = avt_index_list_find(&s->ic, ts, &e, &off);
+        if (err < 0)
+            return err;
+    }
+
+    pos = stream_seek(s, off);
+    if (pos < 0)
+        return pos;
+
+    return 0;
+}
+
+/* Write an empty index packet pointing to the last index packet,
+ * so that readers can find all indices from the end of the file */
+static int stream_write_footer(AVTProtocolCtx *s, int64_t timeout)
+{
+    const avt_pos pos = s->wpos;
+    const avt_pos prev = pos - s->last_idx_pos;
+    if (prev > UINT32_MAX)
+        return 0;
+
+    AVTPktd p = { };
+    p.pkt = AVT_STREAM_INDEX_HDR(
+        .global_seq = s->last_seq,
+        .stream_id = UINT16_MAX,
+        .prev_idx = prev,
+        .next_idx = 0,
+        .nb_indices = 0,
+    );
+    avt_packet_encode_header(&p);
+
+    avt_pos ret = s->io->write_pkt(s->io_ctx, &p, timeout);
+    if (ret < 0)
+        return ret;
+
+    s->wpos = s->footer_end = pos + p.hdr_len;
+
+    return 0;
 }
 
 static int stream_proto_flush(AVTProtocolCtx *p, int64_t timeout)
 {
+    int err;
+
+    if (p->gen_index && p->nb_widx) {
+        err = stream_write_index(p, timeout);
+        if (err < 0)
+            return err;
+    }
+
+    /* Only needed if anything was written since the last one */
+    if (p->gen_index && p->have_last_idx && p->footer_end != p->wpos) {
+        err = stream_write_footer(p, timeout);
+        if (err < 0)
+            return err;
+    }
+
     if (p->io->flush)
         return p->io->flush(p->io_ctx, timeout);
     return AVT_ERROR(ENOTSUP);
@@ -306,6 +1022,8 @@ const AVTProtocol avt_protocol_stream = {
     .send_seq = stream_send_seq,
     .update_packet = NULL,
     .receive = stream_receive,
+    .get_deadline = stream_get_deadline,
+    .set_placement = stream_set_placement,
     .seek = stream_proto_seek,
     .flush = stream_proto_flush,
     .close = stream_proto_close,
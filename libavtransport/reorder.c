@@ -25,27 +25,146 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "reorder.h"
 
 int avt_reorder_init(AVTContext *ctx, AVTReorderBuffer *rb,
                      size_t max_size)
 {
+    rb->size = 0;
+    rb->max_size = max_size;
     return 0;
 }
 
-int avt_reorder_push(AVTContext *ctx, AVTReorderBuffer *rb,
-                     union AVTPacketData pkt, AVTBuffer *pl)
+static inline size_t entry_size(AVTPktd *p)
 {
+    return sizeof(*p) + avt_buffer_get_data_len(&p->pl);
+}
+
+/* Packets are kept in a binary min-heap, ordered by sequence number */
+static inline bool heap_before(AVTPacketFifo *f, uint32_t a, uint32_t b)
+{
+    return avt_seq_before(f->data[a].pkt.seq, f->data[b].pkt.seq);
+}
+
+static void heap_sift_up(AVTPacketFifo *f, uint32_t idx)
+{
+    while (idx) {
+        uint32_t parent = (idx - 1) >> 1;
+        if (!heap_before(f, idx, parent))
+            break;
+        AVT_SWAP(f->data[idx], f->data[parent]);
+        idx = parent;
+    }
+}
+
+static void heap_sift_down(AVTPacketFifo *f, uint32_t idx)
+{
+    for (;;) {
+        uint32_t min = idx;
+        uint32_t left = 2*idx + 1;
+        uint32_t right = left + 1;
+        if (left < f->nb && heap_before(f, left, min))
+            min = left;
+        if (right < f->nb && heap_before(f, right, min))
+            min = right;
+        if (min == idx)
+            break;
+        AVT_SWAP(f->data[idx], f->data[min]);
+        idx = min;
+    }
+}
+
+/* Remove the oldest packet. Its payload must have been moved out. */
+static void heap_remove_first(AVTReorderBuffer *rb, size_t size)
+{
+    AVTPacketFifo *f = &rb->pkts;
+    rb->size -= size;
+    f->data[0] = f->data[--f->nb];
+    f->data[f->nb] = (AVTPktd){ };
+    heap_sift_down(f, 0);
+}
+
+int avt_reorder_push(AVTContext *ctx, AVTReorderBuffer *rb, AVTPktd *p)
+{
+    AVTPacketFifo *f = &rb->pkts;
+
+    size_t size = entry_size(p);
+    int err = avt_pkt_fifo_push_refd(f, p);
+    if (err < 0)
+        return err;
+
+    heap_sift_up(f, f->nb - 1);
+    rb->size += size;
+
     return 0;
 }
 
-int avt_reorder_pop(AVTContext *ctx, AVTReorderChain **chain)
+/* Move the oldest packet to out. Any copies of it still in the buffer,
+ * which should have been caught earlier, are dropped. */
+static int reorder_output_first(AVTReorderBuffer *rb, AVTPacketFifo *out)
 {
+    AVTPacketFifo *f = &rb->pkts;
+    const uint64_t seq = f->data[0].pkt.seq;
+
+    size_t size = entry_size(&f->data[0]);
+    int err = avt_pkt_fifo_push_refd(out, &f->data[0]);
+    if (err < 0)
+        return err;
+    heap_remove_first(rb, size);
+
+    while (f->nb && f->data[0].pkt.seq == seq) {
+        size = entry_size(&f->data[0]);
+        avt_buffer_quick_unref(&f->data[0].pl);
+        heap_remove_first(rb, size);
+    }
+
     return 0;
 }
 
-void avt_reorder_free(AVTContext *ctx, AVTReorderBuffer *rb)
+int avt_reorder_pop(AVTContext *ctx, AVTReorderBuffer *rb,
+                    uint64_t seq_limit, AVTPacketFifo *out)
+{
+    AVTPacketFifo *f = &rb->pkts;
+
+    /* If over the limit, let the oldest packets go regardless */
+    int nb = 0;
+    while (f->nb && (avt_seq_before(f->data[0].pkt.seq, seq_limit) ||
+                     rb->size > rb->max_size)) {
+        int err = reorder_output_first(rb, out);
+        if (err < 0)
+            return err;
+        nb++;
+    }
+
+    return nb;
+}
+
+int avt_reorder_flush(AVTContext *ctx, AVTReorderBuffer *rb,
+                      AVTPacketFifo *out)
 {
+    AVTPacketFifo *f = &rb->pkts;
 
+    int nb = 0;
+    while (f->nb) {
+        int err = reorder_output_first(rb, out);
+        if (err < 0)
+            return err;
+        nb++;
+    }
+
+    return nb;
+}
+
+void avt_reorder_clear(AVTReorderBuffer *rb)
+{
+    avt_pkt_fifo_clear(&rb->pkts);
+    rb->size = 0;
+}
+
+void avt_reorder_free(AVTContext *ctx, AVTReorderBuffer *rb)
+{
+    avt_pkt_fifo_free(&rb->pkts);
+    rb->size = 0;
 }
@@ -32,6 +32,7 @@
 #include "mem.h"
 #include "utils_internal.h"
 #include "utils_packet.h"
+#include "ldpc_encode.h"
 
 FN_CREATING(avt_scheduler, AVTScheduler, AVTPacketFifo,
             bucket, buckets, nb_buckets)
@@ -51,9 +52,49 @@ int avt_scheduler_init(AVTScheduler *s,
 
 static inline uint64_t get_seq(AVTScheduler *s)
 {
+    if (s->shared_seq)
+        return atomic_fetch_add_explicit(&s->shared_seq->next, 1,
+                                         memory_order_relaxed);
     return s->seq++;
 }
 
+static void unref_seq(AVTScheduler *s)
+{
+    if (!s->shared_seq)
+        return;
+
+    s->seq = atomic_load(&s->shared_seq->next);
+    if (atomic_fetch_sub(&s->shared_seq->refs, 1) == 1)
+        free(s->shared_seq);
+    s->shared_seq = NULL;
+}
+
+int avt_scheduler_share_seq(AVTScheduler *s, AVTScheduler *src)
+{
+    if (!src->shared_seq) {
+        src->shared_seq = malloc(sizeof(*src->shared_seq));
+        if (!src->shared_seq)
+            return AVT_ERROR(ENOMEM);
+        atomic_init(&src->shared_seq->next, src->seq);
+        atomic_init(&src->shared_seq->refs, 1);
+    }
+
+    if (s->shared_seq == src->shared_seq)
+        return 0;
+
+    unref_seq(s);
+
+    uint_fast64_t next = atomic_load(&src->shared_seq->next);
+    while (next < s->seq &&
+           !atomic_compare_exchange_weak(&src->shared_seq->next, &next, s->seq))
+        ;
+
+    atomic_fetch_add(&src->shared_seq->refs, 1);
+    s->shared_seq = src->shared_seq;
+
+    return 0;
+}
+
 static inline void update_sw(AVTScheduler *s, size_t size)
 {
     size *= 8;
@@ -72,6 +113,38 @@ static inline void update_sw(AVTScheduler *s, size_t size)
     s->time += duration;
 }
 
+/* Segments of the same packet only differ in their sequence number, offset,
+ * length, and the part of the packet header they carry. Rather than encoding
+ * every header, update the previous one, along with its LDPC code. */
+static inline void encode_segment(AVTSchedulerPacketContext *state, AVTPktd *p)
+{
+    const AVTGenericSegment *seg = &p->pkt.generic_segment;
+    uint8_t *hdr = state->seg_hdr;
+    uint8_t diff[224 / 8];
+
+    if (!state->seg_hdr_set || state->seg_hdr_size != AVT_MIN_HEADER_LEN) {
+        avt_packet_encode_header(p);
+        memcpy(hdr, &p->hdr[p->hdr_off], AVT_MIN_HEADER_LEN);
+        state->seg_hdr_set = true;
+        return;
+    }
+
+    memcpy(diff, hdr, sizeof(diff));
+
+    AVT_WB32(&hdr[AVT_PKT_GENERIC_SEGMENT_OFF_GLOBAL_SEQ], seg->global_seq & UINT32_MAX);
+    AVT_WB32(&hdr[AVT_PKT_GENERIC_SEGMENT_OFF_SEG_OFFSET], seg->seg_offset);
+    AVT_WB32(&hdr[AVT_PKT_GENERIC_SEGMENT_OFF_SEG_LENGTH], seg->seg_length);
+    memcpy(&hdr[AVT_PKT_GENERIC_SEGMENT_OFF_HEADER_7], seg->header_7,
+           sizeof(seg->header_7));
+
+    for (int i = 0; i < sizeof(diff); i++)
+        diff[i] ^= hdr[i];
+    avt_ldpc_update_288_224(hdr, diff, 0, sizeof(diff));
+
+    memcpy(&p->hdr[p->hdr_off], hdr, AVT_MIN_HEADER_LEN);
+    p->hdr_len = AVT_MIN_HEADER_LEN;
+}
+
 static inline int64_t scheduler_push_internal(AVTScheduler *s,
                                               AVTSchedulerPacketContext *state,
                                               AVTPacketFifo *dst,
@@ -90,7 +163,7 @@ static inline int64_t scheduler_push_internal(AVTScheduler *s,
         goto resume;
 
     /* Header size of the encoded packet */
-    hdr_size = avt_pkt_hdr_size(state->p.pkt.desc);
+    hdr_size = avt_packet_hdr_size(state->p.pkt.desc);
 
     /* Signal we need more bytes to output something coherent.
      * If there's payload, make sure we can send off at least a byte of it. */
@@ -103,6 +176,7 @@ static inline int64_t scheduler_push_internal(AVTScheduler *s,
             return AVT_ERROR(ENOMEM);
 
         p->pkt = state->p.pkt;
+        p->pkt.seq = get_seq(s);
         avt_packet_encode_header(p);
         out_acc += hdr_size;
         update_sw(s, hdr_size);
@@ -119,14 +193,14 @@ static inline int64_t scheduler_push_internal(AVTScheduler *s,
         return AVT_ERROR(ENOMEM);
 
     /* Modify packet */
-    avt_packet_change_size(state->p.pkt, 0, seg_pl_size, pl_size);
+    avt_packet_change_size(&state->p.pkt, 0, seg_pl_size, pl_size);
     state->p.pkt.seq = get_seq(s);
 
     /* Encode packet */
     avt_packet_encode_header(&state->p);
 
     /* Update accumulated output */
-    acc = avt_pkt_hdr_size(state->p.pkt.desc) + seg_pl_size;
+    acc = avt_packet_hdr_size(state->p.pkt.desc) + seg_pl_size;
     out_acc += acc;
     update_sw(s, acc);
 
@@ -138,7 +212,8 @@ static inline int64_t scheduler_push_internal(AVTScheduler *s,
     /* Setup segmentation context */
     state->seg_offset = seg_pl_size;
     state->pl_left = pl_size - state->seg_offset;
-    state->seg_hdr_size = avt_pkt_hdr_size(avt_packet_create_segment(&state->p, 0, 0, 0, 0).desc);
+    state->seg_hdr_size = avt_packet_hdr_size(avt_packet_create_segment(&state->p, 0, 0, 0, 0).desc);
+    state->seg_hdr_set = false;
 
     /* Return now with what we wrote if there are not enough bytes */
     if (out_acc >= out_limit)
@@ -149,7 +224,7 @@ resume:
 
     /* Send a hash data packet if needed */
     if (state->p.pl_has_hash && !state->hash_sent) {
-        acc = avt_pkt_hdr_size(AVT_PKT_HASH_DATA);
+        acc = avt_packet_hdr_size(AVT_PKT_HASH_DATA);
 
         if (out_limit < acc)
             return AVT_ERROR(EAGAIN);
@@ -191,10 +266,10 @@ resume:
                                            state->seg_offset, seg_pl_size, pl_size);
 
         /* Encode packet */
-        avt_packet_encode_header(p);
+        encode_segment(state, p);
 
         /* Enqueue packet */
-        acc = avt_pkt_hdr_size(p->pkt.desc) + seg_pl_size;
+        acc = avt_packet_hdr_size(p->pkt.desc) + seg_pl_size;
         out_acc += acc;
         update_sw(s, acc);
 
@@ -223,7 +298,7 @@ static inline void update_stream_ctx(AVTScheduler *s, AVTSchedulerStream *pctx)
     static const AVTRational target_tb = (AVTRational){ 1, 1000000000 };
 
     /* TODO: take into account index packets having larger length */
-    const size_t size = (avt_pkt_hdr_size(pctx->cur.p.pkt.desc) +
+    const size_t size = (avt_packet_hdr_size(pctx->cur.p.pkt.desc) +
                          avt_buffer_get_data_len(&pctx->cur.p.pl)) * 8;
 
     int64_t duration = avt_packet_get_duration(&pctx->cur.p.pkt);
@@ -480,6 +555,17 @@ int avt_scheduler_push(AVTScheduler *s, AVTPktd *p)
     return scheduler_process(s);
 }
 
+int avt_scheduler_push_seq(AVTScheduler *s, const AVTPacketFifo *seq)
+{
+    if (!s->staging) {
+        s->staging = avt_scheduler_create_bucket(s);
+        if (!s->staging)
+            return AVT_ERROR(ENOMEM);
+    }
+
+    return avt_pkt_fifo_copy(s->staging, seq);
+}
+
 int avt_scheduler_pop(AVTScheduler *s, AVTPacketFifo **seq)
 {
     if (!s->staging || (!s->staging->nb))
@@ -501,10 +587,8 @@ int avt_scheduler_flush(AVTScheduler *s, AVTPacketFifo **seq)
     return 0;
 }
 
-int avt_scheduler_done(AVTScheduler *s, AVTPacketFifo *seq)
+static int return_bucket(AVTScheduler *s, AVTPacketFifo *seq)
 {
-    avt_assert1(seq->nb); /* Scheduler FIFO was not fully consumed */
-
     if (!s->staging) {
         s->staging = seq;
     } else {
@@ -525,10 +609,173 @@ int avt_scheduler_done(AVTScheduler *s, AVTPacketFifo *seq)
     return 0;
 }
 
+int avt_scheduler_done(AVTScheduler *s, AVTPacketFifo *seq)
+{
+    avt_assert1(seq->nb); /* Scheduler FIFO was not fully consumed */
+    return return_bucket(s, seq);
+}
+
+int avt_scheduler_recycle(AVTScheduler *s, AVTPacketFifo *seq)
+{
+    avt_pkt_fifo_clear(seq);
+    return return_bucket(s, seq);
+}
+
+/* First part of a packet a stream is still segmenting */
+static AVTPktd *find_cur_base(AVTScheduler *s, uint64_t seq)
+{
+    for (auto i = 0; i < s->nb_active_stream_indices; i++) {
+        AVTSchedulerPacketContext *cur = &s->streams[s->active_stream_indices[i]].cur;
+        if (cur->present && cur->seg_offset &&
+            cur->p.pkt.desc == AVT_PKT_STREAM_DATA && cur->p.pkt.seq == seq)
+            return &cur->p;
+    }
+
+    return NULL;
+}
+
+/* Find the first part of a segmented packet, if its header is still known */
+static AVTPktd *find_seg_base(AVTScheduler *s, AVTPacketFifo *f, uint64_t seq)
+{
+    for (auto i = 0; i < f->nb; i++) {
+        if (f->data[i].pkt.desc == AVT_PKT_STREAM_DATA &&
+            f->data[i].pkt.seq == seq)
+            return &f->data[i];
+    }
+
+    return find_cur_base(s, seq);
+}
+
+/* Total payload size of a segmented packet, or 0 if unknown */
+static uint32_t find_seg_total(AVTScheduler *s, AVTPacketFifo *f, uint64_t seq)
+{
+    for (auto i = 0; i < f->nb; i++) {
+        if (f->data[i].pkt.desc == AVT_PKT_STREAM_DATA_SEGMENT &&
+            f->data[i].pkt.generic_segment.target_seq == seq)
+            return f->data[i].pkt.generic_segment.pkt_total_data;
+    }
+
+    /* The stream state holds the entire payload */
+    AVTPktd *base = find_cur_base(s, seq);
+    return base ? avt_buffer_get_data_len(&base->pl) : 0;
+}
+
+/* Move a staged packet into dst, cutting it up if it no longer fits.
+ * The first part keeps its sequence number, the rest become new segments.
+ * Packets which no longer fit, and cannot be cut, are dropped, as they
+ * could never be sent. */
+static int recut_pkt(AVTScheduler *s, AVTPacketFifo *dst,
+                     AVTPacketFifo *src, AVTPktd *p)
+{
+    int err;
+    bool is_parity;
+    uint32_t off, len, tot;
+    AVTPktd *base = NULL;
+
+    const uint32_t hdr_size = avt_packet_hdr_size(p->pkt.desc);
+    const size_t pl_len = avt_buffer_get_data_len(&p->pl);
+    if ((hdr_size + pl_len) <= s->max_pkt_size)
+        return avt_pkt_fifo_push_refd(dst, p);
+
+    avt_packet_series(p, &is_parity, &off, &len, &tot);
+
+    /* Only stream data gets segmented */
+    if (p->pkt.desc == AVT_PKT_STREAM_DATA)
+        base = p;
+    else if (p->pkt.desc == AVT_PKT_STREAM_DATA_SEGMENT)
+        base = find_seg_base(s, src, p->pkt.generic_segment.target_seq);
+
+    if (base == p && !tot)
+        tot = find_seg_total(s, src, p->pkt.seq);
+
+    const uint32_t seg_hdr_size = avt_packet_hdr_size(AVT_PKT_STREAM_DATA_SEGMENT);
+    if (!base || !tot || s->max_pkt_size <= AVT_MAX(hdr_size, seg_hdr_size)) {
+        avt_log(s, AVT_LOG_WARN, "Dropping packet %" PRIu64 " of %zu bytes, "
+                "which no longer fits, and cannot be cut\n",
+                (uint64_t)p->pkt.seq, hdr_size + pl_len);
+        avt_buffer_quick_unref(&p->pl);
+        return 0;
+    }
+
+    /* The source header is left untouched, and remains the segment base */
+    AVTBuffer pl = p->pl;
+    const uint32_t first = s->max_pkt_size - hdr_size;
+    const int idx = dst->nb;
+    err = avt_pkt_fifo_push_refd(dst, p);
+    if (err < 0)
+        return err;
+
+    for (uint32_t seg_off = first; seg_off < len;) {
+        uint32_t seg_len = AVT_MIN(s->max_pkt_size - seg_hdr_size, len - seg_off);
+
+        AVTPktd *seg = avt_pkt_fifo_push_new(dst, &pl, seg_off, seg_len);
+        if (!seg)
+            return AVT_ERROR(ENOMEM);
+
+        seg->pkt = avt_packet_create_segment(base, get_seq(s),
+                                             off + seg_off, seg_len, tot);
+        seg->hdr_off = 0;
+        seg->pl_has_hash = false;
+        avt_packet_encode_header(seg);
+        update_sw(s, seg_hdr_size);
+
+        seg_off += seg_len;
+    }
+
+    AVTPktd *fp = &dst->data[idx];
+    avt_packet_change_size(&fp->pkt, off, first, tot);
+    fp->pl.len = first;
+    avt_packet_encode_header(fp);
+
+    return 0;
+}
+
+int avt_scheduler_set_max_pkt_size(AVTScheduler *s, size_t max_pkt_size)
+{
+    int err;
+
+    if (max_pkt_size <= AVT_MIN_HEADER_LEN)
+        return AVT_ERROR(EINVAL);
+
+    max_pkt_size = AVT_MIN(max_pkt_size, UINT32_MAX);
+    if (max_pkt_size == s->max_pkt_size)
+        return 0;
+
+    avt_log(s, AVT_LOG_VERBOSE, "Max packet size changed: %zu -> %zu\n",
+            s->max_pkt_size, max_pkt_size);
+
+    /* Anything not yet cut will be segmented at the new size */
+    const bool shrunk = max_pkt_size < s->max_pkt_size;
+    s->max_pkt_size = max_pkt_size;
+    if (!shrunk || !s->staging || !s->staging->nb)
+        return 0;
+
+    AVTPacketFifo *src = s->staging;
+    AVTPacketFifo dst = { };
+    for (auto i = 0; i < src->nb; i++) {
+        err = recut_pkt(s, &dst, src, &src->data[i]);
+        if (err < 0) {
+            /* Whatever was not moved yet is dropped */
+            avt_pkt_fifo_free(&dst);
+            avt_pkt_fifo_clear(src);
+            return err;
+        }
+    }
+
+    /* All payloads were moved to dst */
+    src->nb = 0;
+    AVT_SWAP(*src, dst);
+    avt_pkt_fifo_free(&dst);
+
+    return 0;
+}
+
 void avt_scheduler_free(AVTScheduler *s)
 {
     s->staging = NULL;
 
+    unref_seq(s);
+
     free(s->avail_buckets);
     s->avail_buckets = NULL;
     s->nb_alloc_avail_buckets = 0;
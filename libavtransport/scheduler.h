@@ -27,6 +27,8 @@
 #ifndef AVTRANSPORT_CONNECTION_SCHEDULER_H
 #define AVTRANSPORT_CONNECTION_SCHEDULER_H
 
+#include <stdatomic.h>
+
 #include <avtransport/rational.h>
 #include "utils_internal.h"
 
@@ -41,6 +43,10 @@ typedef struct AVTSchedulerPacketContext {
     uint32_t  seg_hdr_size;
     bool      present;
 
+    /* Last segment header, updated for every following segment */
+    uint8_t   seg_hdr[AVT_MIN_HEADER_LEN];
+    bool      seg_hdr_set;
+
     int64_t   pts; // in 1ns timebase
     int64_t   duration;
     size_t    size;
@@ -60,6 +66,12 @@ typedef struct AVTSchedulerStream {
     uint16_t active_id;
 } AVTSchedulerStream;
 
+/* Sequence numbers, shared between schedulers outputting to the same place */
+typedef struct AVTSchedulerSeq {
+    atomic_uint_fast64_t next;
+    atomic_int refs;
+} AVTSchedulerSeq;
+
 typedef struct AVTScheduler {
     /* Settings */
     size_t max_pkt_size;
@@ -68,6 +80,7 @@ typedef struct AVTScheduler {
 
     /* Scheduling state */
     uint64_t seq;           /* Next packet seq */
+    AVTSchedulerSeq *shared_seq; /* If set, used instead of seq */
     AVTPacketFifo *staging; /* Staging bucket, next for output */
     AVTSlidingWinCtx sw;    /* Sliding window state */
     int64_t avail;
@@ -92,8 +105,7 @@ typedef struct AVTScheduler {
     int nb_buckets;
 } AVTScheduler;
 
-/* Initialization function. If max_pkt_size changes, everything must
- * be torn down and recreated. */
+/* Initialization function. */
 int avt_scheduler_init(AVTScheduler *s,
                        size_t max_pkt_size, int64_t bandwidth);
 
@@ -105,6 +117,25 @@ int avt_scheduler_flush(AVTScheduler *s, AVTPacketFifo **seq);
 
 int avt_scheduler_done(AVTScheduler *s, AVTPacketFifo *seq);
 
+/* Queue packets which were already segmented, interleaved and encoded by
+ * another scheduler with the same max_pkt_size and bandwidth.
+ * Payloads are ref'd. */
+int avt_scheduler_push_seq(AVTScheduler *s, const AVTPacketFifo *seq);
+
+/* Make s allocate sequence numbers from the same counter as src, so that
+ * packets from both, output to the same receivers, never share one.
+ * The counter continues from the highest number either has used. */
+int avt_scheduler_share_seq(AVTScheduler *s, AVTScheduler *src);
+
+/* Return a fully output sequence, so its allocation can be reused. */
+int avt_scheduler_recycle(AVTScheduler *s, AVTPacketFifo *seq);
+
+/* Change the maximum packet size, keeping all queued state.
+ * Packets not yet cut will be segmented at the new size. If it shrunk,
+ * staged packets which no longer fit are re-cut, as long as their
+ * first part is still known, and dropped otherwise. */
+int avt_scheduler_set_max_pkt_size(AVTScheduler *s, size_t max_pkt_size);
+
 void avt_scheduler_free(AVTScheduler *s);
 
 #endif /* AVTRANSPORT_CONNECTION_SCHEDULER_H */
@@ -0,0 +1,575 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <avtransport/avtransport.h>
+#include "stream_scan.h"
+#include "ldpc_encode.h"
+#include "utils_packet.h"
+#include "mem.h"
+
+#include "config.h"
+
+#ifdef CONFIG_HAVE_LIBXXH
+#include <xxhash.h>
+#else
+#define XXH_INLINE_ALL
+#include "extern/xxhash.h"
+#endif
+
+/* Smallest amount of data worth scanning on its own thread */
+#define SCAN_MIN_CHUNK (16*1024*1024)
+#define SCAN_MAX_THREADS 64
+
+#define SCAN_CACHE_MAGIC "AVTIDX02"
+#define SCAN_CACHE_HDR_SIZE (8 + 8 + 8 + 8)
+#define SCAN_CACHE_ENTRY_SIZE (4 + 8 + 8 + 8)
+
+/* Amount of data at the start and end of a stream hashed to tell
+ * whether a cached index still matches it */
+#define SCAN_CACHE_HASH_SIZE (64*1024)
+
+/* Possible first bytes of a descriptor */
+static const bool desc_lead[256] = {
+    [0x00] = true,
+    [(AVT_PKT_STREAM_DATA & 0xFF00) >> 8] = true,
+    [(AVT_PKT_EXTENDED_STREAM_DATA & 0xFF00) >> 8] = true,
+    [(AVT_PKT_TIME_SYNC & 0xFF00) >> 8] = true,
+    [(AVT_PKT_USER_DATA & 0xFF00) >> 8] = true,
+    [(AVT_PKT_STREAM_END & 0xFF00) >> 8] = true,
+    [(AVT_PKT_SESSION_START & 0xFF00) >> 8] = true,
+};
+
+/* Whether any byte in x may start a descriptor. All descriptors start
+ * with a byte lower than 0x10, apart from session start packets.
+ * All 8 bytes are checked at once in a general purpose register. */
+static inline bool scan_word_has_lead(uint64_t x)
+{
+    const uint64_t ones = UINT64_C(0x0101010101010101);
+    const uint64_t high = UINT64_C(0x8080808080808080);
+    const uint64_t ss = x ^ (ones*(AVT_PKT_SESSION_START >> 8));
+
+    return (((x - ones*0x10) & ~x) | ((ss - ones) & ~ss)) & high;
+}
+
+/* Skip over 8-byte words starting at i with nothing resembling
+ * a descriptor. Returns where to check bytewise from, which is where
+ * the first word which can't be skipped starts, or the last word which
+ * fits before end. */
+static size_t scan_skip_c(const uint8_t *data, size_t i, size_t end)
+{
+    while ((i + 8) <= end) {
+        uint64_t x;
+        memcpy(&x, &data[i], sizeof(x));
+        if (scan_word_has_lead(x))
+            break;
+        i += 8;
+    }
+    return i;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+
+/* Same as scan_skip_c, 16 or 32 bytes at a time. Stops at the first
+ * byte which may start a descriptor. */
+__attribute__((target("sse2")))
+static size_t scan_skip_sse2(const uint8_t *data, size_t i, size_t end)
+{
+    const __m128i lead_max = _mm_set1_epi8(0x0F);
+    const __m128i ss = _mm_set1_epi8(AVT_PKT_SESSION_START >> 8);
+
+    while ((i + 16) <= end) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)&data[i]);
+        const __m128i lead = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, lead_max), x),
+                                          _mm_cmpeq_epi8(x, ss));
+        const int mask = _mm_movemask_epi8(lead);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+
+    return scan_skip_c(data, i, end);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_skip_avx2(const uint8_t *data, size_t i, size_t end)
+{
+    const __m256i lead_max = _mm256_set1_epi8(0x0F);
+    const __m256i ss = _mm256_set1_epi8(AVT_PKT_SESSION_START >> 8);
+
+    while ((i + 32) <= end) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)&data[i]);
+        const __m256i lead = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(x, lead_max), x),
+                                             _mm256_cmpeq_epi8(x, ss));
+        const uint32_t mask = _mm256_movemask_epi8(lead);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+
+    return scan_skip_sse2(data, i, end);
+}
+#endif
+
+static inline size_t scan_skip(const uint8_t *data, size_t i, size_t end)
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_skip_avx2(data, i, end);
+    else if (__builtin_cpu_supports("sse2"))
+        return scan_skip_sse2(data, i, end);
+#endif
+    return scan_skip_c(data, i, end);
+}
+
+static inline bool scan_check_parity(const uint8_t *data, size_t len,
+                                     size_t data_len,
+                                     void (*encode)(uint8_t *dst))
+{
+    uint8_t tmp[AVT_MAX_HEADER_LEN - AVT_MIN_HEADER_LEN];
+    memcpy(tmp, data, len);
+    encode(tmp);
+    return !memcmp(&tmp[data_len], &data[data_len], len - data_len);
+}
+
+int avt_scan_check_header(const uint8_t *data, size_t len)
+{
+    if (len < AVT_MIN_HEADER_LEN || !desc_lead[data[0]])
+        return 0;
+
+    const int hdr_size = avt_packet_hdr_size(avt_packet_read_desc(data));
+    if (!hdr_size || hdr_size > len)
+        return 0;
+
+    if (!scan_check_parity(data, AVT_MIN_HEADER_LEN, 224/8,
+                           avt_ldpc_encode_288_224))
+        return 0;
+
+    switch (hdr_size) {
+    case AVT_MIN_HEADER_LEN*2:
+        if (!scan_check_parity(&data[AVT_MIN_HEADER_LEN], AVT_MIN_HEADER_LEN,
+                               224/8, avt_ldpc_encode_288_224))
+            return 0;
+        break;
+    case AVT_MAX_HEADER_LEN:
+        if (!scan_check_parity(&data[AVT_MIN_HEADER_LEN],
+                               AVT_MAX_HEADER_LEN - AVT_MIN_HEADER_LEN,
+                               2016/8, avt_ldpc_encode_2784_2016))
+            return 0;
+        break;
+    default:
+        break;
+    }
+
+    return hdr_size;
+}
+
+/* A header is only plausible if its packet is followed by another header,
+ * or runs past the end of the data. */
+static bool scan_check_next(const uint8_t *data, size_t len, int hdr_size)
+{
+    AVTPktd p;
+    memcpy(p.hdr, data, hdr_size);
+
+    const int64_t pl_bytes = avt_packet_decode_header(NULL, &p);
+    if (pl_bytes < 0)
+        return false;
+
+    const uint64_t next = hdr_size + pl_bytes;
+    if ((next + 2) > len)
+        return true;
+
+    /* Only the descriptor can be checked if the next header is incomplete */
+    const int next_size = avt_packet_hdr_size(avt_packet_read_desc(&data[next]));
+    if ((next + next_size) > len)
+        return next_size;
+
+    return avt_scan_check_header(&data[next], len - next);
+}
+
+size_t avt_scan_find_header(const uint8_t *data, size_t len)
+{
+    size_t i = 0;
+
+    while ((i + AVT_MIN_HEADER_LEN) <= len) {
+        /* Skip over data with nothing resembling a descriptor */
+        i = scan_skip(data, i, len - AVT_MIN_HEADER_LEN);
+
+        const size_t end = AVT_MIN(i + 8, len - AVT_MIN_HEADER_LEN + 1);
+        for (; i < end; i++) {
+            if (!desc_lead[data[i]])
+                continue;
+            const int hdr_size = avt_scan_check_header(&data[i], len - i);
+            if (hdr_size && scan_check_next(&data[i], len - i, hdr_size))
+                return i;
+        }
+    }
+
+    return len;
+}
+
+typedef struct ScanEntry {
+    AVTIndexEntry e; /* With a pts in the timebase of the stream */
+    avt_pos pos;
+    uint16_t stream_id;
+} ScanEntry;
+
+typedef struct ScanTimebase {
+    uint16_t stream_id;
+    AVTRational tb;
+} ScanTimebase;
+
+typedef struct ScanChunk {
+    void *log_ctx;
+    const uint8_t *data;
+    size_t len;
+
+    /* Packets starting in [start, end) are read */
+    avt_pos start;
+    avt_pos end;
+
+    avt_pos first; /* First packet found */
+    avt_pos next; /* First packet after the end */
+
+    ScanEntry *entries;
+    int nb_entries;
+    int nb_alloc_entries;
+
+    ScanTimebase *tbs;
+    int nb_tbs;
+
+    int err;
+} ScanChunk;
+
+static int scan_add_entry(ScanChunk *c, AVTPktd *p, avt_pos pos)
+{
+    if (c->nb_entries == c->nb_alloc_entries) {
+        const int new_alloc = (c->nb_alloc_entries << 1) + 64;
+        ScanEntry *tmp = avt_reallocarray(c->entries, new_alloc, sizeof(*tmp));
+        if (!tmp)
+            return AVT_ERROR(ENOMEM);
+        c->entries = tmp;
+        c->nb_alloc_entries = new_alloc;
+    }
+
+    c->entries[c->nb_entries++] = (ScanEntry) {
+        .e = {
+            .index_entry_descriptor = AVT_PKT_STREAM_DATA,
+            .pts = p->pkt.stream_data.pts,
+            .target_seq = p->pkt.seq,
+        },
+        .pos = pos,
+        .stream_id = p->pkt.stream_id,
+    };
+
+    return 0;
+}
+
+static int scan_add_timebase(ScanChunk *c, AVTStreamRegistration *reg)
+{
+    ScanTimebase *tmp = avt_reallocarray(c->tbs, c->nb_tbs + 1, sizeof(*tmp));
+    if (!tmp)
+        return AVT_ERROR(ENOMEM);
+
+    c->tbs = tmp;
+    c->tbs[c->nb_tbs++] = (ScanTimebase) {
+        .stream_id = reg->stream_id,
+        .tb = reg->timebase,
+    };
+
+    return 0;
+}
+
+static void scan_chunk_reset(ScanChunk *c, avt_pos start)
+{
+    c->start = start;
+    c->nb_entries = 0;
+    c->nb_tbs = 0;
+    c->err = 0;
+}
+
+static void *scan_chunk(void *opaque)
+{
+    int err;
+    ScanChunk *c = opaque;
+    const uint8_t *data = c->data;
+    const size_t len = c->len;
+    AVTPktd *p = malloc(sizeof(*p));
+    if (!p) {
+        c->err = AVT_ERROR(ENOMEM);
+        return NULL;
+    }
+
+    avt_pos pos = c->start + avt_scan_find_header(&data[c->start], len - c->start);
+    c->first = pos;
+
+    while (pos < c->end) {
+        int64_t pl_bytes = -1;
+        const int hdr_size = avt_scan_check_header(&data[pos], len - pos);
+        if (hdr_size) {
+            memcpy(p->hdr, &data[pos], hdr_size);
+            pl_bytes = avt_packet_decode_header(c->log_ctx, p);
+        }
+
+        /* Damaged, or truncated. Resynchronize at the next valid header. */
+        if (pl_bytes < 0 || pl_bytes > (len - pos - hdr_size)) {
+            pos += 1 + avt_scan_find_header(&data[pos + 1], len - pos - 1);
+            continue;
+        }
+
+        err = 0;
+        if (p->pkt.desc == AVT_PKT_STREAM_REGISTRATION)
+            err = scan_add_timebase(c, &p->pkt.stream_registration);
+        else if (p->pkt.desc == AVT_PKT_STREAM_DATA &&
+                 p->pkt.stream_data.frame_type == AVT_FRAME_TYPE_KEY)
+            err = scan_add_entry(c, p, pos);
+        if (err < 0) {
+            c->err = err;
+            break;
+        }
+
+        pos += hdr_size + pl_bytes;
+    }
+
+    c->next = pos;
+    free(p);
+
+    return NULL;
+}
+
+int avt_scan_build_index(void *log_ctx, AVTIndexContext *ic,
+                         const uint8_t *data, size_t len, int nb_threads)
+{
+    int err = 0;
+
+    /* Built separately, so that nothing is left behind on errors */
+    AVTIndexContext res = { .nb_index_max = ic->nb_index_max };
+
+    if (nb_threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        nb_threads = AVT_MAX(nb_threads, 1);
+    }
+
+    const int nb_chunks = AVT_MAX(AVT_MIN(AVT_MIN(nb_threads, SCAN_MAX_THREADS),
+                                          len / SCAN_MIN_CHUNK), 1);
+    const size_t chunk_size = len / nb_chunks;
+
+    ScanChunk *chunks = calloc(nb_chunks, sizeof(*chunks));
+    pthread_t *threads = calloc(nb_chunks, sizeof(*threads));
+    bool *running = calloc(nb_chunks, sizeof(*running));
+    if (!chunks || !threads || !running) {
+        err = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+
+    for (auto i = 0; i < nb_chunks; i++) {
+        chunks[i] = (ScanChunk) {
+            .log_ctx = log_ctx,
+            .data = data,
+            .len = len,
+            .start = i*chunk_size,
+            .end = (i == (nb_chunks - 1)) ? len : (i + 1)*chunk_size,
+        };
+    }
+
+    /* The first chunk is scanned on this thread */
+    for (auto i = 1; i < nb_chunks; i++)
+        running[i] = !pthread_create(&threads[i], NULL, scan_chunk, &chunks[i]);
+    for (auto i = 0; i < nb_chunks; i++) {
+        if (running[i])
+            pthread_join(threads[i], NULL);
+        else
+            scan_chunk(&chunks[i]);
+    }
+
+    /* Stitch the chunks together. A chunk which did not start where its
+     * previous one ended synchronized on data which only looked like a
+     * header, so it gets rescanned from the right place. */
+    for (auto i = 0; i < nb_chunks; i++) {
+        if (i && chunks[i].first != chunks[i - 1].next) {
+            scan_chunk_reset(&chunks[i], chunks[i - 1].next);
+            scan_chunk(&chunks[i]);
+        }
+        if (chunks[i].err < 0) {
+            err = chunks[i].err;
+            goto end;
+        }
+    }
+
+    /* Entries are stored in nanoseconds, so timebases must be known */
+    for (auto i = 0; i < nb_chunks; i++) {
+        for (auto j = 0; j < chunks[i].nb_entries; j++) {
+            ScanEntry *se = &chunks[i].entries[j];
+            ScanTimebase *tb = NULL;
+            for (auto k = 0; k < nb_chunks && !tb; k++)
+                for (auto l = 0; l < chunks[k].nb_tbs && !tb; l++)
+                    if (chunks[k].tbs[l].stream_id == se->stream_id)
+                        tb = &chunks[k].tbs[l];
+            if (!tb)
+                continue;
+
+            AVTIndexEntry e = se->e;
+            e.pts = avt_rescale_rational(e.pts, tb->tb, (AVTRational){ 1, 1000000000 });
+            err = avt_index_list_add(&res, &e, se->pos);
+            if (err < 0)
+                goto end;
+        }
+    }
+
+    avt_log(log_ctx, AVT_LOG_VERBOSE, "Indexed %i keyframes in %i chunks\n",
+            res.nb_index, nb_chunks);
+
+    avt_index_list_free(ic);
+    *ic = res;
+    res = (AVTIndexContext){ };
+
+end:
+    avt_index_list_free(&res);
+    for (auto i = 0; chunks && i < nb_chunks; i++) {
+        free(chunks[i].entries);
+        free(chunks[i].tbs);
+    }
+    free(running);
+    free(threads);
+    free(chunks);
+    return err;
+}
+
+/* Identifies the stream a cache was made for */
+static uint64_t scan_cache_hash(const uint8_t *data, size_t len)
+{
+    const size_t hash_len = AVT_MIN(len, SCAN_CACHE_HASH_SIZE);
+    const uint64_t head = XXH3_64bits(data, hash_len);
+    return XXH3_64bits_withSeed(&data[len - hash_len], hash_len, head);
+}
+
+int avt_scan_cache_read(AVTIndexContext *ic, const char *path,
+                        const uint8_t *data, size_t len)
+{
+    int err = 0;
+    uint8_t hdr[SCAN_CACHE_HDR_SIZE];
+    uint8_t buf[SCAN_CACHE_ENTRY_SIZE];
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return AVT_ERROR(ENOENT);
+
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr, SCAN_CACHE_MAGIC, 8)) {
+        fclose(f);
+        return AVT_ERROR(ENOENT);
+    }
+
+    AVTBytestream bs = avt_bs_init(hdr, sizeof(hdr));
+    avt_bs_skip(&bs, 8);
+    const uint64_t cached_size = avt_bsr_u64b(&bs);
+    const uint64_t cached_hash = avt_bsr_u64b(&bs);
+    const uint64_t nb_entries = avt_bsr_u64b(&bs);
+    if (cached_size != len || cached_hash != scan_cache_hash(data, len)) {
+        fclose(f);
+        return AVT_ERROR(ENOENT);
+    }
+
+    /* Only replaces the index once fully read */
+    AVTIndexContext res = { .nb_index_max = ic->nb_index_max };
+    for (uint64_t i = 0; i < nb_entries; i++) {
+        if (fread(buf, sizeof(buf), 1, f) != 1) {
+            err = AVT_ERROR(ENOENT);
+            break;
+        }
+
+        bs = avt_bs_init(buf, sizeof(buf));
+        AVTIndexEntry e = {
+            .index_entry_descriptor = avt_bsr_u32b(&bs),
+            .pts = avt_bsr_i64b(&bs),
+            .target_seq = avt_bsr_u64b(&bs),
+        };
+        err = avt_index_list_add(&res, &e, avt_bsr_i64b(&bs));
+        if (err < 0)
+            break;
+    }
+
+    fclose(f);
+
+    if (err < 0) {
+        avt_index_list_free(&res);
+        return err;
+    }
+
+    avt_index_list_free(ic);
+    *ic = res;
+
+    return 0;
+}
+
+int avt_scan_cache_write(AVTIndexContext *ic, const char *path,
+                         const uint8_t *data, size_t len)
+{
+    uint8_t hdr[SCAN_CACHE_HDR_SIZE];
+    uint8_t buf[SCAN_CACHE_ENTRY_SIZE];
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return AVT_ERROR(errno);
+
+    AVTBytestream bs = avt_bs_init(hdr, sizeof(hdr));
+    avt_bsw_sbuf(&bs, (const uint8_t *)SCAN_CACHE_MAGIC, 8);
+    avt_bsw_u64b(&bs, len);
+    avt_bsw_u64b(&bs, scan_cache_hash(data, len));
+    avt_bsw_u64b(&bs, ic->nb_index);
+    bool ok = fwrite(hdr, sizeof(hdr), 1, f) == 1;
+    for (auto i = 0; ok && i < ic->nb_index; i++) {
+        /* Entries may have wrapped around */
+        const int idx = ic->nb_index_total > ic->nb_index ?
+                        (ic->nb_index_total + i) % ic->nb_index : i;
+
+        bs = avt_bs_init(buf, sizeof(buf));
+        avt_bsw_u32b(&bs, ic->index[idx].index_entry_descriptor);
+        avt_bsw_i64b(&bs, ic->index[idx].pts);
+        avt_bsw_u64b(&bs, ic->index[idx].target_seq);
+        avt_bsw_i64b(&bs, ic->index_pos[idx]);
+        ok = fwrite(buf, sizeof(buf), 1, f) == 1;
+    }
+
+    if (fclose(f) || !ok) {
+        remove(path);
+        return AVT_ERROR(EIO);
+    }
+
+    return 0;
+}
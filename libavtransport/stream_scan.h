@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AVTRANSPORT_STREAM_SCAN_H
+#define AVTRANSPORT_STREAM_SCAN_H
+
+#include "protocol_common.h"
+
+/* Returns the size of the header at the start of data if its descriptor
+ * is known and its LDPC parity matches, otherwise 0. */
+int avt_scan_check_header(const uint8_t *data, size_t len);
+
+/* Returns the offset of the first valid header in data, or len if there
+ * is none. Headers must also be followed by another valid header where
+ * their packet ends, unless that is past the end of data. */
+size_t avt_scan_find_header(const uint8_t *data, size_t len);
+
+/* Index all keyframes in data, containing an entire stream, by scanning
+ * it in parallel. Damaged headers are skipped over.
+ * If nb_threads is 0, the number of CPUs will be used.
+ * On success, the contents of ic are replaced. On failure, ic is untouched. */
+int avt_scan_build_index(void *log_ctx, AVTIndexContext *ic,
+                         const uint8_t *data, size_t len, int nb_threads);
+
+/* Load an index cached in a sidecar file at path, for the stream in data.
+ * Caches are checked against the stream's size, and a hash of its start
+ * and end. Returns AVT_ERROR(ENOENT) if missing or stale.
+ * On success, the contents of ic are replaced. On failure, ic is untouched. */
+int avt_scan_cache_read(AVTIndexContext *ic, const char *path,
+                        const uint8_t *data, size_t len);
+
+/* Cache an index to a sidecar file at path, for the stream in data */
+int avt_scan_cache_write(AVTIndexContext *ic, const char *path,
+                         const uint8_t *data, size_t len);
+
+#endif /* AVTRANSPORT_STREAM_SCAN_H */
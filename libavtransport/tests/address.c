@@ -284,6 +284,22 @@ int main(void)
         avt_addr_free(&addr);
     }
 
+    /* UDP-Lite checksum coverage */
+    {
+        if ((ret = avt_addr_from_url(NULL, &addr, false, "udplite://192.168.1.5/#cscov=header")) < 0)
+            goto end;
+
+        if (addr.proto != AVT_PROTOCOL_UDP_LITE || addr.opts.cscov != AVT_ADDRESS_CSCOV_HEADER)
+            FAIL(EINVAL);
+
+        avt_addr_free(&addr);
+
+        if (avt_addr_from_url(NULL, &addr, false, "udplite://192.168.1.5/#cscov=none") != AVT_ERROR(EINVAL))
+            FAIL(EINVAL);
+
+        avt_addr_free(&addr);
+    }
+
     /* UUID */
     {
         if ((ret = avt_addr_from_url(NULL, &addr, false, "udp://192.168.1.6/123e4567-e89b-12d3-a456-426614174000")) < 0)
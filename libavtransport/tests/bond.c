@@ -0,0 +1,201 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <avtransport/avtransport.h>
+
+#define NB_PKTS 4
+
+typedef struct BondTestContext {
+    AVTBuffer *src[NB_PKTS];
+    int nb_received;
+    int nb_errors;
+} BondTestContext;
+
+static int stream_pkt_cb(void *opaque, AVTStream *st, AVTPacket pkt)
+{
+    BondTestContext *ctx = opaque;
+    if (ctx->nb_received >= NB_PKTS || pkt.pts != ctx->nb_received) {
+        avt_log(NULL, AVT_LOG_ERROR, "Unexpected packet, pts %" PRIi64 "\n", pkt.pts);
+        ctx->nb_errors++;
+        return 0;
+    }
+
+    size_t ref_len, len;
+    uint8_t *ref = avt_buffer_get_data(ctx->src[ctx->nb_received], &ref_len);
+    uint8_t *data = avt_buffer_get_data(pkt.data, &len);
+    if (len != ref_len || memcmp(ref, data, len)) {
+        avt_log(NULL, AVT_LOG_ERROR, "Packet %i mismatch: %zu vs %zu\n",
+                ctx->nb_received, len, ref_len);
+        ctx->nb_errors++;
+    }
+
+    ctx->nb_received++;
+    return 0;
+}
+
+static int open_conn(AVTContext *avt, AVTConnection **conn,
+                     const char *url, bool listen)
+{
+    AVTConnectionInfo info = {
+        .type = AVT_CONNECTION_URL,
+        .url.url = url,
+        .url.listen = listen,
+        .output_opts.bandwidth = INT64_MAX,
+    };
+    return avt_connection_init(avt, conn, &info);
+}
+
+int main(void)
+{
+    int ret;
+    AVTContext *avt;
+    AVTConnection *tx[2] = { }, *rx[2] = { };
+    AVTSender *s = NULL;
+    BondTestContext ctx = { };
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    if ((ret = open_conn(avt, &rx[0], "udp://[::1]:8217", true)) < 0 ||
+        (ret = open_conn(avt, &rx[1], "udp://[::1]:8218", true)) < 0 ||
+        (ret = open_conn(avt, &tx[0], "udp://[::1]:8217", false)) < 0 ||
+        (ret = open_conn(avt, &tx[1], "udp://[::1]:8218", false)) < 0)
+        goto end;
+
+    /* Both paths feed the same receiver */
+    AVTReceiveCallbacks cb = {
+        .stream_pkt_cb = stream_pkt_cb,
+    };
+    for (int i = 0; i < 2; i++) {
+        ret = avt_receive_open(avt, rx[i], &cb, &ctx, &(AVTReceiveOptions){ });
+        if (ret < 0)
+            goto end;
+    }
+
+    /* The first path has thrice the capacity of the second */
+    if ((ret = avt_send_bond(avt, &s, tx[0], 3000000, &(AVTSenderOptions){ })) < 0 ||
+        (ret = avt_send_bond(avt, &s, tx[1], 1000000, &(AVTSenderOptions){ })) < 0)
+        goto end;
+
+    if (avt_send_bond(avt, &s, tx[1], 1000000, &(AVTSenderOptions){ }) != AVT_ERROR(EEXIST)) {
+        avt_log(NULL, AVT_LOG_ERROR, "Path added twice\n");
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Capacities are not estimated */
+    if (avt_send_bond(avt, &s, tx[1], 0, &(AVTSenderOptions){ }) != AVT_ERROR(EINVAL)) {
+        avt_log(NULL, AVT_LOG_ERROR, "Path added without a capacity\n");
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    AVTStream *st = avt_send_stream_add(s, 0);
+    if (!st) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+    st->codec_id = AVT_CODEC_ID_RAW_VIDEO;
+    st->timebase = (AVTRational){ 1, 1000 };
+
+    ret = avt_send_stream_update(st);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < NB_PKTS; i++) {
+        /* Alternate between small and segmented packets */
+        size_t len = (i & 1) ? 32*1024 + i : 100 + i;
+        ctx.src[i] = avt_buffer_alloc(len);
+        if (!ctx.src[i]) {
+            ret = AVT_ERROR(ENOMEM);
+            goto end;
+        }
+
+        uint8_t *data = avt_buffer_get_data(ctx.src[i], NULL);
+        for (int j = 0; j < len; j++)
+            data[j] = rand() & 0xFF;
+
+        ret = avt_send_stream_data(st, &(AVTPacket) {
+            .data = ctx.src[i],
+            .total_size = len,
+            .pts = i,
+            .duration = 1,
+        });
+        if (ret < 0)
+            goto end;
+
+        for (int j = 0; j < 2; j++) {
+            do {
+                ret = avt_connection_process(tx[j], 0);
+            } while (ret >= 0);
+            if (ret != AVT_ERROR(EAGAIN))
+                goto end;
+        }
+    }
+
+    /* The last packets are held back until the other path goes silent */
+    for (int i = 0; i < 1000 && ctx.nb_received < NB_PKTS; i++) {
+        for (int j = 0; j < 2; j++) {
+            ret = avt_connection_process(rx[j], 0);
+            if (ret < 0 && ret != AVT_ERROR(EAGAIN))
+                goto end;
+        }
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+    }
+
+    AVTConnectionStatus status[2];
+    for (int i = 0; i < 2; i++) {
+        ret = avt_connection_get_status(tx[i], &status[i]);
+        if (ret < 0)
+            goto end;
+    }
+
+    avt_log(NULL, AVT_LOG_INFO, "Received %i packets over %" PRIu64 " + %" PRIu64
+            " segments, %i errors\n", ctx.nb_received,
+            status[0].tx.packets, status[1].tx.packets, ctx.nb_errors);
+
+    if (ctx.nb_received != NB_PKTS || ctx.nb_errors ||
+        !status[1].tx.packets || status[0].tx.packets <= status[1].tx.packets)
+        ret = AVT_ERROR(EINVAL);
+
+end:
+    avt_send_close(&s);
+    avt_receive_close(avt);
+    for (int i = 0; i < 2; i++) {
+        avt_connection_destroy(&tx[i]);
+        avt_connection_destroy(&rx[i]);
+    }
+    for (int i = 0; i < NB_PKTS; i++)
+        avt_buffer_unref(&ctx.src[i]);
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include "dedup.h"
+
+#define FAIL(msg)                                   \
+    do {                                            \
+        fprintf(stderr, msg "\n");                  \
+        return EINVAL;                              \
+    } while (0)
+
+int main(void)
+{
+    AVTDedup d = { };
+
+    fprintf(stderr, "Testing duplicates...\n");
+    for (uint32_t i = 0; i < 3*AVT_DEDUP_WINDOW; i++) {
+        if (avt_dedup_check(&d, i) || avt_dedup_mark(&d, i))
+            FAIL("New packet reported as a duplicate");
+        if (!avt_dedup_check(&d, i) || !avt_dedup_mark(&d, i))
+            FAIL("Duplicate packet not detected");
+    }
+
+    fprintf(stderr, "Testing out of order packets...\n");
+    d = (AVTDedup){ };
+    for (uint32_t i = 0; i < 1000; i += 2)
+        avt_dedup_mark(&d, i);
+    for (uint32_t i = 1; i < 1000; i += 2) {
+        if (avt_dedup_mark(&d, i))
+            FAIL("Late packet reported as a duplicate");
+        if (!avt_dedup_mark(&d, i - 1))
+            FAIL("Duplicate of an older packet not detected");
+    }
+
+    fprintf(stderr, "Testing window sliding and wraparound...\n");
+    d = (AVTDedup){ };
+    const uint32_t start = UINT32_MAX - 10;
+    avt_dedup_mark(&d, start);
+    avt_dedup_mark(&d, start + AVT_DEDUP_WINDOW - 1);
+    if (!avt_dedup_check(&d, start))
+        FAIL("Packet forgotten while still in the window");
+    if (avt_dedup_mark(&d, start + AVT_DEDUP_WINDOW))
+        FAIL("Slid out bit not cleared");
+    if (avt_dedup_check(&d, start))
+        FAIL("Packet outside of the window reported as a duplicate");
+    if (avt_dedup_mark(&d, start + 4*AVT_DEDUP_WINDOW) ||
+        avt_dedup_check(&d, start + AVT_DEDUP_WINDOW))
+        FAIL("Window not reset after a jump");
+
+    /* Half the sequence number space away is neither ahead nor behind */
+    d = (AVTDedup){ };
+    avt_dedup_mark(&d, 0x80000000);
+    if (avt_dedup_mark(&d, 0) || avt_dedup_mark(&d, 0))
+        FAIL("Packet half the sequence space behind reported as a duplicate");
+    if (!avt_dedup_check(&d, 0x80000000))
+        FAIL("Window moved by a packet half the sequence space behind");
+
+    return 0;
+}
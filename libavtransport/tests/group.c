@@ -0,0 +1,260 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <avtransport/avtransport.h>
+#include "output_internal.h"
+#include "utils_packet.h"
+
+#define NB_PKTS 4
+#define MAX_DGRAMS 256
+
+typedef struct GroupTestSink {
+    int fd;
+    uint8_t *dgram[MAX_DGRAMS];
+    size_t len[MAX_DGRAMS];
+    int nb;
+} GroupTestSink;
+
+static int sink_open(GroupTestSink *sink, int port)
+{
+    struct sockaddr_in6 addr = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+
+    sink->fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sink->fd < 0)
+        return AVT_ERROR(errno);
+
+    if (bind(sink->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return AVT_ERROR(errno);
+
+    return 0;
+}
+
+/* Read datagrams until none arrive for a while */
+static int sink_read(GroupTestSink *sink)
+{
+    uint8_t buf[65536];
+    struct pollfd pfd = { .fd = sink->fd, .events = POLLIN };
+
+    while (poll(&pfd, 1, 200) > 0) {
+        ssize_t len = recv(sink->fd, buf, sizeof(buf), 0);
+        if (len < 0)
+            return AVT_ERROR(errno);
+        else if (sink->nb == MAX_DGRAMS)
+            return AVT_ERROR(ENOSPC);
+
+        sink->dgram[sink->nb] = malloc(len);
+        if (!sink->dgram[sink->nb])
+            return AVT_ERROR(ENOMEM);
+        memcpy(sink->dgram[sink->nb], buf, len);
+        sink->len[sink->nb++] = len;
+    }
+
+    return 0;
+}
+
+static void sink_close(GroupTestSink *sink)
+{
+    for (int i = 0; i < sink->nb; i++)
+        free(sink->dgram[i]);
+    if (sink->fd >= 0)
+        close(sink->fd);
+}
+
+static int check_sinks(GroupTestSink *sink)
+{
+    int nb[2] = { };
+    int idx[2][MAX_DGRAMS];
+    uint32_t seq[MAX_DGRAMS];
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < sink[i].nb; j++) {
+            const uint8_t *d = sink[i].dgram[j];
+
+            /* Every packet type carries its sequence number at the same place */
+            seq[j] = AVT_RB32(&d[AVT_PKT_SESSION_START_OFF_GLOBAL_SEQ]);
+            for (int k = 0; k < j; k++) {
+                if (seq[k] == seq[j]) {
+                    printf("Sink %i: sequence number %u used twice\n", i, seq[j]);
+                    return AVT_ERROR(EINVAL);
+                }
+            }
+
+            /* Session start packets are unique to each connection */
+            if (avt_packet_read_desc(d) != AVT_PKT_SESSION_START)
+                idx[i][nb[i]++] = j;
+        }
+    }
+
+    if (nb[0] != nb[1] || nb[0] <= NB_PKTS) {
+        printf("Received %i and %i packets\n", nb[0], nb[1]);
+        return AVT_ERROR(EINVAL);
+    }
+
+    for (int i = 0; i < nb[0]; i++) {
+        const int a = idx[0][i], b = idx[1][i];
+        if (sink[0].len[a] != sink[1].len[b] ||
+            memcmp(sink[0].dgram[a], sink[1].dgram[b], sink[0].len[a])) {
+            printf("Packet %i differs between connections\n", i);
+            return AVT_ERROR(EINVAL);
+        }
+    }
+
+    return 0;
+}
+
+static int group_test(AVTContext *avt, int64_t bandwidth, int port)
+{
+    int ret;
+    AVTConnection *tx[2] = { };
+    AVTSender *s = NULL;
+    AVTBuffer *buf = NULL;
+    GroupTestSink sink[2] = { { .fd = -1 }, { .fd = -1 } };
+
+    for (int i = 0; i < 2; i++) {
+        ret = sink_open(&sink[i], port + i);
+        if (ret < 0)
+            goto end;
+
+        char url[64];
+        snprintf(url, sizeof(url), "udp://[::1]:%i", port + i);
+        AVTConnectionInfo info = {
+            .type = AVT_CONNECTION_URL,
+            .url.url = url,
+            .output_opts.bandwidth = bandwidth,
+        };
+        ret = avt_connection_init(avt, &tx[i], &info);
+        if (ret < 0)
+            goto end;
+
+        ret = avt_send_open(avt, &s, tx[i], &(AVTSenderOptions){ });
+        if (ret < 0)
+            goto end;
+    }
+
+    /* Both connections must be packetized by the same scheduler */
+    if (s->nb_groups != 1 || s->groups[0].nb_conn != 2) {
+        printf("Connections were not grouped: %u groups\n", s->nb_groups);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    AVTStream *st = avt_send_stream_add(s, 0);
+    if (!st) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+    st->codec_id = AVT_CODEC_ID_RAW_VIDEO;
+    st->timebase = (AVTRational){ 1, 1000 };
+
+    ret = avt_send_stream_update(st);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < NB_PKTS; i++) {
+        /* Alternate between small and segmented packets */
+        size_t len = (i & 1) ? 32*1024 + i : 100 + i;
+        buf = avt_buffer_alloc(len);
+        if (!buf) {
+            ret = AVT_ERROR(ENOMEM);
+            goto end;
+        }
+
+        uint8_t *data = avt_buffer_get_data(buf, NULL);
+        for (int j = 0; j < len; j++)
+            data[j] = rand() & 0xFF;
+
+        ret = avt_send_stream_data(st, &(AVTPacket) {
+            .data = buf,
+            .total_size = len,
+            .pts = i,
+            .duration = 1,
+        });
+        avt_buffer_unref(&buf);
+        if (ret < 0)
+            goto end;
+
+        for (int j = 0; j < 2; j++) {
+            do {
+                ret = avt_connection_process(tx[j], 0);
+            } while (ret >= 0);
+            if (ret != AVT_ERROR(EAGAIN))
+                goto end;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        ret = sink_read(&sink[i]);
+        if (ret < 0)
+            goto end;
+    }
+
+    ret = check_sinks(sink);
+
+end:
+    avt_send_close(&s);
+    for (int i = 0; i < 2; i++) {
+        avt_connection_destroy(&tx[i]);
+        sink_close(&sink[i]);
+    }
+    return ret;
+}
+
+int main(void)
+{
+    int ret;
+    AVTContext *avt;
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    ret = group_test(avt, INT64_MAX, 8233);
+    if (ret < 0)
+        printf("Grouped output without interleaving failed: %i\n", ret);
+
+    /* Connections interleaving for the same bandwidth also share output */
+    if (ret >= 0) {
+        ret = group_test(avt, 100*1000*1000, 8235);
+        if (ret < 0)
+            printf("Grouped output with interleaving failed: %i\n", ret);
+    }
+
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <avtransport/avtransport.h>
+
+/* Compressed payloads are hashed one compressor chunk (128 KiB of input)
+ * at a time. Sizes straddle the chunk boundaries, and alternate between
+ * compressible and incompressible data, so that the output of one chunk
+ * can be either tiny or larger than a chunk. */
+static const size_t pkt_sizes[] = {
+    100,
+    128*1024 - 1,
+    128*1024,
+    128*1024 + 1,
+    300*1024,
+    512*1024 + 7,
+};
+#define NB_PKTS (sizeof(pkt_sizes)/sizeof(*pkt_sizes))
+
+typedef struct HashTestContext {
+    AVTBuffer *src[NB_PKTS];
+    int nb_received;
+    int nb_errors;
+} HashTestContext;
+
+static int stream_register_cb(void *opaque, AVTStream *st)
+{
+    return 0;
+}
+
+/* Packets whose hash did not match are dropped by the receiver */
+static int stream_pkt_cb(void *opaque, AVTStream *st, AVTPacket pkt)
+{
+    HashTestContext *ctx = opaque;
+    if (pkt.pts < 0 || pkt.pts >= NB_PKTS) {
+        avt_log(NULL, AVT_LOG_ERROR, "Unexpected packet, pts %" PRIi64 "\n", pkt.pts);
+        ctx->nb_errors++;
+        return 0;
+    }
+
+    size_t ref_len, len;
+    uint8_t *ref = avt_buffer_get_data(ctx->src[pkt.pts], &ref_len);
+    uint8_t *data = avt_buffer_get_data(pkt.data, &len);
+    if (len != ref_len || memcmp(ref, data, len)) {
+        avt_log(NULL, AVT_LOG_ERROR, "Packet %" PRIi64 " mismatch: %zu vs %zu\n",
+                pkt.pts, len, ref_len);
+        ctx->nb_errors++;
+    }
+
+    ctx->nb_received++;
+    return 0;
+}
+
+static int open_conn(AVTContext *avt, AVTConnection **conn,
+                     const char *url, bool listen)
+{
+    AVTConnectionInfo info = {
+        .type = AVT_CONNECTION_URL,
+        .url.url = url,
+        .url.listen = listen,
+        .output_opts.bandwidth = INT64_MAX,
+    };
+    return avt_connection_init(avt, conn, &info);
+}
+
+int main(void)
+{
+    int ret;
+    AVTContext *avt;
+    AVTConnection *rx = NULL, *tx = NULL;
+    AVTSender *s = NULL;
+    HashTestContext ctx = { };
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    /* Use a port of our own, so that concurrent runs don't collide */
+    char rx_url[64], tx_url[64];
+    const int port = 20000 + getpid() % 20000;
+    snprintf(tx_url, sizeof(tx_url), "udp://[::1]:%i", port);
+
+    /* The largest packet is sent in one go, so it must fit in the socket */
+    snprintf(rx_url, sizeof(rx_url), "udp://[::1]:%i/#rx_buf=4194304", port);
+
+    if ((ret = open_conn(avt, &rx, rx_url, true)) < 0 ||
+        (ret = open_conn(avt, &tx, tx_url, false)) < 0)
+        goto end;
+
+    AVTReceiveCallbacks cb = {
+        .stream_register_cb = stream_register_cb,
+        .stream_pkt_cb = stream_pkt_cb,
+    };
+    ret = avt_receive_open(avt, rx, &cb, &ctx, &(AVTReceiveOptions){ });
+    if (ret < 0)
+        goto end;
+
+    ret = avt_send_open(avt, &s, tx, &(AVTSenderOptions){
+        .hash = true,
+        .compress = AVT_SENDER_COMPRESS_VIDEO,
+    });
+    if (ret < 0)
+        goto end;
+
+    AVTStream *st = avt_send_stream_add(s, 0);
+    if (!st) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+    st->codec_id = AVT_CODEC_ID_RAW_VIDEO;
+    st->timebase = (AVTRational){ 1, 1000 };
+
+    ret = avt_send_stream_update(st);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < NB_PKTS; i++) {
+        size_t len = pkt_sizes[i];
+        ctx.src[i] = avt_buffer_alloc(len);
+        if (!ctx.src[i]) {
+            ret = AVT_ERROR(ENOMEM);
+            goto end;
+        }
+
+        uint8_t *data = avt_buffer_get_data(ctx.src[i], NULL);
+        for (int j = 0; j < len; j++)
+            data[j] = (i & 1) ? rand() & 0xFF : rand() & 0x3;
+
+        ret = avt_send_stream_data(st, &(AVTPacket) {
+            .data = ctx.src[i],
+            .total_size = len,
+            .pts = i,
+            .duration = 1,
+        });
+        if (ret < 0)
+            goto end;
+
+        do {
+            ret = avt_connection_process(tx, 0);
+        } while (ret >= 0);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        /* Drain the loopback socket before it fills up */
+        for (int j = 0; j < 1000 && ctx.nb_received <= i; j++) {
+            ret = avt_connection_process(rx, 0);
+            if (ret < 0 && ret != AVT_ERROR(EAGAIN))
+                goto end;
+        }
+    }
+
+    avt_log(NULL, AVT_LOG_INFO, "Received %i packets, %i errors\n",
+            ctx.nb_received, ctx.nb_errors);
+
+    ret = (ctx.nb_received == NB_PKTS && !ctx.nb_errors) ? 0 : AVT_ERROR(EINVAL);
+
+end:
+    avt_send_close(&s);
+    avt_receive_close(avt);
+    avt_connection_destroy(&tx);
+    avt_connection_destroy(&rx);
+    for (int i = 0; i < NB_PKTS; i++)
+        avt_buffer_unref(&ctx.src[i]);
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
@@ -25,14 +25,142 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 
 #include <avtransport/avtransport.h>
 #include "io_common.h"
+#include "buffer.h"
 
 #include "file_io_common.h"
 
 extern const AVTIO avt_io_mmap_path;
 
+/* Write enough to remap and write back the file multiple times */
+static int64_t grow_test(AVTContext *avt, const AVTIO *io, AVTIOCtx *io_ctx)
+{
+    int64_t ret;
+    const size_t pl_len = 3*1024*1024 + 17;
+    AVTPktd p = { .hdr_len = 16 };
+    avt_pos start = 0;
+
+    for (int i = 0; i < 8; i++) {
+        uint8_t *data = avt_buffer_quick_alloc(&p.pl, pl_len);
+        if (!data)
+            return AVT_ERROR(ENOMEM);
+        memset(p.hdr, i, p.hdr_len);
+        memset(data, ~i, pl_len);
+
+        ret = io->write_pkt(io_ctx, &p, INT64_MAX);
+        avt_buffer_quick_unref(&p.pl);
+        if (ret < 0)
+            return ret;
+        if (!i)
+            start = ret;
+    }
+
+    ret = io->seek(io_ctx, start);
+    if (ret < 0)
+        return ret;
+
+    AVTBuffer buf = { };
+    for (int i = 0; i < 8; i++) {
+        ret = io->read_input(io_ctx, &buf, p.hdr_len + pl_len, INT64_MAX, 0);
+        if (ret < 0)
+            return ret;
+
+        size_t len;
+        uint8_t *data = avt_buffer_get_data(&buf, &len);
+        if (len != (p.hdr_len + pl_len)) {
+            avt_buffer_quick_unref(&buf);
+            return AVT_ERROR(EINVAL);
+        }
+
+        for (size_t j = 0; j < len; j++) {
+            if (data[j] != (uint8_t)(j < p.hdr_len ? i : ~i)) {
+                printf("Mismatch in grown file at packet %i, byte %zu\n", i, j);
+                avt_buffer_quick_unref(&buf);
+                return AVT_ERROR(EINVAL);
+            }
+        }
+    }
+    avt_buffer_quick_unref(&buf);
+
+    return 0;
+}
+
+/* Data handed out as references must not change under them */
+static int64_t rewrite_test(AVTContext *avt, const AVTIO *io, AVTIOCtx *io_ctx)
+{
+    int64_t ret;
+    AVTPktd p = { .hdr_len = 16 };
+    AVTBuffer buf = { };
+
+    uint8_t *data = avt_buffer_quick_alloc(&p.pl, 64);
+    if (!data)
+        return AVT_ERROR(ENOMEM);
+    memset(p.hdr, 1, p.hdr_len);
+    memset(data, 1, 64);
+
+    avt_pos pos = io->write_pkt(io_ctx, &p, INT64_MAX);
+    if (pos < 0) {
+        ret = pos;
+        goto end;
+    }
+
+    ret = io->seek(io_ctx, pos);
+    if (ret < 0)
+        goto end;
+
+    ret = io->read_input(io_ctx, &buf, p.hdr_len + 64, INT64_MAX, 0);
+    if (ret < 0)
+        goto end;
+
+    memset(data, 2, 64);
+    ret = io->rewrite(io_ctx, &p, pos, INT64_MAX);
+    if (ret != AVT_ERROR(EBUSY)) {
+        printf("Referenced data rewritten: %" PRIi64 "\n", ret);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    size_t len;
+    const uint8_t *ref = avt_buffer_get_data(&buf, &len);
+    if (len != (p.hdr_len + 64) || ref[len - 1] != 1) {
+        printf("Referenced data changed\n");
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Once no references are left, rewriting is fine */
+    avt_buffer_quick_unref(&buf);
+    ret = io->rewrite(io_ctx, &p, pos, INT64_MAX);
+    if (ret < 0)
+        goto end;
+
+    ret = io->seek(io_ctx, pos);
+    if (ret < 0)
+        goto end;
+
+    ret = io->read_input(io_ctx, &buf, p.hdr_len + 64, INT64_MAX, 0);
+    if (ret < 0)
+        goto end;
+
+    ref = avt_buffer_get_data(&buf, &len);
+    if (len != (p.hdr_len + 64) || ref[len - 1] != 2) {
+        printf("Rewrite not applied\n");
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    avt_buffer_quick_unref(&buf);
+    avt_buffer_quick_unref(&p.pl);
+    return ret;
+}
+
 int main(void)
 {
     int64_t ret;
@@ -56,6 +184,10 @@ int main(void)
     }
 
     ret = file_io_test(avt, io, io_ctx);
+    if (!ret)
+        ret = grow_test(avt, io, io_ctx);
+    if (!ret)
+        ret = rewrite_test(avt, io, io_ctx);
 
     if (ret)
         io->close(&io_ctx);
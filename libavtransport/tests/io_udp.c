@@ -24,6 +24,8 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <netinet/in.h>
+
 #include "net_io_common.h"
 
 extern const AVTIO avt_io_udp;
@@ -36,6 +38,10 @@ int main(void)
         return AVT_ERROR(ret);
 
     ret = net_io_test(&ntc);
+    if (ret >= 0)
+        ret = net_io_fanout_test(&ntc, "udp://[::1]:30001");
+    if (ret >= 0)
+        ret = net_io_shard_test(&ntc, "udp://[::]:30002", IPPROTO_UDP);
 
     net_io_free(&ntc);
     return AVT_ERROR(ret);
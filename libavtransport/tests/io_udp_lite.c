@@ -24,10 +24,132 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <avtransport/avtransport.h>
 #include "net_io_common.h"
 
+#ifndef UDPLITE_SEND_CSCOV
+#define UDPLITE_SEND_CSCOV 10
+#endif
+#ifndef UDPLITE_RECV_CSCOV
+#define UDPLITE_RECV_CSCOV 11
+#endif
+
+#define CSCOV_PORT 30003
+#define CSCOV_HDR_LEN 200
+#define CSCOV_PL_LEN 64
+
 extern const AVTIO avt_io_udp_lite;
 
+/* Receive a datagram, returning its length, or -1 if none arrived */
+static ssize_t cscov_recv(int fd)
+{
+    uint8_t buf[1024];
+    return recv(fd, buf, sizeof(buf), 0);
+}
+
+/* With header coverage, all of every header must be covered. The receiver
+ * drops anything covering less than the long header. */
+static int net_io_cscov_test(NetTestContext *ntc)
+{
+    int ret;
+    int fd = -1;
+    AVTAddress addr = { };
+    AVTIOCtx *io = NULL;
+    AVTPktd pkt[2] = { };
+
+    fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDPLITE);
+    if (fd < 0)
+        return AVT_ERROR(errno);
+
+    const int recv_cscov = 8 + CSCOV_HDR_LEN;
+    const struct sockaddr_in6 sa = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(CSCOV_PORT),
+        .sin6_addr = in6addr_loopback,
+    };
+    if (setsockopt(fd, IPPROTO_UDPLITE, UDPLITE_RECV_CSCOV,
+                   &recv_cscov, sizeof(recv_cscov)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+                   &(struct timeval){ .tv_usec = 200000 }, sizeof(struct timeval)) < 0 ||
+        bind(fd, (const struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        ret = AVT_ERROR(errno);
+        goto end;
+    }
+
+    ret = avt_addr_from_url(ntc->avt, &addr, false, "udplite://[::1]:30003/#cscov=header");
+    if (ret < 0)
+        goto end;
+
+    ret = ntc->io->init(ntc->avt, &io, &addr);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < 2; i++) {
+        pkt[i].hdr_len = !i ? AVT_MIN_HEADER_LEN : CSCOV_HDR_LEN;
+        memset(pkt[i].hdr, i + 1, pkt[i].hdr_len);
+        uint8_t *data = avt_buffer_quick_alloc(&pkt[i].pl, CSCOV_PL_LEN);
+        if (!data) {
+            ret = AVT_ERROR(ENOMEM);
+            goto end;
+        }
+        memset(data, i + 1, CSCOV_PL_LEN);
+    }
+
+    /* A long header on its own */
+    ret = ntc->io->write_pkt(io, &pkt[1], 0);
+    if (ret >= 0 && cscov_recv(fd) != (CSCOV_HDR_LEN + CSCOV_PL_LEN)) {
+        avt_log(ntc->avt, AVT_LOG_ERROR, "Long header not covered\n");
+        ret = AVT_ERROR(EINVAL);
+    }
+    if (ret < 0)
+        goto end;
+
+    /* Short headers get their own coverage */
+    int cscov;
+    socklen_t cscov_len = sizeof(cscov);
+    ret = ntc->io->write_pkt(io, &pkt[0], 0);
+    if (ret >= 0 && (getsockopt(ntc->io->get_fd(io), IPPROTO_UDPLITE, UDPLITE_SEND_CSCOV,
+                                &cscov, &cscov_len) < 0 ||
+                     cscov != (8 + AVT_MIN_HEADER_LEN))) {
+        avt_log(ntc->avt, AVT_LOG_ERROR, "Short header coverage not restored\n");
+        ret = AVT_ERROR(EINVAL);
+    }
+    if (ret < 0)
+        goto end;
+
+    /* Dropped by the receiver, which wants more covered */
+    cscov_recv(fd);
+
+    /* Mixed in a batch, both must be fully covered */
+    ret = ntc->io->write_vec(io, pkt, 2, 0);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < 2; i++) {
+        if (cscov_recv(fd) != (pkt[i].hdr_len + CSCOV_PL_LEN)) {
+            avt_log(ntc->avt, AVT_LOG_ERROR, "Batched packet %i not covered\n", i);
+            ret = AVT_ERROR(EINVAL);
+            break;
+        }
+    }
+
+end:
+    for (int i = 0; i < 2; i++)
+        avt_buffer_quick_unref(&pkt[i].pl);
+    if (io)
+        ntc->io->close(&io);
+    avt_addr_free(&addr);
+    if (fd >= 0)
+        close(fd);
+    return ret < 0 ? ret : 0;
+}
+
 int main(void)
 {
     NetTestContext ntc;
@@ -36,6 +158,12 @@ int main(void)
         return AVT_ERROR(ret);
 
     ret = net_io_test(&ntc);
+    if (ret >= 0)
+        ret = net_io_fanout_test(&ntc, "udplite://[::1]:30001");
+    if (ret >= 0)
+        ret = net_io_shard_test(&ntc, "udplite://[::]:30002", IPPROTO_UDPLITE);
+    if (ret >= 0)
+        ret = net_io_cscov_test(&ntc);
 
     net_io_free(&ntc);
     return AVT_ERROR(ret);
@@ -26,9 +26,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "ldpc_tables.h"
+#include "ldpc_encode.h"
 
 #define DATA_LEN 1024
 #define PARITY_LEN 1024
@@ -73,5 +75,25 @@ int main(void)
         }
     }
 
+    /* Updating a code must give the same result as encoding from scratch */
+    uint8_t hdr[36], ref[36], diff[28];
+    for (int i = 0; i < 28; i++)
+        hdr[i] = ref[i] = rand() & 0xFF;
+    for (int i = 4; i < 20; i++)
+        ref[i] = rand() & 0xFF;
+
+    avt_ldpc_encode_288_224(hdr);
+    avt_ldpc_encode_288_224(ref);
+
+    for (int i = 0; i < 28; i++)
+        diff[i] = hdr[i] ^ ref[i];
+    memcpy(hdr, ref, 28);
+    avt_ldpc_update_288_224(hdr, diff, 0, 28);
+
+    if (memcmp(hdr, ref, 36)) {
+        printf("Mismatch between updated and encoded code\n");
+        return 1;
+    }
+
     return 0;
 }
@@ -25,6 +25,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "merger.h"
 #include "buffer.h"
@@ -243,6 +244,255 @@ int main(void)
         ret = 0;
     }
 
+    {
+        fprintf(stderr, "Testing in-place segment + packet + in-place segment merger...\n");
+        hdr = (AVTPktd) {
+            .pkt = AVT_STREAM_DATA_HDR(
+                .frame_type = AVT_FRAME_TYPE_KEY,
+                .pkt_in_fec_group = 0,
+                .field_id = 0,
+                .pkt_compression = AVT_DATA_COMPRESSION_NONE,
+                .stream_id = 0,
+                .pts = 0,
+                .duration = 1,
+            ),
+        };
+        hdr.pkt.seq = 10;
+
+        hdr_data = avt_buffer_quick_alloc(&hdr.pl, 64);
+        if (!hdr_data)
+            return ENOMEM;
+        memset(hdr_data, 0, 64);
+        avt_packet_change_size(&hdr, 0, 64, 192);
+
+        /* Received in place, before the main packet */
+        seg.pkt = avt_packet_create_segment(&hdr, 12, 128, 64, 192);
+        ret = avt_pkt_merge_place(NULL, &s, &seg);
+        if (ret < 0)
+            goto end;
+        memset(avt_buffer_get_data(&seg.pl, NULL), 2, 64);
+
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        ret = avt_pkt_merge_seg(NULL, &s, &hdr);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        /* Neither a duplicate nor an overlap may be placed over it */
+        seg.pkt = avt_packet_create_segment(&hdr, 12, 128, 64, 192);
+        ret = avt_pkt_merge_place(NULL, &s, &seg);
+        if (ret != AVT_ERROR(EEXIST)) {
+            fprintf(stderr, "Duplicate segment placed: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        seg.pkt = avt_packet_create_segment(&hdr, 13, 96, 64, 192);
+        ret = avt_pkt_merge_place(NULL, &s, &seg);
+        if (ret != AVT_ERROR(EINVAL)) {
+            fprintf(stderr, "Overlapping segment placed: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        seg.pkt = avt_packet_create_segment(&hdr, 11, 64, 64, 192);
+        ret = avt_pkt_merge_place(NULL, &s, &seg);
+        if (ret < 0)
+            goto end;
+        memset(avt_buffer_get_data(&seg.pl, NULL), 1, 64);
+
+        /* Output */
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        if (ret != 192) {
+            ret = ret < 0 ? ret : AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        size_t out_len;
+        uint8_t *out = avt_buffer_get_data(&seg.pl, &out_len);
+        for (int i = 0; i < out_len; i++) {
+            if (out[i] != (i >> 6)) {
+                fprintf(stderr, "Mismatch at %i: %i\n", i, out[i]);
+                ret = AVT_ERROR(EINVAL);
+                goto end;
+            }
+        }
+        avt_buffer_quick_unref(&seg.pl);
+
+        ret = 0;
+    }
+
+    {
+        fprintf(stderr, "Testing out of order, duplicate and uneven segments...\n");
+        hdr = (AVTPktd) {
+            .pkt = AVT_STREAM_DATA_HDR(
+                .frame_type = AVT_FRAME_TYPE_KEY,
+                .pkt_in_fec_group = 0,
+                .field_id = 0,
+                .pkt_compression = AVT_DATA_COMPRESSION_NONE,
+                .stream_id = 0,
+                .pts = 0,
+                .duration = 1,
+            ),
+        };
+        hdr.pkt.seq = 20;
+
+        if (!avt_buffer_quick_alloc(&hdr.pl, 100))
+            return ENOMEM;
+        avt_packet_change_size(&hdr, 0, 100, 1000);
+
+        /* Everything but the header packet and 500-600, backwards */
+        for (int i = 9; i > 0; i--) {
+            if (i == 5)
+                continue;
+            seg.pkt = avt_packet_create_segment(&hdr, 20 + i, 100*i, 100, 1000);
+            if (!avt_buffer_quick_alloc(&seg.pl, 100))
+                return ENOMEM;
+            ret = avt_pkt_merge_seg(NULL, &s, &seg);
+            avt_buffer_quick_unref(&seg.pl);
+            if (ret != AVT_ERROR(EAGAIN))
+                goto end;
+        }
+
+        /* Duplicate */
+        seg.pkt = avt_packet_create_segment(&hdr, 27, 700, 100, 1000);
+        if (!avt_buffer_quick_alloc(&seg.pl, 100))
+            return ENOMEM;
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        avt_buffer_quick_unref(&seg.pl);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        AVTMergerRange missing[4];
+        ret = avt_pkt_merge_missing(&s, missing, 4);
+        if (ret != 2 ||
+            missing[0].offset != 0   || missing[0].size != 100 ||
+            missing[1].offset != 500 || missing[1].size != 100) {
+            fprintf(stderr, "Unexpected missing ranges: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        /* Overlap */
+        seg.pkt = avt_packet_create_segment(&hdr, 30, 450, 100, 1000);
+        if (!avt_buffer_quick_alloc(&seg.pl, 100))
+            return ENOMEM;
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        avt_buffer_quick_unref(&seg.pl);
+        if (ret != AVT_ERROR(EINVAL))
+            goto end;
+
+        /* Fill in the gap with uneven segments */
+        seg.pkt = avt_packet_create_segment(&hdr, 31, 530, 70, 1000);
+        if (!avt_buffer_quick_alloc(&seg.pl, 70))
+            return ENOMEM;
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        avt_buffer_quick_unref(&seg.pl);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        ret = avt_pkt_merge_missing(&s, missing, 4);
+        if (ret != 2 || missing[1].offset != 500 || missing[1].size != 30) {
+            fprintf(stderr, "Unexpected missing ranges after split: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        seg.pkt = avt_packet_create_segment(&hdr, 32, 500, 30, 1000);
+        if (!avt_buffer_quick_alloc(&seg.pl, 30))
+            return ENOMEM;
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        avt_buffer_quick_unref(&seg.pl);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        /* Output */
+        ret = avt_pkt_merge_seg(NULL, &s, &hdr);
+        if (ret != 1000) {
+            ret = ret < 0 ? ret : AVT_ERROR(EINVAL);
+            goto end;
+        }
+        avt_buffer_quick_unref(&hdr.pl);
+
+        ret = 0;
+    }
+
+    {
+        fprintf(stderr, "Testing empty segments...\n");
+        hdr.pkt.seq = 40;
+        avt_packet_change_size(&hdr, 0, 0, 100);
+
+        seg = (AVTPktd){ };
+        seg.pkt = avt_packet_create_segment(&hdr, 41, 0, 0, 100);
+        ret = avt_pkt_merge_seg(NULL, &s, &seg);
+        if (ret != AVT_ERROR(EINVAL)) {
+            fprintf(stderr, "Empty segment not rejected: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        ret = avt_pkt_merge_place(NULL, &s, &seg);
+        if (ret != AVT_ERROR(EINVAL)) {
+            fprintf(stderr, "Empty segment placed: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto end;
+        }
+
+        ret = 0;
+    }
+
+    { /* Merger table: lookup, LRU order, release and reuse */
+        AVTMergerTable t;
+        AVTMerger *m, *tm[8];
+        fprintf(stderr, "Testing merger table...\n");
+        ret = avt_merger_table_init(&t, 8, 100);
+        if (ret < 0)
+            goto end;
+
+        /* Colliding targets must all be found */
+        for (auto i = 0; i < 8; i++) {
+            ret = avt_merger_table_get(&t, i*16, i, &tm[i]);
+            if (ret < 0)
+                goto table_end;
+        }
+
+        ret = avt_merger_table_get(&t, 1000, 8, &m);
+        if (ret != AVT_ERROR(ENOSPC)) {
+            fprintf(stderr, "Merger table did not report being full: %i\n", ret);
+            ret = AVT_ERROR(EINVAL);
+            goto table_end;
+        }
+
+        avt_merger_table_touch(&t, tm[0], 150);
+        if (avt_merger_table_oldest(&t) != tm[1] ||
+            avt_merger_table_expired(&t, 102) != tm[1] ||
+            avt_merger_table_expired(&t, 101)) {
+            fprintf(stderr, "Unexpected merger table LRU order\n");
+            ret = AVT_ERROR(EINVAL);
+            goto table_end;
+        }
+
+        avt_merger_table_release(&t, tm[1]);
+        avt_merger_table_release(&t, tm[4]);
+        for (auto i = 0; i < 8; i++) {
+            ret = avt_merger_table_get(&t, i*16, 200, &m);
+            if (ret < 0)
+                goto table_end;
+            if (m->target != i*16 || (i != 1 && i != 4 && m != tm[i])) {
+                fprintf(stderr, "Unexpected merger table lookup of %i\n", i*16);
+                ret = AVT_ERROR(EINVAL);
+                goto table_end;
+            }
+        }
+
+        ret = 0;
+table_end:
+        avt_merger_table_free(&t);
+        if (ret < 0)
+            goto end;
+    }
 
 end:
     avt_pkt_merge_free(&s);
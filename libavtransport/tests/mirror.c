@@ -0,0 +1,158 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <avtransport/avtransport.h>
+#include "mirror.h"
+#include "utils_packet.h"
+
+/* Only keyframes, so that a stream output would have written indices */
+#define NB_PACKETS 1000
+#define PKT_SIZE 4096
+#define PUSH_BATCH 100
+
+/* Sequence numbers wrap around halfway through */
+#define SEQ_BASE (UINT32_MAX - NB_PACKETS/2)
+
+static int push_packets(AVTMirror *m)
+{
+    int err;
+    AVTPktd p = {
+        .pkt = AVT_STREAM_REGISTRATION_HDR(
+            .global_seq = SEQ_BASE,
+            .stream_id = 0,
+            .timebase = (AVTRational){ 1, 1000 },
+        ),
+    };
+    avt_packet_encode_header(&p);
+
+    err = avt_mirror_push(m, &p, 1, true);
+    if (err < 0)
+        return err;
+
+    AVTPktd pkts[PUSH_BATCH] = { };
+    for (int i = 0; i < NB_PACKETS; i += PUSH_BATCH) {
+        for (int j = 0; j < PUSH_BATCH; j++) {
+            const int n = i + j;
+            uint8_t *data = avt_buffer_quick_alloc(&pkts[j].pl, PKT_SIZE + n);
+            if (!data)
+                return AVT_ERROR(ENOMEM);
+            memset(data, n, PKT_SIZE + n);
+
+            pkts[j].pkt = AVT_STREAM_DATA_HDR(
+                .global_seq = SEQ_BASE + n + 1,
+                .stream_id = 0,
+                .frame_type = AVT_FRAME_TYPE_KEY,
+                .pts = n,
+                .data_length = PKT_SIZE + n,
+            );
+            avt_packet_encode_header(&pkts[j]);
+        }
+
+        err = avt_mirror_push(m, pkts, PUSH_BATCH, true);
+        for (int j = 0; j < PUSH_BATCH; j++)
+            avt_buffer_quick_unref(&pkts[j].pl);
+        if (err < 0)
+            return err;
+        else if (err != PUSH_BATCH)
+            return AVT_ERROR(ENOSPC);
+    }
+
+    return 0;
+}
+
+/* Every sent packet must be readable back from the file */
+static int fetch_packets(AVTMirror *m)
+{
+    int err = 0;
+
+    for (int n = 0; !err && n < NB_PACKETS; n++) {
+        AVTPktd p = { };
+        err = avt_mirror_fetch(m, SEQ_BASE + n + 1, &p);
+        if (err < 0) {
+            printf("Fetching packet %i failed: %i\n", n + 1, err);
+            break;
+        }
+
+        size_t len;
+        const uint8_t *data = avt_buffer_get_data(&p.pl, &len);
+        if (p.pkt.desc != AVT_PKT_STREAM_DATA || p.pkt.stream_data.pts != n ||
+            len != PKT_SIZE + n || data[0] != (uint8_t)n || data[len - 1] != (uint8_t)n) {
+            printf("Fetched packet %i does not match\n", n + 1);
+            err = AVT_ERROR(EINVAL);
+        }
+        avt_buffer_quick_unref(&p.pl);
+    }
+
+    return err;
+}
+
+int main(void)
+{
+    int ret;
+
+    AVTContext *avt;
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    AVTConnectionInfo info = {
+        .type = AVT_CONNECTION_FILE,
+        .path = "mirror_test.avt",
+    };
+    remove(info.path);
+
+    AVTMirror *m;
+    ret = avt_mirror_init(avt, &m, &info);
+    if (ret < 0) {
+        printf("Unable to open mirror: %i\n", ret);
+        goto end;
+    }
+
+    ret = push_packets(m);
+    if (ret < 0)
+        printf("Unable to queue packets: %i\n", ret);
+
+    /* Wait for the writer thread to catch up */
+    if (!ret)
+        ret = avt_mirror_drain(m, INT64_MAX);
+
+    if (!ret)
+        ret = fetch_packets(m);
+
+    int err = avt_mirror_close(&m);
+    if (!ret)
+        ret = err;
+
+end:
+    remove(info.path);
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
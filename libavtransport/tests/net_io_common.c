@@ -28,6 +28,10 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <threads.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 #include <avtransport/avtransport.h>
 #include "net_io_common.h"
@@ -188,6 +192,237 @@ fail:
     return ret;
 }
 
+int net_io_fanout_test(NetTestContext *ntc, const char *url)
+{
+    int64_t ret;
+    int t_res[2] = { };
+    thrd_t listener_thread[2];
+    int nb_threads = 0;
+    AVTAddress addr = { };
+    AVTAddress bad_addr;
+    AVTIOCtx *ioctx_listener = NULL;
+    NetListenerContext listener_ctx[2] = {
+        { .avt = ntc->avt, .io = ntc->io, .ioctx = ntc->ioctx_listener },
+        { .avt = ntc->avt, .io = ntc->io },
+    };
+
+    ret = avt_addr_from_url(ntc->avt, &addr, true, url);
+    if (ret < 0)
+        return ret;
+
+    ret = ntc->io->init(ntc->avt, &ioctx_listener, &addr);
+    if (ret < 0)
+        goto fail;
+    listener_ctx[1].ioctx = ioctx_listener;
+
+    /* Nothing can be sent to port 0, which must not stop the packets
+     * from reaching the destinations after it */
+    bad_addr = addr;
+    bad_addr.port = 0;
+    ret = ntc->io->add_dst(ntc->ioctx_sender, &bad_addr);
+    if (ret < 0)
+        goto fail;
+
+    /* Every packet sent must now also arrive at the second listener */
+    ret = ntc->io->add_dst(ntc->ioctx_sender, &addr);
+    if (ret < 0)
+        goto fail;
+
+    if (ntc->io->add_dst(ntc->ioctx_sender, &addr) != AVT_ERROR(EEXIST)) {
+        avt_log(ntc->avt, AVT_LOG_ERROR, "Duplicate destination accepted\n");
+        ret = AVT_ERROR(EINVAL);
+        goto fail;
+    }
+
+    AVTPktd test_pkt[16] = { };
+    for (int i = 0; i < AVT_ARRAY_ELEMS(test_pkt); i++) {
+        test_pkt[i].hdr_len = sizeof(test_pkt[i].hdr);
+        for (int j = 0; j < test_pkt[i].hdr_len; j++)
+            test_pkt[i].hdr[j] = (rand() & 0xFF);
+    }
+
+    for (int i = 0; i < AVT_ARRAY_ELEMS(listener_ctx); i++) {
+        listener_ctx[i].output = avt_buffer_alloc(1024*1024);
+        if (!listener_ctx[i].output) {
+            ret = AVT_ERROR(ENOMEM);
+            goto fail;
+        }
+        listener_ctx[i].pkt_len = sizeof(test_pkt[0].hdr);
+        listener_ctx[i].nb_pkts = AVT_ARRAY_ELEMS(test_pkt);
+        if (thrd_create(&listener_thread[i], listener_fn,
+                        &listener_ctx[i]) != thrd_success) {
+            ret = AVT_ERROR(EINVAL);
+            goto fail;
+        }
+        nb_threads++;
+    }
+
+    ret = ntc->io->write_vec(ntc->ioctx_sender, test_pkt,
+                             AVT_ARRAY_ELEMS(test_pkt), INT64_MAX);
+    if (ret < 0)
+        goto fail;
+
+    for (; nb_threads; nb_threads--)
+        thrd_join(listener_thread[nb_threads - 1], &t_res[nb_threads - 1]);
+
+    for (int i = 0; i < AVT_ARRAY_ELEMS(listener_ctx); i++) {
+        if (t_res[i] < 0) {
+            ret = t_res[i];
+            goto fail;
+        }
+
+        uint8_t *buf_data = avt_buffer_get_data(listener_ctx[i].output, NULL);
+        for (int j = 0; j < AVT_ARRAY_ELEMS(test_pkt); j++) {
+            bool found = false;
+            for (int k = 0; k < AVT_ARRAY_ELEMS(test_pkt); k++)
+                found |= !memcmp(buf_data, test_pkt[k].hdr, test_pkt[k].hdr_len);
+            if (!found) {
+                avt_log(ntc->avt, AVT_LOG_ERROR, "Listener %i: data written and "
+                        "read does not match (pkt %i)\n", i, j);
+                ret = AVT_ERROR(EINVAL);
+                goto fail;
+            }
+            buf_data += test_pkt[j].hdr_len;
+        }
+    }
+
+    ret = ntc->io->del_dst(ntc->ioctx_sender, &bad_addr);
+    if (ret >= 0)
+        ret = ntc->io->del_dst(ntc->ioctx_sender, &addr);
+    if (ret >= 0 &&
+        ntc->io->del_dst(ntc->ioctx_sender, &addr) != AVT_ERROR(ENOENT)) {
+        avt_log(ntc->avt, AVT_LOG_ERROR, "Removed destination still present\n");
+        ret = AVT_ERROR(EINVAL);
+    }
+
+fail:
+    /* Unblock any listener still waiting */
+    if (nb_threads && ret < 0)
+        for (int i = 0; i < AVT_ARRAY_ELEMS(test_pkt); i++)
+            ntc->io->write_vec(ntc->ioctx_sender, &test_pkt[i], 1, INT64_MAX);
+    for (; nb_threads; nb_threads--)
+        thrd_join(listener_thread[nb_threads - 1], NULL);
+
+    for (int i = 0; i < AVT_ARRAY_ELEMS(listener_ctx); i++)
+        avt_buffer_unref(&listener_ctx[i].output);
+    if (ioctx_listener)
+        ntc->io->close(&ioctx_listener);
+    avt_addr_free(&addr);
+    return ret;
+}
+
+/* Send packets from an IPv4 loopback address of our choosing */
+static int send_from(const char *src, int port, int proto, uint8_t id, int nb)
+{
+    int ret = 0;
+    uint8_t data[AVT_MAX_HEADER_BUF] = { id };
+    struct sockaddr_in src_addr = { .sin_family = AF_INET };
+    struct sockaddr_in dst_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    inet_pton(AF_INET, src, &src_addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, proto);
+    if (fd < 0)
+        return AVT_ERROR(errno);
+
+    if (bind(fd, (struct sockaddr *)&src_addr, sizeof(src_addr)) < 0)
+        ret = AVT_ERROR(errno);
+
+    for (int i = 0; !ret && i < nb; i++)
+        if (sendto(fd, data, sizeof(data), 0, (struct sockaddr *)&dst_addr,
+                   sizeof(dst_addr)) < 0)
+            ret = AVT_ERROR(errno);
+
+    close(fd);
+    return ret;
+}
+
+int net_io_shard_test(NetTestContext *ntc, const char *url, int proto)
+{
+    int ret;
+    int nb_pkts[2][3] = { };
+    char shard_url[256];
+    AVTAddress addr[3] = { };
+    AVTIOCtx *ioctx[3] = { };
+    AVTBuffer *buf = NULL;
+
+    /* Two listening shards, opened out of order, and a sender */
+    for (int i = 0; i < 3; i++) {
+        const int idx = i < 2 ? 1 - i : i;
+        snprintf(shard_url, sizeof(shard_url), "%s/#shards=2&shard=%i", url, idx);
+        ret = avt_addr_from_url(ntc->avt, &addr[idx], i < 2, i < 2 ? shard_url : url);
+        if (ret < 0)
+            goto fail;
+
+        ret = ntc->io->init(ntc->avt, &ioctx[idx], &addr[idx]);
+        if (ret < 0)
+            goto fail;
+    }
+
+    AVTPktd test_pkt = { .hdr_len = sizeof(test_pkt.hdr) };
+    for (int i = 0; i < 16; i++) {
+        ret = ntc->io->write_pkt(ioctx[2], &test_pkt, INT64_MAX);
+        if (ret < 0)
+            goto fail;
+    }
+
+    /* Two other senders, whose addresses hash to different shards */
+    if ((ret = send_from("127.0.0.1", addr[0].port, proto, 1, 16)) < 0 ||
+        (ret = send_from("127.0.0.2", addr[0].port, proto, 2, 16)) < 0)
+        goto fail;
+
+    buf = avt_buffer_alloc(sizeof(test_pkt.hdr));
+    if (!buf) {
+        ret = AVT_ERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (int i = 0; i < 16*3*2; i++) {
+        ret = ntc->io->read_input(ioctx[i & 1], buf, sizeof(test_pkt.hdr),
+                                  0, AVT_IO_READ_MUTABLE);
+        if (ret >= 0) {
+            uint8_t *data = avt_buffer_get_data(buf, NULL);
+            nb_pkts[i & 1][AVT_MIN(data[0], 2)]++;
+        }
+    }
+
+    /* Everything from a single sender must end up on the same shard */
+    ret = 0;
+    for (int i = 0; i < 3; i++) {
+        if ((nb_pkts[0][i] + nb_pkts[1][i]) != 16 ||
+            (nb_pkts[0][i] && nb_pkts[1][i])) {
+            avt_log(ntc->avt, AVT_LOG_ERROR, "Sender %i: packets split across "
+                    "shards: %i/%i\n", i, nb_pkts[0][i], nb_pkts[1][i]);
+            ret = AVT_ERROR(EINVAL);
+        }
+    }
+
+    /* 127.0.0.1 and 127.0.0.2 hash to shards 1 and 0. Shards only get
+     * their own senders if they are steered to by index, not by the
+     * order they were opened in. */
+    if (!ret && !(nb_pkts[1][1] && nb_pkts[0][2])) {
+        if (nb_pkts[0][1] && nb_pkts[1][2]) {
+            avt_log(ntc->avt, AVT_LOG_WARN, "Shards steered to by the order "
+                    "they were opened in\n");
+        } else {
+            avt_log(ntc->avt, AVT_LOG_ERROR, "Senders steered to the same shard\n");
+            ret = AVT_ERROR(EINVAL);
+        }
+    }
+
+fail:
+    avt_buffer_unref(&buf);
+    for (int i = 0; i < 3; i++) {
+        if (ioctx[i])
+            ntc->io->close(&ioctx[i]);
+        avt_addr_free(&addr[i]);
+    }
+    return ret;
+}
+
 int net_io_init(NetTestContext *ntc, const AVTIO *io, const char *url)
 {
     int ret;
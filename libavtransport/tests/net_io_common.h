@@ -39,6 +39,8 @@ typedef struct NetTestContext {
 
 int net_io_init(NetTestContext *ntc, const AVTIO *io, const char *url);
 int net_io_test(NetTestContext *ntc);
+int net_io_fanout_test(NetTestContext *ntc, const char *url);
+int net_io_shard_test(NetTestContext *ntc, const char *url, int proto);
 int net_io_free(NetTestContext *ntc);
 
 #endif /* TEST_NET_COMMON_H */
@@ -78,6 +78,27 @@ int main(void)
             return EINVAL;
     }
 
+    /* Every descriptor must be coded with the header size from the table */
+    for (int i = 0; i < AVT_PKT_DESC_TABLE_SIZE; i++) {
+        const AVTPktDesc *d = &avt_pkt_desc_table[i];
+        if (!d->hdr_size)
+            continue;
+
+        if (avt_pkt_desc_get(d->desc) != d)
+            return EINVAL;
+
+        in = (AVTPktd) { .pkt.desc = d->desc };
+        avt_packet_encode_header(&in);
+        if (in.hdr_len != d->hdr_size ||
+            avt_packet_read_desc(in.hdr) != d->desc)
+            return EINVAL;
+
+        AVTBytestream bs = avt_bs_init(in.hdr, in.hdr_len);
+        d->decode(&bs, &out.pkt);
+        if (out.pkt.desc != d->desc || avt_bs_offs(&bs) > d->hdr_size)
+            return EINVAL;
+    }
+
     avt_buffer_unref(&buf);
 
     return 0;
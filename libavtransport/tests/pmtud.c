@@ -0,0 +1,213 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <avtransport/avtransport.h>
+
+#define PMTUD_BASE (1280 - 48)
+#define FRAME_SIZE 4096
+
+static int open_conn(AVTContext *avt, AVTConnection **conn,
+                     const char *url, bool listen)
+{
+    AVTConnectionInfo info = {
+        .type = AVT_CONNECTION_URL,
+        .url.url = url,
+        .url.listen = listen,
+        .output_opts.bandwidth = INT64_MAX,
+    };
+    return avt_connection_init(avt, conn, &info);
+}
+
+int main(void)
+{
+    int ret;
+    AVTContext *avt;
+    AVTConnection *tx = NULL, *rx = NULL;
+    AVTSender *s = NULL;
+    AVTBuffer *buf = NULL;
+    AVTConnectionStatus status;
+    uint64_t tx_packets = 0;
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    if ((ret = open_conn(avt, &rx, "udp://[::1]:8216", true)) < 0 ||
+        (ret = open_conn(avt, &tx, "udp://[::1]:8216/#pmtud=9000", false)) < 0)
+        goto end;
+
+    ret = avt_connection_get_status(tx, &status);
+    if (ret < 0)
+        goto end;
+
+    if (status.mtu != PMTUD_BASE) {
+        avt_log(NULL, AVT_LOG_ERROR, "Unexpected initial MTU: %u\n", status.mtu);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Probes are acknowledged by the receiver */
+    ret = avt_receive_open(avt, rx, &(AVTReceiveCallbacks){ }, NULL,
+                           &(AVTReceiveOptions){ });
+    if (ret < 0)
+        goto end;
+
+    ret = avt_send_open(avt, &s, tx, &(AVTSenderOptions){ });
+    if (ret < 0)
+        goto end;
+
+    AVTStream *st = avt_send_stream_add(s, 0);
+    if (!st) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+    st->codec_id = AVT_CODEC_ID_RAW_VIDEO;
+    st->timebase = (AVTRational){ 1, 1000 };
+
+    ret = avt_send_stream_update(st);
+    if (ret < 0)
+        goto end;
+
+    buf = avt_buffer_alloc(FRAME_SIZE);
+    if (!buf) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+
+    /* Incompressible, so that it gets segmented at the base MTU */
+    uint8_t *data = avt_buffer_get_data(buf, NULL);
+    for (int i = 0; i < FRAME_SIZE; i++)
+        data[i] = rand() & 0xFF;
+
+    /* Every send carries a probe, and the loopback acknowledges them all.
+     * The last frame is sent once the MTU is known. */
+    for (int i = 0; i < 65; i++) {
+        if (i == 64) {
+            ret = avt_connection_get_status(tx, &status);
+            if (ret < 0)
+                goto end;
+
+            avt_log(NULL, AVT_LOG_INFO, "Discovered MTU: %u\n", status.mtu);
+            if (status.mtu <= FRAME_SIZE || status.mtu > 9000 - 48) {
+                ret = AVT_ERROR(EINVAL);
+                goto end;
+            }
+            tx_packets = status.tx.packets;
+        }
+
+        ret = avt_send_stream_data(st, &(AVTPacket) {
+            .data = buf,
+            .total_size = FRAME_SIZE,
+            .pts = i,
+            .duration = 1,
+        });
+        if (ret < 0)
+            goto end;
+
+        do {
+            ret = avt_connection_process(tx, 0);
+        } while (ret >= 0);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        ret = avt_connection_process(rx, 0);
+        if (ret < 0 && ret != AVT_ERROR(EAGAIN))
+            goto end;
+    }
+
+    /* The next probe is due at some point, even with nothing to send */
+    AVTConnectionPoll pfd;
+    ret = avt_connection_get_poll(tx, &pfd);
+    if (ret < 0)
+        goto end;
+
+    if (!pfd.read || pfd.timeout == INT64_MAX) {
+        avt_log(NULL, AVT_LOG_ERROR, "No poll deadline for the next probe\n");
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Segments must have followed the MTU, so the frame wasn't split */
+    ret = avt_connection_get_status(tx, &status);
+    if (ret < 0)
+        goto end;
+
+    if (status.tx.packets - tx_packets != 1) {
+        avt_log(NULL, AVT_LOG_ERROR, "Frame sent as %" PRIu64 " packets\n",
+                status.tx.packets - tx_packets);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Acknowledged probes give the round-trip time */
+    if (status.tx.rtt <= 0 || status.tx.rtt >= 1000000000) {
+        avt_log(NULL, AVT_LOG_ERROR, "Unexpected round-trip time: %" PRIi64 "\n",
+                status.tx.rtt);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Once the receiver stops acknowledging, the MTU is no longer
+     * confirmed, and must fall back to the base */
+    for (int i = 0; i < 40 && status.mtu != PMTUD_BASE; i++) {
+        ret = avt_connection_get_poll(tx, &pfd);
+        if (ret < 0)
+            goto end;
+
+        const int64_t wait = pfd.timeout < 500000000 ? pfd.timeout : 500000000;
+        nanosleep(&(struct timespec){ .tv_nsec = wait }, NULL);
+
+        ret = avt_connection_process(tx, 0);
+        if (ret < 0 && ret != AVT_ERROR(EAGAIN))
+            goto end;
+
+        ret = avt_connection_get_status(tx, &status);
+        if (ret < 0)
+            goto end;
+    }
+
+    if (status.mtu != PMTUD_BASE) {
+        avt_log(NULL, AVT_LOG_ERROR, "Path MTU still %u without confirmations\n",
+                status.mtu);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+end:
+    avt_send_close(&s);
+    avt_receive_close(avt);
+    avt_connection_destroy(&tx);
+    avt_connection_destroy(&rx);
+    avt_buffer_unref(&buf);
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
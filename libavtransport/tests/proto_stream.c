@@ -0,0 +1,546 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <avtransport/avtransport.h>
+#include "protocol_common.h"
+#include "io_common.h"
+#include "utils_internal.h"
+#include "utils_packet.h"
+#include "stream_scan.h"
+#include "packet_encode.h"
+#include "bytestream.h"
+
+extern const AVTIO avt_io_mmap_path;
+extern const AVTIO avt_io_fd_path;
+extern const AVTProtocol avt_protocol_stream;
+
+#define NB_PACKETS 1024
+#define PKT_SIZE (64*1024)
+#define KEYFRAME_INTERVAL 10
+#define PKT_DURATION 40 /* Milliseconds */
+#define INDEX_CACHE "proto_stream_test.avt.idx"
+
+enum WriteMode {
+    WRITE_UNINDEXED, /* Written directly, and one header is damaged */
+    WRITE_PACKETS,   /* Sent one at a time */
+    WRITE_BATCHES,   /* Sent as sequences, with index packets in between */
+};
+
+#define WRITE_BATCH 3
+
+static int write_pkt(const AVTIO *io, AVTIOCtx *io_ctx,
+                     const AVTProtocol *proto, AVTProtocolCtx *p_ctx,
+                     AVTPacketFifo *seq, AVTPktd *p, enum WriteMode mode)
+{
+    int err;
+
+    switch (mode) {
+    case WRITE_UNINDEXED:
+        return AVT_MIN(io->write_pkt(io_ctx, p, INT64_MAX), 0);
+    case WRITE_PACKETS:
+        return proto->send_packet(p_ctx, p, INT64_MAX);
+    case WRITE_BATCHES:
+        err = avt_pkt_fifo_push(seq, p);
+        if (err < 0 || seq->nb < WRITE_BATCH)
+            return err;
+        err = proto->send_seq(p_ctx, seq, INT64_MAX);
+        avt_pkt_fifo_clear(seq);
+        return err;
+    }
+
+    return AVT_ERROR(EINVAL);
+}
+
+static int write_file(AVTContext *avt, AVTAddress *addr, enum WriteMode mode)
+{
+    int err;
+    AVTPacketFifo seq = { };
+    const AVTIO *io = &avt_io_mmap_path;
+    const AVTProtocol *proto = &avt_protocol_stream;
+    AVTIOCtx *io_ctx;
+    AVTProtocolCtx *p_ctx;
+    AVTProtocolOpts opts = { };
+
+    err = io->init(avt, &io_ctx, addr);
+    if (err < 0)
+        return err;
+
+    err = proto->init(avt, &p_ctx, addr, io, io_ctx, &opts);
+    if (err < 0) {
+        io->close(&io_ctx);
+        return err;
+    }
+
+    AVTPktd p = {
+        .pkt = AVT_STREAM_REGISTRATION_HDR(
+            .global_seq = 0,
+            .stream_id = 0,
+            .timebase = (AVTRational){ 1, 1000 },
+        ),
+    };
+    avt_packet_encode_header(&p);
+    err = write_pkt(io, io_ctx, proto, p_ctx, &seq, &p, mode);
+
+    for (int i = 0; !err && i < NB_PACKETS; i++) {
+        uint8_t *data = avt_buffer_quick_alloc(&p.pl, PKT_SIZE);
+        if (!data) {
+            err = AVT_ERROR(ENOMEM);
+            break;
+        }
+        memset(data, i, PKT_SIZE);
+
+        p.pkt = AVT_STREAM_DATA_HDR(
+            .global_seq = i + 1,
+            .stream_id = 0,
+            .frame_type = (i % KEYFRAME_INTERVAL) ? AVT_FRAME_TYPE_P :
+                                                    AVT_FRAME_TYPE_KEY,
+            .pts = i*PKT_DURATION,
+            .duration = PKT_DURATION,
+            .data_length = PKT_SIZE,
+        );
+        avt_packet_encode_header(&p);
+
+        if (mode == WRITE_UNINDEXED && i == NB_PACKETS/2 + 5)
+            p.hdr[AVT_MIN_HEADER_LEN - 4] ^= 0xFF;
+        err = write_pkt(io, io_ctx, proto, p_ctx, &seq, &p, mode);
+        avt_buffer_quick_unref(&p.pl);
+    }
+
+    if (!err && seq.nb)
+        err = proto->send_seq(p_ctx, &seq, INT64_MAX);
+    if (!err)
+        err = proto->flush(p_ctx, INT64_MAX);
+    avt_pkt_fifo_free(&seq);
+
+    proto->close(&p_ctx);
+    int ret = io->close(&io_ctx);
+    return err < 0 ? err : ret;
+}
+
+/* Indices are loaded from the footer if the file can be mapped,
+ * and from the start otherwise */
+static int seek_file(AVTContext *avt, AVTAddress *addr, const AVTIO *io)
+{
+    int err;
+    const AVTProtocol *proto = &avt_protocol_stream;
+    AVTIOCtx *io_ctx;
+    AVTProtocolCtx *p_ctx;
+    AVTProtocolOpts opts = {
+        .index_cache = true,
+    };
+    AVTPacketFifo fifo = { };
+
+    err = io->init(avt, &io_ctx, addr);
+    if (err < 0)
+        return err;
+
+    err = proto->init(avt, &p_ctx, addr, io, io_ctx, &opts);
+    if (err < 0) {
+        io->close(&io_ctx);
+        return err;
+    }
+
+    const int64_t targets[] = { 0, 1234, 20000, 39999, 1000000 };
+    for (int i = 0; i < sizeof(targets)/sizeof(*targets); i++) {
+        const int64_t ts = targets[i];
+        const int expected = AVT_MIN(ts / PKT_DURATION, NB_PACKETS - 1) /
+                             KEYFRAME_INTERVAL * KEYFRAME_INTERVAL;
+
+        err = proto->seek(p_ctx, -1, UINT32_MAX, ts*1000000, false);
+        if (err < 0) {
+            printf("Seeking to %" PRIi64 "ms failed: %i\n", ts, err);
+            break;
+        }
+
+        avt_pkt_fifo_clear(&fifo);
+        err = proto->receive(p_ctx, &fifo, INT64_MAX);
+        if (err < 0)
+            break;
+
+        AVTPktd *p = &fifo.data[0];
+        if (!fifo.nb || p->pkt.desc != AVT_PKT_STREAM_DATA ||
+            p->pkt.stream_data.pts != expected*PKT_DURATION ||
+            p->pkt.stream_data.frame_type != AVT_FRAME_TYPE_KEY) {
+            printf("Seeking to %" PRIi64 "ms gave the wrong packet\n", ts);
+            err = AVT_ERROR(EINVAL);
+            break;
+        }
+        err = 0;
+    }
+
+    /* Timestamps before the first keyframe cannot be seeked to */
+    if (!err && proto->seek(p_ctx, -1, UINT32_MAX, -1, false) != AVT_ERROR(ENOENT))
+        err = AVT_ERROR(EINVAL);
+
+    avt_pkt_fifo_free(&fifo);
+    proto->close(&p_ctx);
+    io->close(&io_ctx);
+    return err;
+}
+
+/* Indexed files must end with an empty index packet, pointing back */
+static int check_footer(AVTContext *avt, AVTAddress *addr)
+{
+    const int hdr_size = avt_packet_hdr_size(AVT_PKT_STREAM_INDEX);
+    AVTPktd p = { };
+
+    FILE *f = fopen((char *)addr->path, "rb");
+    if (!f)
+        return AVT_ERROR(ENOENT);
+    int ret = fseek(f, -hdr_size, SEEK_END);
+    if (!ret)
+        ret = fread(p.hdr, hdr_size, 1, f) == 1 ? 0 : -1;
+    fclose(f);
+
+    if (!ret && avt_packet_decode_header(avt, &p) >= 0 &&
+        p.pkt.desc == AVT_PKT_STREAM_INDEX && !p.pkt.stream_index.nb_indices &&
+        p.pkt.stream_index.prev_idx)
+        return 0;
+
+    printf("No index footer written\n");
+    return AVT_ERROR(EINVAL);
+}
+
+static void put_index(AVTIndexContext *ic, avt_pos pos,
+                      int64_t pts0, int32_t off0, int64_t pts1, int32_t off1)
+{
+    uint8_t data[2*AVT_PKT_INDEX_ENTRY_SIZE];
+    AVTBytestream bs = avt_bs_init(data, sizeof(data));
+    avt_encode_index_entry(&bs, (AVTIndexEntry){ .pts = pts0, .pkt_offset = off0 });
+    avt_encode_index_entry(&bs, (AVTIndexEntry){ .pts = pts1, .pkt_offset = off1 });
+
+    bs = avt_bs_init(data, sizeof(data));
+    avt_index_list_parse(ic, &bs, &(AVTStreamIndex){ .nb_indices = 2 }, pos);
+}
+
+static int check_index(AVTIndexContext *ic, const int64_t *pts, int nb)
+{
+    AVTIndexEntry e;
+    avt_pos pos;
+
+    if (ic->nb_index != nb)
+        return AVT_ERROR(EINVAL);
+    for (int i = 0; i < nb; i++) {
+        if (avt_index_list_find(ic, pts[i], &e, &pos) < 0 ||
+            e.pts != pts[i] || pos != pts[i]*100)
+            return AVT_ERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+/* Index packets read out of order, or twice, must give the same index */
+static int index_order_test(void)
+{
+    int err;
+    AVTIndexContext ic = { };
+
+    put_index(&ic, 2000, 15, -500, 19, -100);
+    put_index(&ic, 1000, 1, -900, 6, -400);
+    put_index(&ic, 2000, 15, -500, 19, -100);
+    put_index(&ic, 3000, 25, -500, 29, -100);
+    err = check_index(&ic, (int64_t []){ 1, 6, 15, 19, 25, 29 }, 6);
+    avt_index_list_free(&ic);
+    if (err < 0) {
+        printf("Index packets read out of order gave a different index\n");
+        return err;
+    }
+
+    /* With a limit, only the newest entries are kept */
+    avt_index_list_config(&ic, 3);
+    put_index(&ic, 3000, 25, -500, 29, -100);
+    put_index(&ic, 2000, 15, -500, 19, -100);
+    err = check_index(&ic, (int64_t []){ 19, 25, 29 }, 3);
+    avt_index_list_free(&ic);
+    if (err < 0)
+        printf("Limited index gave the wrong entries\n");
+
+    return err;
+}
+
+/* Headers must be found at any offset, after bytes which can't be
+ * skipped over without checking them one by one */
+static int find_test(void)
+{
+    uint8_t buf[4096];
+    AVTPktd p = {
+        .pkt = AVT_STREAM_DATA_HDR(
+            .global_seq = 1,
+            .stream_id = 0,
+            .frame_type = AVT_FRAME_TYPE_KEY,
+            .data_length = 1 << 20,
+        ),
+    };
+    avt_packet_encode_header(&p);
+
+    for (int off = 0; off < 200; off++) {
+        for (int i = 0; i < sizeof(buf); i++)
+            buf[i] = (i % 13) ? 0x10 + (i % 200) : 0x0F;
+        memcpy(&buf[off], p.hdr, p.hdr_len);
+
+        const size_t found = avt_scan_find_header(buf, sizeof(buf));
+        if (found != off) {
+            printf("Header at %i found at %zu\n", off, found);
+            return AVT_ERROR(EINVAL);
+        }
+    }
+
+    return 0;
+}
+
+/* Read every packet, resynchronizing after damaged headers.
+ * Index packets are not counted. */
+static int read_file(AVTContext *avt, AVTAddress *addr, const AVTIO *io,
+                     int expected)
+{
+    int err;
+    const AVTProtocol *proto = &avt_protocol_stream;
+    AVTIOCtx *io_ctx;
+    AVTProtocolCtx *p_ctx;
+    AVTProtocolOpts opts = { };
+    AVTPacketFifo fifo = { };
+    int nb_pkts = 0;
+    int64_t last_pts = -1;
+
+    err = io->init(avt, &io_ctx, addr);
+    if (err < 0)
+        return err;
+
+    err = proto->init(avt, &p_ctx, addr, io, io_ctx, &opts);
+    if (err < 0) {
+        io->close(&io_ctx);
+        return err;
+    }
+
+    while ((err = proto->receive(p_ctx, &fifo, 0)) > 0) {
+        for (int i = 0; i < fifo.nb; i++) {
+            AVTPktd *p = &fifo.data[i];
+            if (p->pkt.desc == AVT_PKT_STREAM_DATA) {
+                if (p->pkt.stream_data.pts <= last_pts)
+                    err = AVT_ERROR(EINVAL);
+                last_pts = p->pkt.stream_data.pts;
+            }
+            nb_pkts += p->pkt.desc != AVT_PKT_STREAM_INDEX;
+        }
+        avt_pkt_fifo_clear(&fifo);
+        if (err < 0)
+            break;
+    }
+
+    if (err == AVT_ERROR(EAGAIN))
+        err = 0;
+    if (!err && nb_pkts != expected) {
+        printf("Read %i packets, expected %i\n", nb_pkts, expected);
+        err = AVT_ERROR(EINVAL);
+    }
+
+    avt_pkt_fifo_free(&fifo);
+    proto->close(&p_ctx);
+    io->close(&io_ctx);
+    return err;
+}
+
+/* Cached indices must only be used for the file they were made for */
+static int check_cache(AVTContext *avt, AVTAddress *addr)
+{
+    int err;
+    const AVTIO *io = &avt_io_mmap_path;
+    AVTIOCtx *io_ctx;
+    AVTBuffer map = { };
+    AVTIndexContext ic = { };
+
+    err = io->init(avt, &io_ctx, addr);
+    if (err < 0)
+        return err;
+
+    avt_pos ret = io->read_ref(io_ctx, &map, SIZE_MAX, 0);
+    if (ret < 0) {
+        io->close(&io_ctx);
+        return ret;
+    }
+
+    size_t len;
+    const uint8_t *data = avt_buffer_get_data(&map, &len);
+
+    err = avt_scan_cache_read(&ic, INDEX_CACHE, data, len);
+    if (!err && ic.nb_index != (NB_PACKETS + KEYFRAME_INTERVAL - 1)/KEYFRAME_INTERVAL)
+        err = AVT_ERROR(EINVAL);
+    if (err < 0)
+        printf("Unable to read back index cache: %i\n", err);
+    avt_index_list_free(&ic);
+
+    /* Same size, different contents */
+    uint8_t *copy = malloc(len);
+    if (!err && !copy)
+        err = AVT_ERROR(ENOMEM);
+    if (!err) {
+        memcpy(copy, data, len);
+        copy[len - 1] ^= 0xFF;
+        if (avt_scan_cache_read(&ic, INDEX_CACHE, copy, len) != AVT_ERROR(ENOENT) ||
+            ic.nb_index) {
+            printf("Stale index cache was used\n");
+            err = AVT_ERROR(EINVAL);
+        }
+        avt_index_list_free(&ic);
+    }
+
+    free(copy);
+    avt_buffer_quick_unref(&map);
+    io->close(&io_ctx);
+    return err;
+}
+
+/* Scanning in parallel must give the same index as scanning serially */
+static int scan_file(AVTContext *avt, AVTAddress *addr)
+{
+    int err;
+    const AVTIO *io = &avt_io_mmap_path;
+    AVTIOCtx *io_ctx;
+    AVTBuffer map = { };
+    AVTIndexContext ref = { }, ic = { };
+
+    err = io->init(avt, &io_ctx, addr);
+    if (err < 0)
+        return err;
+
+    avt_pos ret = io->read_ref(io_ctx, &map, SIZE_MAX, 0);
+    if (ret < 0) {
+        io->close(&io_ctx);
+        return ret;
+    }
+
+    size_t len;
+    const uint8_t *data = avt_buffer_get_data(&map, &len);
+
+    err = avt_scan_build_index(avt, &ref, data, len, 1);
+    for (int t = 2; !err && t <= 8; t++) {
+        err = avt_scan_build_index(avt, &ic, data, len, t);
+        if (!err && ic.nb_index != ref.nb_index)
+            err = AVT_ERROR(EINVAL);
+        for (int i = 0; !err && i < ic.nb_index; i++) {
+            if (ic.index_pos[i] != ref.index_pos[i] ||
+                ic.index[i].pts != ref.index[i].pts)
+                err = AVT_ERROR(EINVAL);
+        }
+        if (err)
+            printf("Scanning with %i threads gave a different index\n", t);
+        avt_index_list_free(&ic);
+    }
+
+    if (!err && ref.nb_index != (NB_PACKETS + KEYFRAME_INTERVAL - 1)/KEYFRAME_INTERVAL) {
+        printf("Scanning found %i keyframes\n", ref.nb_index);
+        err = AVT_ERROR(EINVAL);
+    }
+
+    avt_index_list_free(&ref);
+    avt_buffer_quick_unref(&map);
+    io->close(&io_ctx);
+    return err;
+}
+
+int main(void)
+{
+    int ret;
+
+    AVTContext *avt;
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    AVTAddress addr = { .path = "proto_stream_test.avt" };
+    remove(addr.path);
+
+    ret = index_order_test();
+    if (!ret)
+        ret = find_test();
+    if (ret < 0)
+        goto end;
+
+    ret = write_file(avt, &addr, WRITE_PACKETS);
+    if (ret < 0)
+        printf("Unable to write test file: %i\n", ret);
+    if (!ret)
+        ret = check_footer(avt, &addr);
+    if (!ret)
+        ret = seek_file(avt, &addr, &avt_io_mmap_path);
+    if (!ret)
+        ret = seek_file(avt, &addr, &avt_io_fd_path);
+
+    /* Index packets go after each batch, never in the middle of one */
+    if (!ret) {
+        remove(addr.path);
+        ret = write_file(avt, &addr, WRITE_BATCHES);
+        if (ret < 0)
+            printf("Unable to write batched test file: %i\n", ret);
+    }
+    if (!ret)
+        ret = seek_file(avt, &addr, &avt_io_mmap_path);
+    if (!ret)
+        ret = read_file(avt, &addr, &avt_io_mmap_path, NB_PACKETS + 1);
+
+    /* Files without indices get scanned, then seeked using the cache */
+    if (!ret) {
+        remove(addr.path);
+        remove(INDEX_CACHE);
+        ret = write_file(avt, &addr, WRITE_UNINDEXED);
+        if (ret < 0)
+            printf("Unable to write unindexed test file: %i\n", ret);
+    }
+    /* The registration packet, and all but the damaged packet */
+    if (!ret)
+        ret = read_file(avt, &addr, &avt_io_mmap_path, NB_PACKETS);
+    /* Same, through the read-ahead buffer */
+    if (!ret)
+        ret = read_file(avt, &addr, &avt_io_fd_path, NB_PACKETS);
+    if (!ret) {
+        ret = seek_file(avt, &addr, &avt_io_mmap_path);
+        FILE *f = fopen(INDEX_CACHE, "rb");
+        if (!f) {
+            printf("No index cache written\n");
+            ret = AVT_ERROR(ENOENT);
+        } else {
+            fclose(f);
+        }
+    }
+    if (!ret)
+        ret = check_cache(avt, &addr);
+    if (!ret)
+        ret = seek_file(avt, &addr, &avt_io_mmap_path);
+    if (!ret)
+        ret = scan_file(avt, &addr);
+
+    remove(INDEX_CACHE);
+
+end:
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <avtransport/avtransport.h>
+#include "connection_internal.h"
+
+#define NB_PKTS 6
+
+typedef struct RecvTestContext {
+    AVTBuffer *src[NB_PKTS];
+    int nb_registered;
+    int nb_received;
+    int nb_errors;
+} RecvTestContext;
+
+static int stream_register_cb(void *opaque, AVTStream *st)
+{
+    RecvTestContext *ctx = opaque;
+    ctx->nb_registered++;
+    return 0;
+}
+
+static int stream_pkt_cb(void *opaque, AVTStream *st, AVTPacket pkt)
+{
+    RecvTestContext *ctx = opaque;
+    if (ctx->nb_received >= NB_PKTS || pkt.pts != ctx->nb_received) {
+        avt_log(NULL, AVT_LOG_ERROR, "Unexpected packet, pts %" PRIi64 "\n", pkt.pts);
+        ctx->nb_errors++;
+        return 0;
+    }
+
+    size_t ref_len, len;
+    uint8_t *ref = avt_buffer_get_data(ctx->src[ctx->nb_received], &ref_len);
+    uint8_t *data = avt_buffer_get_data(pkt.data, &len);
+    if (len != ref_len || memcmp(ref, data, len)) {
+        avt_log(NULL, AVT_LOG_ERROR, "Packet %i mismatch: %zu vs %zu\n",
+                ctx->nb_received, len, ref_len);
+        ctx->nb_errors++;
+    }
+
+    ctx->nb_received++;
+    return 0;
+}
+
+/* Files have nothing to poll on, but reading them never blocks */
+static int check_file_poll(const char *path)
+{
+    int ret;
+    AVTContext *avt;
+    AVTConnection *conn = NULL;
+    AVTConnectionPoll pfd;
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return ret;
+
+    ret = avt_connection_init(avt, &conn, &(AVTConnectionInfo) {
+        .type = AVT_CONNECTION_FILE,
+        .path = path,
+        .output_opts.bandwidth = INT64_MAX,
+    });
+    if (ret < 0)
+        goto end;
+
+    ret = avt_receive_open(avt, conn, &(AVTReceiveCallbacks){ }, NULL,
+                           &(AVTReceiveOptions){ });
+    if (ret < 0)
+        goto end;
+
+    ret = avt_connection_get_poll(conn, &pfd);
+    if (ret < 0)
+        goto end;
+
+    if (pfd.fd >= 0 || !pfd.read || pfd.timeout) {
+        avt_log(NULL, AVT_LOG_ERROR, "File input would block: fd %i, timeout %" PRIi64 "\n",
+                pfd.fd, pfd.timeout);
+        ret = AVT_ERROR(EINVAL);
+    }
+
+end:
+    avt_receive_close(avt);
+    avt_connection_destroy(&conn);
+    avt_close(&avt);
+    return ret;
+}
+
+static int count_register_cb(void *opaque, AVTStream *st)
+{
+    return 0;
+}
+
+static int count_pkt_cb(void *opaque, AVTStream *st, AVTPacket pkt)
+{
+    int *nb = opaque;
+    (*nb)++;
+    return 0;
+}
+
+/* Seeking back must output everything after the new position again */
+static int check_file_seek(const char *path, bool redundant)
+{
+    int ret;
+    int nb = 0;
+    AVTContext *avt;
+    AVTConnection *conn = NULL;
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return ret;
+
+    ret = avt_connection_init(avt, &conn, &(AVTConnectionInfo) {
+        .type = AVT_CONNECTION_FILE,
+        .path = path,
+        .output_opts.bandwidth = INT64_MAX,
+    });
+    if (ret < 0)
+        goto end;
+
+    ret = avt_receive_open(avt, conn, &(AVTReceiveCallbacks){
+                               .stream_register_cb = count_register_cb,
+                               .stream_pkt_cb = count_pkt_cb,
+                           }, &nb, &(AVTReceiveOptions){ .redundant = redundant });
+    if (ret < 0)
+        goto end;
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass) {
+            ret = avt_connection_seek(avt, conn, INT64_MIN, (AVTRational){ 1, 1 },
+                                      0, true);
+            if (ret < 0)
+                goto end;
+        }
+
+        for (int i = 0; i < 100 && nb < (pass + 1)*NB_PKTS; i++) {
+            ret = avt_connection_process(conn, 0);
+            if (ret < 0 && ret != AVT_ERROR(EAGAIN))
+                goto end;
+        }
+    }
+
+    ret = 0;
+    if (nb != 2*NB_PKTS) {
+        avt_log(NULL, AVT_LOG_ERROR, "Received %i packets reading twice, "
+                "redundant: %i\n", nb, redundant);
+        ret = AVT_ERROR(EINVAL);
+    }
+
+end:
+    avt_receive_close(avt);
+    avt_connection_destroy(&conn);
+    avt_close(&avt);
+    return ret;
+}
+
+int main(void)
+{
+    int ret;
+    AVTContext *avt;
+    AVTConnection *rx = NULL, *tx = NULL;
+    AVTSender *s = NULL;
+    RecvTestContext ctx = { };
+
+    ret = avt_init(&avt, NULL);
+    if (ret < 0)
+        return AVT_ERROR(ret);
+
+    /* Use a port of our own, so that concurrent runs don't collide */
+    char url[64];
+    snprintf(url, sizeof(url), "udp://[::1]:%i", 20000 + getpid() % 20000);
+
+    AVTConnectionInfo rx_info = {
+        .type = AVT_CONNECTION_URL,
+        .url.url = url,
+        .url.listen = true,
+        .output_opts.bandwidth = INT64_MAX,
+    };
+    ret = avt_connection_init(avt, &rx, &rx_info);
+    if (ret < 0)
+        goto end;
+
+    AVTConnectionInfo tx_info = {
+        .type = AVT_CONNECTION_URL,
+        .url.url = url,
+        .output_opts.bandwidth = INT64_MAX,
+    };
+    ret = avt_connection_init(avt, &tx, &tx_info);
+    if (ret < 0)
+        goto end;
+
+    /* Mirror everything sent */
+    AVTConnectionInfo mirror_info = {
+        .type = AVT_CONNECTION_FILE,
+        .path = "receive_mirror.avt",
+    };
+    ret = avt_connection_mirror_open(avt, tx, &mirror_info);
+    if (ret < 0)
+        goto end;
+
+    AVTReceiveCallbacks cb = {
+        .stream_register_cb = stream_register_cb,
+        .stream_pkt_cb = stream_pkt_cb,
+    };
+    ret = avt_receive_open(avt, rx, &cb, &ctx, &(AVTReceiveOptions){ });
+    if (ret < 0)
+        goto end;
+
+    ret = avt_send_open(avt, &s, tx, &(AVTSenderOptions){ .hash = true });
+    if (ret < 0)
+        goto end;
+
+    AVTStream *st = avt_send_stream_add(s, 0);
+    if (!st) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+    st->codec_id = AVT_CODEC_ID_RAW_VIDEO;
+    st->timebase = (AVTRational){ 1, 1000 };
+
+    ret = avt_send_stream_update(st);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < NB_PKTS; i++) {
+        /* Alternate between small and segmented packets */
+        size_t len = (i & 1) ? 64*1024 + i : 100 + i;
+        ctx.src[i] = avt_buffer_alloc(len);
+        if (!ctx.src[i]) {
+            ret = AVT_ERROR(ENOMEM);
+            goto end;
+        }
+
+        uint8_t *data = avt_buffer_get_data(ctx.src[i], NULL);
+        for (int j = 0; j < len; j++)
+            data[j] = rand() & 0xFF;
+
+        ret = avt_send_stream_data(st, &(AVTPacket) {
+            .data = ctx.src[i],
+            .total_size = len,
+            .pts = i,
+            .duration = 1,
+        });
+        if (ret < 0)
+            goto end;
+
+        do {
+            ret = avt_connection_process(tx, 0);
+        } while (ret >= 0);
+        if (ret != AVT_ERROR(EAGAIN))
+            goto end;
+    }
+
+    /* Waits for the mirror to write out all sent packets */
+    ret = avt_connection_flush(tx, INT64_MAX);
+    if (ret < 0)
+        goto end;
+
+    /* All packets sent must have been written to the mirror */
+    AVTConnectionStatus status;
+    ret = avt_connection_get_status(tx, &status);
+    if (ret < 0)
+        goto end;
+
+    uint64_t nb_mirrored = status.mirror.packets;
+    if (!nb_mirrored || status.mirror.queued_packets ||
+        status.mirror.dropped_packets) {
+        avt_log(NULL, AVT_LOG_ERROR, "Mirrored %" PRIu64 " packets, dropped %" PRIu64 "\n",
+                nb_mirrored, status.mirror.dropped_packets);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Once written, sent packets can be resent from the mirror */
+    ret = avt_connection_resend(tx, 1, 0);
+    if (ret < 0) {
+        avt_log(NULL, AVT_LOG_ERROR, "Unable to resend packet: %i\n", ret);
+        goto end;
+    }
+
+    ret = avt_connection_resend(tx, UINT32_MAX, 0);
+    if (ret != AVT_ERROR(ENOENT)) {
+        avt_log(NULL, AVT_LOG_ERROR, "Resent a packet never sent: %i\n", ret);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    ret = avt_connection_mirror_close(avt, tx);
+    if (ret < 0)
+        goto end;
+
+    FILE *mirror = fopen(mirror_info.path, "rb");
+    if (!mirror) {
+        ret = AVT_ERROR(ENOENT);
+        goto end;
+    }
+    fseek(mirror, 0, SEEK_END);
+    long mirror_size = ftell(mirror);
+    fclose(mirror);
+    if (mirror_size < (64*1024*(NB_PKTS/2))) {
+        avt_log(NULL, AVT_LOG_ERROR, "Mirror too small: %li bytes\n", mirror_size);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    /* Everything is already queued up on the loopback socket */
+    AVTConnectionPoll pfd;
+    ret = avt_connection_get_poll(rx, &pfd);
+    if (ret < 0)
+        goto end;
+
+    if (pfd.fd < 0 || !pfd.read ||
+        poll(&(struct pollfd){ .fd = pfd.fd, .events = POLLIN }, 1, 0) != 1) {
+        avt_log(NULL, AVT_LOG_ERROR, "Connection not pollable for input\n");
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    for (int i = 0; i < 1000 && ctx.nb_received < NB_PKTS; i++) {
+        ret = avt_connection_process(rx, 0);
+        if (ret < 0 && ret != AVT_ERROR(EAGAIN))
+            goto end;
+    }
+
+    avt_log(NULL, AVT_LOG_INFO, "Received %i packets, %i registered streams, %i errors\n",
+            ctx.nb_received, ctx.nb_registered, ctx.nb_errors);
+
+    ret = (ctx.nb_received == NB_PKTS && ctx.nb_registered == 1 && !ctx.nb_errors) ?
+          0 : AVT_ERROR(EINVAL);
+    if (!ret)
+        ret = check_file_poll(mirror_info.path);
+    if (!ret)
+        ret = check_file_seek(mirror_info.path, false);
+    if (!ret)
+        ret = check_file_seek(mirror_info.path, true);
+
+end:
+    avt_send_close(&s);
+    avt_receive_close(avt);
+    avt_connection_destroy(&tx);
+    avt_connection_destroy(&rx);
+    for (int i = 0; i < NB_PKTS; i++)
+        avt_buffer_unref(&ctx.src[i]);
+    avt_close(&avt);
+    return AVT_ERROR(ret);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2024, Lynne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "buffer.h"
+#include "utils_packet.h"
+
+#define PL_SIZE 4000
+
+static int check_seq(AVTPacketFifo *seq, size_t max_pkt_size)
+{
+    uint32_t covered = 0;
+
+    for (auto i = 0; i < seq->nb; i++) {
+        AVTPktd *p = &seq->data[i];
+        bool is_parity;
+        uint32_t off, len, tot;
+        size_t pl_len = avt_buffer_get_data_len(&p->pl);
+
+        if ((p->hdr_len + pl_len) > max_pkt_size) {
+            fprintf(stderr, "Packet %i too large: %zu\n", i, p->hdr_len + pl_len);
+            return AVT_ERROR(EMSGSIZE);
+        }
+
+        avt_packet_series(p, &is_parity, &off, &len, &tot);
+        if (len != pl_len || (off + len) > PL_SIZE) {
+            fprintf(stderr, "Packet %i mismatch: %u/%u/%zu\n", i, off, len, pl_len);
+            return AVT_ERROR(EINVAL);
+        }
+
+        /* Each part carries the payload at its offset */
+        const uint8_t *data = avt_buffer_get_data(&p->pl, NULL);
+        for (auto j = 0; j < len; j++) {
+            if (data[j] != ((off + j) & 0xFF)) {
+                fprintf(stderr, "Packet %i payload mismatch at %u\n", i, off + j);
+                return AVT_ERROR(EINVAL);
+            }
+        }
+
+        covered += len;
+    }
+
+    if (covered != PL_SIZE) {
+        fprintf(stderr, "Payload not covered: %u\n", covered);
+        return AVT_ERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+    AVTPacketFifo *seq;
+    AVTPktd p = { };
+
+    AVTScheduler *s = calloc(1, sizeof(*s));
+    if (!s)
+        return ENOMEM;
+
+    ret = avt_scheduler_init(s, 1024, INT64_MAX);
+    if (ret < 0)
+        goto end;
+
+    p.pkt = AVT_STREAM_DATA_HDR(
+        .frame_type = AVT_FRAME_TYPE_KEY,
+        .pkt_compression = AVT_DATA_COMPRESSION_NONE,
+        .stream_id = 0,
+        .pts = 0,
+        .duration = 1,
+    );
+
+    uint8_t *data = avt_buffer_quick_alloc(&p.pl, PL_SIZE);
+    if (!data) {
+        ret = AVT_ERROR(ENOMEM);
+        goto end;
+    }
+    for (auto i = 0; i < PL_SIZE; i++)
+        data[i] = i & 0xFF;
+
+    fprintf(stderr, "Testing segmentation...\n");
+    ret = avt_scheduler_push(s, &p);
+    if (ret < 0)
+        goto end;
+
+    const unsigned int nb_pkts = s->staging->nb;
+    const uint64_t next_seq = s->seq;
+
+    fprintf(stderr, "Testing re-cutting to a smaller size...\n");
+    ret = avt_scheduler_set_max_pkt_size(s, 512);
+    if (ret < 0)
+        goto end;
+
+    ret = avt_scheduler_pop(s, &seq);
+    if (ret < 0)
+        goto end;
+
+    if (seq->nb <= nb_pkts || s->seq != (next_seq + seq->nb - nb_pkts)) {
+        fprintf(stderr, "Unexpected output: %u packets, %u before\n",
+                seq->nb, nb_pkts);
+        ret = AVT_ERROR(EINVAL);
+        goto end;
+    }
+
+    ret = check_seq(seq, 512);
+    if (ret < 0)
+        goto end;
+
+    fprintf(stderr, "Testing segmentation at the new size...\n");
+    ret = avt_scheduler_recycle(s, seq);
+    if (ret < 0)
+        goto end;
+
+    ret = avt_scheduler_push(s, &p);
+    if (ret < 0)
+        goto end;
+
+    ret = avt_scheduler_pop(s, &seq);
+    if (ret < 0)
+        goto end;
+
+    ret = check_seq(seq, 512);
+    if (ret < 0)
+        goto end;
+
+    fprintf(stderr, "Testing shrinking with segments left of a sent packet...\n");
+    ret = avt_scheduler_recycle(s, seq);
+    if (ret < 0)
+        goto end;
+
+    ret = avt_scheduler_push(s, &p);
+    if (ret < 0)
+        goto end;
+
+    /* The first part went out already, so the rest cannot be re-cut */
+    AVTPacketFifo *staging = s->staging;
+    avt_buffer_quick_unref(&staging->data[0].pl);
+    memmove(&staging->data[0], &staging->data[1],
+            (staging->nb - 1)*sizeof(*staging->data));
+    staging->nb--;
+
+    ret = avt_scheduler_set_max_pkt_size(s, 256);
+    if (ret < 0)
+        goto end;
+
+    ret = avt_scheduler_pop(s, &seq);
+    if (ret == AVT_ERROR(EAGAIN)) {
+        ret = 0;
+    } else if (ret < 0) {
+        goto end;
+    } else {
+        for (auto i = 0; i < seq->nb; i++) {
+            if ((seq->data[i].hdr_len + avt_buffer_get_data_len(&seq->data[i].pl)) > 256) {
+                fprintf(stderr, "Unsendable packet %i kept\n", i);
+                ret = AVT_ERROR(EMSGSIZE);
+                goto end;
+            }
+        }
+        ret = avt_scheduler_recycle(s, seq);
+    }
+
+end:
+    avt_buffer_quick_unref(&p.pl);
+    avt_scheduler_free(s);
+    free(s);
+    if (ret < 0)
+        fprintf(stderr, "Error: %s\n", strerror(-ret));
+    return AVT_ERROR(ret);
+}
@@ -37,6 +37,8 @@ f_packet_encode = None
 f_packet_decode = None
 f_ldpc_tables_h = None
 f_ldpc_tables_c = None
+f_packet_table_h = None
+f_packet_table_c = None
 
 # Convert '/', '$' and '.' to '_',
 # or if this is stdin just use "stdin" as the name.
@@ -64,8 +66,12 @@ for i,  m in enumerate(mode):
         f_ldpc_tables_h = sys.argv[3 + i]
     elif m == "ldpc_tables_c":
         f_ldpc_tables_c = sys.argv[3 + i]
+    elif m == "packet_table_h":
+        f_packet_table_h = sys.argv[3 + i]
+    elif m == "packet_table_c":
+        f_packet_table_c = sys.argv[3 + i]
     else:
-        print("Invalid list: expected 'packet_enums', 'packet_data', 'packet_encode', 'packet_decode'")
+        print("Invalid list: expected 'packet_enums', 'packet_data', 'packet_encode', 'packet_decode', 'ldpc_tables_h', 'ldpc_tables_c', 'packet_table_h', 'packet_table_c'")
         exit(22)
 
 # Parse spec
@@ -323,6 +329,7 @@ def iter_data_fields(target_id, struct_name, anchor_name):
             "array_len": array_len,
             "string": string,
             "payload": payload,
+            "offset_bits": total_bits,
         })
 
         if type(array_len) == int and array_len > 1:
@@ -654,17 +661,16 @@ if f_packet_encode != None:
                 else:
                     file_encode.write(", " + str(field["bytestream"]))
             elif sym != bsw["pad"] and sym != bsw["ldpc"]:
-                if field["struct"] != None:
-                    file_encode.write(", p." + name)
+                if name.endswith("descriptor") and field["size_bits"] < 16:
+                    # Only the top byte is written, the rest is a bitfield
+                    file_encode.write(", (p." + name + " & UINT16_MAX) >> 8")
                 else:
                     file_encode.write(", p." + name)
 
             if name == "global_seq" or name == "target_seq":
                 file_encode.write(" & UINT32_MAX")
-            elif name.endswith("descriptor"):
+            elif name.endswith("descriptor") and field["size_bits"] >= 16:
                 file_encode.write(" & UINT16_MAX")
-                if field["size_bits"] < 16:
-                    file_encode.write(" >> 8")
 
             # Array index
             if ((type(field["array_len"]) == int and field["array_len"] > 1) or \
@@ -733,7 +739,11 @@ if f_packet_encode != None:
 
             if bitfield and (MAX_BITFIELD_LEN - bitfield_bit - 1) >= 8 and \
                math.log2(MAX_BITFIELD_LEN - bitfield_bit - 1).is_integer(): # Terminate bitfield
-                file_encode.write(indent + bsw["int"] + "u" + str(MAX_BITFIELD_LEN - bitfield_bit - 1) + "b (bs, bitfield);\n")
+                bitfield_len = MAX_BITFIELD_LEN - bitfield_bit - 1
+                file_encode.write(indent + bsw["int"] + "u" + str(bitfield_len) + "b (bs, bitfield")
+                if bitfield_len < MAX_BITFIELD_LEN:
+                    file_encode.write(" >> " + str(MAX_BITFIELD_LEN - bitfield_len))
+                file_encode.write(");\n")
                 bitfield = False
         file_encode.write("}\n")
     file_encode.write("\n#endif /* AVTRANSPORT_ENCODE_H */\n")
@@ -816,7 +826,7 @@ if f_packet_decode != None:
             file_decode.write(")")
 
             if name.endswith("descriptor") and field["size_bits"] < 16:
-                file_decode.write(" << 8");
+                file_decode.write(" << 8 | " + data_prefix.upper() + "_PKT_FLAG_LSB_BITMASK");
 
             file_decode.write(";")
             if field["struct"] != None:
@@ -828,7 +838,16 @@ if f_packet_decode != None:
 #                file_decode.write(" ^ " + "0x" + format(field["fixed"], "04X") + ")\n")
 #                file_decode.write(indent + indent + "return AVT_ERROR(EINVAL);\n")
 
-        for name, field in fields.items():
+        def bitfield_length(start):
+            # Length of the bitfield starting at the given field index
+            length = 0
+            for _, field in list(fields.items())[start:]:
+                length += field["size_bits"]
+                if length >= 8 and math.log2(length).is_integer():
+                    break
+            return length
+
+        for idx, (name, field) in enumerate(fields.items()):
             indent = "    "
             read_sym = bsr["int"]
             if field["datatype"] == data_prefix + "Rational":
@@ -850,7 +869,14 @@ if f_packet_decode != None:
                 file_decode.write("\n")
                 if had_bitfield == False:
                     file_decode.write(indent + "uint32_t ");
-                file_decode.write("bitfield = " + bsr["int"] + "u8b(bs);\n")
+                bitfield_len = bitfield_length(idx)
+                file_decode.write("bitfield = ")
+                if bitfield_len < MAX_BITFIELD_LEN:
+                    file_decode.write("(uint32_t)")
+                file_decode.write(bsr["int"] + "u" + str(bitfield_len) + "b(bs)")
+                if bitfield_len < MAX_BITFIELD_LEN:
+                    file_decode.write(" << " + str(MAX_BITFIELD_LEN - bitfield_len))
+                file_decode.write(";\n")
                 bitfield = True
                 had_bitfield = True
                 bitfield_bit = (MAX_BITFIELD_LEN - 1)
@@ -888,6 +914,133 @@ if f_packet_decode != None:
     file_decode.close()
 
 
+# Every descriptor, along with the structure used to code it
+desc_structs = { }
+for struct, name in orig_desc_names.items():
+    if struct not in substructs and name in descriptors:
+        desc_structs[name] = struct
+for struct, tstruct in templated_structs.items():
+    desc_structs[tstruct["name"]] = tstruct["template"]
+
+# Descriptors are 16 bits, with the lower 8 bits of some being a bitfield.
+# Find the smallest table in which all of them have a unique slot.
+desc_keys = [ desc & 0xFFFF for name, desc in descriptors.items() if name in desc_structs ]
+desc_table_size = len(desc_keys)
+while len(set(k % desc_table_size for k in desc_keys)) != len(desc_keys):
+    desc_table_size += 1
+
+if f_packet_table_h != None:
+    file_table_h = open(f_packet_table_h, "w+")
+    file_table_h.write(copyright_header + "\n")
+    file_table_h.write(autogenerate_note + "\n")
+    file_table_h.write("#ifndef AVTRANSPORT_PACKET_TABLE_H\n")
+    file_table_h.write("#define AVTRANSPORT_PACKET_TABLE_H\n\n")
+    file_table_h.write("#include <avtransport/packet_data.h>\n\n")
+    file_table_h.write("#include \"bytestream.h\"\n\n")
+    file_table_h.write("enum AVTPktDescFlags {\n")
+    file_table_h.write("    AVT_PKT_DESC_FLAG_PAYLOAD = 1 << 0, /* Header is followed by a payload */\n")
+    file_table_h.write("    AVT_PKT_DESC_FLAG_SEGMENT = 1 << 1, /* Segment of another packet */\n")
+    file_table_h.write("    AVT_PKT_DESC_FLAG_PARITY  = 1 << 2, /* Parity data for another packet */\n")
+    file_table_h.write("};\n\n")
+    file_table_h.write("typedef struct AVTPktDesc {\n")
+    file_table_h.write("    uint32_t desc;\n")
+    file_table_h.write("    uint16_t hdr_size;\n")
+    file_table_h.write("    uint16_t flags;\n")
+    file_table_h.write("    void (*decode)(AVTBytestream *bs, union AVTPacketData *p);\n")
+    file_table_h.write("    void (*encode)(AVTBytestream *bs, const union AVTPacketData *p);\n")
+    file_table_h.write("    int64_t (*payload_len)(const union AVTPacketData *p);\n")
+    file_table_h.write("} AVTPktDesc;\n\n")
+    # Byte offsets of fields within headers, for updating them in place
+    file_table_h.write("enum AVTPktFieldOffsets {\n")
+    for struct in dict.fromkeys(desc_structs.values()):
+        for name, field in packet_structs[struct].items():
+            if field["ldpc"] != None or field["payload"] or \
+               name.endswith("descriptor") or name.startswith("padding") or \
+               type(field["array_len"]) == str or (field["offset_bits"] & 7):
+                continue
+            file_table_h.write("    " + (data_prefix + "_PKT_" + orig_desc_names[struct] + "_OFF_" + name).upper() + " = " + str(field["offset_bits"] >> 3) + ",\n")
+    file_table_h.write("};\n\n")
+    file_table_h.write("#define AVT_PKT_DESC_TABLE_SIZE " + str(desc_table_size) + "\n\n")
+    file_table_h.write("extern const AVTPktDesc avt_pkt_desc_table[AVT_PKT_DESC_TABLE_SIZE];\n\n")
+    file_table_h.write("/* Look up a descriptor, as returned by avt_packet_read_desc().\n")
+    file_table_h.write(" * Returns NULL if the descriptor is unknown. */\n")
+    file_table_h.write("static inline const AVTPktDesc *avt_pkt_desc_get(uint32_t desc)\n")
+    file_table_h.write("{\n")
+    file_table_h.write("    const AVTPktDesc *d = &avt_pkt_desc_table[(desc & UINT16_MAX) % AVT_PKT_DESC_TABLE_SIZE];\n")
+    file_table_h.write("    return (d->desc == desc && d->hdr_size) ? d : NULL;\n")
+    file_table_h.write("}\n\n")
+    file_table_h.write("#endif /* AVTRANSPORT_PACKET_TABLE_H */\n")
+    file_table_h.close()
+
+if f_packet_table_c != None:
+    file_table_c = open(f_packet_table_c, "w+")
+    file_table_c.write(copyright_header + "\n")
+    file_table_c.write(autogenerate_note + "\n")
+    file_table_c.write("#include \"packet_table.h\"\n")
+    file_table_c.write("#include \"packet_encode.h\"\n")
+    file_table_c.write("#include \"packet_decode.h\"\n")
+
+    # Payload length, in bytes
+    def payload_len(struct):
+        terms = [ ]
+        for name, field in packet_structs[struct].items():
+            if type(field["array_len"]) != str:
+                continue
+            if field["payload"]:
+                terms.append("p->" + orig_desc_names[struct] + "." + field["array_len"])
+            elif field["struct"] != None:
+                terms.append("p->" + orig_desc_names[struct] + "." + field["array_len"] + " * " + str(field["bytestream"]))
+        return terms
+
+    for struct in packet_structs:
+        if struct not in desc_structs.values():
+            continue
+        name = orig_desc_names[struct]
+        file_table_c.write("\nstatic void decode_" + name + "(AVTBytestream *bs, union AVTPacketData *p)\n")
+        file_table_c.write("{\n")
+        file_table_c.write("    " + fn_prefix + "decode_" + name + "(bs, &p->" + name + ");\n")
+        file_table_c.write("}\n")
+        file_table_c.write("\nstatic void encode_" + name + "(AVTBytestream *bs, const union AVTPacketData *p)\n")
+        file_table_c.write("{\n")
+        file_table_c.write("    " + fn_prefix + "encode_" + name + "(bs, p->" + name + ");\n")
+        file_table_c.write("}\n")
+        terms = payload_len(struct)
+        if len(terms):
+            file_table_c.write("\nstatic int64_t payload_len_" + name + "(const union AVTPacketData *p)\n")
+            file_table_c.write("{\n")
+            file_table_c.write("    return " + " + ".join("(int64_t)" + t for t in terms) + ";\n")
+            file_table_c.write("}\n")
+
+    file_table_c.write("\nstatic int64_t payload_len_none(const union AVTPacketData *p)\n")
+    file_table_c.write("{\n")
+    file_table_c.write("    return 0;\n")
+    file_table_c.write("}\n")
+
+    file_table_c.write("\nconst AVTPktDesc avt_pkt_desc_table[AVT_PKT_DESC_TABLE_SIZE] = {\n")
+    for name, desc in sorted(descriptors.items(), key=lambda d: (d[1] & 0xFFFF) % desc_table_size):
+        if name not in desc_structs:
+            continue
+        struct = desc_structs[name]
+        sname = orig_desc_names[struct]
+        flags = [ ]
+        if len(payload_len(struct)):
+            flags.append("AVT_PKT_DESC_FLAG_PAYLOAD")
+        if struct == data_prefix + "GenericSegment":
+            flags.append("AVT_PKT_DESC_FLAG_SEGMENT")
+        elif struct == data_prefix + "GenericParity":
+            flags.append("AVT_PKT_DESC_FLAG_PARITY")
+        file_table_c.write("    [" + str((desc & 0xFFFF) % desc_table_size) + "] = {\n")
+        file_table_c.write("        .desc = " + (data_prefix + "_PKT_" + name).upper() + ",\n")
+        file_table_c.write("        .hdr_size = " + str(struct_sizes[struct] >> 3) + ",\n")
+        file_table_c.write("        .flags = " + (" | ".join(flags) if len(flags) else "0x0") + ",\n")
+        file_table_c.write("        .decode = decode_" + sname + ",\n")
+        file_table_c.write("        .encode = encode_" + sname + ",\n")
+        file_table_c.write("        .payload_len = payload_len_" + (sname if len(payload_len(struct)) else "none") + ",\n")
+        file_table_c.write("    },\n")
+    file_table_c.write("};\n")
+    file_table_c.close()
+
+
 ldpc_tables_list = {
     "ldpc_h_matrix_288_224": [ 288, 224 ],
     "ldpc_h_matrix_2784_2016": [ 2784, 2016 ],
@@ -72,6 +72,11 @@ static int fifo_resize(AVTPacketFifo *fifo, unsigned int alloc_new)
         return AVT_ERROR(ENOMEM);
     fifo->data = alloc_pkt;
 
+    /* New entries may get ref'd into, so they must not contain garbage */
+    if (alloc_new > fifo->alloc)
+        memset(&fifo->data[fifo->alloc], 0,
+               (alloc_new - fifo->alloc)*sizeof(*fifo->data));
+
     fifo->alloc = alloc_new;
 
     return 0;
@@ -162,8 +167,9 @@ int avt_pkt_fifo_copy(AVTPacketFifo *dst, const AVTPacketFifo *src)
     for (int i = 0; i < src->nb; i++) {
         AVTPktd *pdst = &dst->data[dst->nb + i];
         AVTPktd *psrc = &src->data[i];
-        *psrc = *pdst;
-        avt_buffer_quick_ref(&pdst->pl, &psrc->pl, 0, 0);
+        *pdst = *psrc;
+        pdst->pl = (AVTBuffer) { };
+        avt_buffer_quick_ref(&pdst->pl, &psrc->pl, 0, psrc->pl.len);
     }
 
     dst->nb += src->nb;
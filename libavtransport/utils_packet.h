@@ -30,7 +30,22 @@
 #include <avtransport/packet_enums.h>
 #include <avtransport/packet_data.h>
 #include "utils_internal.h"
-#include "packet_encode.h"
+#include "packet_table.h"
+
+/* Identify the descriptor of an encoded header. Descriptors which carry
+ * a bitfield in their lower bits are returned with it masked off. */
+static inline enum AVTPktDescriptors avt_packet_read_desc(const uint8_t *hdr)
+{
+    uint16_t desc = AVT_RB16(hdr);
+    switch (desc & 0xFF00) {
+    case AVT_PKT_STREAM_DATA & 0xFF00:          [[fallthrough]];
+    case AVT_PKT_EXTENDED_STREAM_DATA & 0xFF00: [[fallthrough]];
+    case AVT_PKT_TIME_SYNC & 0xFF00:
+        return (desc & 0xFF00) | AVT_PKT_FLAG_LSB_BITMASK;
+    default:
+        return desc;
+    }
+}
 
 static inline union AVTPacketData avt_packet_create_segment(AVTPktd *p,
                                                             uint64_t seq,
@@ -56,45 +71,21 @@ static inline union AVTPacketData avt_packet_create_segment(AVTPktd *p,
     }
 }
 
+/* Size of a header, or 0 if the descriptor is unknown */
+static inline int avt_packet_hdr_size(enum AVTPktDescriptors desc)
+{
+    const AVTPktDesc *d = avt_pkt_desc_get(desc);
+    return d ? d->hdr_size : 0;
+}
+
 static inline void avt_packet_encode_header(AVTPktd *p)
 {
     AVTBytestream bs = avt_bs_init(&p->hdr[p->hdr_off], (AVT_MAX_HEADER_LEN - p->hdr_off));
 
-    switch (p->pkt.desc) {
-    case AVT_PKT_SESSION_START:
-        avt_encode_session_start(&bs, p->pkt.session_start);
-        break;
-    case AVT_PKT_STREAM_REGISTRATION:
-        avt_encode_stream_registration(&bs, p->pkt.stream_registration);
-        break;
-    case AVT_PKT_VIDEO_INFO:
-        avt_encode_video_info(&bs, p->pkt.video_info);
-        break;
-    case AVT_PKT_LUT_ICC:
-        avt_encode_lut_icc(&bs, p->pkt.lut_icc);
-        break;
-    case AVT_PKT_FONT_DATA:
-        avt_encode_font_data(&bs, p->pkt.font_data);
-        break;
-    case AVT_PKT_STREAM_DATA:
-        avt_encode_stream_data(&bs, p->pkt.stream_data);
-        break;
-    case AVT_PKT_USER_DATA:
-        avt_encode_user_data(&bs, p->pkt.user_data);
-        break;
-    case AVT_PKT_STREAM_INDEX:
-        avt_encode_stream_index(&bs, p->pkt.stream_index);
-        break;
-    case AVT_PKT_METADATA_SEGMENT:    [[fallthrough]];
-    case AVT_PKT_FONT_DATA_SEGMENT:   [[fallthrough]];
-    case AVT_PKT_STREAM_DATA_SEGMENT: [[fallthrough]];
-    case AVT_PKT_USER_DATA_SEGMENT:
-        avt_encode_generic_segment(&bs, p->pkt.generic_segment);
-        break;
-    default:
-        avt_assert1(0);
-        unreachable();
-    }
+    const AVTPktDesc *d = avt_pkt_desc_get(p->pkt.desc);
+    avt_assert1(d);
+
+    d->encode(&bs, &p->pkt);
 
     p->hdr_len = avt_bs_offs(&bs);
 }
@@ -159,6 +150,15 @@ static inline void avt_packet_encode_header(AVTPktd *p)
              const union AVTPacketData *: avt_packet_get_tb_pp    \
     ) (x __VA_OPT__(,) __VA_ARGS__)
 
+#define avt_packet_get_compression(x, ...)                             \
+    _Generic((x),                                                      \
+             AVTPktd *: avt_packet_get_compression_d,                  \
+             const AVTPktd *: avt_packet_get_compression_d,            \
+             union AVTPacketData: avt_packet_get_compression_p,        \
+             union AVTPacketData *: avt_packet_get_compression_pp,     \
+             const union AVTPacketData *: avt_packet_get_compression_pp \
+    ) (x __VA_OPT__(,) __VA_ARGS__)
+
 #define avt_packet_set_compression(x, ...)                        \
     _Generic((x),                                                 \
              AVTPktd *: avt_packet_set_compression_d,             \
@@ -58,6 +58,25 @@ static inline int RENAME(avt_packet_get_tb)(const TYPE p, AVTRational *tb)
     }
 }
 
+static inline enum AVTDataCompression RENAME(avt_packet_get_compression)(const TYPE p)
+{
+    switch (GET(desc)) {
+    case AVT_PKT_STREAM_DATA:
+        return GET(stream_data).pkt_compression;
+    case AVT_PKT_STREAM_CONFIG: [[fallthrough]];
+    case AVT_PKT_METADATA:
+        return GET(generic_data).generic_data_compression;
+    case AVT_PKT_USER_DATA:
+        return GET(user_data).userdata_compression;
+    case AVT_PKT_LUT_ICC:
+        return GET(lut_icc).lut_compression;
+    case AVT_PKT_FONT_DATA:
+        return GET(font_data).font_compression;
+    default:
+        return AVT_DATA_COMPRESSION_NONE;
+    }
+}
+
 static inline void RENAME(avt_packet_set_compression)(TYPE p,
                                                       enum AVTDataCompression compression)
 {